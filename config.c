@@ -0,0 +1,398 @@
+#include "sys/types.h"
+#include "sys/socket.h"
+#include "sys/un.h"
+#include "netinet/in.h"
+#include "arpa/inet.h"
+#include "string.h"
+#include "strings.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "csrv.h"
+
+// Sizes may carry a k/m suffix (1024-based)
+static int csrv_config_size(char *value, size_t *out) {
+  size_t len = strlen(value);
+  size_t scale = 1;
+  if(len == 0) {
+    return -1;
+  }
+  if(value[len - 1] == 'k' || value[len - 1] == 'K') {
+    scale = 1024;
+  } else if(value[len - 1] == 'm' || value[len - 1] == 'M') {
+    scale = 1024 * 1024;
+  }
+
+  char saved = value[len - 1];
+  if(scale != 1) {
+    value[len - 1] = '\0';
+  }
+  int res = csrv_parse_size(value, out);
+  if(scale != 1) {
+    value[len - 1] = saved;
+  }
+
+  if(res != 0 || *out > SIZE_MAX / scale) {
+    return -1;
+  }
+  *out *= scale;
+  return 0;
+}
+
+static int csrv_config_int(char *value, int *out) {
+  size_t n;
+  if(csrv_parse_size(value, &n) != 0 || n > INT32_MAX) {
+    return -1;
+  }
+  *out = (int) n;
+  return 0;
+}
+
+// Address forms:
+//   8080                 every IPv4 address
+//   127.0.0.1:8080       one IPv4 address ("*:8080" for all of them)
+//   [::1]:8080           one IPv6 address ("[::]:8080" for all of them)
+//   unix:/run/csrv.sock  Unix domain socket
+static int csrv_listener_address(struct CsrvListener *listener, char *address) {
+  memset(&listener->addr, 0, sizeof(listener->addr));
+
+  if(strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un *un = (struct sockaddr_un *) &listener->addr;
+    char *path = address + 5;
+    if(path[0] == '\0' || strlen(path) >= sizeof(un->sun_path)) {
+      return -1;
+    }
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, path);
+    listener->addr_len = sizeof(struct sockaddr_un);
+    return 0;
+  }
+
+  char *host = NULL;
+  char *port = address;
+  char *colon = strrchr(address, ':');
+  if(colon != NULL) {
+    *colon = '\0';
+    host = address;
+    port = colon + 1;
+  }
+
+  size_t port_num;
+  if(csrv_parse_size(port, &port_num) != 0 || port_num > 65535) {
+    return -1;
+  }
+
+  int res = 0;
+  size_t host_len = host == NULL ? 0 : strlen(host);
+  if(host_len >= 2 && host[0] == '[' && host[host_len - 1] == ']') {
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &listener->addr;
+    host[host_len - 1] = '\0';
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port_num);
+    res = inet_pton(AF_INET6, host + 1, &in6->sin6_addr) == 1 ? 0 : -1;
+    host[host_len - 1] = ']';
+    listener->addr_len = sizeof(struct sockaddr_in6);
+  } else {
+    struct sockaddr_in *in = (struct sockaddr_in *) &listener->addr;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port_num);
+    if(host_len == 0 || strcmp(host, "*") == 0) {
+      in->sin_addr.s_addr = htonl(INADDR_ANY);
+    } else {
+      res = inet_pton(AF_INET, host, &in->sin_addr) == 1 ? 0 : -1;
+    }
+    listener->addr_len = sizeof(struct sockaddr_in);
+  }
+
+  if(colon != NULL) {
+    *colon = ':';
+  }
+  return res;
+}
+
+static int csrv_listener_option(struct CsrvListener *listener, char *option) {
+  char *value = strchr(option, '=');
+  if(value != NULL) {
+    *value++ = '\0';
+  }
+
+  if(strcmp(option, "reuseport") == 0 && value == NULL) {
+    listener->reuse_port = true;
+  } else if(strcmp(option, "nodelay") == 0 && value == NULL) {
+    listener->no_delay = true;
+  } else if(strcmp(option, "backlog") == 0 && value != NULL) {
+    return csrv_config_int(value, &listener->backlog);
+  } else if(strcmp(option, "defer_accept") == 0 && value != NULL) {
+    return csrv_config_int(value, &listener->defer_accept);
+  } else if(strcmp(option, "rcvbuf") == 0 && value != NULL) {
+    return csrv_config_int(value, &listener->rcvbuf);
+  } else if(strcmp(option, "sndbuf") == 0 && value != NULL) {
+    return csrv_config_int(value, &listener->sndbuf);
+  } else if(strcmp(option, "mode") == 0 && value != NULL) {
+    char *end;
+    listener->mode = (int) strtol(value, &end, 8);
+    return *end == '\0' && end != value ? 0 : -1;
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
+// Two listeners on one address would only fail at bind(), or with
+// reuseport silently split its connections. Port 0 picks a fresh port each
+// time, so those never clash.
+static bool csrv_listener_same(struct CsrvListener *a, struct CsrvListener *b) {
+  if(a->addr_len != b->addr_len || memcmp(&a->addr, &b->addr, a->addr_len) != 0) {
+    return false;
+  }
+  if(a->addr.ss_family == AF_INET) {
+    return ((struct sockaddr_in *) &a->addr)->sin_port != 0;
+  } else if(a->addr.ss_family == AF_INET6) {
+    return ((struct sockaddr_in6 *) &a->addr)->sin6_port != 0;
+  }
+  return true;
+}
+
+// Add a listener from "<address> [option ...]", e.g.
+//   [::]:8080 reuseport backlog=1024
+//   unix:/run/csrv.sock mode=0660
+// Options: backlog=N, reuseport, nodelay, defer_accept=SECONDS, rcvbuf=N,
+// sndbuf=N and mode=OCTAL. The socket is opened by csrv_listen(). An
+// address that is already listed fails with EADDRINUSE.
+int csrv_add_listener(struct Csrv *csrv, char *spec) {
+  if(csrv->n_listeners == CSRV_LISTENERS_MAX) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  char *copy = strdup(spec);
+  if(copy == NULL) {
+    return -1;
+  }
+
+  struct CsrvListener listener;
+  memset(&listener, 0, sizeof(listener));
+  listener.kind = CSRV_EVENT_LISTENER;
+  listener.socket_handle = -1;
+
+  char *save = NULL;
+  char *address = strtok_r(copy, " \t", &save);
+  if(address == NULL || csrv_listener_address(&listener, address) != 0) {
+    free(copy);
+    errno = EINVAL;
+    return -1;
+  }
+
+  char *option;
+  while((option = strtok_r(NULL, " \t", &save)) != NULL) {
+    if(csrv_listener_option(&listener, option) != 0) {
+      free(copy);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  for(size_t i = 0; i < csrv->n_listeners; i++) {
+    if(csrv_listener_same(&csrv->listeners[i], &listener)) {
+      free(copy);
+      errno = EADDRINUSE;
+      return -1;
+    }
+  }
+
+  listener.name = strdup(address);
+  free(copy);
+
+  struct CsrvListener *listeners = (struct CsrvListener *) realloc(csrv->listeners, sizeof(struct CsrvListener) * (csrv->n_listeners + 1));
+  if(listener.name == NULL || listeners == NULL) {
+    free(listener.name);
+    return -1;
+  }
+
+  csrv->listeners = listeners;
+  csrv->listeners[csrv->n_listeners++] = listener;
+  return 0;
+}
+
+// What the file being loaded opened or allocated itself, and may replace
+struct CsrvConfigOwned {
+  FILE *log;
+  char *trace_path;
+};
+
+static int csrv_config_set(struct Csrv *csrv, struct CsrvConfigOwned *owned, char *key, char *value) {
+  if(strcmp(key, "listen") == 0) {
+    return csrv_add_listener(csrv, value);
+  } else if(strcmp(key, "model") == 0) {
+    if(strcmp(value, "fork") == 0) {
+      csrv->model = CSRV_FORK;
+    } else if(strcmp(value, "event") == 0) {
+      csrv->model = CSRV_EVENT;
+    } else {
+      return -1;
+    }
+  } else if(strcmp(key, "workers") == 0) {
+    int workers;
+    if(csrv_config_int(value, &workers) != 0 || workers == 0) {
+      return -1;
+    }
+    csrv->n_workers = workers;
+  } else if(strcmp(key, "port") == 0) {
+    int port;
+    if(csrv_config_int(value, &port) != 0 || port > 65535) {
+      return -1;
+    }
+    csrv->port = port;
+  } else if(strcmp(key, "stack_size") == 0) {
+    return csrv_config_size(value, &csrv->stack_size);
+  } else if(strcmp(key, "read_buffer") == 0) {
+    return csrv_config_size(value, &csrv->read_buffer_size) == 0 && csrv->read_buffer_size > 0 ? 0 : -1;
+  } else if(strcmp(key, "proxy_buffer") == 0) {
+    // Chunk size lines and multipart headers have to fit in these
+    return csrv_config_size(value, &csrv->proxy_buffer_size) == 0 && csrv->proxy_buffer_size >= CSRV_CONFIG_BUFFER_MIN ? 0 : -1;
+  } else if(strcmp(key, "multipart_buffer") == 0) {
+    return csrv_config_size(value, &csrv->multipart_buffer_size) == 0 && csrv->multipart_buffer_size >= CSRV_CONFIG_BUFFER_MIN ? 0 : -1;
+  } else if(strcmp(key, "drain_timeout_ms") == 0) {
+    return csrv_config_int(value, &csrv->drain_timeout_ms);
+  } else if(strcmp(key, "trace_sample") == 0) {
+    int sample;
+    if(csrv_config_int(value, &sample) != 0) {
+      return -1;
+    }
+    csrv->trace_sample = sample;
+  } else if(strcmp(key, "trace_file") == 0) {
+    char *path = strdup(value);
+    if(path == NULL) {
+      return -1;
+    }
+    // A repeated key replaces the earlier value; one set by the caller
+    // isn't ours to free
+    if(csrv->trace_path == owned->trace_path) {
+      free(owned->trace_path);
+    }
+    csrv->trace_path = owned->trace_path = path;
+  } else if(strcmp(key, "trace_interval_ms") == 0) {
+    return csrv_config_int(value, &csrv->trace_interval_ms);
+  } else if(strcmp(key, "rate_limit") == 0) {
+    int rate;
+    if(csrv_config_int(value, &rate) != 0) {
+      return -1;
+    }
+    csrv->rate_limit = rate;
+  } else if(strcmp(key, "rate_burst") == 0) {
+    int burst;
+    if(csrv_config_int(value, &burst) != 0) {
+      return -1;
+    }
+    csrv->rate_burst = burst;
+  } else if(strcmp(key, "rate_limit_slots") == 0) {
+    return csrv_config_size(value, &csrv->rate_limit_slots);
+  } else if(strcmp(key, "zerocopy_min") == 0) {
+    return csrv_config_size(value, &csrv->zerocopy_min);
+  } else if(strcmp(key, "log") == 0) {
+    FILE *log = fopen(value, "a");
+    if(log == NULL) {
+      return -1;
+    }
+    if(owned->log != NULL && csrv->log == owned->log) {
+      fclose(owned->log);
+    }
+    csrv->log = owned->log = log;
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
+// Read "key = value" lines into csrv; blank lines and '#' comments are
+// skipped. Keys: listen (repeatable), port, model, workers, stack_size,
+// read_buffer, proxy_buffer, multipart_buffer, drain_timeout_ms, trace_sample,
+// trace_file, trace_interval_ms, rate_limit, rate_burst, rate_limit_slots,
+// zerocopy_min and log.
+// Call before csrv_listen(). On error the line is logged and -1 returned.
+int csrv_config_load(struct Csrv *csrv, char *path) {
+  FILE *file = fopen(path, "r");
+  if(file == NULL) {
+    CSRV_LOG_ERROR(csrv, "failed to open config %s, errno=%s", path, strerror(errno));
+    csrv->status = CSRV_CONFIG_FAILURE;
+    return -1;
+  }
+
+  struct CsrvConfigOwned owned = { NULL, NULL };
+  char line[CSRV_CONFIG_LINE_MAX];
+  unsigned int line_num = 0;
+  int res = 0;
+  while(res == 0 && fgets(line, sizeof(line), file) != NULL) {
+    line_num++;
+
+    char *comment = strchr(line, '#');
+    if(comment != NULL) {
+      *comment = '\0';
+    }
+
+    // Trim both ends
+    char *key = line;
+    while(*key == ' ' || *key == '\t') {
+      key++;
+    }
+    size_t len = strlen(key);
+    while(len > 0 && (key[len - 1] == ' ' || key[len - 1] == '\t' || key[len - 1] == '\r' || key[len - 1] == '\n')) {
+      key[--len] = '\0';
+    }
+    if(len == 0) {
+      continue;
+    }
+
+    char *value = strchr(key, '=');
+    if(value == NULL) {
+      CSRV_LOG_ERROR(csrv, "%s:%u: expected key = value", path, line_num);
+      res = -1;
+      break;
+    }
+
+    char *key_end = value;
+    while(key_end > key && (key_end[-1] == ' ' || key_end[-1] == '\t')) {
+      key_end--;
+    }
+    *key_end = '\0';
+    value++;
+    while(*value == ' ' || *value == '\t') {
+      value++;
+    }
+
+    if(csrv_config_set(csrv, &owned, key, value) != 0) {
+      CSRV_LOG_ERROR(csrv, "%s:%u: invalid %s \"%s\"", path, line_num, key, value);
+      res = -1;
+    }
+  }
+
+  fclose(file);
+  if(res != 0) {
+    csrv->status = CSRV_CONFIG_FAILURE;
+  }
+  return res;
+}
+
+// Fill in everything left at 0. Called by csrv_listen().
+void csrv_config_defaults(struct Csrv *csrv) {
+  if(csrv->read_buffer_size == 0) {
+    csrv->read_buffer_size = CSRV_CHUNK_SIZE;
+  }
+  if(csrv->proxy_buffer_size == 0) {
+    csrv->proxy_buffer_size = CSRV_PROXY_BUFFER;
+  }
+  if(csrv->multipart_buffer_size == 0) {
+    csrv->multipart_buffer_size = CSRV_MULTIPART_BUFFER;
+  }
+  if(csrv->n_workers == 0) {
+    csrv->n_workers = CSRV_DEFAULT_WORKERS;
+  }
+  if(csrv->trace_path == NULL) {
+    csrv->trace_path = CSRV_TRACE_FILE;
+  }
+  if(csrv->zerocopy_min == 0) {
+    csrv->zerocopy_min = CSRV_ZEROCOPY_MIN;
+  }
+}
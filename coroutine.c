@@ -0,0 +1,434 @@
+#include "sys/types.h"
+#include "sys/socket.h"
+#include "sys/mman.h"
+#include "sys/epoll.h"
+#include "string.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "poll.h"
+#include "time.h"
+#include "ucontext.h"
+#include "csrv.h"
+
+// Coroutine currently running on this thread, NULL when on the loop's own stack
+static __thread struct CsrvCoro *csrv_current_coro = NULL;
+
+int64_t csrv_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int csrv_stack_pool_init(struct CsrvStackPool *pool, size_t stack_size) {
+  pool->page_size = (size_t) sysconf(_SC_PAGESIZE);
+  if(stack_size == 0) {
+    stack_size = CSRV_DEFAULT_STACK_SIZE;
+  }
+
+  // Round up to a whole number of pages
+  pool->stack_size = (stack_size + pool->page_size - 1) & ~(pool->page_size - 1);
+  pool->n_free = 0;
+  pool->capacity = CSRV_STACK_POOL_MAX;
+  pool->stacks = (void **) malloc(sizeof(void *) * pool->capacity);
+  if(pool->stacks == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+// Returns the base of the mapping -- the usable stack starts one page above it
+void *csrv_stack_alloc(struct CsrvStackPool *pool) {
+  if(pool->n_free > 0) {
+    return pool->stacks[--pool->n_free];
+  }
+
+  size_t map_size = pool->stack_size + pool->page_size;
+  void *stack = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if(stack == MAP_FAILED) {
+    return NULL;
+  }
+
+  // Stacks grow down, so an overflow runs into this page and faults
+  // instead of silently corrupting the neighbouring mapping
+  if(mprotect(stack, pool->page_size, PROT_NONE) != 0) {
+    munmap(stack, map_size);
+    return NULL;
+  }
+
+  return stack;
+}
+
+void csrv_stack_free(struct CsrvStackPool *pool, void *stack) {
+  if(pool->n_free < pool->capacity) {
+    pool->stacks[pool->n_free++] = stack;
+    return;
+  }
+
+  munmap(stack, pool->stack_size + pool->page_size);
+}
+
+void csrv_stack_pool_cleanup(struct CsrvStackPool *pool) {
+  for(size_t i = 0; i < pool->n_free; i++) {
+    munmap(pool->stacks[i], pool->stack_size + pool->page_size);
+  }
+
+  free(pool->stacks);
+  pool->n_free = 0;
+}
+
+// makecontext() can only pass int arguments, so the coroutine picks itself
+// up from the thread-local instead
+static void csrv_coro_entry(void) {
+  struct CsrvCoro *coro = csrv_current_coro;
+  if(coro->entry != NULL) {
+    coro->entry(coro->arg);
+  } else {
+    csrv_serve_connection(coro->loop->csrv, coro->socket_handle);
+  }
+  coro->state = CSRV_CORO_DONE;
+  // Returning switches to uc_link, which is the loop's context
+}
+
+static struct CsrvCoro *csrv_coro_create(struct CsrvLoop *loop) {
+  struct CsrvCoro *coro = (struct CsrvCoro *) calloc(1, sizeof(struct CsrvCoro));
+  if(coro == NULL) {
+    return NULL;
+  }
+
+  coro->stack = csrv_stack_alloc(&loop->stacks);
+  if(coro->stack == NULL) {
+    free(coro);
+    return NULL;
+  }
+
+  coro->kind = CSRV_EVENT_CORO;
+  coro->loop = loop;
+  coro->socket_handle = -1;
+  coro->wait_fd = -1;
+
+  getcontext(&coro->context);
+  coro->context.uc_stack.ss_sp = (char *) coro->stack + loop->stacks.page_size;
+  coro->context.uc_stack.ss_size = loop->stacks.stack_size;
+  coro->context.uc_link = &loop->context;
+  makecontext(&coro->context, csrv_coro_entry, 0);
+
+  loop->n_coros++;
+  return coro;
+}
+
+int csrv_coro_spawn(struct CsrvLoop *loop, int sock_handle) {
+  struct CsrvCoro *coro = csrv_coro_create(loop);
+  if(coro == NULL) {
+    return -1;
+  }
+
+  coro->socket_handle = sock_handle;
+  csrv_coro_resume(coro);
+  return 0;
+}
+
+// Run entry(arg) in a new coroutine, from the loop itself: for work the loop
+// must not block on
+int csrv_coro_spawn_task(struct CsrvLoop *loop, void (*entry)(void *), void *arg) {
+  struct CsrvCoro *coro = csrv_coro_create(loop);
+  if(coro == NULL) {
+    return -1;
+  }
+
+  coro->entry = entry;
+  coro->arg = arg;
+  csrv_coro_resume(coro);
+  return 0;
+}
+
+static void csrv_coro_push_ready(struct CsrvCoro *coro) {
+  struct CsrvLoop *loop = coro->loop;
+  coro->state = CSRV_CORO_READY;
+  coro->next = NULL;
+  if(loop->ready_tail != NULL) {
+    loop->ready_tail->next = coro;
+  } else {
+    loop->ready = coro;
+  }
+  loop->ready_tail = coro;
+}
+
+struct CsrvCoro *csrv_coro_self(void) {
+  return csrv_current_coro;
+}
+
+// Start entry(arg) in a new coroutine on the running coroutine's loop. It
+// runs once the caller yields; only the loop itself may switch contexts.
+struct CsrvCoro *csrv_coro_start(void (*entry)(void *), void *arg) {
+  if(csrv_current_coro == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  struct CsrvCoro *coro = csrv_coro_create(csrv_current_coro->loop);
+  if(coro == NULL) {
+    return NULL;
+  }
+
+  coro->entry = entry;
+  coro->arg = arg;
+  csrv_coro_push_ready(coro);
+  return coro;
+}
+
+void csrv_coro_run_ready(struct CsrvLoop *loop) {
+  while(loop->ready != NULL) {
+    struct CsrvCoro *coro = loop->ready;
+    loop->ready = coro->next;
+    if(loop->ready == NULL) {
+      loop->ready_tail = NULL;
+    }
+    coro->next = NULL;
+    csrv_coro_resume(coro);
+  }
+}
+
+static void csrv_coro_unlink(struct CsrvCoro *coro) {
+  if(coro->prev != NULL) {
+    coro->prev->next = coro->next;
+  } else if(coro->loop->waiting == coro) {
+    coro->loop->waiting = coro->next;
+  }
+
+  if(coro->next != NULL) {
+    coro->next->prev = coro->prev;
+  }
+
+  coro->prev = NULL;
+  coro->next = NULL;
+}
+
+static void csrv_coro_link(struct CsrvCoro *coro) {
+  struct CsrvLoop *loop = coro->loop;
+  coro->next = loop->waiting;
+  if(loop->waiting != NULL) {
+    loop->waiting->prev = coro;
+  }
+  loop->waiting = coro;
+}
+
+// Run the coroutine until it either finishes or parks
+void csrv_coro_resume(struct CsrvCoro *coro) {
+  struct CsrvLoop *loop = coro->loop;
+
+  coro->state = CSRV_CORO_READY;
+  csrv_current_coro = coro;
+  swapcontext(&loop->context, &coro->context);
+  csrv_current_coro = NULL;
+
+  if(coro->state == CSRV_CORO_DONE) {
+    csrv_stack_free(&loop->stacks, coro->stack);
+    loop->n_coros--;
+    free(coro);
+    return;
+  }
+
+  // Parked without a descriptor: only listed, for the deadline sweep
+  if(coro->wait_fd == -1) {
+    csrv_coro_link(coro);
+    return;
+  }
+
+  // One-shot so a descriptor never wakes a coroutine that isn't parked on it
+  struct epoll_event ev;
+  ev.events = EPOLLONESHOT;
+  ev.events |= (coro->wait_events & POLLIN) ? EPOLLIN | EPOLLRDHUP : 0;
+  ev.events |= (coro->wait_events & POLLOUT) ? EPOLLOUT : 0;
+  ev.data.ptr = coro;
+
+  // Descriptors are reused across coroutines (and outlive them), so MOD first
+  int ctl_res = epoll_ctl(loop->epoll_handle, EPOLL_CTL_MOD, coro->wait_fd, &ev);
+  if(ctl_res == -1 && errno == ENOENT) {
+    ctl_res = epoll_ctl(loop->epoll_handle, EPOLL_CTL_ADD, coro->wait_fd, &ev);
+  }
+
+  if(ctl_res == -1) {
+    CSRV_LOG_ERROR(loop->csrv, "epoll_ctl() failed for fd=%d with errno=%s", coro->wait_fd, strerror(errno));
+    coro->wait_failed = true;
+    csrv_coro_resume(coro);
+    return;
+  }
+
+  csrv_coro_link(coro);
+}
+
+// Mark the running coroutine as waiting for a follow-up keep-alive request
+void csrv_coro_set_idle(bool idle) {
+  if(csrv_current_coro != NULL) {
+    csrv_current_coro->idle = idle;
+  }
+}
+
+// Take a parked coroutine off the waiting list and queue it to see its wait
+// fail. The sweeps below queue everything first and only then run it: a
+// coroutine resumed mid-sweep may unpark, and so unlink, the very one the
+// sweep would have visited next.
+static void csrv_coro_fail(struct CsrvCoro *coro) {
+  // Disarm first so a late event can't reach a finished coroutine
+  if(coro->wait_fd != -1) {
+    epoll_ctl(coro->loop->epoll_handle, EPOLL_CTL_DEL, coro->wait_fd, NULL);
+  }
+  csrv_coro_unlink(coro);
+  coro->wait_failed = true;
+  csrv_coro_push_ready(coro);
+}
+
+// Fail the waits of idle keep-alive connections so they close now
+void csrv_coro_wake_idle(struct CsrvLoop *loop) {
+  struct CsrvCoro *coro = loop->waiting;
+  while(coro != NULL) {
+    struct CsrvCoro *next = coro->next;
+    if(coro->idle) {
+      csrv_coro_fail(coro);
+    }
+    coro = next;
+  }
+  csrv_coro_run_ready(loop);
+}
+
+void csrv_coro_wake(struct CsrvCoro *coro, bool failed) {
+  csrv_coro_unlink(coro);
+  coro->wait_failed = failed;
+  csrv_coro_resume(coro);
+}
+
+// Fail every wait whose deadline has passed
+void csrv_coro_expire(struct CsrvLoop *loop, int64_t now) {
+  struct CsrvCoro *coro = loop->waiting;
+  while(coro != NULL) {
+    struct CsrvCoro *next = coro->next;
+    if(coro->deadline <= now) {
+      csrv_coro_fail(coro);
+    }
+    coro = next;
+  }
+  csrv_coro_run_ready(loop);
+}
+
+// Block until fd is ready for events. Inside a coroutine this yields back to
+// the event loop; anywhere else (e.g. a forked child) it falls back to poll()
+int csrv_coro_wait(int fd, short events, int timeout_ms) {
+  struct CsrvCoro *coro = csrv_current_coro;
+  if(coro == NULL) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+
+    int poll_res;
+    do {
+      poll_res = poll(&pfd, 1, timeout_ms);
+    } while(poll_res == -1 && errno == EINTR);
+
+    if(poll_res == 0) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    return poll_res < 0 ? -1 : 0;
+  }
+
+  coro->wait_fd = fd;
+  coro->wait_events = events;
+  coro->deadline = csrv_now_ms() + timeout_ms;
+  coro->wait_failed = false;
+  coro->state = CSRV_CORO_WAITING;
+  swapcontext(&coro->context, &coro->loop->context);
+
+  if(coro->wait_failed) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return 0;
+}
+
+// Park the running coroutine until csrv_coro_unpark(), for at most
+// timeout_ms. For waits on something other than a descriptor, e.g. another
+// coroutine's progress.
+int csrv_coro_park(int timeout_ms) {
+  struct CsrvCoro *coro = csrv_current_coro;
+  if(coro == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  coro->wait_fd = -1;
+  coro->wait_events = 0;
+  coro->deadline = csrv_now_ms() + timeout_ms;
+  coro->wait_failed = false;
+  coro->state = CSRV_CORO_WAITING;
+  swapcontext(&coro->context, &coro->loop->context);
+
+  if(coro->wait_failed) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return 0;
+}
+
+// Queue a parked coroutine to run again. A no-op for one that isn't parked,
+// so waking everyone that might be interested is always safe.
+void csrv_coro_unpark(struct CsrvCoro *coro) {
+  if(coro->state != CSRV_CORO_WAITING || coro->wait_fd != -1) {
+    return;
+  }
+
+  csrv_coro_unlink(coro);
+  coro->wait_failed = false;
+  csrv_coro_push_ready(coro);
+}
+
+ssize_t csrv_io_read(int fd, void *buffer, size_t sz) {
+  for(;;) {
+    ssize_t sz_read = read(fd, buffer, sz);
+    if(sz_read >= 0) {
+      return sz_read;
+    }
+
+    if(errno == EINTR) {
+      continue;
+    }
+
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      return -1;
+    }
+
+    if(csrv_coro_wait(fd, POLLIN, CSRV_IO_TIMEOUT_MS) != 0) {
+      return -1;
+    }
+  }
+}
+
+// Writes the whole buffer, parking on POLLOUT whenever the socket is full
+ssize_t csrv_io_write(int fd, const void *buffer, size_t sz) {
+  size_t written = 0;
+  while(written < sz) {
+    // MSG_NOSIGNAL: a peer hanging up must not SIGPIPE the whole server
+    ssize_t sz_sent = send(fd, (const char *) buffer + written, sz - written, MSG_NOSIGNAL);
+    if(sz_sent >= 0) {
+      written += sz_sent;
+      continue;
+    }
+
+    if(errno == EINTR) {
+      continue;
+    }
+
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      return -1;
+    }
+
+    if(csrv_coro_wait(fd, POLLOUT, CSRV_IO_TIMEOUT_MS) != 0) {
+      return -1;
+    }
+  }
+
+  return written;
+}
@@ -4,6 +4,10 @@
 #include "stdio.h"
 #include "stdlib.h"
 #include "stdbool.h"
+#include "stdint.h"
+#include "ucontext.h"
+#include "pthread.h"
+#include "netinet/in.h"
 
 enum CsrvModel {
   CSRV_FORK,
@@ -19,7 +23,9 @@ enum CsrvStatus {
   CSRV_ACCEPT_FAILURE,
   CSRV_HEADER_PARSE_FAILURE,
   CSRV_ALLOC_FAILURE,
-  CSRV_RETRY_EXCEEDED
+  CSRV_RETRY_EXCEEDED,
+  CSRV_CONNECTION_CLOSED,
+  CSRV_CONFIG_FAILURE
 };
 
 // Internal states during header parsing
@@ -35,12 +41,43 @@ enum CsrvHeaderParseState {
   CSRV_HEADER_PARSE_RETURN
 };
 
+// Headers recognised during the parse and kept in fixed slots on the request
+// (CsrvRequestHeader.known) instead of the generic map. See headers.c
+enum CsrvHeader {
+  CSRV_HEADER_HOST,
+  CSRV_HEADER_CONTENT_LENGTH,
+  CSRV_HEADER_CONNECTION,
+  CSRV_HEADER_TRANSFER_ENCODING,
+  CSRV_HEADER_CONTENT_TYPE,
+  CSRV_HEADER_ACCEPT_ENCODING,
+  CSRV_HEADER_IF_NONE_MATCH,
+  CSRV_HEADER_COOKIE,
+  CSRV_HEADER_USER_AGENT,
+  CSRV_HEADER_ACCEPT,
+  CSRV_HEADER_AUTHORIZATION,
+  CSRV_HEADER_EXPECT,
+  CSRV_HEADER_UPGRADE,
+  CSRV_HEADER_KEEP_ALIVE,
+  CSRV_HEADER_IF_MODIFIED_SINCE,
+  CSRV_HEADER_RANGE,
+  CSRV_HEADER_REFERER,
+  CSRV_HEADER_ORIGIN,
+  CSRV_HEADER_HTTP2_SETTINGS,
+  CSRV_HEADER_SEC_WEBSOCKET_KEY,
+  CSRV_HEADER_SEC_WEBSOCKET_VERSION,
+  CSRV_HEADER_X_FORWARDED_FOR,
+  CSRV_HEADER_COUNT
+};
+
 enum CsrvResponseStatus {
   CSRV_HTTP_OK,
   CSRV_HTTP_NOT_FOUND,
   CSRV_HTTP_SERVER_ERROR,
   CSRV_HTTP_UNAUTHORIZED,
-  CSRV_HTTP_BAD_REQUEST
+  CSRV_HTTP_BAD_REQUEST,
+  CSRV_HTTP_BAD_GATEWAY,
+  CSRV_HTTP_TOO_MANY_REQUESTS,
+  CSRV_HTTP_LENGTH_REQUIRED
 };
 
 // Hashmap of string->string
@@ -62,28 +99,190 @@ struct CsrvStrVec {
   char *string;
 };
 
+// Tag stored first in anything registered with an event loop, so the loop
+// can tell what an epoll_event.data.ptr points at
+enum CsrvEventKind {
+  CSRV_EVENT_LISTENER,
+  CSRV_EVENT_CORO,
+  CSRV_EVENT_WS
+};
+
+// One listening socket, see csrv_add_listener() for the address syntax
+struct CsrvListener {
+  enum CsrvEventKind kind;
+  int socket_handle;
+  char *name;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+
+  // Set on the listener before listen(); accepted sockets inherit them
+  int backlog;
+  bool reuse_port;
+  bool no_delay;
+  int defer_accept;
+  int rcvbuf;
+  int sndbuf;
+  // Unix sockets only: permissions for the socket file, 0 leaves the umask's
+  int mode;
+};
+
+// A buffer queued for sending on a connection, freed once sent. One that
+// went out with MSG_ZEROCOPY is kept until the kernel has reported sends
+// zc_first..zc_last complete (zc_done of them so far)
+struct CsrvOutBuf {
+  struct CsrvOutBuf *next;
+  char *data;
+  size_t len;
+  size_t sent;
+  bool zerocopy;
+  bool zc_sent;
+  uint32_t zc_first;
+  uint32_t zc_last;
+  uint32_t zc_done;
+};
+
+// Per-connection output. zerocopy: 0 until first needed, 1 when SO_ZEROCOPY
+// is on, -1 when it isn't worth using; zc_next is the socket's next
+// zerocopy sequence number
+struct CsrvOutQueue {
+  int fd;
+  struct CsrvOutBuf *head;
+  struct CsrvOutBuf **tail;
+  int zerocopy;
+  uint32_t zc_next;
+};
+
+struct CsrvRequest;
+struct CsrvResponse;
+typedef void (*csrv_handler_t)(struct CsrvRequest*, struct CsrvResponse*);
+
 // Core server -- entrypoint into library
 struct Csrv {
   enum CsrvModel model;
   enum CsrvStatus status;
-  int socket_handle;
+  // Every listener is served by the same accept loop. With none configured,
+  // csrv_listen() listens on port on every IPv4 address
+  struct CsrvListener *listeners;
+  size_t n_listeners;
   uint16_t port;
   unsigned int num_requests;
   FILE *log;
   size_t active_requests;
   size_t request_id_max;
+  csrv_handler_t handler;
+  struct CsrvProxy *proxy;
+
+  // CSRV_EVENT only: number of event loop threads and coroutine stack size
+  unsigned int n_workers;
+  size_t stack_size;
+
+  // Buffer sizes, 0 for the defaults: header reads, proxy relaying and the
+  // multipart parser's window
+  size_t read_buffer_size;
+  size_t proxy_buffer_size;
+  size_t multipart_buffer_size;
+
+  // Graceful restart: SIGUSR2 re-executes argv, hands it the listening
+  // socket, then drains for up to drain_timeout_ms. Disabled if argv is NULL
+  char **argv;
+  int drain_timeout_ms;
+  bool draining;
+  int64_t drain_deadline;
+
+  // Tracing: 1 in trace_sample requests (0 for none) records spans, which
+  // are appended to trace_path on SIGUSR1 and every trace_interval_ms
+  unsigned int trace_sample;
+  char *trace_path;
+  int trace_interval_ms;
+
+  // Rate limiting: each client address may open connections and send
+  // requests at rate_limit per second (0 for no limit), in bursts of up to
+  // rate_burst, tracked in a table of rate_limit_slots buckets
+  unsigned int rate_limit;
+  unsigned int rate_burst;
+  size_t rate_limit_slots;
+  struct CsrvRateLimit *limiter;
+
+  // Response bodies of at least this size are sent with MSG_ZEROCOPY, 0 for
+  // the default
+  size_t zerocopy_min;
+};
+
+enum CsrvCoroState {
+  CSRV_CORO_READY,
+  CSRV_CORO_WAITING,
+  CSRV_CORO_DONE
+};
+
+// Pool of mmap()'d coroutine stacks, each with a PROT_NONE guard page below it
+struct CsrvStackPool {
+  size_t stack_size;
+  size_t page_size;
+  size_t n_free;
+  size_t capacity;
+  void **stacks;
+};
+
+// One event loop per worker thread
+struct CsrvLoop {
+  struct Csrv *csrv;
+  int epoll_handle;
+  ucontext_t context;
+  struct CsrvStackPool stacks;
+  size_t n_coros;
+  bool accepting;
+
+  // Intrusive list of parked coroutines
+  struct CsrvCoro *waiting;
+
+  // Coroutines to run before the next epoll_wait(): new ones started from
+  // another coroutine, and parked ones that were unparked
+  struct CsrvCoro *ready;
+  struct CsrvCoro *ready_tail;
+
+  // Upgraded WebSocket connections, served without a coroutine
+  struct CsrvWs *websockets;
+};
+
+// Stackful coroutine serving a single connection, or running entry(arg)
+struct CsrvCoro {
+  enum CsrvEventKind kind;
+  enum CsrvCoroState state;
+  ucontext_t context;
+  void *stack;
+  int socket_handle;
+  void (*entry)(void *);
+  void *arg;
+  struct CsrvLoop *loop;
+
+  // What we are parked on, and until when (CLOCK_MONOTONIC milliseconds).
+  // wait_fd is -1 for csrv_coro_park(), which only csrv_coro_unpark() ends
+  int wait_fd;
+  short wait_events;
+  int64_t deadline;
+  bool wait_failed;
+
+  // Parked between keep-alive requests, so safe to drop when draining
+  bool idle;
+  struct CsrvCoro *prev;
+  struct CsrvCoro *next;
 };
 
 struct CsrvRequestHeader {
   unsigned int status_code;
   size_t content_size;
+  bool has_content_length;
+  bool chunked;
   
+  // Alias of known[CSRV_HEADER_HOST]
   char *host;
   char *method;
   char *uri;
   char *path;
   char *proto;
 
+  // Well-known header values, NULL when absent; unknown headers go to the map
+  char *known[CSRV_HEADER_COUNT];
   struct CsrvStrMap header_map;
 };
 
@@ -91,30 +290,441 @@ struct CsrvRequest {
   int socket_handle;
   size_t id;
   size_t body_offset;
+  size_t body_read;
+  bool keep_alive;
   enum CsrvStatus status;
   
   struct CsrvRequestHeader headers;
   struct CsrvStrVec request;
   struct Csrv *csrv;
+
+  // Sampled for tracing (1 in csrv->trace_sample ids), and when it started
+  bool traced;
+  uint64_t trace_start;
+
+  // Set for requests arriving on an HTTP/2 stream; the head in request is
+  // then synthesized from the decoded header block
+  struct CsrvH2Stream *stream;
+
+  // The connection's output queue, which HTTP/1 reads go through
+  struct CsrvOutQueue *out;
 };
 
 struct CsrvResponse {
   int socket_handle;
   enum CsrvResponseStatus status;
+  bool keep_alive;
+
+  // Set by handlers that wrote to the socket themselves (e.g. the proxy)
+  bool written;
   struct CsrvStrMap headers;
   struct CsrvStrVec body;
   struct Csrv *csrv;
+  struct CsrvH2Stream *stream;
+
+  // Set by csrv_ws_upgrade(); the socket is handed over after the handler
+  struct CsrvWs *websocket;
+
+  // The connection's output queue, which csrv_write_response() sends through
+  struct CsrvOutQueue *out;
 };
 
-typedef void (*csrv_handler_t)(struct CsrvRequest*, struct CsrvResponse*);
+// One part of a multipart/form-data body. Small fields are kept in value;
+// files (and fields over CSRV_MULTIPART_FIELD_MAX, or past
+// CSRV_MULTIPART_MEMORY_MAX for all fields) are written to a temp file
+// at path, which is unlinked on cleanup unless the handler sets path to NULL
+struct CsrvMultipartPart {
+  char *name;
+  char *filename;
+  char *content_type;
+  size_t size;
+  struct CsrvStrVec value;
+  char *path;
+  int fd;
+  struct CsrvMultipartPart *next;
+};
+
+enum CsrvMultipartState {
+  CSRV_MULTIPART_PREAMBLE,
+  CSRV_MULTIPART_DELIMITER,
+  CSRV_MULTIPART_HEADERS,
+  CSRV_MULTIPART_BODY,
+  CSRV_MULTIPART_DONE
+};
+
+// Streaming parser state. Memory is the fixed buffer plus in-memory fields,
+// whatever the size of the uploaded files
+struct CsrvMultipart {
+  struct CsrvRequest *req;
+  enum CsrvMultipartState state;
+  char *buffer;
+  size_t buffer_size;
+  size_t pos;
+  size_t len;
+  char *delimiter;
+  size_t delimiter_len;
+  // Bytes of all in-memory fields, and parts so far
+  size_t memory;
+  size_t n_parts;
+  struct CsrvMultipartPart *parts;
+  struct CsrvMultipartPart *current;
+};
+
+#define CSRV_H2_FRAME_HEADER 9
+#define CSRV_H2_FRAME_SIZE 16384
+#define CSRV_H2_FLAG_END_STREAM 0x1
+#define CSRV_H2_FLAG_ACK 0x1
+#define CSRV_H2_FLAG_END_HEADERS 0x4
+#define CSRV_H2_FLAG_PADDED 0x8
+#define CSRV_H2_FLAG_PRIORITY 0x20
+
+// HPACK (RFC 7541) decoder state: the dynamic table as a ring, newest entry
+// last. Each entry costs its name and value lengths plus 32 against max_size,
+// so the ring never needs more than CSRV_HPACK_TABLE_ENTRIES slots
+#define CSRV_HPACK_TABLE_SIZE 4096
+#define CSRV_HPACK_TABLE_ENTRIES (CSRV_HPACK_TABLE_SIZE / 32)
+
+struct CsrvHpackEntry {
+  // name and value share one allocation, owned by name
+  char *name;
+  char *value;
+  size_t name_len;
+  size_t value_len;
+};
+
+struct CsrvHpack {
+  struct CsrvHpackEntry entries[CSRV_HPACK_TABLE_ENTRIES];
+  size_t first;
+  size_t count;
+  size_t size;
+  size_t max_size;
+};
+
+typedef int (*csrv_hpack_emit_t)(void *ctx, char *name, size_t name_len, char *value, size_t value_len);
+
+enum CsrvH2FrameType {
+  CSRV_H2_DATA,
+  CSRV_H2_HEADERS,
+  CSRV_H2_PRIORITY,
+  CSRV_H2_RST_STREAM,
+  CSRV_H2_SETTINGS,
+  CSRV_H2_PUSH_PROMISE,
+  CSRV_H2_PING,
+  CSRV_H2_GOAWAY,
+  CSRV_H2_WINDOW_UPDATE,
+  CSRV_H2_CONTINUATION
+};
+
+enum CsrvH2Error {
+  CSRV_H2_NO_ERROR,
+  CSRV_H2_PROTOCOL_ERROR,
+  CSRV_H2_INTERNAL_ERROR,
+  CSRV_H2_FLOW_CONTROL_ERROR,
+  CSRV_H2_SETTINGS_TIMEOUT,
+  CSRV_H2_STREAM_CLOSED,
+  CSRV_H2_FRAME_SIZE_ERROR,
+  CSRV_H2_REFUSED_STREAM,
+  CSRV_H2_CANCEL,
+  CSRV_H2_COMPRESSION_ERROR
+};
+
+// One request/response exchange on an HTTP/2 connection. The handler runs
+// against req as usual; the body it reads comes from DATA frames buffered here
+struct CsrvH2Stream {
+  uint32_t id;
+  struct CsrvH2Conn *conn;
+  struct CsrvRequest *req;
+
+  // END_STREAM received / sent, or RST_STREAM either way
+  bool remote_closed;
+  bool local_closed;
+  bool reset;
+  bool headers_sent;
+
+  // Without coroutines streams run one at a time, in the order they arrived
+  bool started;
+
+  int64_t send_window;
+  int64_t recv_window;
+
+  // Body bytes the handler has read but we haven't returned to the peer's
+  // window yet
+  size_t unacked;
+  size_t received;
+  struct CsrvStrVec body;
+  size_t body_pos;
+
+  // The stream's coroutine, while it waits for data, window or output space
+  struct CsrvCoro *waiter;
+  struct CsrvH2Stream *next;
+};
+
+// Pseudo-headers and regular fields of a request header block, collected as
+// it is decoded. The fields are kept as HTTP/1 header lines.
+struct CsrvH2Head {
+  char *method;
+  char *scheme;
+  char *authority;
+  char *path;
+  struct CsrvStrVec fields;
+  struct CsrvStrVec cookie;
+  bool has_host;
+  bool regular_seen;
+  bool malformed;
+};
+
+// An HTTP/2 connection. In the event model the connection's own coroutine
+// reads and dispatches frames, each stream's handler runs in a coroutine of
+// its own and a writer coroutine sends whatever they queue in out. Elsewhere
+// streams run one after the other and reading happens whenever one waits.
+struct CsrvH2Conn {
+  struct Csrv *csrv;
+  int socket_handle;
+  // Rate limit key of the client, 0 when not limited
+  uint64_t client;
+
+  // A dup() of socket_handle, so the writer can wait for POLLOUT while the
+  // reader waits for POLLIN: epoll keeps one registration per descriptor
+  int write_handle;
+  bool concurrent;
+  struct CsrvCoro *reader;
+  struct CsrvCoro *writer;
+
+  struct CsrvHpack decoder;
+  uint8_t in[CSRV_H2_FRAME_SIZE + CSRV_H2_FRAME_HEADER];
+  size_t in_len;
+  struct CsrvStrVec out;
+  size_t out_pos;
+
+  struct CsrvH2Stream *streams;
+  size_t n_streams;
+  uint32_t last_stream_id;
+
+  // Header block being reassembled from HEADERS + CONTINUATION
+  uint32_t header_stream;
+  bool header_end_stream;
+  struct CsrvStrVec header_block;
+
+  int64_t send_window;
+  int64_t recv_window;
+  size_t unacked;
+  uint32_t peer_max_frame;
+  uint32_t peer_initial_window;
+
+  // goaway: no new streams, close once the open ones finish. broken: a
+  // protocol or I/O error, streams fail their next read or write
+  bool goaway;
+  bool broken;
+  bool write_failed;
+  bool closing;
+};
+
+enum CsrvWsOpcode {
+  CSRV_WS_CONTINUATION = 0x0,
+  CSRV_WS_TEXT = 0x1,
+  CSRV_WS_BINARY = 0x2,
+  CSRV_WS_CLOSE = 0x8,
+  CSRV_WS_PING = 0x9,
+  CSRV_WS_PONG = 0xa
+};
+
+// Close codes (RFC 6455 section 7.4.1)
+#define CSRV_WS_NORMAL 1000
+#define CSRV_WS_GOING_AWAY 1001
+#define CSRV_WS_PROTOCOL_ERROR 1002
+#define CSRV_WS_NO_STATUS 1005
+#define CSRV_WS_ABNORMAL 1006
+#define CSRV_WS_INVALID_DATA 1007
+#define CSRV_WS_TOO_BIG 1009
+#define CSRV_WS_INTERNAL_ERROR 1011
+
+struct CsrvWs;
+
+// Callbacks run on the connection's own loop. message gets whole messages,
+// reassembled from fragments; data is only valid during the call. close is
+// called once, with the client's close code or CSRV_WS_ABNORMAL, right
+// before the connection is freed.
+struct CsrvWsHandler {
+  void (*message)(struct CsrvWs *ws, enum CsrvWsOpcode opcode, char *data, size_t len);
+  void (*close)(struct CsrvWs *ws, uint16_t code);
+};
+
+// Queued output: a reference to a shared frame and how much of it is sent
+struct CsrvWsOut {
+  struct CsrvWsFrame *frame;
+  size_t pos;
+  struct CsrvWsOut *next;
+};
+
+// An upgraded connection. There is no coroutine or stack behind it, and the
+// buffers are only allocated while a frame, a fragmented message or output
+// is pending, so an idle connection costs little more than this struct.
+struct CsrvWs {
+  enum CsrvEventKind kind;
+  int socket_handle;
+  struct Csrv *csrv;
+  struct CsrvLoop *loop;
+  const struct CsrvWsHandler *handler;
+  void *user;
+
+  // Partial frame carried over from the last read
+  uint8_t *in;
+  uint32_t in_len;
+  uint32_t in_size;
+
+  // Fragmented message being reassembled, CSRV_WS_CONTINUATION if none
+  uint8_t *msg;
+  uint32_t msg_len;
+  uint8_t msg_opcode;
+
+  // The owner's reference and one per broadcast under way
+  uint32_t refs;
+
+  // Guards the output side, which other threads reach through broadcasts.
+  // Whoever holds sending does the writing and EPOLLOUT changes, outside the
+  // lock; dirty tells it output was queued meanwhile.
+  bool lock;
+  bool sending;
+  bool dirty;
+  bool registered;
+  bool armed;
+  bool close_sent;
+  bool failed;
+  uint16_t close_code;
+  uint32_t out_bytes;
+  // Outside an event loop: an eventfd that wakes the serving thread's poll()
+  int wake_handle;
+  struct CsrvWsOut *out;
+  struct CsrvWsOut *out_tail;
+
+  struct CsrvWsGroup *group;
+  struct CsrvWs *group_prev;
+  struct CsrvWs *group_next;
+  struct CsrvWs *prev;
+  struct CsrvWs *next;
+};
+
+// Connections that receive the same broadcasts, across every worker
+struct CsrvWsGroup {
+  pthread_mutex_t lock;
+  struct CsrvWs *members;
+  size_t n_members;
+};
+
+// A timed stage of a traced request; start and end are csrv_trace_clock() ticks
+struct CsrvSpan {
+  const char *name;
+  size_t id;
+  uint64_t start;
+  uint64_t end;
+};
+
+// Spans recorded by one thread since its last dump. next links buffers
+// waiting for the trace writer.
+#define CSRV_TRACE_SPANS 4096
+struct CsrvTraceBuffer {
+  struct CsrvSpan spans[CSRV_TRACE_SPANS];
+  size_t n_spans;
+  int tid;
+  int generation;
+  int64_t last_dump;
+  struct CsrvTraceBuffer *next;
+};
+
+// A client's token bucket. state packs the time of the last refill and the
+// tokens left (see ratelimit.c); referenced is the CLOCK bit, set on use and
+// cleared as the set's hand passes
+struct CsrvRateSlot {
+  uint64_t key;
+  uint64_t state;
+  uint8_t referenced;
+};
+
+// Fixed-size table of buckets, CSRV_RATE_LIMIT_WAYS to a set, with a clock
+// hand per set choosing which client to forget
+struct CsrvRateLimit {
+  struct CsrvRateSlot *slots;
+  uint8_t *hands;
+  size_t n_sets;
+  size_t map_size;
+  uint32_t rate;
+  uint32_t burst;
+  int64_t epoch;
+};
+
+// Reverse proxy. Pools are per worker thread and per proxy, so
+// least-connections balances on what this worker has in flight
+struct CsrvUpstreamPool {
+  int *idle;
+  size_t n_idle;
+  size_t active;
+};
+
+struct CsrvUpstream {
+  char *name;
+  struct sockaddr_in addr;
+
+  // Marked down until this time (csrv_now_ms()), 0 while healthy
+  int64_t retry_at;
+
+  // Active health check (csrv_proxy_probe()): probed once the prober has
+  // taken the upstream over from requests, probing while one caller is at
+  // it, and the connect in progress
+  bool probed;
+  uint8_t probing;
+  int probe_fd;
+  int64_t probe_start;
+};
+
+struct CsrvProxy {
+  size_t n_upstreams;
+  struct CsrvUpstream *upstreams;
+  size_t map_size;
+  // Each thread's array of pools (see proxy.c)
+  pthread_key_t pools_key;
+};
 
 // Connection handling
-#define CSRV_LISTEN_BACKLOG 20
-#define CSRV_MAX_EAGAIN_TRIES 8
+#define CSRV_LISTEN_BACKLOG 4096
+#define CSRV_LISTENERS_MAX 16
 void csrv_listen(struct Csrv *csrv);
-void csrv_accept_handler(struct Csrv *csrv);
+void csrv_accept_handler(struct Csrv *csrv, struct CsrvListener *listener);
 void csrv_accept_fork(struct Csrv *csrv, int sock_handle);
 void csrv_accept_thread(struct Csrv *csrv, int sock_handle);
+void csrv_serve_connection(struct Csrv *csrv, int sock_handle);
+#define CSRV_KEEPALIVE_MAX 999
+#define CSRV_BAD_REQUEST_RESPONSE "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n"
+
+// Event loop (CSRV_EVENT model)
+#define CSRV_EVENT_BATCH 64
+#define CSRV_DEFAULT_WORKERS 1
+void csrv_listen_event(struct Csrv *csrv);
+void *csrv_event_loop(void *arg);
+
+// Coroutines and coroutine-aware I/O
+#define CSRV_DEFAULT_STACK_SIZE (128 * 1024)
+#define CSRV_STACK_POOL_MAX 1024
+#define CSRV_IO_TIMEOUT_MS (5 * 1000)
+int csrv_stack_pool_init(struct CsrvStackPool *pool, size_t stack_size);
+void *csrv_stack_alloc(struct CsrvStackPool *pool);
+void csrv_stack_free(struct CsrvStackPool *pool, void *stack);
+void csrv_stack_pool_cleanup(struct CsrvStackPool *pool);
+int csrv_coro_spawn(struct CsrvLoop *loop, int sock_handle);
+int csrv_coro_spawn_task(struct CsrvLoop *loop, void (*entry)(void *), void *arg);
+void csrv_coro_wake(struct CsrvCoro *coro, bool failed);
+void csrv_coro_expire(struct CsrvLoop *loop, int64_t now);
+void csrv_coro_resume(struct CsrvCoro *coro);
+void csrv_coro_set_idle(bool idle);
+void csrv_coro_wake_idle(struct CsrvLoop *loop);
+struct CsrvCoro *csrv_coro_self(void);
+struct CsrvCoro *csrv_coro_start(void (*entry)(void *), void *arg);
+int csrv_coro_park(int timeout_ms);
+void csrv_coro_unpark(struct CsrvCoro *coro);
+void csrv_coro_run_ready(struct CsrvLoop *loop);
+int csrv_coro_wait(int fd, short events, int timeout_ms);
+int64_t csrv_now_ms(void);
+ssize_t csrv_io_read(int fd, void *buffer, size_t sz);
+ssize_t csrv_io_write(int fd, const void *buffer, size_t sz);
 
 // Request handling
 #define CSRV_CHUNK_SIZE (512 * sizeof(char))
@@ -124,6 +734,16 @@ int csrv_read_header_chunk(struct CsrvRequest *req);
 void csrv_cleanup_request(struct CsrvRequest *req);
 void csrv_parse_headers(struct CsrvRequest *req);
 int csrv_set_request_meta(struct CsrvRequest *req);
+ssize_t csrv_read_body(struct CsrvRequest *req, char *buffer, size_t sz);
+int csrv_drain_body(struct CsrvRequest *req);
+int csrv_request_carry(struct CsrvRequest *from, struct CsrvRequest *to);
+
+// Well-known headers
+#define CSRV_HEADER_SLOTS 64
+int csrv_header_lookup(char *name, size_t len);
+char *csrv_header_name(enum CsrvHeader header);
+char *csrv_get_header(struct CsrvRequest *req, char *name);
+int csrv_parse_size(char *str, size_t *out);
 
 // String handling
 #define CSRV_STR_VEC_SIZE 32
@@ -141,10 +761,145 @@ void csrv_str_map_add(struct CsrvStrMap *map, char *key, char *value);
 char *csrv_str_map_get(struct CsrvStrMap *map, char *key);
 
 // Response handling
+#define CSRV_OUT_IOV 16
+#define CSRV_ZEROCOPY_MIN (16 * 1024)
+// How long a closing connection waits for its zerocopy completions
+#define CSRV_OUT_FINISH_MS 1000
 char *csrv_response_status_string(enum CsrvResponseStatus status);
 struct CsrvResponse *csrv_init_response(struct CsrvRequest *req);
 int csrv_write_response(struct CsrvResponse *resp);
+int csrv_response_write_head(struct CsrvResponse *resp, char *head, size_t len);
+int csrv_response_write_body(struct CsrvResponse *resp, char *data, size_t len);
 void csrv_cleanup_response(struct CsrvResponse *resp);
+void csrv_out_init(struct CsrvOutQueue *out, int fd);
+int csrv_out_push(struct CsrvOutQueue *out, char *data, size_t len, bool zerocopy);
+int csrv_out_flush(struct CsrvOutQueue *out);
+ssize_t csrv_out_read(struct CsrvOutQueue *out, void *buffer, size_t sz);
+void csrv_out_finish(struct CsrvOutQueue *out, int64_t deadline);
+int64_t csrv_out_deadline(struct Csrv *csrv);
+void csrv_out_cleanup(struct CsrvOutQueue *out);
+
+// HPACK
+#define CSRV_HPACK_STATIC_COUNT 61
+void csrv_hpack_init(struct CsrvHpack *hpack);
+void csrv_hpack_cleanup(struct CsrvHpack *hpack);
+int csrv_hpack_decode(struct CsrvHpack *hpack, const uint8_t *block, size_t len, csrv_hpack_emit_t emit, void *ctx);
+int csrv_huffman_decode(const uint8_t *src, size_t len, struct CsrvStrVec *out);
+size_t csrv_hpack_static_name(char *name);
+int csrv_hpack_encode_indexed(struct CsrvStrVec *out, size_t index);
+int csrv_hpack_encode(struct CsrvStrVec *out, size_t name_index, char *name, char *value, size_t value_len);
+
+// HTTP/2 (h2c)
+#define CSRV_H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define CSRV_H2_MAX_STREAMS 100
+#define CSRV_H2_STREAM_WINDOW (128 * 1024)
+#define CSRV_H2_CONN_WINDOW (1024 * 1024)
+#define CSRV_H2_OUT_MAX (256 * 1024)
+#define CSRV_H2_HEADER_MAX (64 * 1024)
+bool csrv_h2_detect(struct CsrvRequest *req);
+void csrv_h2_serve(struct Csrv *csrv, struct CsrvRequest *req);
+ssize_t csrv_h2_read_body(struct CsrvRequest *req, char *buffer, size_t sz);
+int csrv_h2_write_response(struct CsrvResponse *resp);
+int csrv_h2_write_head(struct CsrvH2Stream *stream, char *head, size_t len);
+int csrv_h2_write_data(struct CsrvH2Stream *stream, char *data, size_t len, bool end);
+
+// multipart/form-data
+#define CSRV_MULTIPART_BUFFER (64 * 1024)
+#define CSRV_MULTIPART_FIELD_MAX (64 * 1024)
+#define CSRV_MULTIPART_MEMORY_MAX (1024 * 1024)
+#define CSRV_MULTIPART_PARTS_MAX 1024
+#define CSRV_MULTIPART_BOUNDARY_MAX 70
+#define CSRV_MULTIPART_TEMPLATE "/tmp/csrv-upload-XXXXXX"
+int csrv_multipart_parse(struct CsrvRequest *req, struct CsrvMultipartPart **parts);
+void csrv_multipart_cleanup(struct CsrvMultipartPart *parts);
+ssize_t csrv_multipart_find(const char *haystack, size_t n, const char *needle, size_t k);
+
+// WebSocket
+#define CSRV_WS_READ_BUFFER (16 * 1024)
+#define CSRV_WS_MESSAGE_MAX (1024 * 1024)
+#define CSRV_WS_OUT_MAX (1024 * 1024)
+// Spins on a connection's lock before yielding the CPU
+#define CSRV_WS_SPIN_MAX 128
+struct CsrvWs *csrv_ws_upgrade(struct CsrvRequest *req, struct CsrvResponse *resp, const struct CsrvWsHandler *handler, void *user);
+void csrv_ws_run(struct CsrvWs *ws);
+void csrv_ws_event(struct CsrvWs *ws, uint32_t events);
+void csrv_ws_drain(struct CsrvLoop *loop);
+int csrv_ws_send(struct CsrvWs *ws, enum CsrvWsOpcode opcode, char *data, size_t len);
+void csrv_ws_close(struct CsrvWs *ws, uint16_t code);
+void csrv_ws_unmask(uint8_t *data, size_t len, const uint8_t key[4]);
+int csrv_ws_group_init(struct CsrvWsGroup *group);
+void csrv_ws_group_cleanup(struct CsrvWsGroup *group);
+void csrv_ws_join(struct CsrvWsGroup *group, struct CsrvWs *ws);
+void csrv_ws_leave(struct CsrvWs *ws);
+ssize_t csrv_ws_broadcast(struct CsrvWsGroup *group, enum CsrvWsOpcode opcode, char *data, size_t len);
+
+// Tracing. Unsampled requests pay one predictable branch per trace point
+#define CSRV_TRACE_FILE "csrv-trace.json"
+#define CSRV_TRACE_CALIBRATE_MS 20
+// Buffers the trace writer may fall behind by before more are dropped
+#define CSRV_TRACE_QUEUE_MAX 16
+#define CSRV_TRACE_START(req) (__builtin_expect((req)->traced, 0) ? csrv_trace_clock() : 0)
+#define CSRV_TRACE_END(req, name, start) do { \
+    if(__builtin_expect((req)->traced, 0)) { \
+      csrv_trace_span((req), (name), (start), csrv_trace_clock()); \
+    } \
+  } while(0)
+uint64_t csrv_trace_clock(void);
+void csrv_trace_install(struct Csrv *csrv);
+bool csrv_trace_sampled(struct Csrv *csrv, size_t id);
+void csrv_trace_accepted(uint64_t start);
+void csrv_trace_accept_span(struct CsrvRequest *req);
+void csrv_trace_span(struct CsrvRequest *req, const char *name, uint64_t start, uint64_t end);
+void csrv_trace_dump(struct Csrv *csrv);
+void csrv_trace_poll(struct Csrv *csrv);
+void csrv_trace_writer_start(struct Csrv *csrv);
+void csrv_trace_writer_stop(struct Csrv *csrv);
+
+// Rate limiting
+#define CSRV_RATE_LIMIT_SLOTS (16 * 1024)
+#define CSRV_RATE_LIMIT_WAYS 8
+#define CSRV_RATE_BURST_MAX (1000 * 1000)
+// Reads of 4 KiB, at most, of what a refused client sent before its close
+#define CSRV_RATE_LIMIT_DRAIN 16
+#define CSRV_RATE_LIMIT_RESPONSE \
+  "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nConnection: close\r\nContent-Length: 0\r\n\r\n"
+int csrv_rate_limit_init(struct Csrv *csrv);
+void csrv_rate_limit_cleanup(struct Csrv *csrv);
+uint64_t csrv_rate_limit_key(const struct sockaddr *addr);
+uint64_t csrv_rate_limit_peer(int sock_handle);
+bool csrv_rate_limit_accept(struct Csrv *csrv, int sock_handle, const struct sockaddr *addr);
+bool csrv_rate_limit_take(struct CsrvRateLimit *limit, uint64_t key);
+
+// Listeners and startup configuration
+#define CSRV_CONFIG_LINE_MAX 1024
+#define CSRV_CONFIG_BUFFER_MIN 1024
+int csrv_add_listener(struct Csrv *csrv, char *spec);
+int csrv_config_load(struct Csrv *csrv, char *path);
+void csrv_config_defaults(struct Csrv *csrv);
+
+// Graceful restart and draining
+#define CSRV_HANDOFF_ENV "CSRV_HANDOFF_FD"
+#define CSRV_HANDOFF_TIMEOUT_MS (10 * 1000)
+#define CSRV_DRAIN_TIMEOUT_MS (30 * 1000)
+void csrv_restart_install(struct Csrv *csrv);
+bool csrv_restart_pending(void);
+int csrv_handoff_begin(struct Csrv *csrv);
+int csrv_handoff_end(struct Csrv *csrv, int channel, bool ready);
+int csrv_handoff_start(struct Csrv *csrv);
+int csrv_handoff_receive(struct Csrv *csrv);
+void csrv_drain_begin(struct Csrv *csrv);
+void csrv_drain_child(struct Csrv *csrv, int parent_pid);
+bool csrv_is_draining(struct Csrv *csrv);
+
+// Reverse proxy
+#define CSRV_PROXY_POOL_MAX 32
+#define CSRV_PROXY_BUFFER (16 * 1024)
+#define CSRV_PROXY_CONNECT_TIMEOUT_MS 1000
+#define CSRV_PROXY_RETRY_MS (5 * 1000)
+int csrv_proxy_init(struct CsrvProxy *proxy, char **addrs, size_t n_addrs);
+void csrv_proxy_cleanup(struct CsrvProxy *proxy);
+void csrv_proxy_handler(struct CsrvRequest *req, struct CsrvResponse *resp);
+void csrv_proxy_probe(struct Csrv *csrv, struct CsrvProxy *proxy);
 
 // Logging
 #define CSRV_LOG_INFO(csrv, fmt, ...) \
@@ -0,0 +1,192 @@
+#include "sys/types.h"
+#include "sys/socket.h"
+#include "sys/epoll.h"
+#include "netinet/in.h"
+#include "string.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "csrv.h"
+
+// Every worker runs its own loop with its own coroutines and stack pool.
+// The listening socket is shared; EPOLLEXCLUSIVE keeps a new connection
+// from waking every worker at once.
+void csrv_listen_event(struct Csrv *csrv) {
+  CSRV_LOG_INFO(csrv, "enter csrv_listen_event()");
+
+  pthread_t *threads = (pthread_t *) calloc(csrv->n_workers, sizeof(pthread_t));
+  if(threads == NULL) {
+    CSRV_LOG_ERROR(csrv, "failed to allocate worker threads, errno=%s", strerror(errno));
+    csrv->status = CSRV_ALLOC_FAILURE;
+    return;
+  }
+
+  csrv_trace_writer_start(csrv);
+
+  // The calling thread is worker 0
+  for(unsigned int i = 1; i < csrv->n_workers; i++) {
+    if(pthread_create(&threads[i], NULL, csrv_event_loop, csrv) != 0) {
+      CSRV_LOG_ERROR(csrv, "pthread_create() failed for worker %u", i);
+      csrv->n_workers = i;
+      break;
+    }
+  }
+
+  csrv_event_loop(csrv);
+
+  for(unsigned int i = 1; i < csrv->n_workers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  csrv_trace_writer_stop(csrv);
+}
+
+static void csrv_event_accept(struct CsrvLoop *loop, struct CsrvListener *listener) {
+  struct Csrv *csrv = loop->csrv;
+
+  // Drain the backlog; the listener is non-blocking so this stops at EAGAIN
+  for(;;) {
+    struct sockaddr_storage addr;
+    socklen_t addr_sz = sizeof(addr);
+    uint64_t accept_start = csrv->trace_sample != 0 ? csrv_trace_clock() : 0;
+    int new_sock_handle = accept4(listener->socket_handle, (struct sockaddr *) &addr, &addr_sz, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(new_sock_handle < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        CSRV_LOG_ERROR(csrv, "accept() failed with errno=%s", strerror(errno));
+      }
+      return;
+    }
+
+    CSRV_LOG_INFO(csrv, "accept() successful with socket handle %d", new_sock_handle);
+    if(csrv->trace_sample != 0) {
+      csrv_trace_accepted(accept_start);
+    }
+    if(!csrv_rate_limit_accept(csrv, new_sock_handle, (struct sockaddr *) &addr)) {
+      continue;
+    }
+    if(csrv_coro_spawn(loop, new_sock_handle) != 0) {
+      CSRV_LOG_ERROR(csrv, "failed to spawn coroutine, errno=%s", strerror(errno));
+      close(new_sock_handle);
+    }
+  }
+}
+
+// The handoff waits for the new process to start up, which takes its own
+// coroutine: on the loop's stack it would stall every connection the worker has
+static void csrv_event_handoff(void *arg) {
+  struct Csrv *csrv = (struct Csrv *) arg;
+  if(csrv_handoff_start(csrv) == 0) {
+    csrv_drain_begin(csrv);
+  }
+}
+
+void *csrv_event_loop(void *arg) {
+  struct Csrv *csrv = (struct Csrv *) arg;
+  CSRV_LOG_INFO(csrv, "enter csrv_event_loop()");
+
+  struct CsrvLoop loop;
+  memset(&loop, 0, sizeof(loop));
+  loop.csrv = csrv;
+
+  if(csrv_stack_pool_init(&loop.stacks, csrv->stack_size) != 0) {
+    CSRV_LOG_ERROR(csrv, "failed to init stack pool, errno=%s", strerror(errno));
+    return NULL;
+  }
+
+  loop.epoll_handle = epoll_create1(EPOLL_CLOEXEC);
+  if(loop.epoll_handle == -1) {
+    CSRV_LOG_ERROR(csrv, "epoll_create1() failed with errno=%s", strerror(errno));
+    csrv_stack_pool_cleanup(&loop.stacks);
+    return NULL;
+  }
+
+  // Listeners are shared by every worker and only ever read, so each one is
+  // its own epoll tag
+  for(size_t i = 0; i < csrv->n_listeners; i++) {
+    struct CsrvListener *listener = &csrv->listeners[i];
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &listener->kind;
+    if(epoll_ctl(loop.epoll_handle, EPOLL_CTL_ADD, listener->socket_handle, &ev) == -1) {
+      CSRV_LOG_ERROR(csrv, "epoll_ctl() on listener %s failed with errno=%s", listener->name, strerror(errno));
+      close(loop.epoll_handle);
+      csrv_stack_pool_cleanup(&loop.stacks);
+      return NULL;
+    }
+  }
+
+  loop.accepting = true;
+
+  struct epoll_event events[CSRV_EVENT_BATCH];
+  int64_t last_expire = csrv_now_ms();
+  for(;;) {
+    if(csrv_restart_pending() && csrv_coro_spawn_task(&loop, csrv_event_handoff, csrv) != 0) {
+      CSRV_LOG_ERROR(csrv, "failed to spawn handoff coroutine, errno=%s", strerror(errno));
+    }
+
+    // The new process shares the listeners, so they have to be removed from
+    // our epoll explicitly; closing our descriptors wouldn't do it
+    if(loop.accepting && csrv_is_draining(csrv)) {
+      for(size_t i = 0; i < csrv->n_listeners; i++) {
+        epoll_ctl(loop.epoll_handle, EPOLL_CTL_DEL, csrv->listeners[i].socket_handle, NULL);
+      }
+      loop.accepting = false;
+      csrv_coro_wake_idle(&loop);
+      csrv_ws_drain(&loop);
+    }
+
+    if(!loop.accepting && ((loop.n_coros == 0 && loop.websockets == NULL) || csrv_now_ms() >= csrv->drain_deadline)) {
+      CSRV_LOG_INFO(csrv, "worker drained with %zu connections left", loop.n_coros);
+      break;
+    }
+
+    int n_events = epoll_wait(loop.epoll_handle, events, CSRV_EVENT_BATCH, loop.ready != NULL ? 0 : 1000);
+    if(n_events == -1) {
+      if(errno != EINTR) {
+        CSRV_LOG_ERROR(csrv, "epoll_wait() failed with errno=%s", strerror(errno));
+      }
+      continue;
+    }
+
+    for(int i = 0; i < n_events; i++) {
+      enum CsrvEventKind *kind = (enum CsrvEventKind *) events[i].data.ptr;
+      switch(*kind) {
+        case CSRV_EVENT_LISTENER:
+          if(loop.accepting) {
+            csrv_event_accept(&loop, (struct CsrvListener *) kind);
+          }
+          break;
+        case CSRV_EVENT_CORO:
+          // Errors and hangups still resume the coroutine; its next
+          // read()/write() is what reports them
+          csrv_coro_wake((struct CsrvCoro *) kind, false);
+          break;
+        case CSRV_EVENT_WS:
+          csrv_ws_event((struct CsrvWs *) kind, events[i].events);
+          break;
+      }
+    }
+
+    csrv_coro_run_ready(&loop);
+    csrv_trace_poll(csrv);
+
+    // Timeouts and upstream probes are coarse, so a sweep once a second is
+    // plenty
+    int64_t now = csrv_now_ms();
+    if(now - last_expire >= 1000) {
+      csrv_coro_expire(&loop, now);
+      if(csrv->proxy != NULL) {
+        csrv_proxy_probe(csrv, csrv->proxy);
+      }
+      last_expire = now;
+    }
+  }
+
+  // Coroutines still running past the deadline are abandoned with the process
+  csrv_trace_dump(csrv);
+  close(loop.epoll_handle);
+  csrv_stack_pool_cleanup(&loop.stacks);
+  return NULL;
+}
@@ -0,0 +1,1412 @@
+#include "sys/types.h"
+#include "sys/socket.h"
+#include "sys/epoll.h"
+#include "string.h"
+#include "strings.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "poll.h"
+#include "ctype.h"
+#include "csrv.h"
+
+// Connection-specific headers have no meaning in HTTP/2 (RFC 9113 8.2.2)
+static char *csrv_h2_hop_headers[] = {
+  "connection",
+  "keep-alive",
+  "proxy-connection",
+  "transfer-encoding",
+  "upgrade",
+  NULL
+};
+
+static uint32_t csrv_h2_u32(const uint8_t *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static bool csrv_h2_hop_header(char *name, size_t len) {
+  for(size_t i = 0; csrv_h2_hop_headers[i] != NULL; i++) {
+    if(strlen(csrv_h2_hop_headers[i]) == len && strncasecmp(name, csrv_h2_hop_headers[i], len) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Let every coroutine waiting on the connection re-check its condition
+static void csrv_h2_wake(struct CsrvH2Conn *conn) {
+  if(!conn->concurrent) {
+    return;
+  }
+
+  for(struct CsrvH2Stream *stream = conn->streams; stream != NULL; stream = stream->next) {
+    if(stream->waiter != NULL) {
+      csrv_coro_unpark(stream->waiter);
+    }
+  }
+  csrv_coro_unpark(conn->reader);
+}
+
+static void csrv_h2_wake_stream(struct CsrvH2Stream *stream) {
+  if(stream->waiter != NULL) {
+    csrv_coro_unpark(stream->waiter);
+  }
+}
+
+// Queue a frame on conn->out. Never blocks: the writer coroutine, or
+// csrv_h2_send() without coroutines, is what puts it on the wire.
+static int csrv_h2_frame(struct CsrvH2Conn *conn, enum CsrvH2FrameType type, uint8_t flags, uint32_t stream_id, const void *payload, size_t len) {
+  uint8_t header[CSRV_H2_FRAME_HEADER];
+  header[0] = len >> 16;
+  header[1] = len >> 8;
+  header[2] = len;
+  header[3] = type;
+  header[4] = flags;
+  header[5] = (stream_id >> 24) & 0x7f;
+  header[6] = stream_id >> 16;
+  header[7] = stream_id >> 8;
+  header[8] = stream_id;
+
+  if(csrv_str_vec_pushn(&conn->out, (char *) header, sizeof(header)) != 0
+     || (len > 0 && csrv_str_vec_pushn(&conn->out, (char *) payload, len) != 0)) {
+    conn->broken = true;
+    return -1;
+  }
+
+  if(conn->writer != NULL) {
+    csrv_coro_unpark(conn->writer);
+  }
+  return 0;
+}
+
+static void csrv_h2_put_u32(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static int csrv_h2_frame_u32(struct CsrvH2Conn *conn, enum CsrvH2FrameType type, uint32_t stream_id, uint32_t value) {
+  uint8_t payload[4];
+  csrv_h2_put_u32(payload, value);
+  return csrv_h2_frame(conn, type, 0, stream_id, payload, sizeof(payload));
+}
+
+// No new streams from here on; the open ones are still served
+static void csrv_h2_goaway(struct CsrvH2Conn *conn, enum CsrvH2Error code) {
+  uint8_t payload[8];
+  csrv_h2_put_u32(payload, conn->last_stream_id);
+  csrv_h2_put_u32(&payload[4], code);
+  csrv_h2_frame(conn, CSRV_H2_GOAWAY, 0, 0, payload, sizeof(payload));
+  conn->goaway = true;
+}
+
+// Connection error: the peer gets a GOAWAY and every stream fails
+static void csrv_h2_fail(struct CsrvH2Conn *conn, enum CsrvH2Error code) {
+  CSRV_LOG_ERROR(conn->csrv, "h2 connection error %d on socket handle %d", code, conn->socket_handle);
+  if(!conn->broken) {
+    csrv_h2_goaway(conn, code);
+    conn->broken = true;
+  }
+  csrv_h2_wake(conn);
+}
+
+// Stream error: only this stream is closed
+static void csrv_h2_reset(struct CsrvH2Conn *conn, struct CsrvH2Stream *stream, enum CsrvH2Error code) {
+  if(!stream->reset) {
+    csrv_h2_frame_u32(conn, CSRV_H2_RST_STREAM, stream->id, code);
+  }
+  stream->reset = true;
+  stream->remote_closed = true;
+  stream->local_closed = true;
+  csrv_h2_wake_stream(stream);
+}
+
+static struct CsrvH2Stream *csrv_h2_stream(struct CsrvH2Conn *conn, uint32_t id) {
+  for(struct CsrvH2Stream *stream = conn->streams; stream != NULL; stream = stream->next) {
+    if(stream->id == id) {
+      return stream;
+    }
+  }
+
+  return NULL;
+}
+
+// The connection window is handed back as soon as DATA arrives: the stream
+// windows already bound what is buffered, and holding it back would let a
+// stream nobody reads from starve the others. Updates are batched to half a
+// window at a time.
+static void csrv_h2_conn_consumed(struct CsrvH2Conn *conn, size_t n) {
+  conn->unacked += n;
+  if(conn->unacked >= CSRV_H2_CONN_WINDOW / 2) {
+    csrv_h2_frame_u32(conn, CSRV_H2_WINDOW_UPDATE, 0, conn->unacked);
+    conn->recv_window += conn->unacked;
+    conn->unacked = 0;
+  }
+}
+
+// A stream's window is only handed back once the handler has read the body
+static void csrv_h2_consumed(struct CsrvH2Conn *conn, struct CsrvH2Stream *stream, size_t n) {
+  if(stream->remote_closed) {
+    return;
+  }
+
+  stream->unacked += n;
+  if(stream->unacked >= CSRV_H2_STREAM_WINDOW / 2) {
+    csrv_h2_frame_u32(conn, CSRV_H2_WINDOW_UPDATE, stream->id, stream->unacked);
+    stream->recv_window += stream->unacked;
+    stream->unacked = 0;
+  }
+}
+
+// Write all queued output. Only used without coroutines, where the stream
+// and the reader are the same flow of control.
+static int csrv_h2_send(struct CsrvH2Conn *conn) {
+  if(conn->write_failed) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  size_t pending = conn->out.length - conn->out_pos;
+  if(pending > 0 && csrv_io_write(conn->socket_handle, &conn->out.string[conn->out_pos], pending) < 0) {
+    conn->write_failed = true;
+    conn->broken = true;
+    return -1;
+  }
+
+  conn->out.length = 0;
+  conn->out_pos = 0;
+  return 0;
+}
+
+// Writer coroutine: sends out as it fills up, parking on write_handle when
+// the socket is full, until the connection closes
+static void csrv_h2_writer(void *arg) {
+  struct CsrvH2Conn *conn = (struct CsrvH2Conn *) arg;
+  while(!conn->write_failed) {
+    size_t pending = conn->out.length - conn->out_pos;
+    if(pending == 0) {
+      conn->out.length = 0;
+      conn->out_pos = 0;
+      if(conn->closing) {
+        break;
+      }
+      csrv_coro_park(CSRV_IO_TIMEOUT_MS);
+      continue;
+    }
+
+    ssize_t sz_sent = send(conn->write_handle, &conn->out.string[conn->out_pos], pending, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(sz_sent > 0) {
+      conn->out_pos += sz_sent;
+      // Streams may be waiting for the queue to shrink
+      csrv_h2_wake(conn);
+      continue;
+    }
+
+    if(sz_sent == -1 && errno == EINTR) {
+      continue;
+    }
+    if(sz_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)
+       && csrv_coro_wait(conn->write_handle, POLLOUT, CSRV_IO_TIMEOUT_MS) == 0) {
+      continue;
+    }
+
+    CSRV_LOG_ERROR(conn->csrv, "h2 write on socket handle %d failed, errno=%s", conn->socket_handle, strerror(errno));
+    conn->write_failed = true;
+    conn->broken = true;
+    // Get the reader out of its read() too
+    shutdown(conn->socket_handle, SHUT_RDWR);
+  }
+
+  conn->writer = NULL;
+  csrv_h2_wake(conn);
+}
+
+static int csrv_h2_pump(struct CsrvH2Conn *conn);
+
+// Wait for the connection to make progress on stream's behalf: more body,
+// more window or less queued output. A stream coroutine parks until the
+// reader or writer wakes it; without coroutines the frames are read here.
+static int csrv_h2_wait(struct CsrvH2Conn *conn, struct CsrvH2Stream *stream) {
+  if(conn->broken) {
+    errno = ECONNRESET;
+    return -1;
+  }
+
+  if(!conn->concurrent) {
+    return csrv_h2_pump(conn);
+  }
+
+  stream->waiter = csrv_coro_self();
+  int res = csrv_coro_park(CSRV_IO_TIMEOUT_MS);
+  stream->waiter = NULL;
+  return res;
+}
+
+// Keep the output queue bounded: without coroutines write it out now,
+// otherwise wait while more than CSRV_H2_OUT_MAX is queued
+static int csrv_h2_flush(struct CsrvH2Conn *conn, struct CsrvH2Stream *stream) {
+  if(!conn->concurrent) {
+    return csrv_h2_send(conn);
+  }
+
+  while(conn->out.length - conn->out_pos > CSRV_H2_OUT_MAX) {
+    if(csrv_h2_wait(conn, stream) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Apply a SETTINGS payload (also what an h2c Upgrade carries). The header
+// table size and list size don't matter to an encoder that never indexes.
+static int csrv_h2_settings(struct CsrvH2Conn *conn, const uint8_t *payload, size_t len) {
+  for(size_t pos = 0; pos + 6 <= len; pos += 6) {
+    uint16_t param = (uint16_t) payload[pos] << 8 | payload[pos + 1];
+    uint32_t value = csrv_h2_u32(&payload[pos + 2]);
+    switch(param) {
+      case 0x2:
+        // SETTINGS_ENABLE_PUSH: we never push either way
+        if(value > 1) {
+          csrv_h2_fail(conn, CSRV_H2_PROTOCOL_ERROR);
+          return -1;
+        }
+        break;
+      case 0x4: {
+        // SETTINGS_INITIAL_WINDOW_SIZE also applies to open streams
+        if(value > INT32_MAX) {
+          csrv_h2_fail(conn, CSRV_H2_FLOW_CONTROL_ERROR);
+          return -1;
+        }
+        int64_t delta = (int64_t) value - conn->peer_initial_window;
+        for(struct CsrvH2Stream *stream = conn->streams; stream != NULL; stream = stream->next) {
+          stream->send_window += delta;
+        }
+        conn->peer_initial_window = value;
+        break;
+      }
+      case 0x5:
+        // SETTINGS_MAX_FRAME_SIZE
+        if(value < CSRV_H2_FRAME_SIZE || value > 0xffffff) {
+          csrv_h2_fail(conn, CSRV_H2_PROTOCOL_ERROR);
+          return -1;
+        }
+        conn->peer_max_frame = value;
+        break;
+      default:
+        break;
+    }
+  }
+
+  csrv_h2_wake(conn);
+  return 0;
+}
+
+// Strip the padding of a PADDED frame; -1 if it claims more than the frame
+static int csrv_h2_unpad(uint8_t flags, const uint8_t **payload, size_t *len) {
+  if(!(flags & CSRV_H2_FLAG_PADDED)) {
+    return 0;
+  }
+
+  if(*len == 0 || (*payload)[0] >= *len) {
+    return -1;
+  }
+  *len -= 1 + (*payload)[0];
+  (*payload)++;
+  return 0;
+}
+
+// hpack emit callback: turn each field into an HTTP/1 header line, so the
+// request can be parsed with csrv_parse_headers() like any other
+static int csrv_h2_collect(void *ctx, char *name, size_t name_len, char *value, size_t value_len) {
+  struct CsrvH2Head *head = (struct CsrvH2Head *) ctx;
+  if(name_len == 0 || memchr(value, '\r', value_len) != NULL || memchr(value, '\n', value_len) != NULL
+     || memchr(value, '\0', value_len) != NULL) {
+    head->malformed = true;
+    return 0;
+  }
+
+  if(name[0] == ':') {
+    char **slot = NULL;
+    if(strcmp(name, ":method") == 0) {
+      slot = &head->method;
+    } else if(strcmp(name, ":scheme") == 0) {
+      slot = &head->scheme;
+    } else if(strcmp(name, ":authority") == 0) {
+      slot = &head->authority;
+    } else if(strcmp(name, ":path") == 0) {
+      slot = &head->path;
+    }
+
+    // Pseudo-headers come first, once each
+    if(slot == NULL || *slot != NULL || head->regular_seen) {
+      head->malformed = true;
+      return 0;
+    }
+    *slot = strndup(value, value_len);
+    return *slot == NULL ? -1 : 0;
+  }
+
+  head->regular_seen = true;
+  for(size_t i = 0; i < name_len; i++) {
+    if(isupper((unsigned char) name[i]) || name[i] == ':' || name[i] <= ' ' || name[i] == 0x7f) {
+      head->malformed = true;
+      return 0;
+    }
+  }
+
+  if(csrv_h2_hop_header(name, name_len)
+     || (strcmp(name, "te") == 0 && (value_len != 8 || strncmp(value, "trailers", 8) != 0))) {
+    head->malformed = true;
+    return 0;
+  }
+
+  // HTTP/2 splits cookies into one field per pair; HTTP/1 wants one header
+  if(strcmp(name, "cookie") == 0) {
+    int res = 0;
+    if(head->cookie.length > 0) {
+      res |= csrv_str_vec_pushn(&head->cookie, "; ", 2);
+    }
+    return res | csrv_str_vec_pushn(&head->cookie, value, value_len);
+  }
+
+  // csrv_parse_headers() has no notion of an empty value
+  if(value_len == 0) {
+    return 0;
+  }
+
+  if(strcmp(name, "host") == 0) {
+    head->has_host = true;
+  }
+
+  int res = 0;
+  res |= csrv_str_vec_pushn(&head->fields, name, name_len);
+  res |= csrv_str_vec_pushn(&head->fields, ": ", 2);
+  res |= csrv_str_vec_pushn(&head->fields, value, value_len);
+  res |= csrv_str_vec_pushn(&head->fields, "\r\n", 2);
+  return res;
+}
+
+static void csrv_h2_head_cleanup(struct CsrvH2Head *head) {
+  free(head->method);
+  free(head->scheme);
+  free(head->authority);
+  free(head->path);
+  free(head->fields.string);
+  free(head->cookie.string);
+}
+
+// Lay the decoded block out as "METHOD PATH HTTP/2.0" plus header lines
+static int csrv_h2_head_build(struct CsrvH2Head *head, struct CsrvStrVec *out) {
+  if(head->malformed || head->method == NULL || head->scheme == NULL || head->path == NULL
+     || head->path[0] == '\0' || strchr(head->method, ' ') != NULL || strchr(head->path, ' ') != NULL) {
+    return -1;
+  }
+
+  int res = 0;
+  res |= csrv_str_vec_pushn(out, head->method, strlen(head->method));
+  res |= csrv_str_vec_pushn(out, " ", 1);
+  res |= csrv_str_vec_pushn(out, head->path, strlen(head->path));
+  res |= csrv_str_vec_pushn(out, " HTTP/2.0\r\n", 11);
+  if(head->authority != NULL && !head->has_host) {
+    res |= csrv_str_vec_pushn(out, "host: ", 6);
+    res |= csrv_str_vec_pushn(out, head->authority, strlen(head->authority));
+    res |= csrv_str_vec_pushn(out, "\r\n", 2);
+  }
+  res |= csrv_str_vec_pushn(out, head->fields.string, head->fields.length);
+  if(head->cookie.length > 0) {
+    res |= csrv_str_vec_pushn(out, "cookie: ", 8);
+    res |= csrv_str_vec_pushn(out, head->cookie.string, head->cookie.length);
+    res |= csrv_str_vec_pushn(out, "\r\n", 2);
+  }
+  res |= csrv_str_vec_pushn(out, "\r\n", 2);
+  return res;
+}
+
+static void csrv_h2_stream_free(struct CsrvH2Conn *conn, struct CsrvH2Stream *stream) {
+  struct CsrvH2Stream **link = &conn->streams;
+  while(*link != stream) {
+    link = &(*link)->next;
+  }
+  *link = stream->next;
+  conn->n_streams--;
+
+  free(stream->body.string);
+  csrv_cleanup_request(stream->req);
+  free(stream);
+
+  if(conn->concurrent) {
+    csrv_coro_unpark(conn->reader);
+    // The reader is blocked in read(); once nothing is left after a GOAWAY
+    // there is no reason to wait for the client
+    if(conn->goaway && conn->n_streams == 0) {
+      shutdown(conn->socket_handle, SHUT_RD);
+    }
+  }
+}
+
+// Create a stream for a request head laid out in HTTP/1 form
+static struct CsrvH2Stream *csrv_h2_open(struct CsrvH2Conn *conn, uint32_t id, struct CsrvStrVec *head, bool end_stream) {
+  struct CsrvH2Stream *stream = (struct CsrvH2Stream *) calloc(1, sizeof(struct CsrvH2Stream));
+  if(stream == NULL) {
+    return NULL;
+  }
+
+  stream->req = csrv_alloc_request(conn->csrv, conn->socket_handle);
+  if(stream->req == NULL) {
+    free(stream);
+    return NULL;
+  }
+
+  if(csrv_str_vec_init(&stream->body) != 0) {
+    csrv_cleanup_request(stream->req);
+    free(stream);
+    return NULL;
+  }
+
+  stream->id = id;
+  stream->conn = conn;
+  stream->remote_closed = end_stream;
+  stream->send_window = conn->peer_initial_window;
+  stream->recv_window = CSRV_H2_STREAM_WINDOW;
+
+  // The head is already complete, so this parses without reading
+  struct CsrvRequest *req = stream->req;
+  req->stream = stream;
+  if(csrv_str_vec_pushn(&req->request, head->string, head->length) == 0) {
+    csrv_parse_headers(req);
+  } else {
+    req->status = CSRV_ALLOC_FAILURE;
+  }
+
+  if(req->status != CSRV_OK || (end_stream && req->headers.content_size != 0)) {
+    free(stream->body.string);
+    csrv_cleanup_request(req);
+    free(stream);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  // Without a Content-Length the body runs until END_STREAM
+  if(!req->headers.has_content_length) {
+    req->headers.content_size = end_stream ? 0 : SIZE_MAX;
+  }
+
+  struct CsrvH2Stream **link = &conn->streams;
+  while(*link != NULL) {
+    link = &(*link)->next;
+  }
+  *link = stream;
+  conn->n_streams++;
+  return stream;
+}
+
+// Run the handler for one stream: in its own coroutine, or straight from the
+// reader loop without coroutines
+static void csrv_h2_run_stream(void *arg) {
+  struct CsrvH2Stream *stream = (struct CsrvH2Stream *) arg;
+  struct CsrvH2Conn *conn = stream->conn;
+  struct Csrv *csrv = conn->csrv;
+  struct CsrvRequest *req = stream->req;
+  CSRV_LOG_INFO(csrv, "h2 stream %u: #%zu %s %s", stream->id, req->id, req->headers.method, req->headers.uri);
+
+  int res = -1;
+  struct CsrvResponse *resp = csrv_init_response(req);
+  if(resp != NULL) {
+    uint64_t handler_start = CSRV_TRACE_START(req);
+    if(conn->client != 0 && !csrv_rate_limit_take(csrv->limiter, conn->client)) {
+      // Streams are requests too, or multiplexing would lift the limit
+      CSRV_LOG_INFO(csrv, "#%zu rate limited", req->id);
+      resp->status = CSRV_HTTP_TOO_MANY_REQUESTS;
+      csrv_str_map_add(&resp->headers, strdup("Retry-After"), strdup("1"));
+    } else if(csrv->handler != NULL) {
+      csrv->handler(req, resp);
+    } else {
+      resp->status = CSRV_HTTP_NOT_FOUND;
+    }
+    CSRV_TRACE_END(req, "handler", handler_start);
+
+    uint64_t write_start = CSRV_TRACE_START(req);
+    if(!resp->written) {
+      res = csrv_write_response(resp);
+    } else if(stream->headers_sent && !stream->local_closed) {
+      // A handler that wrote its own response leaves the stream open
+      res = csrv_h2_write_data(stream, NULL, 0, true);
+    } else {
+      res = stream->local_closed ? 0 : -1;
+    }
+    CSRV_TRACE_END(req, "write", write_start);
+    csrv_cleanup_response(resp);
+  }
+
+  if(res != 0 && !stream->local_closed) {
+    CSRV_LOG_ERROR(csrv, "failed to write response on h2 stream %u, errno=%s", stream->id, strerror(errno));
+    csrv_h2_reset(conn, stream, CSRV_H2_INTERNAL_ERROR);
+  } else if(!stream->remote_closed) {
+    // The response is complete; the rest of the request body isn't wanted
+    csrv_h2_reset(conn, stream, CSRV_H2_NO_ERROR);
+  }
+
+  csrv_h2_stream_free(conn, stream);
+}
+
+static void csrv_h2_start(struct CsrvH2Conn *conn, struct CsrvH2Stream *stream) {
+  // Without coroutines the reader loop picks it up
+  if(!conn->concurrent) {
+    return;
+  }
+
+  if(csrv_coro_start(csrv_h2_run_stream, stream) == NULL) {
+    CSRV_LOG_ERROR(conn->csrv, "failed to start h2 stream %u, errno=%s", stream->id, strerror(errno));
+    csrv_h2_reset(conn, stream, CSRV_H2_REFUSED_STREAM);
+    csrv_h2_stream_free(conn, stream);
+  }
+}
+
+// The client closed its side; the body must match Content-Length
+static void csrv_h2_remote_close(struct CsrvH2Conn *conn, struct CsrvH2Stream *stream) {
+  struct CsrvRequestHeader *headers = &stream->req->headers;
+  stream->remote_closed = true;
+  if(headers->has_content_length && stream->received != headers->content_size) {
+    csrv_h2_reset(conn, stream, CSRV_H2_PROTOCOL_ERROR);
+  }
+  csrv_h2_wake_stream(stream);
+}
+
+// A complete header block: a new request, or trailers on an open stream
+static void csrv_h2_header_block(struct CsrvH2Conn *conn) {
+  uint32_t id = conn->header_stream;
+  bool end_stream = conn->header_end_stream;
+  conn->header_stream = 0;
+
+  struct CsrvH2Head head;
+  memset(&head, 0, sizeof(head));
+  struct CsrvStrVec request;
+  request.string = NULL;
+  if(csrv_str_vec_init(&head.fields) != 0 || csrv_str_vec_init(&head.cookie) != 0 || csrv_str_vec_init(&request) != 0) {
+    csrv_h2_head_cleanup(&head);
+    csrv_h2_fail(conn, CSRV_H2_INTERNAL_ERROR);
+    return;
+  }
+
+  // Always decoded, even for streams we refuse: the dynamic table depends on it
+  if(csrv_hpack_decode(&conn->decoder, (uint8_t *) conn->header_block.string, conn->header_block.length, csrv_h2_collect, &head) != 0) {
+    csrv_h2_fail(conn, CSRV_H2_COMPRESSION_ERROR);
+    goto header_block_done;
+  }
+
+  struct CsrvH2Stream *stream = csrv_h2_stream(conn, id);
+  if(stream != NULL) {
+    // Trailers are decoded and dropped; they have to end the stream
+    if(stream->remote_closed) {
+      if(!stream->reset) {
+        csrv_h2_reset(conn, stream, CSRV_H2_STREAM_CLOSED);
+      }
+    } else if(!end_stream) {
+      csrv_h2_reset(conn, stream, CSRV_H2_PROTOCOL_ERROR);
+    } else {
+      csrv_h2_remote_close(conn, stream);
+    }
+    goto header_block_done;
+  }
+
+  if((id & 1) == 0 || id <= conn->last_stream_id) {
+    csrv_h2_fail(conn, CSRV_H2_PROTOCOL_ERROR);
+    goto header_block_done;
+  }
+  conn->last_stream_id = id;
+
+  if(conn->goaway || conn->n_streams >= CSRV_H2_MAX_STREAMS) {
+    csrv_h2_frame_u32(conn, CSRV_H2_RST_STREAM, id, CSRV_H2_REFUSED_STREAM);
+    goto header_block_done;
+  }
+
+  if(csrv_h2_head_build(&head, &request) != 0 || (stream = csrv_h2_open(conn, id, &request, end_stream)) == NULL) {
+    CSRV_LOG_ERROR(conn->csrv, "malformed request on h2 stream %u", id);
+    csrv_h2_frame_u32(conn, CSRV_H2_RST_STREAM, id, CSRV_H2_PROTOCOL_ERROR);
+    goto header_block_done;
+  }
+  csrv_h2_start(conn, stream);
+
+header_block_done:
+  csrv_h2_head_cleanup(&head);
+  free(request.string);
+}
+
+static void csrv_h2_on_headers(struct CsrvH2Conn *conn, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len) {
+  if(id == 0 || csrv_h2_unpad(flags, &payload, &len) != 0) {
+    csrv_h2_fail(conn, CSRV_H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  // Stream dependency and weight; priorities are ignored
+  if(flags & CSRV_H2_FLAG_PRIORITY) {
+    if(len < 5) {
+      csrv_h2_fail(conn, CSRV_H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    payload += 5;
+    len -= 5;
+  }
+
+  conn->header_stream = id;
+  conn->header_end_stream = (flags & CSRV_H2_FLAG_END_STREAM) != 0;
+  conn->header_block.length = 0;
+  if(csrv_str_vec_pushn(&conn->header_block, (char *) payload, len) != 0) {
+    csrv_h2_fail(conn, CSRV_H2_INTERNAL_ERROR);
+    return;
+  }
+
+  if(flags & CSRV_H2_FLAG_END_HEADERS) {
+    csrv_h2_header_block(conn);
+  }
+}
+
+static void csrv_h2_on_continuation(struct CsrvH2Conn *conn, uint8_t flags, const uint8_t *payload, size_t len) {
+  if(conn->header_stream == 0 || conn->header_block.length + len > CSRV_H2_HEADER_MAX) {
+    csrv_h2_fail(conn, CSRV_H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  if(csrv_str_vec_pushn(&conn->header_block, (char *) payload, len) != 0) {
+    csrv_h2_fail(conn, CSRV_H2_INTERNAL_ERROR);
+    return;
+  }
+
+  if(flags & CSRV_H2_FLAG_END_HEADERS) {
+    csrv_h2_header_block(conn);
+  }
+}
+
+static void csrv_h2_on_data(struct CsrvH2Conn *conn, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len) {
+  // Flow control counts the whole payload, padding included
+  size_t frame_len = len;
+  if(id == 0 || csrv_h2_unpad(flags, &payload, &len) != 0) {
+    csrv_h2_fail(conn, CSRV_H2_PROTOCOL_ERROR);
+    return;
+  }
+  if((int64_t) frame_len > conn->recv_window) {
+    csrv_h2_fail(conn, CSRV_H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  conn->recv_window -= frame_len;
+  csrv_h2_conn_consumed(conn, frame_len);
+
+  struct CsrvH2Stream *stream = csrv_h2_stream(conn, id);
+  if(stream == NULL || stream->remote_closed) {
+    if(id > conn->last_stream_id) {
+      csrv_h2_fail(conn, CSRV_H2_PROTOCOL_ERROR);
+      return;
+    }
+    // Frames already in flight when a stream was reset are fine
+    if(stream != NULL && !stream->reset) {
+      csrv_h2_reset(conn, stream, CSRV_H2_STREAM_CLOSED);
+    }
+    return;
+  }
+
+  if((int64_t) frame_len > stream->recv_window) {
+    csrv_h2_reset(conn, stream, CSRV_H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  stream->recv_window -= frame_len;
+  csrv_h2_consumed(conn, stream, frame_len - len);
+
+  stream->received += len;
+  struct CsrvRequestHeader *headers = &stream->req->headers;
+  if(headers->has_content_length && stream->received > headers->content_size) {
+    csrv_h2_reset(conn, stream, CSRV_H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  if(len > 0 && csrv_str_vec_pushn(&stream->body, (char *) payload, len) != 0) {
+    csrv_h2_reset(conn, stream, CSRV_H2_INTERNAL_ERROR);
+    return;
+  }
+
+  if(flags & CSRV_H2_FLAG_END_STREAM) {
+    csrv_h2_remote_close(conn, stream);
+  }
+  csrv_h2_wake_stream(stream);
+}
+
+static void csrv_h2_on_window_update(struct CsrvH2Conn *conn, uint32_t id, const uint8_t *payload, size_t len) {
+  if(len != 4) {
+    csrv_h2_fail(conn, CSRV_H2_FRAME_SIZE_ERROR);
+    return;
+  }
+
+  uint32_t increment = csrv_h2_u32(payload) & 0x7fffffff;
+  if(id == 0) {
+    conn->send_window += increment;
+    if(increment == 0 || conn->send_window > INT32_MAX) {
+      csrv_h2_fail(conn, increment == 0 ? CSRV_H2_PROTOCOL_ERROR : CSRV_H2_FLOW_CONTROL_ERROR);
+      return;
+    }
+    csrv_h2_wake(conn);
+    return;
+  }
+
+  struct CsrvH2Stream *stream = csrv_h2_stream(conn, id);
+  if(stream == NULL) {
+    if(id > conn->last_stream_id) {
+      csrv_h2_fail(conn, CSRV_H2_PROTOCOL_ERROR);
+    }
+    return;
+  }
+
+  stream->send_window += increment;
+  if(increment == 0 || stream->send_window > INT32_MAX) {
+    csrv_h2_reset(conn, stream, increment == 0 ? CSRV_H2_PROTOCOL_ERROR : CSRV_H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  csrv_h2_wake_stream(stream);
+}
+
+static void csrv_h2_on_frame(struct CsrvH2Conn *conn, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len) {
+  // A header block must not be interleaved with anything
+  if(conn->header_stream != 0 && (type != CSRV_H2_CONTINUATION || id != conn->header_stream)) {
+    csrv_h2_fail(conn, CSRV_H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  struct CsrvH2Stream *stream;
+  switch(type) {
+    case CSRV_H2_DATA:
+      csrv_h2_on_data(conn, flags, id, payload, len);
+      break;
+    case CSRV_H2_HEADERS:
+      csrv_h2_on_headers(conn, flags, id, payload, len);
+      break;
+    case CSRV_H2_PRIORITY:
+      if(id == 0 || len != 5) {
+        csrv_h2_fail(conn, id == 0 ? CSRV_H2_PROTOCOL_ERROR : CSRV_H2_FRAME_SIZE_ERROR);
+      }
+      break;
+    case CSRV_H2_RST_STREAM:
+      if(id == 0 || id > conn->last_stream_id || len != 4) {
+        csrv_h2_fail(conn, len != 4 ? CSRV_H2_FRAME_SIZE_ERROR : CSRV_H2_PROTOCOL_ERROR);
+        break;
+      }
+      stream = csrv_h2_stream(conn, id);
+      if(stream != NULL) {
+        // The peer's reset needs no reply
+        stream->reset = true;
+        stream->remote_closed = true;
+        stream->local_closed = true;
+        csrv_h2_wake_stream(stream);
+      }
+      break;
+    case CSRV_H2_SETTINGS:
+      if(id != 0 || len % 6 != 0 || ((flags & CSRV_H2_FLAG_ACK) && len != 0)) {
+        csrv_h2_fail(conn, id != 0 ? CSRV_H2_PROTOCOL_ERROR : CSRV_H2_FRAME_SIZE_ERROR);
+      } else if(!(flags & CSRV_H2_FLAG_ACK) && csrv_h2_settings(conn, payload, len) == 0) {
+        csrv_h2_frame(conn, CSRV_H2_SETTINGS, CSRV_H2_FLAG_ACK, 0, NULL, 0);
+      }
+      break;
+    case CSRV_H2_PUSH_PROMISE:
+      // Only servers push
+      csrv_h2_fail(conn, CSRV_H2_PROTOCOL_ERROR);
+      break;
+    case CSRV_H2_PING:
+      if(id != 0 || len != 8) {
+        csrv_h2_fail(conn, id != 0 ? CSRV_H2_PROTOCOL_ERROR : CSRV_H2_FRAME_SIZE_ERROR);
+      } else if(!(flags & CSRV_H2_FLAG_ACK)) {
+        csrv_h2_frame(conn, CSRV_H2_PING, CSRV_H2_FLAG_ACK, 0, payload, len);
+      }
+      break;
+    case CSRV_H2_GOAWAY:
+      if(id != 0 || len < 8) {
+        csrv_h2_fail(conn, id != 0 ? CSRV_H2_PROTOCOL_ERROR : CSRV_H2_FRAME_SIZE_ERROR);
+        break;
+      }
+      CSRV_LOG_INFO(conn->csrv, "h2 GOAWAY from client, error=%u", csrv_h2_u32(&payload[4]));
+      conn->goaway = true;
+      break;
+    case CSRV_H2_WINDOW_UPDATE:
+      csrv_h2_on_window_update(conn, id, payload, len);
+      break;
+    case CSRV_H2_CONTINUATION:
+      csrv_h2_on_continuation(conn, flags, payload, len);
+      break;
+    default:
+      // Unknown frame types are ignored (RFC 9113 4.1)
+      break;
+  }
+}
+
+// Dispatch every complete frame in the input buffer
+static int csrv_h2_frames(struct CsrvH2Conn *conn) {
+  size_t pos = 0;
+  while(!conn->broken && conn->in_len - pos >= CSRV_H2_FRAME_HEADER) {
+    uint8_t *frame = &conn->in[pos];
+    size_t len = (size_t) frame[0] << 16 | (size_t) frame[1] << 8 | frame[2];
+    if(len > CSRV_H2_FRAME_SIZE) {
+      csrv_h2_fail(conn, CSRV_H2_FRAME_SIZE_ERROR);
+      break;
+    }
+    if(conn->in_len - pos < CSRV_H2_FRAME_HEADER + len) {
+      break;
+    }
+
+    csrv_h2_on_frame(conn, frame[3], frame[4], csrv_h2_u32(&frame[5]) & 0x7fffffff, &frame[CSRV_H2_FRAME_HEADER], len);
+    pos += CSRV_H2_FRAME_HEADER + len;
+  }
+
+  memmove(conn->in, &conn->in[pos], conn->in_len - pos);
+  conn->in_len -= pos;
+  if(conn->broken) {
+    errno = EPROTO;
+    return -1;
+  }
+  return 0;
+}
+
+// Read from the socket and handle whatever frames that completes
+static int csrv_h2_pump(struct CsrvH2Conn *conn) {
+  if(!conn->concurrent && csrv_h2_send(conn) != 0) {
+    return -1;
+  }
+
+  // A client that sends but doesn't read would otherwise grow the queue
+  // with our replies
+  while(conn->concurrent && conn->out.length - conn->out_pos > CSRV_H2_OUT_MAX && !conn->broken) {
+    csrv_coro_park(CSRV_IO_TIMEOUT_MS);
+  }
+
+  csrv_coro_set_idle(conn->n_streams == 0);
+  ssize_t sz_read = csrv_io_read(conn->socket_handle, &conn->in[conn->in_len], sizeof(conn->in) - conn->in_len);
+  csrv_coro_set_idle(false);
+  if(sz_read <= 0) {
+    if(sz_read == 0) {
+      errno = ECONNRESET;
+    }
+    return -1;
+  }
+
+  conn->in_len += sz_read;
+  return csrv_h2_frames(conn);
+}
+
+// Read until the input buffer starts with the connection preface (or the
+// rest of it), then drop it
+static int csrv_h2_preface(struct CsrvH2Conn *conn, const char *preface, size_t len) {
+  while(conn->in_len < len) {
+    ssize_t sz_read = csrv_io_read(conn->socket_handle, &conn->in[conn->in_len], sizeof(conn->in) - conn->in_len);
+    if(sz_read <= 0) {
+      return -1;
+    }
+    conn->in_len += sz_read;
+  }
+
+  if(memcmp(conn->in, preface, len) != 0) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  memmove(conn->in, &conn->in[len], conn->in_len - len);
+  conn->in_len -= len;
+  return 0;
+}
+
+// HTTP2-Settings is base64url without padding (RFC 9113 3.2.1)
+static ssize_t csrv_h2_base64url(char *src, uint8_t *out, size_t out_size) {
+  uint32_t acc = 0;
+  int bits = 0;
+  size_t n = 0;
+  for(; *src != '\0' && *src != '='; src++) {
+    char c = *src;
+    int v;
+    if(c >= 'A' && c <= 'Z') {
+      v = c - 'A';
+    } else if(c >= 'a' && c <= 'z') {
+      v = c - 'a' + 26;
+    } else if(c >= '0' && c <= '9') {
+      v = c - '0' + 52;
+    } else if(c == '-' || c == '+') {
+      v = 62;
+    } else if(c == '_' || c == '/') {
+      v = 63;
+    } else {
+      return -1;
+    }
+
+    acc = (acc << 6) | v;
+    bits += 6;
+    if(bits >= 8) {
+      bits -= 8;
+      if(n == out_size) {
+        return -1;
+      }
+      out[n++] = (acc >> bits) & 0xff;
+    }
+  }
+
+  return n;
+}
+
+// The request that carried an h2c Upgrade becomes stream 1, half-closed
+// since it had no body. Its head is copied without the upgrade headers.
+static int csrv_h2_upgrade_stream(struct CsrvH2Conn *conn, struct CsrvRequest *req) {
+  struct CsrvStrVec head;
+  if(csrv_str_vec_init(&head) != 0) {
+    return -1;
+  }
+
+  int res = 0;
+  res |= csrv_str_vec_pushn(&head, req->headers.method, strlen(req->headers.method));
+  res |= csrv_str_vec_pushn(&head, " ", 1);
+  res |= csrv_str_vec_pushn(&head, req->headers.uri, strlen(req->headers.uri));
+  res |= csrv_str_vec_pushn(&head, " HTTP/2.0\r\n", 11);
+
+  char *string = req->request.string;
+  size_t end = req->body_offset + 1;
+  size_t pos = (char *) memchr(string, '\n', end) - string + 1;
+  while(pos < end) {
+    size_t line_end = pos;
+    while(line_end < end && string[line_end] != '\n') {
+      line_end++;
+    }
+    size_t len = line_end + 1 - pos;
+    if(len <= 2) {
+      break;
+    }
+
+    char *colon = memchr(&string[pos], ':', len);
+    size_t name_len = colon == NULL ? 0 : colon - &string[pos];
+    if(colon != NULL && !csrv_h2_hop_header(&string[pos], name_len)
+       && !(name_len == 14 && strncasecmp(&string[pos], "HTTP2-Settings", 14) == 0)) {
+      res |= csrv_str_vec_pushn(&head, &string[pos], len);
+    }
+    pos = line_end + 1;
+  }
+  res |= csrv_str_vec_pushn(&head, "\r\n", 2);
+
+  conn->last_stream_id = 1;
+  struct CsrvH2Stream *stream = res == 0 ? csrv_h2_open(conn, 1, &head, true) : NULL;
+  free(head.string);
+  if(stream == NULL) {
+    return -1;
+  }
+
+  csrv_h2_start(conn, stream);
+  return 0;
+}
+
+// Whether req starts HTTP/2: the client preface sent straight away, which
+// parses as a "PRI * HTTP/2.0" request (prior knowledge), or an h2c Upgrade
+bool csrv_h2_detect(struct CsrvRequest *req) {
+  struct CsrvRequestHeader *headers = &req->headers;
+  if(strcmp(headers->method, "PRI") == 0 && strcmp(headers->uri, "*") == 0 && strcmp(headers->proto, "HTTP/2.0") == 0) {
+    return true;
+  }
+
+  // An upgrade with a body would need it replayed as stream 1's; such
+  // requests are simply served over HTTP/1.1, which RFC 9113 allows
+  char *upgrade = headers->known[CSRV_HEADER_UPGRADE];
+  return upgrade != NULL && strcasestr(upgrade, "h2c") != NULL
+    && headers->known[CSRV_HEADER_HTTP2_SETTINGS] != NULL
+    && headers->content_size == 0 && !headers->chunked;
+}
+
+static void csrv_h2_cleanup(struct CsrvH2Conn *conn) {
+  while(conn->streams != NULL) {
+    csrv_h2_stream_free(conn, conn->streams);
+  }
+
+  if(conn->write_handle != -1) {
+    // The socket outlives this descriptor, so closing it wouldn't remove
+    // the writer's registration
+    struct CsrvCoro *self = csrv_coro_self();
+    if(self != NULL) {
+      epoll_ctl(self->loop->epoll_handle, EPOLL_CTL_DEL, conn->write_handle, NULL);
+    }
+    close(conn->write_handle);
+  }
+
+  csrv_hpack_cleanup(&conn->decoder);
+  free(conn->out.string);
+  free(conn->header_block.string);
+  free(conn);
+}
+
+// Serve HTTP/2 on a connection whose first request csrv_h2_detect() accepted.
+// The caller still owns req and the socket.
+void csrv_h2_serve(struct Csrv *csrv, struct CsrvRequest *req) {
+  struct CsrvH2Conn *conn = (struct CsrvH2Conn *) calloc(1, sizeof(struct CsrvH2Conn));
+  if(conn == NULL) {
+    CSRV_LOG_ERROR(csrv, "failed to allocate h2 connection, errno=%s", strerror(errno));
+    return;
+  }
+
+  conn->csrv = csrv;
+  conn->socket_handle = req->socket_handle;
+  conn->client = csrv->limiter != NULL ? csrv_rate_limit_peer(conn->socket_handle) : 0;
+  conn->write_handle = -1;
+  conn->reader = csrv_coro_self();
+  conn->concurrent = conn->reader != NULL;
+  conn->send_window = 65535;
+  conn->recv_window = 65535;
+  conn->peer_max_frame = CSRV_H2_FRAME_SIZE;
+  conn->peer_initial_window = 65535;
+  csrv_hpack_init(&conn->decoder);
+  if(csrv_str_vec_init(&conn->out) != 0 || csrv_str_vec_init(&conn->header_block) != 0) {
+    csrv_h2_cleanup(conn);
+    return;
+  }
+
+  // Whatever followed the request head is the start of the preface
+  size_t body_start = req->body_offset + 1;
+  size_t leftover = req->request.length - body_start;
+  if(leftover > sizeof(conn->in)) {
+    CSRV_LOG_ERROR(csrv, "too much data after h2 preface on socket handle %d", conn->socket_handle);
+    csrv_h2_cleanup(conn);
+    return;
+  }
+  memcpy(conn->in, &req->request.string[body_start], leftover);
+  conn->in_len = leftover;
+
+  bool upgrade = strcmp(req->headers.method, "PRI") != 0;
+  if(upgrade) {
+    uint8_t settings[256];
+    ssize_t settings_len = csrv_h2_base64url(req->headers.known[CSRV_HEADER_HTTP2_SETTINGS], settings, sizeof(settings));
+    char *reply = settings_len < 0 || settings_len % 6 != 0
+      ? CSRV_BAD_REQUEST_RESPONSE
+      : "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    if(csrv_io_write(conn->socket_handle, reply, strlen(reply)) < 0 || reply[9] != '1') {
+      csrv_h2_cleanup(conn);
+      return;
+    }
+    csrv_h2_settings(conn, settings, settings_len);
+  }
+
+  // Our preface: SETTINGS, then open the connection window past the default
+  uint8_t settings[12] = { 0, 0x3, 0, 0, 0, 0, 0, 0x4 };
+  csrv_h2_put_u32(&settings[2], CSRV_H2_MAX_STREAMS);
+  csrv_h2_put_u32(&settings[8], CSRV_H2_STREAM_WINDOW);
+  csrv_h2_frame(conn, CSRV_H2_SETTINGS, 0, 0, settings, sizeof(settings));
+  csrv_h2_frame_u32(conn, CSRV_H2_WINDOW_UPDATE, 0, CSRV_H2_CONN_WINDOW - conn->recv_window);
+  conn->recv_window = CSRV_H2_CONN_WINDOW;
+
+  if(conn->concurrent) {
+    conn->write_handle = dup(conn->socket_handle);
+    conn->writer = conn->write_handle == -1 ? NULL : csrv_coro_start(csrv_h2_writer, conn);
+    if(conn->writer == NULL) {
+      CSRV_LOG_ERROR(csrv, "failed to start h2 writer, errno=%s", strerror(errno));
+      csrv_h2_cleanup(conn);
+      return;
+    }
+  }
+
+  // A prior-knowledge client's preface has been parsed as a request up to
+  // the blank line; an upgraded one sends it whole after our 101
+  char *preface = CSRV_H2_PREFACE;
+  size_t preface_len = strlen(preface);
+  if(!upgrade) {
+    preface += preface_len - 6;
+    preface_len = 6;
+  }
+
+  if((upgrade && csrv_h2_upgrade_stream(conn, req) != 0) || csrv_h2_preface(conn, preface, preface_len) != 0) {
+    CSRV_LOG_ERROR(csrv, "h2 preface failed on socket handle %d, errno=%s", conn->socket_handle, strerror(errno));
+    conn->broken = true;
+  } else if(csrv_h2_frames(conn) != 0) {
+    conn->broken = true;
+  }
+
+  while(!conn->broken) {
+    if(!conn->concurrent) {
+      struct CsrvH2Stream *stream = conn->streams;
+      while(stream != NULL && stream->started) {
+        stream = stream->next;
+      }
+      if(stream != NULL) {
+        stream->started = true;
+        csrv_h2_run_stream(stream);
+        continue;
+      }
+    }
+
+    if(conn->goaway && conn->n_streams == 0) {
+      break;
+    }
+
+    if(!conn->goaway && csrv_is_draining(csrv)) {
+      // Streams the client has already sent are still served
+      csrv_h2_goaway(conn, CSRV_H2_NO_ERROR);
+      continue;
+    }
+
+    if(csrv_h2_pump(conn) != 0) {
+      // Timeouts only close an idle connection
+      if(errno == ETIMEDOUT && !conn->broken && (conn->n_streams > 0 || (!conn->goaway && csrv_is_draining(csrv)))) {
+        continue;
+      }
+      break;
+    }
+  }
+
+  CSRV_LOG_INFO(csrv, "closing h2 connection on socket handle %d", conn->socket_handle);
+  if(!conn->goaway && !conn->write_failed) {
+    csrv_h2_goaway(conn, CSRV_H2_NO_ERROR);
+  }
+
+  // Streams still running fail their next read or write
+  conn->broken = true;
+  csrv_h2_wake(conn);
+  while(conn->concurrent && conn->n_streams > 0) {
+    csrv_coro_park(CSRV_IO_TIMEOUT_MS);
+  }
+
+  conn->closing = true;
+  if(conn->concurrent) {
+    while(conn->writer != NULL) {
+      csrv_coro_unpark(conn->writer);
+      csrv_coro_park(CSRV_IO_TIMEOUT_MS);
+    }
+  } else {
+    csrv_h2_send(conn);
+  }
+
+  csrv_h2_cleanup(conn);
+}
+
+ssize_t csrv_h2_read_body(struct CsrvRequest *req, char *buffer, size_t sz) {
+  struct CsrvH2Stream *stream = req->stream;
+  struct CsrvH2Conn *conn = stream->conn;
+  for(;;) {
+    if(stream->reset) {
+      errno = ECONNRESET;
+      return -1;
+    }
+
+    size_t buffered = stream->body.length - stream->body_pos;
+    if(buffered > 0) {
+      size_t n = buffered < sz ? buffered : sz;
+      memcpy(buffer, &stream->body.string[stream->body_pos], n);
+      stream->body_pos += n;
+      if(stream->body_pos == stream->body.length) {
+        stream->body.length = 0;
+        stream->body_pos = 0;
+      }
+      req->body_read += n;
+      csrv_h2_consumed(conn, stream, n);
+      return n;
+    }
+
+    if(stream->remote_closed) {
+      req->headers.content_size = req->body_read;
+      return 0;
+    }
+
+    if(csrv_h2_wait(conn, stream) != 0) {
+      return -1;
+    }
+  }
+}
+
+// Send a header block as HEADERS plus as many CONTINUATIONs as the peer's
+// frame size calls for. They are queued back to back, so no other frame
+// can come between them.
+static int csrv_h2_headers(struct CsrvH2Stream *stream, struct CsrvStrVec *block, bool end) {
+  struct CsrvH2Conn *conn = stream->conn;
+  if(conn->broken || stream->reset || stream->headers_sent) {
+    errno = ECONNRESET;
+    return -1;
+  }
+
+  size_t pos = 0;
+  enum CsrvH2FrameType type = CSRV_H2_HEADERS;
+  do {
+    size_t n = block->length - pos < conn->peer_max_frame ? block->length - pos : conn->peer_max_frame;
+    uint8_t flags = pos + n == block->length ? CSRV_H2_FLAG_END_HEADERS : 0;
+    if(type == CSRV_H2_HEADERS && end) {
+      flags |= CSRV_H2_FLAG_END_STREAM;
+    }
+    if(csrv_h2_frame(conn, type, flags, stream->id, &block->string[pos], n) != 0) {
+      return -1;
+    }
+    pos += n;
+    type = CSRV_H2_CONTINUATION;
+  } while(pos < block->length);
+
+  stream->headers_sent = true;
+  stream->local_closed = end;
+  return csrv_h2_flush(conn, stream);
+}
+
+static int csrv_h2_status(struct CsrvStrVec *block, long code) {
+  // :status values with a static table entry of their own, 8 to 14
+  static const long indexed[] = { 200, 204, 206, 304, 400, 404, 500 };
+  for(size_t i = 0; i < sizeof(indexed) / sizeof(indexed[0]); i++) {
+    if(indexed[i] == code) {
+      return csrv_hpack_encode_indexed(block, 8 + i);
+    }
+  }
+
+  char value[4];
+  snprintf(value, sizeof(value), "%03ld", code);
+  return csrv_hpack_encode(block, 8, NULL, value, 3);
+}
+
+// Append one response field with its name lowercased, as HTTP/2 requires.
+// Connection-specific fields are dropped.
+static int csrv_h2_field(struct CsrvStrVec *block, char *name, size_t name_len, char *value, size_t value_len) {
+  char lower[CSRV_CHUNK_SIZE];
+  if(name_len == 0 || name_len >= sizeof(lower)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for(size_t i = 0; i < name_len; i++) {
+    lower[i] = tolower((unsigned char) name[i]);
+  }
+  lower[name_len] = '\0';
+
+  if(csrv_h2_hop_header(lower, name_len)) {
+    return 0;
+  }
+  return csrv_hpack_encode(block, csrv_hpack_static_name(lower), lower, value, value_len);
+}
+
+// csrv_write_response() for a stream: the same status, headers and body,
+// as HEADERS and DATA frames
+int csrv_h2_write_response(struct CsrvResponse *resp) {
+  struct CsrvH2Stream *stream = resp->stream;
+  struct CsrvStrVec block;
+  if(csrv_str_vec_init(&block) != 0) {
+    return -1;
+  }
+
+  int result = csrv_h2_status(&block, strtol(csrv_response_status_string(resp->status), NULL, 10));
+  bool has_type = false;
+  for(size_t i = 0; i < resp->headers.n_items; i++) {
+    char *key = resp->headers.keys[i];
+    char *value = csrv_str_map_get(&resp->headers, key);
+    if(value == NULL || strcasecmp(key, "Content-Length") == 0) {
+      continue;
+    }
+
+    has_type |= strcasecmp(key, "Content-Type") == 0;
+    result |= csrv_h2_field(&block, key, strlen(key), value, strlen(value));
+  }
+
+  char length[32];
+  int length_len = snprintf(length, sizeof(length), "%zu", resp->body.length);
+  result |= csrv_hpack_encode(&block, csrv_hpack_static_name("content-length"), NULL, length, length_len);
+  if(!has_type) {
+    result |= csrv_hpack_encode(&block, csrv_hpack_static_name("content-type"), NULL, "text/plain", 10);
+  }
+
+  bool no_body = resp->body.length == 0 || strcmp(stream->req->headers.method, "HEAD") == 0;
+  if(result == 0) {
+    result = csrv_h2_headers(stream, &block, no_body);
+  }
+  if(result == 0 && !no_body) {
+    result = csrv_h2_write_data(stream, resp->body.string, resp->body.length, true);
+  }
+
+  free(block.string);
+  return result;
+}
+
+// Send a raw HTTP/1 response head ("HTTP/1.1 200 OK\r\nName: value\r\n...")
+// as HEADERS, for handlers such as the proxy that produce one. The stream
+// stays open for csrv_h2_write_data().
+int csrv_h2_write_head(struct CsrvH2Stream *stream, char *head, size_t len) {
+  char *end = head + len;
+  char *line_end = memchr(head, '\n', len);
+  char *space = memchr(head, ' ', len);
+  if(line_end == NULL || space == NULL || space > line_end) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  long code = strtol(space + 1, NULL, 10);
+  if(code < 100 || code > 999) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct CsrvStrVec block;
+  if(csrv_str_vec_init(&block) != 0) {
+    return -1;
+  }
+
+  int result = csrv_h2_status(&block, code);
+  char *line = line_end + 1;
+  while(result == 0 && line < end) {
+    char *nl = memchr(line, '\n', end - line);
+    if(nl == NULL) {
+      nl = end;
+    }
+    char *value_end = nl > line && nl[-1] == '\r' ? nl - 1 : nl;
+    if(value_end == line) {
+      break;
+    }
+
+    char *colon = memchr(line, ':', value_end - line);
+    if(colon == NULL) {
+      result = -1;
+      break;
+    }
+    char *value = colon + 1;
+    while(value < value_end && (*value == ' ' || *value == '\t')) {
+      value++;
+    }
+
+    result = csrv_h2_field(&block, line, colon - line, value, value_end - value);
+    line = nl + 1;
+  }
+
+  if(result == 0) {
+    result = csrv_h2_headers(stream, &block, false);
+  }
+  free(block.string);
+  return result;
+}
+
+// Send len bytes of body as DATA frames, waiting for flow-control window
+// whenever the stream or connection runs out. end closes the stream.
+int csrv_h2_write_data(struct CsrvH2Stream *stream, char *data, size_t len, bool end) {
+  struct CsrvH2Conn *conn = stream->conn;
+  while(len > 0 || end) {
+    if(conn->broken || stream->reset || !stream->headers_sent) {
+      errno = ECONNRESET;
+      return -1;
+    }
+
+    int64_t window = stream->send_window < conn->send_window ? stream->send_window : conn->send_window;
+    size_t n = len < conn->peer_max_frame ? len : conn->peer_max_frame;
+    if(window < (int64_t) n) {
+      n = window > 0 ? window : 0;
+    }
+    if(n == 0 && len > 0) {
+      if(csrv_h2_wait(conn, stream) != 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    bool last = end && n == len;
+    if(csrv_h2_frame(conn, CSRV_H2_DATA, last ? CSRV_H2_FLAG_END_STREAM : 0, stream->id, data, n) != 0) {
+      return -1;
+    }
+    stream->send_window -= n;
+    conn->send_window -= n;
+    data += n;
+    len -= n;
+
+    if(last) {
+      stream->local_closed = true;
+      end = false;
+    }
+    if(csrv_h2_flush(conn, stream) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -2,6 +2,7 @@
 #include "errno.h"
 #include "stdlib.h"
 #include "string.h"
+#include "stdarg.h"
 #include "csrv.h"
 
 char *csrv_response_status_string(enum CsrvResponseStatus status) {
@@ -14,6 +15,12 @@ char *csrv_response_status_string(enum CsrvResponseStatus status) {
       return "401 Unauthorized";
     case CSRV_HTTP_BAD_REQUEST:
       return "400 Bad Request";
+    case CSRV_HTTP_BAD_GATEWAY:
+      return "502 Bad Gateway";
+    case CSRV_HTTP_TOO_MANY_REQUESTS:
+      return "429 Too Many Requests";
+    case CSRV_HTTP_LENGTH_REQUIRED:
+      return "411 Length Required";
     case CSRV_HTTP_SERVER_ERROR:
     default:
       return "500 Internal Server Error";
@@ -31,6 +38,12 @@ struct CsrvResponse *csrv_init_response(struct CsrvRequest *req) {
   resp->status = CSRV_HTTP_OK;
   resp->socket_handle = req->socket_handle;
   resp->csrv = req->csrv;
+  resp->keep_alive = req->keep_alive;
+  resp->written = false;
+  resp->stream = req->stream;
+  resp->websocket = NULL;
+  resp->out = NULL;
+  resp->headers.size = 0;
 
   if(csrv_str_map_init(&resp->headers) != 0) {
     CSRV_LOG_ERROR(req->csrv, "failed to init str map, errno=%s", strerror(errno));
@@ -47,18 +60,43 @@ struct CsrvResponse *csrv_init_response(struct CsrvRequest *req) {
   return resp;
 }
 
+// Appends a formatted line to the outgoing head
+static int csrv_head_printf(struct CsrvStrVec *head, const char *fmt, ...) {
+  char line[CSRV_CHUNK_SIZE];
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+
+  if(len < 0 || (size_t) len >= sizeof(line)) {
+    return -1;
+  }
+
+  return csrv_str_vec_pushn(head, line, len);
+}
+
 int csrv_write_response(struct CsrvResponse *resp) {
-  FILE *file = fdopen(resp->socket_handle, "w");
-  if(file == NULL) {
-    CSRV_LOG_ERROR(resp->csrv, "failed to open socket as file, errno=%s", strerror(errno));
+  if(resp->stream != NULL) {
+    return csrv_h2_write_response(resp);
+  }
+
+  // Build the head in memory and queue it with the body on the connection,
+  // so both go out in one sendmsg() when the socket takes them
+  struct CsrvStrVec head;
+  if(csrv_str_vec_init(&head) != 0) {
+    CSRV_LOG_ERROR(resp->csrv, "failed to allocate response head, errno=%s", strerror(errno));
     return -1;
   }
   
-  char* body = csrv_str_vec_value(&resp->body);
-  
-  fprintf(file, "HTTP/1.1 %s\r\n", csrv_response_status_string(resp->status));
-  fprintf(file, "Connection: Keep-Alive\r\n");
-  fprintf(file, "Keep-Alive: timeout=5, max=999\r\n");
+  int result = 0;
+  result |= csrv_head_printf(&head, "HTTP/1.1 %s\r\n", csrv_response_status_string(resp->status));
+  if(resp->keep_alive) {
+    result |= csrv_head_printf(&head, "Connection: Keep-Alive\r\n");
+    result |= csrv_head_printf(&head, "Keep-Alive: timeout=%d, max=%d\r\n",
+                               CSRV_IO_TIMEOUT_MS / 1000, CSRV_KEEPALIVE_MAX);
+  } else {
+    result |= csrv_head_printf(&head, "Connection: close\r\n");
+  }
   
   // Include user-defined headers
   for(size_t i = 0; i < resp->headers.n_items; i++) {
@@ -69,17 +107,55 @@ int csrv_write_response(struct CsrvResponse *resp) {
       continue;
     }
 
-    fprintf(file, "%s: %s\r\n", key, value);
+    result |= csrv_head_printf(&head, "%s: %s\r\n", key, value);
+  }
+
+  result |= csrv_head_printf(&head, "Content-Length: %zu\r\n", resp->body.length);
+  result |= csrv_head_printf(&head, "Content-Type: text/plain\r\n");
+  result |= csrv_head_printf(&head, "\r\n");
+
+  if(result != 0) {
+    free(head.string);
+    return -1;
+  }
+
+  // The queue owns both buffers from here; a large body stays allocated
+  // until a zerocopy send of it completes
+  struct CsrvOutQueue *out = resp->out;
+  if(csrv_out_push(out, head.string, head.length, false) != 0) {
+    return -1;
+  }
+  if(resp->body.length > 0) {
+    bool zerocopy = resp->body.length >= resp->csrv->zerocopy_min;
+    result = csrv_out_push(out, resp->body.string, resp->body.length, zerocopy);
+    resp->body.string = NULL;
+    resp->body.length = 0;
+    if(result != 0) {
+      return -1;
+    }
+  }
+
+  return csrv_out_flush(out);
+}
+
+// For handlers that write the response themselves (and set resp->written):
+// head is an HTTP/1.1 status line and headers up to the blank line. On an
+// HTTP/2 stream it is converted to a HEADERS frame.
+int csrv_response_write_head(struct CsrvResponse *resp, char *head, size_t len) {
+  if(resp->stream != NULL) {
+    return csrv_h2_write_head(resp->stream, head, len);
   }
 
-  // length technically includes the \0 character, so subtract 1
-  fprintf(file, "Content-Length: %zu\r\n", resp->body.length - 1);
-  fprintf(file, "Content-Type: text/plain\r\n");
-  fprintf(file, "\r\n");
-  fprintf(file, "%s", body);
+  return csrv_io_write(resp->socket_handle, head, len) < 0 ? -1 : 0;
+}
+
+// Body bytes following csrv_response_write_head(), sent as they are
+int csrv_response_write_body(struct CsrvResponse *resp, char *data, size_t len) {
+  if(resp->stream != NULL) {
+    return csrv_h2_write_data(resp->stream, data, len, false);
+  }
 
-  fflush(file);
-  return 0;
+  return csrv_io_write(resp->socket_handle, data, len) < 0 ? -1 : 0;
 }
 
 void csrv_cleanup_response(struct CsrvResponse *resp) {
@@ -0,0 +1,116 @@
+#include "string.h"
+#include "strings.h"
+#include "csrv.h"
+
+#define CSRV_HEADER_NAME(name) { name, sizeof(name) - 1 }
+
+// Canonical spelling, indexed by enum CsrvHeader
+static const struct {
+  char *name;
+  size_t length;
+} csrv_header_names[CSRV_HEADER_COUNT] = {
+  CSRV_HEADER_NAME("Host"),
+  CSRV_HEADER_NAME("Content-Length"),
+  CSRV_HEADER_NAME("Connection"),
+  CSRV_HEADER_NAME("Transfer-Encoding"),
+  CSRV_HEADER_NAME("Content-Type"),
+  CSRV_HEADER_NAME("Accept-Encoding"),
+  CSRV_HEADER_NAME("If-None-Match"),
+  CSRV_HEADER_NAME("Cookie"),
+  CSRV_HEADER_NAME("User-Agent"),
+  CSRV_HEADER_NAME("Accept"),
+  CSRV_HEADER_NAME("Authorization"),
+  CSRV_HEADER_NAME("Expect"),
+  CSRV_HEADER_NAME("Upgrade"),
+  CSRV_HEADER_NAME("Keep-Alive"),
+  CSRV_HEADER_NAME("If-Modified-Since"),
+  CSRV_HEADER_NAME("Range"),
+  CSRV_HEADER_NAME("Referer"),
+  CSRV_HEADER_NAME("Origin"),
+  CSRV_HEADER_NAME("HTTP2-Settings"),
+  CSRV_HEADER_NAME("Sec-WebSocket-Key"),
+  CSRV_HEADER_NAME("Sec-WebSocket-Version"),
+  CSRV_HEADER_NAME("X-Forwarded-For")
+};
+
+// Perfect hash over the names above:
+//   slot = (lower(first char) + lower(last char) + 7 * length) & 63
+// The length multiplier was picked by hand so that every name gets its own
+// slot, which check_slots() in tests/test_headers.c verifies against the
+// names themselves. Adding a header means checking its slot is free (or
+// trying other multipliers there) and filling it in; -1 marks an empty slot.
+_Static_assert(CSRV_HEADER_COUNT <= CSRV_HEADER_SLOTS, "more headers than slots");
+_Static_assert((CSRV_HEADER_SLOTS & (CSRV_HEADER_SLOTS - 1)) == 0, "slot count must be a power of two");
+static const int8_t csrv_header_slots[CSRV_HEADER_SLOTS] = {
+  -1, -1, -1, 11, -1, 14, -1, 17, -1, -1, -1, 12, -1, -1, -1, -1,
+  -1, -1,  3, 21, -1, 16, 13,  2, -1, -1, -1, -1,  4, -1, -1, -1,
+  -1, -1, -1, 19, -1, -1, -1, -1, -1, -1, 10, -1,  6,  1, -1,  8,
+  -1,  5,  7, -1, 20, -1, -1, -1,  0, -1, 15, -1, -1, 18, -1,  9
+};
+
+// Returns the enum CsrvHeader for name, or -1 if it isn't a well-known header.
+// One table load and one compare, whatever the header.
+int csrv_header_lookup(char *name, size_t len) {
+  if(len == 0) {
+    return -1;
+  }
+
+  // | 0x20 lowercases letters; anything else just hashes differently and
+  // fails the compare below
+  size_t slot = ((name[0] | 0x20) + (name[len - 1] | 0x20) + 7 * len) & (CSRV_HEADER_SLOTS - 1);
+  int id = csrv_header_slots[slot];
+  if(id < 0 || csrv_header_names[id].length != len || strncasecmp(name, csrv_header_names[id].name, len) != 0) {
+    return -1;
+  }
+
+  return id;
+}
+
+char *csrv_header_name(enum CsrvHeader header) {
+  return csrv_header_names[header].name;
+}
+
+// Well-known headers live in fixed slots, everything else in the map. A
+// repeated well-known header keeps its first value in the slot, and the
+// later copies go to the map, which this doesn't look at for those names:
+// they are there for whoever iterates headers.header_map.
+char *csrv_get_header(struct CsrvRequest *req, char *name) {
+  int id = csrv_header_lookup(name, strlen(name));
+  if(id >= 0) {
+    return req->headers.known[id];
+  }
+
+  return csrv_str_map_get(&req->headers.header_map, name);
+}
+
+// Decimal digits with optional surrounding blanks, rejecting overflow.
+// Stands in for sscanf("%zu"), which is far too slow for every request.
+int csrv_parse_size(char *str, size_t *out) {
+  size_t value = 0;
+  size_t i = 0;
+  bool digits = false;
+
+  while(str[i] == ' ' || str[i] == '\t') {
+    i++;
+  }
+
+  for(; str[i] >= '0' && str[i] <= '9'; i++) {
+    size_t digit = str[i] - '0';
+    if(value > (SIZE_MAX - digit) / 10) {
+      return -1;
+    }
+    value = value * 10 + digit;
+    digits = true;
+  }
+
+  while(str[i] == ' ' || str[i] == '\t') {
+    i++;
+  }
+
+  if(!digits || str[i] != '\0') {
+    return -1;
+  }
+
+  *out = value;
+  return 0;
+}
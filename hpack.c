@@ -0,0 +1,408 @@
+#include "string.h"
+#include "stdlib.h"
+#include "csrv.h"
+
+// Static table (RFC 7541 Appendix A), 1-based
+static const struct {
+  char *name;
+  char *value;
+} csrv_hpack_static[CSRV_HPACK_STATIC_COUNT + 1] = {
+  { NULL, NULL },
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" }
+};
+
+// Huffman code (RFC 7541 Appendix B) in canonical form: for each length, the first code, how many codes have it
+// and where its symbols start in csrv_huffman_symbols
+static const uint32_t csrv_huffman_first[31] = {
+  0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+  0x00000014, 0x0000005c, 0x000000f8, 0x00000000, 0x000003f8, 0x000007fa,
+  0x00000ffa, 0x00001ff8, 0x00003ffc, 0x00007ffc, 0x00000000, 0x00000000,
+  0x00000000, 0x0007fff0, 0x000fffe6, 0x001fffdc, 0x003fffd2, 0x007fffd8,
+  0x00ffffea, 0x01ffffec, 0x03ffffe0, 0x07ffffde, 0x0fffffe2, 0x00000000,
+  0x3ffffffc
+};
+
+static const uint16_t csrv_huffman_count[31] = {
+  0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+  0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const uint16_t csrv_huffman_offset[31] = {
+  0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79, 82, 84, 90, 92,
+  0, 0, 0, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 0, 253
+};
+
+// Symbols ordered by code; 256 is EOS
+static const uint16_t csrv_huffman_symbols[257] = {
+  48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+  52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+  110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+  77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+  119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+  43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+  195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+  179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+  163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+  233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+  158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+  144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+  200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+  212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+  2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+  21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+  256
+};
+
+void csrv_hpack_init(struct CsrvHpack *hpack) {
+  memset(hpack, 0, sizeof(*hpack));
+  hpack->max_size = CSRV_HPACK_TABLE_SIZE;
+}
+
+void csrv_hpack_cleanup(struct CsrvHpack *hpack) {
+  for(size_t i = 0; i < hpack->count; i++) {
+    free(hpack->entries[(hpack->first + i) % CSRV_HPACK_TABLE_ENTRIES].name);
+  }
+  hpack->count = 0;
+  hpack->size = 0;
+}
+
+static void csrv_hpack_evict(struct CsrvHpack *hpack, size_t max_size) {
+  while(hpack->count > 0 && hpack->size > max_size) {
+    struct CsrvHpackEntry *oldest = &hpack->entries[hpack->first];
+    hpack->size -= oldest->name_len + oldest->value_len + 32;
+    free(oldest->name);
+    hpack->first = (hpack->first + 1) % CSRV_HPACK_TABLE_ENTRIES;
+    hpack->count--;
+  }
+}
+
+// An entry bigger than the whole table empties it and isn't added
+static int csrv_hpack_add(struct CsrvHpack *hpack, char *name, size_t name_len, char *value, size_t value_len) {
+  size_t entry_size = name_len + value_len + 32;
+  if(entry_size > hpack->max_size) {
+    csrv_hpack_evict(hpack, 0);
+    return 0;
+  }
+  csrv_hpack_evict(hpack, hpack->max_size - entry_size);
+
+  char *copy = (char *) malloc(name_len + value_len + 2);
+  if(copy == NULL) {
+    return -1;
+  }
+  memcpy(copy, name, name_len);
+  copy[name_len] = '\0';
+  memcpy(copy + name_len + 1, value, value_len);
+  copy[name_len + 1 + value_len] = '\0';
+
+  // Every entry costs at least 32, so the ring can't overflow
+  struct CsrvHpackEntry *entry = &hpack->entries[(hpack->first + hpack->count) % CSRV_HPACK_TABLE_ENTRIES];
+  entry->name = copy;
+  entry->name_len = name_len;
+  entry->value = copy + name_len + 1;
+  entry->value_len = value_len;
+  hpack->count++;
+  hpack->size += entry_size;
+  return 0;
+}
+
+// Index 1-61 is the static table, 62 onwards the dynamic one, newest first
+static int csrv_hpack_lookup(struct CsrvHpack *hpack, size_t index, char **name, size_t *name_len, char **value, size_t *value_len) {
+  if(index == 0) {
+    return -1;
+  }
+
+  if(index <= CSRV_HPACK_STATIC_COUNT) {
+    *name = csrv_hpack_static[index].name;
+    *name_len = strlen(*name);
+    *value = csrv_hpack_static[index].value;
+    *value_len = strlen(*value);
+    return 0;
+  }
+
+  index -= CSRV_HPACK_STATIC_COUNT + 1;
+  if(index >= hpack->count) {
+    return -1;
+  }
+
+  struct CsrvHpackEntry *entry = &hpack->entries[(hpack->first + hpack->count - 1 - index) % CSRV_HPACK_TABLE_ENTRIES];
+  *name = entry->name;
+  *name_len = entry->name_len;
+  *value = entry->value;
+  *value_len = entry->value_len;
+  return 0;
+}
+
+// Prefix-coded integer (RFC 7541 5.1), capped well below overflow
+static int csrv_hpack_int(const uint8_t *block, size_t len, size_t *pos, int prefix, size_t *out) {
+  size_t max = (1 << prefix) - 1;
+  size_t value = block[(*pos)++] & max;
+  if(value < max) {
+    *out = value;
+    return 0;
+  }
+
+  for(int shift = 0; ; shift += 7) {
+    if(*pos >= len || shift > 28) {
+      return -1;
+    }
+    uint8_t b = block[(*pos)++];
+    value += (size_t) (b & 0x7f) << shift;
+    if((b & 0x80) == 0) {
+      break;
+    }
+  }
+
+  *out = value;
+  return 0;
+}
+
+// Decodes a string literal into out, NUL-terminated but not counting it
+static int csrv_hpack_string(const uint8_t *block, size_t len, size_t *pos, struct CsrvStrVec *out) {
+  if(*pos >= len) {
+    return -1;
+  }
+
+  bool huffman = (block[*pos] & 0x80) != 0;
+  size_t str_len;
+  if(csrv_hpack_int(block, len, pos, 7, &str_len) != 0 || str_len > len - *pos) {
+    return -1;
+  }
+
+  out->length = 0;
+  int res = huffman ? csrv_huffman_decode(&block[*pos], str_len, out)
+                    : csrv_str_vec_pushn(out, (char *) &block[*pos], str_len);
+  *pos += str_len;
+  if(res != 0 || csrv_str_vec_pushc(out, '\0') != 0) {
+    return -1;
+  }
+  out->length--;
+  return 0;
+}
+
+// Walks the canonical code a bit at a time: a code of length L is valid iff
+// it falls in [first[L], first[L] + count[L]).
+int csrv_huffman_decode(const uint8_t *src, size_t len, struct CsrvStrVec *out) {
+  uint32_t code = 0;
+  int bits = 0;
+
+  for(size_t i = 0; i < len; i++) {
+    for(int b = 7; b >= 0; b--) {
+      code = (code << 1) | ((src[i] >> b) & 1);
+      bits++;
+
+      if(code - csrv_huffman_first[bits] < csrv_huffman_count[bits]) {
+        uint16_t sym = csrv_huffman_symbols[csrv_huffman_offset[bits] + code - csrv_huffman_first[bits]];
+        // EOS must never appear in the string itself
+        if(sym == 256 || csrv_str_vec_pushc(out, (char) sym) != 0) {
+          return -1;
+        }
+        code = 0;
+        bits = 0;
+      } else if(bits == 30) {
+        return -1;
+      }
+    }
+  }
+
+  // Padding is the most significant bits of EOS, i.e. all ones, and shorter
+  // than a byte
+  if(bits > 7 || code != (1u << bits) - 1) {
+    return -1;
+  }
+  return 0;
+}
+
+// Decode one header block, calling emit for every field in order. Returns -1
+// on a malformed block, which is a connection error: the dynamic table can't
+// be trusted afterwards.
+int csrv_hpack_decode(struct CsrvHpack *hpack, const uint8_t *block, size_t len, csrv_hpack_emit_t emit, void *ctx) {
+  struct CsrvStrVec name_buf;
+  struct CsrvStrVec value_buf;
+  if(csrv_str_vec_init(&name_buf) != 0) {
+    return -1;
+  }
+  if(csrv_str_vec_init(&value_buf) != 0) {
+    free(name_buf.string);
+    return -1;
+  }
+
+  int res = 0;
+  bool fields_seen = false;
+  size_t pos = 0;
+  while(res == 0 && pos < len) {
+    uint8_t b = block[pos];
+    size_t index;
+    char *name;
+    char *value;
+    size_t name_len;
+    size_t value_len;
+
+    if(b & 0x80) {
+      // Indexed field
+      if(csrv_hpack_int(block, len, &pos, 7, &index) != 0
+         || csrv_hpack_lookup(hpack, index, &name, &name_len, &value, &value_len) != 0) {
+        res = -1;
+        break;
+      }
+      fields_seen = true;
+      res = emit(ctx, name, name_len, value, value_len);
+      continue;
+    }
+
+    if((b & 0xe0) == 0x20) {
+      // Table size update, only allowed before the first field
+      size_t max_size;
+      if(fields_seen || csrv_hpack_int(block, len, &pos, 5, &max_size) != 0 || max_size > CSRV_HPACK_TABLE_SIZE) {
+        res = -1;
+        break;
+      }
+      hpack->max_size = max_size;
+      csrv_hpack_evict(hpack, max_size);
+      continue;
+    }
+
+    // Literal with incremental indexing (01), without indexing (0000) or
+    // never indexed (0001)
+    bool indexing = (b & 0xc0) == 0x40;
+    if(csrv_hpack_int(block, len, &pos, indexing ? 6 : 4, &index) != 0) {
+      res = -1;
+      break;
+    }
+
+    if(index > 0) {
+      if(csrv_hpack_lookup(hpack, index, &name, &name_len, &value, &value_len) != 0) {
+        res = -1;
+        break;
+      }
+      // Copy: adding the new entry may evict the one the name came from
+      name_buf.length = 0;
+      if(csrv_str_vec_pushn(&name_buf, name, name_len) != 0 || csrv_str_vec_pushc(&name_buf, '\0') != 0) {
+        res = -1;
+        break;
+      }
+      name_buf.length--;
+    } else if(csrv_hpack_string(block, len, &pos, &name_buf) != 0) {
+      res = -1;
+      break;
+    }
+
+    if(csrv_hpack_string(block, len, &pos, &value_buf) != 0) {
+      res = -1;
+      break;
+    }
+
+    if(indexing && csrv_hpack_add(hpack, name_buf.string, name_buf.length, value_buf.string, value_buf.length) != 0) {
+      res = -1;
+      break;
+    }
+
+    fields_seen = true;
+    res = emit(ctx, name_buf.string, name_buf.length, value_buf.string, value_buf.length);
+  }
+
+  free(name_buf.string);
+  free(value_buf.string);
+  return res;
+}
+
+static int csrv_hpack_put_int(struct CsrvStrVec *out, uint8_t flags, int prefix, size_t value) {
+  size_t max = (1 << prefix) - 1;
+  if(value < max) {
+    return csrv_str_vec_pushc(out, (char) (flags | value));
+  }
+
+  int res = csrv_str_vec_pushc(out, (char) (flags | max));
+  for(value -= max; value >= 0x80; value >>= 7) {
+    res |= csrv_str_vec_pushc(out, (char) (0x80 | (value & 0x7f)));
+  }
+  return res | csrv_str_vec_pushc(out, (char) value);
+}
+
+// Static table index of a name, 0 if it isn't there
+size_t csrv_hpack_static_name(char *name) {
+  for(size_t i = 1; i <= CSRV_HPACK_STATIC_COUNT; i++) {
+    if(strcmp(csrv_hpack_static[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+// A fully indexed field, e.g. 8 for ":status: 200"
+int csrv_hpack_encode_indexed(struct CsrvStrVec *out, size_t index) {
+  return csrv_hpack_put_int(out, 0x80, 7, index);
+}
+
+// A literal without indexing: we never add to the peer's dynamic table, so
+// there is no encoder state to keep. name is only used if name_index is 0.
+int csrv_hpack_encode(struct CsrvStrVec *out, size_t name_index, char *name, char *value, size_t value_len) {
+  int res = csrv_hpack_put_int(out, 0x00, 4, name_index);
+  if(name_index == 0) {
+    size_t name_len = strlen(name);
+    res |= csrv_hpack_put_int(out, 0x00, 7, name_len);
+    res |= csrv_str_vec_pushn(out, name, name_len);
+  }
+  res |= csrv_hpack_put_int(out, 0x00, 7, value_len);
+  res |= csrv_str_vec_pushn(out, value, value_len);
+  return res;
+}
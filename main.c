@@ -3,12 +3,26 @@
 #include "string.h"
 #include "csrv.h"
 
+void hello_handler(struct CsrvRequest *req, struct CsrvResponse *resp) {
+  char *text = "Hello, world!";
+  if(csrv_str_vec_pushn(&resp->body, text, strlen(text)) != 0) {
+    CSRV_LOG_ERROR(resp->csrv, "failed to write body, errno=%s", strerror(errno));
+  }
+
+  char* key_lit = "X-Hello";
+  char* value_lit = "Hello World";
+  csrv_str_map_add(&resp->headers, strdup(key_lit), strdup(value_lit));
+}
+
 int main(int argc, char **argv) {
   struct Csrv srv;
+  memset(&srv, 0, sizeof(srv));
   srv.model = CSRV_FORK;
   srv.status = CSRV_OK;
   srv.port = 2222;
   srv.num_requests = 0;
+  srv.handler = hello_handler;
+  srv.argv = argv;
   srv.log = fopen("/dev/stdout", "w");
 
   if(srv.log == NULL) {
@@ -16,6 +30,11 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  // Optional config file; anything it doesn't set keeps the values above
+  if(argc > 1 && csrv_config_load(&srv, argv[1]) != 0) {
+    exit(1);
+  }
+
   csrv_listen(&srv);
 
   return 0;
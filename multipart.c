@@ -0,0 +1,439 @@
+#include "sys/types.h"
+#include "string.h"
+#include "strings.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "csrv.h"
+
+#ifdef __SSE2__
+#include "emmintrin.h"
+#endif
+
+// Offset of needle in haystack, or -1. The SSE2 path compares the first and
+// last byte of the needle against 16 positions at once and only runs memcmp()
+// where both match; with a random boundary that almost never happens, so the
+// body is scanned at close to memory speed.
+ssize_t csrv_multipart_find(const char *haystack, size_t n, const char *needle, size_t k) {
+  if(k == 0 || k > n) {
+    return -1;
+  }
+
+  size_t i = 0;
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i last = _mm_set1_epi8(needle[k - 1]);
+  for(; i + k - 1 + 16 <= n; i += 16) {
+    __m128i block_first = _mm_loadu_si128((const __m128i *) (haystack + i));
+    __m128i block_last = _mm_loadu_si128((const __m128i *) (haystack + i + k - 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                        _mm_cmpeq_epi8(last, block_last)));
+    while(mask != 0) {
+      unsigned int bit = __builtin_ctz(mask);
+      if(memcmp(haystack + i + bit, needle, k) == 0) {
+        return i + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  const char *found = (const char *) memmem(haystack + i, n - i, needle, k);
+  return found == NULL ? -1 : found - haystack;
+}
+
+// Value of param in a header value such as
+//   form-data; name="field"; filename="a.txt"
+// Quoted values may contain ';' and backslash escapes. Returns a malloc'd copy.
+static char *csrv_multipart_param(const char *value, size_t len, const char *param) {
+  size_t param_len = strlen(param);
+  size_t i = 0;
+
+  // The first item is the disposition/type itself
+  while(i < len && value[i] != ';') {
+    i++;
+  }
+
+  while(i < len) {
+    while(i < len && (value[i] == ';' || value[i] == ' ' || value[i] == '\t')) {
+      i++;
+    }
+
+    size_t key = i;
+    while(i < len && value[i] != '=' && value[i] != ';') {
+      i++;
+    }
+    size_t key_len = i - key;
+    while(key_len > 0 && (value[key + key_len - 1] == ' ' || value[key + key_len - 1] == '\t')) {
+      key_len--;
+    }
+
+    if(i >= len || value[i] != '=') {
+      continue;
+    }
+    i++;
+
+    struct CsrvStrVec result;
+    if(csrv_str_vec_init(&result) != 0) {
+      return NULL;
+    }
+
+    if(i < len && value[i] == '"') {
+      for(i++; i < len && value[i] != '"'; i++) {
+        if(value[i] == '\\' && i + 1 < len) {
+          i++;
+        }
+        csrv_str_vec_pushc(&result, value[i]);
+      }
+      i++;
+    } else {
+      size_t start = i;
+      while(i < len && value[i] != ';' && value[i] != ' ' && value[i] != '\t') {
+        i++;
+      }
+      csrv_str_vec_pushn(&result, (char *) &value[start], i - start);
+    }
+
+    if(key_len == param_len && strncasecmp(&value[key], param, param_len) == 0) {
+      return csrv_str_vec_value(&result);
+    }
+    free(result.string);
+  }
+
+  return NULL;
+}
+
+static void csrv_multipart_part_free(struct CsrvMultipartPart *part) {
+  free(part->name);
+  free(part->filename);
+  free(part->content_type);
+  free(part->value.string);
+  if(part->fd != -1) {
+    close(part->fd);
+  }
+  if(part->path != NULL) {
+    unlink(part->path);
+    free(part->path);
+  }
+  free(part);
+}
+
+void csrv_multipart_cleanup(struct CsrvMultipartPart *parts) {
+  while(parts != NULL) {
+    struct CsrvMultipartPart *next = parts->next;
+    csrv_multipart_part_free(parts);
+    parts = next;
+  }
+}
+
+static int csrv_multipart_write(int fd, const char *data, size_t len) {
+  while(len > 0) {
+    ssize_t sz_written = write(fd, data, len);
+    if(sz_written < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += sz_written;
+    len -= sz_written;
+  }
+  return 0;
+}
+
+// Move a part from memory to a temp file
+static int csrv_multipart_spill(struct CsrvMultipart *mp, struct CsrvMultipartPart *part) {
+  part->path = strdup(CSRV_MULTIPART_TEMPLATE);
+  if(part->path == NULL) {
+    return -1;
+  }
+
+  part->fd = mkostemp(part->path, O_CLOEXEC);
+  if(part->fd == -1) {
+    free(part->path);
+    part->path = NULL;
+    return -1;
+  }
+
+  if(csrv_multipart_write(part->fd, part->value.string, part->value.length) != 0) {
+    return -1;
+  }
+  mp->memory -= part->value.length;
+  free(part->value.string);
+  return csrv_str_vec_init(&part->value);
+}
+
+// Body bytes of the current part. Fields accumulate in memory until they
+// outgrow CSRV_MULTIPART_FIELD_MAX, or all fields together would outgrow
+// CSRV_MULTIPART_MEMORY_MAX; files are on disk from the start.
+//
+// Data is read() into the window and write()n out. A boundary search has to
+// look at every byte anyway, so moving file data with splice() instead
+// saves no copy: peeking at the socket costs the one read() would.
+static int csrv_multipart_emit(struct CsrvMultipart *mp, const char *data, size_t len) {
+  struct CsrvMultipartPart *part = mp->current;
+  if(len == 0) {
+    return 0;
+  }
+
+  if(part->fd == -1 && (part->size + len > CSRV_MULTIPART_FIELD_MAX || mp->memory + len > CSRV_MULTIPART_MEMORY_MAX)) {
+    if(csrv_multipart_spill(mp, part) != 0) {
+      return -1;
+    }
+  }
+
+  int res;
+  if(part->fd == -1) {
+    res = csrv_str_vec_pushn(&part->value, (char *) data, len);
+    mp->memory += len;
+  } else {
+    res = csrv_multipart_write(part->fd, data, len);
+  }
+  part->size += len;
+  return res;
+}
+
+// Compact the window and append more of the body. Fails on a truncated body
+// or when the window is full, which only part headers can cause.
+static int csrv_multipart_fill(struct CsrvMultipart *mp) {
+  if(mp->pos > 0) {
+    memmove(mp->buffer, mp->buffer + mp->pos, mp->len - mp->pos);
+    mp->len -= mp->pos;
+    mp->pos = 0;
+  }
+
+  if(mp->len == mp->buffer_size) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  ssize_t sz_read = csrv_read_body(mp->req, mp->buffer + mp->len, mp->buffer_size - mp->len);
+  if(sz_read <= 0) {
+    if(sz_read == 0) {
+      errno = EBADMSG;
+    }
+    return -1;
+  }
+
+  mp->len += sz_read;
+  return 0;
+}
+
+// Start a new part from its header block [start, start + len)
+static int csrv_multipart_begin_part(struct CsrvMultipart *mp, char *start, size_t len) {
+  // Every part costs its headers and possibly a temp file, however small
+  if(++mp->n_parts > CSRV_MULTIPART_PARTS_MAX) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  struct CsrvMultipartPart *part = (struct CsrvMultipartPart *) calloc(1, sizeof(struct CsrvMultipartPart));
+  if(part == NULL) {
+    return -1;
+  }
+  part->fd = -1;
+  if(csrv_str_vec_init(&part->value) != 0) {
+    free(part);
+    return -1;
+  }
+
+  // Append rather than prepend so parts come out in body order
+  if(mp->current != NULL) {
+    mp->current->next = part;
+  } else {
+    mp->parts = part;
+  }
+  mp->current = part;
+
+  size_t i = 0;
+  while(i < len) {
+    size_t line = i;
+    while(i < len && start[i] != '\r') {
+      i++;
+    }
+    size_t line_len = i - line;
+    i += 2;
+
+    char *colon = (char *) memchr(&start[line], ':', line_len);
+    if(colon == NULL) {
+      continue;
+    }
+    size_t name_len = colon - &start[line];
+    char *value = colon + 1;
+    size_t value_len = line_len - name_len - 1;
+    while(value_len > 0 && (*value == ' ' || *value == '\t')) {
+      value++;
+      value_len--;
+    }
+
+    if(name_len == 19 && strncasecmp(&start[line], "Content-Disposition", 19) == 0) {
+      free(part->name);
+      free(part->filename);
+      part->name = csrv_multipart_param(value, value_len, "name");
+      part->filename = csrv_multipart_param(value, value_len, "filename");
+    } else if(name_len == 12 && strncasecmp(&start[line], "Content-Type", 12) == 0) {
+      free(part->content_type);
+      part->content_type = strndup(value, value_len);
+    }
+  }
+
+  if(part->filename != NULL) {
+    return csrv_multipart_spill(mp, part);
+  }
+  return 0;
+}
+
+static void csrv_multipart_end_part(struct CsrvMultipart *mp) {
+  struct CsrvMultipartPart *part = mp->current;
+  if(part->fd == -1) {
+    // NUL-terminate in-memory values without counting it
+    csrv_str_vec_pushc(&part->value, '\0');
+    part->value.length--;
+  } else {
+    lseek(part->fd, 0, SEEK_SET);
+  }
+}
+
+static int csrv_multipart_run(struct CsrvMultipart *mp) {
+  while(mp->state != CSRV_MULTIPART_DONE) {
+    char *window = mp->buffer + mp->pos;
+    size_t available = mp->len - mp->pos;
+
+    switch(mp->state) {
+      case CSRV_MULTIPART_PREAMBLE:
+      case CSRV_MULTIPART_BODY: {
+        ssize_t found = csrv_multipart_find(window, available, mp->delimiter, mp->delimiter_len);
+        if(found >= 0) {
+          if(mp->state == CSRV_MULTIPART_BODY) {
+            if(csrv_multipart_emit(mp, window, found) != 0) {
+              return -1;
+            }
+            csrv_multipart_end_part(mp);
+          }
+          mp->pos += found + mp->delimiter_len;
+          mp->state = CSRV_MULTIPART_DELIMITER;
+          break;
+        }
+
+        // Everything except a possible partial delimiter at the end is data
+        size_t keep = mp->delimiter_len - 1;
+        size_t safe = available > keep ? available - keep : 0;
+        if(mp->state == CSRV_MULTIPART_BODY && csrv_multipart_emit(mp, window, safe) != 0) {
+          return -1;
+        }
+        mp->pos += safe;
+
+        if(csrv_multipart_fill(mp) != 0) {
+          return -1;
+        }
+        break;
+      }
+
+      case CSRV_MULTIPART_DELIMITER:
+        if(available < 2) {
+          if(csrv_multipart_fill(mp) != 0) {
+            return -1;
+          }
+          break;
+        }
+
+        // "--" closes the body; anything after it is an epilogue that the
+        // connection loop drains
+        if(window[0] == '-' && window[1] == '-') {
+          mp->state = CSRV_MULTIPART_DONE;
+          break;
+        }
+        if(window[0] != '\r' || window[1] != '\n') {
+          errno = EBADMSG;
+          return -1;
+        }
+        mp->pos += 2;
+        mp->state = CSRV_MULTIPART_HEADERS;
+        break;
+
+      case CSRV_MULTIPART_HEADERS: {
+        // A part with no headers at all starts with the blank line
+        size_t header_len = 0;
+        if(available < 2 || window[0] != '\r' || window[1] != '\n') {
+          ssize_t found = csrv_multipart_find(window, available, "\r\n\r\n", 4);
+          if(found < 0) {
+            if(csrv_multipart_fill(mp) != 0) {
+              return -1;
+            }
+            break;
+          }
+          header_len = found + 2;
+        }
+
+        if(csrv_multipart_begin_part(mp, window, header_len) != 0) {
+          return -1;
+        }
+        mp->pos += header_len + 2;
+        mp->state = CSRV_MULTIPART_BODY;
+        break;
+      }
+
+      case CSRV_MULTIPART_DONE:
+        break;
+    }
+  }
+
+  return 0;
+}
+
+// Parse a multipart/form-data request body into *parts, streaming it through
+// a fixed csrv->multipart_buffer_size window. Memory use doesn't depend on
+// the size of the uploaded files, which are written to temp files as they
+// arrive. The caller owns the list and frees it with csrv_multipart_cleanup().
+int csrv_multipart_parse(struct CsrvRequest *req, struct CsrvMultipartPart **parts) {
+  *parts = NULL;
+
+  char *content_type = req->headers.known[CSRV_HEADER_CONTENT_TYPE];
+  if(content_type == NULL || strncasecmp(content_type, "multipart/form-data", 19) != 0 || req->headers.chunked) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  char *boundary = csrv_multipart_param(content_type, strlen(content_type), "boundary");
+  if(boundary == NULL || boundary[0] == '\0' || strlen(boundary) > CSRV_MULTIPART_BOUNDARY_MAX) {
+    free(boundary);
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct CsrvMultipart mp;
+  memset(&mp, 0, sizeof(mp));
+  mp.req = req;
+  mp.state = CSRV_MULTIPART_PREAMBLE;
+  mp.delimiter_len = strlen(boundary) + 4;
+  mp.delimiter = (char *) malloc(mp.delimiter_len + 1);
+  mp.buffer_size = req->csrv->multipart_buffer_size;
+  mp.buffer = (char *) malloc(mp.buffer_size);
+  if(mp.delimiter == NULL || mp.buffer == NULL) {
+    free(boundary);
+    free(mp.delimiter);
+    free(mp.buffer);
+    return -1;
+  }
+  snprintf(mp.delimiter, mp.delimiter_len + 1, "\r\n--%s", boundary);
+  free(boundary);
+
+  // Every delimiter but the first follows a CRLF; pretend the first one does
+  // too so a single search handles them all
+  memcpy(mp.buffer, "\r\n", 2);
+  mp.len = 2;
+
+  int res = csrv_multipart_run(&mp);
+  if(res == 0) {
+    *parts = mp.parts;
+  } else {
+    CSRV_LOG_ERROR(req->csrv, "multipart body of request %zu rejected, errno=%s", req->id, strerror(errno));
+    csrv_multipart_cleanup(mp.parts);
+  }
+
+  free(mp.delimiter);
+  free(mp.buffer);
+  return res;
+}
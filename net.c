@@ -2,6 +2,9 @@
 #include "sys/socket.h"
 #include "netinet/in.h"
 #include "netinet/ip.h"
+#include "netinet/tcp.h"
+#include "sys/un.h"
+#include "sys/stat.h"
 #include "string.h"
 #include "stdio.h"
 #include "errno.h"
@@ -9,80 +12,240 @@
 #include "fcntl.h"
 #include "unistd.h"
 #include "poll.h"
+#include "signal.h"
 #include "csrv.h"
 
-// 1. open socket
-// 2. bind socket to address
-// 3. listen() to set backlog and open connection
-// 4. accept() to handle incoming connections
-void csrv_listen(struct Csrv *csrv) {
-  CSRV_LOG_INFO(csrv, "enter csrv_listen()");
-  
-  csrv->socket_handle = socket(AF_INET, SOCK_STREAM, 0);
-  if (csrv->socket_handle == -1) {
-    CSRV_LOG_ERROR(csrv, "socket() failed with errno=%s", strerror(errno));
-    csrv->status = CSRV_BIND_FAILURE;
-    return;
+// Socket options are set before listen() so accepted sockets inherit them
+static void csrv_listener_options(struct Csrv *csrv, struct CsrvListener *listener) {
+  int family = listener->addr.ss_family;
+  int on = 1;
+
+  if(family != AF_UNIX) {
+    // Let a restarted server bind while old connections sit in TIME_WAIT
+    setsockopt(listener->socket_handle, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  }
+  if(family == AF_INET6) {
+    // So "[::]:80" and "0.0.0.0:80" can both be listed
+    setsockopt(listener->socket_handle, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+  }
+  if(listener->reuse_port) {
+    setsockopt(listener->socket_handle, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+  }
+  if(listener->no_delay && family != AF_UNIX) {
+    setsockopt(listener->socket_handle, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  if(listener->defer_accept > 0 && family != AF_UNIX) {
+    setsockopt(listener->socket_handle, IPPROTO_TCP, TCP_DEFER_ACCEPT, &listener->defer_accept, sizeof(int));
+  }
+  if(listener->rcvbuf > 0) {
+    setsockopt(listener->socket_handle, SOL_SOCKET, SO_RCVBUF, &listener->rcvbuf, sizeof(int));
+  }
+  if(listener->sndbuf > 0) {
+    setsockopt(listener->socket_handle, SOL_SOCKET, SO_SNDBUF, &listener->sndbuf, sizeof(int));
+  }
+
+  CSRV_LOG_INFO(csrv, "socket() returned handle %d for %s", listener->socket_handle, listener->name);
+}
+
+// A socket file left behind by a server that is gone is removed; one that
+// still accepts connections is left alone and the bind fails
+static int csrv_bind_unix(struct CsrvListener *listener) {
+  struct sockaddr_un *un = (struct sockaddr_un *) &listener->addr;
+  if(bind(listener->socket_handle, (const struct sockaddr *) un, listener->addr_len) == 0) {
+    return 0;
+  }
+  if(errno != EADDRINUSE) {
+    return -1;
   }
 
-  fcntl(csrv->socket_handle, F_SETFL, O_NONBLOCK);
-  CSRV_LOG_INFO(csrv, "socket() returned handle %d", csrv->socket_handle);
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(probe == -1) {
+    return -1;
+  }
+  int connect_res = connect(probe, (const struct sockaddr *) un, listener->addr_len);
+  int connect_errno = errno;
+  close(probe);
+
+  if(connect_res == 0 || connect_errno != ECONNREFUSED) {
+    errno = EADDRINUSE;
+    return -1;
+  }
 
-  struct sockaddr_in addr;
-  memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(csrv->port);
+  unlink(un->sun_path);
+  return bind(listener->socket_handle, (const struct sockaddr *) un, listener->addr_len);
+}
 
-  // TODO: allow binding on not-the host
-  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+// CLOEXEC: on a graceful restart the listeners are passed on explicitly, and
+// nothing else should leak into the new process
+static int csrv_open_listener(struct Csrv *csrv, struct CsrvListener *listener) {
+  int family = listener->addr.ss_family;
+  listener->socket_handle = socket(family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (listener->socket_handle == -1) {
+    CSRV_LOG_ERROR(csrv, "socket() failed for %s with errno=%s", listener->name, strerror(errno));
+    csrv->status = CSRV_BIND_FAILURE;
+    return -1;
+  }
 
-  int bind_result = bind(csrv->socket_handle, (const struct sockaddr *) &addr, sizeof(addr));
+  csrv_listener_options(csrv, listener);
+
+  int bind_result = family == AF_UNIX
+    ? csrv_bind_unix(listener)
+    : bind(listener->socket_handle, (const struct sockaddr *) &listener->addr, listener->addr_len);
   if (bind_result == -1) {
-    CSRV_LOG_ERROR(csrv, "bind() failed with errno=%s", strerror(errno));
+    CSRV_LOG_ERROR(csrv, "bind() failed for %s with errno=%s", listener->name, strerror(errno));
     csrv->status = CSRV_BIND_FAILURE;
-    return;
+    return -1;
+  }
+
+  if(family == AF_UNIX && listener->mode != 0) {
+    chmod(((struct sockaddr_un *) &listener->addr)->sun_path, listener->mode);
   }
 
   CSRV_LOG_INFO(csrv, "bind() successful");
 
-  int listen_result = listen(csrv->socket_handle, CSRV_LISTEN_BACKLOG);
+  int backlog = listener->backlog > 0 ? listener->backlog : CSRV_LISTEN_BACKLOG;
+  int listen_result = listen(listener->socket_handle, backlog);
   if(listen_result == -1) {
-    CSRV_LOG_ERROR(csrv, "listen() failed with errno=%s", strerror(errno));
+    CSRV_LOG_ERROR(csrv, "listen() failed for %s with errno=%s", listener->name, strerror(errno));
     csrv->status = CSRV_LISTEN_FAILURE;
+    return -1;
+  }
+
+  return 0;
+}
+
+// 1. open sockets (or take them over from the process we are replacing)
+// 2. bind sockets to addresses
+// 3. listen() to set backlog and open connection
+// 4. accept() to handle incoming connections
+void csrv_listen(struct Csrv *csrv) {
+  CSRV_LOG_INFO(csrv, "enter csrv_listen()");
+
+  csrv_config_defaults(csrv);
+  if(csrv->n_listeners == 0) {
+    char port[8];
+    snprintf(port, sizeof(port), "%u", csrv->port);
+    if(csrv_add_listener(csrv, port) != 0) {
+      csrv->status = CSRV_ALLOC_FAILURE;
+      return;
+    }
+  }
+
+  int handoff = csrv_handoff_receive(csrv);
+  if(handoff == -1) {
+    csrv->status = CSRV_BIND_FAILURE;
     return;
   }
-  
+
+  for(size_t i = 0; handoff == 0 && i < csrv->n_listeners; i++) {
+    if(csrv_open_listener(csrv, &csrv->listeners[i]) != 0) {
+      return;
+    }
+  }
+
+  csrv_restart_install(csrv);
+  csrv_trace_install(csrv);
+  if(csrv_rate_limit_init(csrv) != 0) {
+    CSRV_LOG_ERROR(csrv, "failed to allocate rate limit table, errno=%s", strerror(errno));
+    csrv->status = CSRV_ALLOC_FAILURE;
+    return;
+  }
+  for(size_t i = 0; i < csrv->n_listeners; i++) {
+    CSRV_LOG_INFO(csrv, "listening on %s with handle %d", csrv->listeners[i].name, csrv->listeners[i].socket_handle);
+  }
+
+  if(csrv->model == CSRV_EVENT) {
+    CSRV_LOG_INFO(csrv, "listen() successful, starting event loop");
+    csrv->status = CSRV_OK;
+    csrv_listen_event(csrv);
+    csrv_rate_limit_cleanup(csrv);
+    return;
+  }
+
   CSRV_LOG_INFO(csrv, "listen() successful, starting poll()");
 
-  struct pollfd pfd;
-  pfd.fd = csrv->socket_handle;
-  pfd.events = POLLIN;
+  // One more for the handoff channel while a restart is under way
+  struct pollfd pfds[CSRV_LISTENERS_MAX + 1];
+  for(size_t i = 0; i < csrv->n_listeners; i++) {
+    pfds[i].fd = csrv->listeners[i].socket_handle;
+    pfds[i].events = POLLIN;
+  }
+  struct pollfd *handoff_pfd = &pfds[csrv->n_listeners];
+  handoff_pfd->fd = -1;
+  int64_t handoff_deadline = 0;
 
   csrv->status = CSRV_OK;
+  int64_t last_probe = csrv_now_ms();
   for(;;) {
-    int poll_res = poll(&pfd, 1, 1000);
-    if(poll_res == 0) {
-      continue;
-    } else if(poll_res == -1) {
+    // Children share the upstreams' health with us, and we probe the ones
+    // they found down
+    int64_t now = csrv_now_ms();
+    if(csrv->proxy != NULL && now - last_probe >= 1000) {
+      csrv_proxy_probe(csrv, csrv->proxy);
+      last_probe = now;
+    }
+
+    // Keep accepting while the new process starts up: its acknowledgement
+    // is polled for along with the listeners
+    if(handoff_pfd->fd == -1 && csrv_restart_pending()) {
+      handoff_pfd->fd = csrv_handoff_begin(csrv);
+      handoff_pfd->events = POLLIN;
+      handoff_pfd->revents = 0;
+      handoff_deadline = now + CSRV_HANDOFF_TIMEOUT_MS;
+    }
+
+    nfds_t n_pfds = csrv->n_listeners + (handoff_pfd->fd != -1);
+    int poll_res = poll(pfds, n_pfds, 1000);
+    if(poll_res == -1 && errno != EINTR) {
       CSRV_LOG_ERROR(csrv, "poll() failed with errno=%s", strerror(errno));
+    }
+
+    // Forked children finish their own connections, so once the new process
+    // has the listeners there is nothing left to drain here
+    if(handoff_pfd->fd != -1 && (handoff_pfd->revents != 0 || csrv_now_ms() >= handoff_deadline)) {
+      if(csrv_handoff_end(csrv, handoff_pfd->fd, handoff_pfd->revents != 0) == 0) {
+        CSRV_LOG_INFO(csrv, "listeners handed off, leaving csrv_listen()");
+        csrv_rate_limit_cleanup(csrv);
+        return;
+      }
+      handoff_pfd->fd = -1;
+    }
+
+    if(poll_res <= 0) {
       continue;
     }
 
-    csrv_accept_handler(csrv);
+    for(size_t i = 0; i < csrv->n_listeners; i++) {
+      if(pfds[i].revents & POLLIN) {
+        csrv_accept_handler(csrv, &csrv->listeners[i]);
+      }
+    }
   }
 }
 
-void csrv_accept_handler(struct Csrv *csrv) {
+void csrv_accept_handler(struct Csrv *csrv, struct CsrvListener *listener) {
   CSRV_LOG_INFO(csrv, "enter csrv_accept_handler()");
-  struct sockaddr_in addr;
-  socklen_t addr_sz;
-  int new_sock_handle = accept(csrv->socket_handle, (struct sockaddr *) &addr, &addr_sz);
+  struct sockaddr_storage addr;
+  socklen_t addr_sz = sizeof(addr);
+  // The listener is non-blocking for the event loop; another poll()er may
+  // have taken the connection already
+  uint64_t accept_start = csrv->trace_sample != 0 ? csrv_trace_clock() : 0;
+  int new_sock_handle = accept4(listener->socket_handle, (struct sockaddr *) &addr, &addr_sz, SOCK_CLOEXEC);
   if(new_sock_handle < 0) {
+    if(errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    }
     csrv->status = CSRV_ACCEPT_FAILURE;
     CSRV_LOG_ERROR(csrv, "accept() failed with errno=%s", strerror(errno));
     return;
   }
-  CSRV_LOG_INFO(csrv, "accept() successful with socket handle %d", new_sock_handle);
+  CSRV_LOG_INFO(csrv, "accept() successful with socket handle %d on %s", new_sock_handle, listener->name);
+  if(csrv->trace_sample != 0) {
+    csrv_trace_accepted(accept_start);
+  }
+  if(!csrv_rate_limit_accept(csrv, new_sock_handle, (struct sockaddr *) &addr)) {
+    return;
+  }
 
   switch(csrv->model) {
   case CSRV_FORK:
@@ -106,6 +269,7 @@ void csrv_accept_fork(struct Csrv *csrv, int sock_handle) {
   // If we don't handle this signal, we either have to wait for the
   // process to finish (blocking) or ignore it (creates process zombies)
   signal(SIGCHLD, SIG_IGN);
+  int parent_pid = getpid();
   int pid = fork();
   if(pid == -1) {
     CSRV_LOG_ERROR(csrv, "fork() failed with errno=%s", strerror(errno));
@@ -115,49 +279,137 @@ void csrv_accept_fork(struct Csrv *csrv, int sock_handle) {
 
   if(pid != 0) {
     CSRV_LOG_INFO(csrv, "fork() child pid=%d", pid);
+    // The child numbers its requests from its copy of the counter, so give
+    // each connection its own block of ids (keep-alive bounds its size)
+    csrv->request_id_max += CSRV_KEEPALIVE_MAX;
     close(sock_handle);
     return;
   }
 
+  csrv_drain_child(csrv, parent_pid);
+  csrv_serve_connection(csrv, sock_handle);
+  csrv_trace_dump(csrv);
+  CSRV_LOG_INFO(csrv, "ending forked process");
+  _exit(0);
+}
+
+// Parse requests off the socket, run the handler and write each response,
+// for as long as the client keeps the connection alive. Shared by every
+// model: a forked child calls it directly, CSRV_EVENT runs it inside a
+// coroutine so any blocking read/write yields to the event loop.
+void csrv_serve_connection(struct Csrv *csrv, int sock_handle) {
   struct CsrvRequest *req = csrv_alloc_request(csrv, sock_handle);
   if(req == NULL) {
     CSRV_LOG_ERROR(csrv, "csrv_alloc_request() failed! Aborting.");
     close(sock_handle);
-    _exit(1);
+    return;
+  }
+
+  if(req->traced) {
+    csrv_trace_accept_span(req);
   }
 
-  csrv_parse_headers(req);
-  if(req->status == CSRV_OK) {
-    CSRV_LOG_INFO(csrv, "%s %s", req->headers.method, req->headers.uri);
+  // Looked up once; every request on the connection draws from its bucket
+  uint64_t client = csrv->limiter != NULL ? csrv_rate_limit_peer(sock_handle) : 0;
+
+  struct CsrvOutQueue out;
+  csrv_out_init(&out, sock_handle);
+  req->out = &out;
+
+  for(unsigned int n_served = 1; ; n_served++) {
+    // Between requests a draining server may drop the connection
+    csrv_coro_set_idle(n_served > 1);
+    csrv_parse_headers(req);
+    if(req->status == CSRV_CONNECTION_CLOSED) {
+      CSRV_LOG_INFO(csrv, "connection on socket handle %d closed", sock_handle);
+      break;
+    } else if(req->status != CSRV_OK) {
+      CSRV_LOG_ERROR(csrv, "request failed with status=%d", req->status);
+      if(req->status == CSRV_HEADER_PARSE_FAILURE) {
+        csrv_io_write(sock_handle, CSRV_BAD_REQUEST_RESPONSE, sizeof(CSRV_BAD_REQUEST_RESPONSE) - 1);
+      }
+      break;
+    }
+
+    CSRV_LOG_INFO(csrv, "#%zu %s %s", req->id, req->headers.method, req->headers.uri);
     CSRV_LOG_INFO(csrv, "Size: %zu", req->headers.content_size);
+
+    // Over the limit: answer without running the handler, and hang up
+    // rather than read whatever body the client sent. The token taken at
+    // accept pays for the first request
+    if(client != 0 && n_served > 1 && !csrv_rate_limit_take(csrv->limiter, client)) {
+      CSRV_LOG_INFO(csrv, "#%zu rate limited", req->id);
+      csrv_io_write(sock_handle, CSRV_RATE_LIMIT_RESPONSE, sizeof(CSRV_RATE_LIMIT_RESPONSE) - 1);
+      break;
+    }
+
+    // The rest of the connection speaks HTTP/2
+    if(csrv_h2_detect(req)) {
+      csrv_h2_serve(csrv, req);
+      break;
+    }
+
+    if(n_served >= CSRV_KEEPALIVE_MAX || csrv_is_draining(csrv)) {
+      req->keep_alive = false;
+    }
+
     struct CsrvResponse *resp = csrv_init_response(req);
     if(resp == NULL) {
       CSRV_LOG_ERROR(csrv, "failed to create response");
-      _exit(1);
+      break;
     }
-    
-    //TODO: Remove this test code
-    char *text = "Hello, world!";
-    if(csrv_str_vec_pushn(&resp->body, text, strlen(text)) != 0) {
-      CSRV_LOG_ERROR(resp->csrv, "failed to write body, errno=%s", strerror(errno));
+    resp->out = &out;
+
+    uint64_t handler_start = CSRV_TRACE_START(req);
+    if(csrv->handler != NULL) {
+      csrv->handler(req, resp);
+    } else {
+      resp->status = CSRV_HTTP_NOT_FOUND;
     }
-    
-    char* key_lit = "X-Hello";
-    char* value_lit = "Hello World";
-    csrv_str_map_add(&resp->headers, strdup(key_lit), strdup(value_lit));
+    CSRV_TRACE_END(req, "handler", handler_start);
 
-    if(csrv_write_response(resp) != 0) {
+    uint64_t write_start = CSRV_TRACE_START(req);
+    if(!resp->written && csrv_write_response(resp) != 0) {
       CSRV_LOG_ERROR(csrv, "failed to write response, errno=%s", strerror(errno));
+      resp->keep_alive = false;
     }
+    CSRV_TRACE_END(req, "write", write_start);
+
+    // The handler upgraded the connection; the socket is the WebSocket's now
+    struct CsrvWs *ws = resp->websocket;
+    if(ws != NULL) {
+      csrv_cleanup_response(resp);
+      csrv_cleanup_request(req);
+      csrv_out_finish(&out, csrv_out_deadline(csrv));
+      csrv_out_cleanup(&out);
+      csrv_ws_run(ws);
+      return;
+    }
+
+    bool keep_alive = resp->keep_alive;
     csrv_cleanup_response(resp);
-  } else {
-    CSRV_LOG_ERROR(csrv, "request failed with status=%d", req->status);
+    if(!keep_alive || csrv_is_draining(csrv) || csrv_drain_body(req) != 0) {
+      break;
+    }
+
+    struct CsrvRequest *next = csrv_alloc_request(csrv, sock_handle);
+    if(next == NULL || csrv_request_carry(req, next) != 0) {
+      CSRV_LOG_ERROR(csrv, "failed to set up next request on socket handle %d", sock_handle);
+      if(next != NULL) {
+        csrv_cleanup_request(next);
+      }
+      break;
+    }
+
+    csrv_cleanup_request(req);
+    req = next;
+    req->out = &out;
   }
 
+  csrv_out_finish(&out, csrv_out_deadline(csrv));
   close(sock_handle);
+  csrv_out_cleanup(&out);
   csrv_cleanup_request(req);
-  CSRV_LOG_INFO(csrv, "ending forked process");
-  _exit(0);
 }
 
 void csrv_accept_thread(struct Csrv *csrv, int sock_handle) {
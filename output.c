@@ -0,0 +1,325 @@
+#include "sys/types.h"
+#include "sys/socket.h"
+#include "sys/uio.h"
+#include "sys/ioctl.h"
+#include "netinet/in.h"
+#include "linux/errqueue.h"
+#include "linux/sockios.h"
+#include "string.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "poll.h"
+#include "csrv.h"
+
+void csrv_out_init(struct CsrvOutQueue *out, int fd) {
+  out->fd = fd;
+  out->head = NULL;
+  out->tail = &out->head;
+  out->zerocopy = 0;
+  out->zc_next = 0;
+}
+
+// Queue len bytes of data, which the queue owns (and frees) from now on.
+// With zerocopy the pages are sent with MSG_ZEROCOPY when the socket allows.
+int csrv_out_push(struct CsrvOutQueue *out, char *data, size_t len, bool zerocopy) {
+  struct CsrvOutBuf *buf = (struct CsrvOutBuf *) calloc(1, sizeof(struct CsrvOutBuf));
+  if(buf == NULL) {
+    free(data);
+    return -1;
+  }
+
+  buf->data = data;
+  buf->len = len;
+  buf->zerocopy = zerocopy;
+  *out->tail = buf;
+  out->tail = &buf->next;
+  return 0;
+}
+
+// SO_ZEROCOPY is only asked for once a connection has something big to send.
+// It is off for good if the socket refuses it (Unix sockets), or once the
+// kernel reports it had to copy anyway (loopback, devices without
+// scatter-gather), where the pinning is pure overhead.
+static bool csrv_out_zerocopy(struct CsrvOutQueue *out) {
+  if(out->zerocopy == 0) {
+    int one = 1;
+    out->zerocopy = setsockopt(out->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 ? 1 : -1;
+  }
+  return out->zerocopy == 1;
+}
+
+// Make close() send a reset and drop whatever the socket still holds, so
+// that nothing is sent from buffers after they are freed
+static void csrv_out_reset(struct CsrvOutQueue *out) {
+  struct linger linger = { 1, 0 };
+  setsockopt(out->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+}
+
+static bool csrv_out_buf_done(struct CsrvOutBuf *buf) {
+  return buf->sent == buf->len && (!buf->zc_sent || buf->zc_done == buf->zc_last - buf->zc_first + 1);
+}
+
+// Free every buffer that is sent and, if it went out with MSG_ZEROCOPY,
+// that the kernel no longer references
+static void csrv_out_release(struct CsrvOutQueue *out) {
+  struct CsrvOutBuf **link = &out->head;
+  while(*link != NULL) {
+    struct CsrvOutBuf *buf = *link;
+    if(!csrv_out_buf_done(buf)) {
+      link = &buf->next;
+      continue;
+    }
+
+    *link = buf->next;
+    free(buf->data);
+    free(buf);
+  }
+  out->tail = link;
+}
+
+// Account sent bytes to the buffers in queue order. Every successful
+// MSG_ZEROCOPY send takes the socket's next sequence number, which the
+// buffers it covered keep to match against completions.
+static void csrv_out_advance(struct CsrvOutQueue *out, size_t sent, bool zerocopy) {
+  uint32_t seq = out->zc_next;
+  if(zerocopy) {
+    out->zc_next++;
+  }
+
+  for(struct CsrvOutBuf *buf = out->head; buf != NULL && sent > 0; buf = buf->next) {
+    size_t n = buf->len - buf->sent;
+    if(n == 0) {
+      continue;
+    }
+    if(n > sent) {
+      n = sent;
+    }
+
+    buf->sent += n;
+    sent -= n;
+    if(zerocopy) {
+      if(!buf->zc_sent) {
+        buf->zc_sent = true;
+        buf->zc_first = seq;
+      }
+      buf->zc_last = seq;
+    }
+  }
+}
+
+// Sends lo..hi (inclusive, wrapping) are complete
+static void csrv_out_complete(struct CsrvOutQueue *out, uint32_t lo, uint32_t hi) {
+  for(struct CsrvOutBuf *buf = out->head; buf != NULL; buf = buf->next) {
+    if(!buf->zc_sent) {
+      continue;
+    }
+
+    uint32_t from = (int32_t) (lo - buf->zc_first) > 0 ? lo : buf->zc_first;
+    uint32_t to = (int32_t) (hi - buf->zc_last) < 0 ? hi : buf->zc_last;
+    if((int32_t) (to - from) >= 0) {
+      buf->zc_done += to - from + 1;
+    }
+  }
+}
+
+// Read the zerocopy completions off the socket's error queue, which never
+// blocks. Returns how many notifications there were. Only asked while a
+// buffer waits for one: not every socket has an error queue (on a Unix
+// socket MSG_ERRQUEUE is ignored and an empty read returns 0 forever).
+static int csrv_out_reap(struct CsrvOutQueue *out) {
+  bool waiting = false;
+  for(struct CsrvOutBuf *buf = out->head; buf != NULL && !waiting; buf = buf->next) {
+    waiting = buf->zc_sent && !csrv_out_buf_done(buf);
+  }
+  if(!waiting) {
+    return 0;
+  }
+
+  int n_reaped = 0;
+  for(;;) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if(recvmsg(out->fd, &msg, MSG_ERRQUEUE) == -1) {
+      return n_reaped;
+    }
+
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if(!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+         && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+
+      struct sock_extended_err err;
+      memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      if(err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      if(err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        out->zerocopy = -1;
+      }
+      csrv_out_complete(out, err.ee_info, err.ee_data);
+      n_reaped++;
+    }
+  }
+}
+
+// Send everything queued, resuming after partial writes. Inside a coroutine
+// every wait parks it, so a slow client only holds its own connection.
+//
+// Zerocopy buffers stay queued until the kernel releases them, which takes
+// the peer's ACK: waiting for that here would add a round trip before the
+// next request is even read. Completions are collected on the next flush or
+// read instead (see csrv_out_read()), and at the latest by csrv_out_finish().
+int csrv_out_flush(struct CsrvOutQueue *out) {
+  csrv_out_reap(out);
+  csrv_out_release(out);
+  for(;;) {
+    struct iovec iov[CSRV_OUT_IOV];
+    int n_iov = 0;
+    bool zerocopy = false;
+    for(struct CsrvOutBuf *buf = out->head; buf != NULL && n_iov < CSRV_OUT_IOV; buf = buf->next) {
+      if(buf->sent == buf->len) {
+        continue;
+      }
+      iov[n_iov].iov_base = buf->data + buf->sent;
+      iov[n_iov].iov_len = buf->len - buf->sent;
+      zerocopy |= buf->zerocopy;
+      n_iov++;
+    }
+    if(n_iov == 0) {
+      break;
+    }
+
+    zerocopy = zerocopy && csrv_out_zerocopy(out);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n_iov;
+
+    // MSG_NOSIGNAL: a peer hanging up must not SIGPIPE the whole server
+    ssize_t sz_sent = sendmsg(out->fd, &msg, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+    if(sz_sent >= 0) {
+      csrv_out_advance(out, sz_sent, zerocopy);
+      continue;
+    }
+
+    if(errno == EINTR) {
+      continue;
+    }
+
+    // Out of option memory for notifications: copy instead
+    if(errno == ENOBUFS && zerocopy) {
+      out->zerocopy = -1;
+      continue;
+    }
+
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      goto failed;
+    }
+
+    csrv_out_reap(out);
+    if(csrv_coro_wait(out->fd, POLLOUT, CSRV_IO_TIMEOUT_MS) != 0) {
+      goto failed;
+    }
+  }
+
+  csrv_out_reap(out);
+  csrv_out_release(out);
+  return 0;
+
+failed:
+  csrv_out_release(out);
+  for(struct CsrvOutBuf *buf = out->head; buf != NULL; buf = buf->next) {
+    if(buf->zc_sent) {
+      // The write failed, so the connection is done for. Close it with a
+      // reset, which drops the unsent data, instead of leaving that queued
+      // behind pages that are about to be freed
+      csrv_out_reset(out);
+      break;
+    }
+  }
+  return -1;
+}
+
+// csrv_io_read() for a connection with an output queue. A pending
+// completion makes the socket report an error, which would wake every wait
+// for input at once: completions are collected before each one.
+ssize_t csrv_out_read(struct CsrvOutQueue *out, void *buffer, size_t sz) {
+  for(;;) {
+    ssize_t sz_read = read(out->fd, buffer, sz);
+    if(sz_read >= 0) {
+      return sz_read;
+    }
+
+    if(errno == EINTR) {
+      continue;
+    }
+
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      return -1;
+    }
+
+    if(out->head != NULL) {
+      csrv_out_reap(out);
+      csrv_out_release(out);
+    }
+    if(csrv_coro_wait(out->fd, POLLIN, CSRV_IO_TIMEOUT_MS) != 0) {
+      return -1;
+    }
+  }
+}
+
+// Before the socket is closed or handed over, after which its completions
+// can no longer be read: wait until deadline for the kernel to release the
+// zerocopy buffers still queued (see csrv_out_deadline()). Only a peer that
+// has left data unacknowledged for the whole wait gets its connection reset;
+// completions that are merely late, for data the peer already has, are
+// nothing to fail over.
+void csrv_out_finish(struct CsrvOutQueue *out, int64_t deadline) {
+  for(;;) {
+    csrv_out_reap(out);
+    csrv_out_release(out);
+    int64_t now = csrv_now_ms();
+    if(out->head == NULL || now >= deadline) {
+      break;
+    }
+
+    // Nothing to wait for but the error queue, which poll and epoll always
+    // report. A wake without a completion is the connection failing.
+    if(csrv_coro_wait(out->fd, 0, deadline - now) != 0 || csrv_out_reap(out) == 0) {
+      break;
+    }
+  }
+
+  int unacked = 0;
+  if(out->head != NULL && (ioctl(out->fd, SIOCOUTQ, &unacked) != 0 || unacked > 0)) {
+    csrv_out_reset(out);
+  }
+}
+
+// When a connection closing now stops waiting for completions. A
+// completion follows the peer's ACK, so a live peer needs a round trip, not
+// the I/O timeout; a draining server doesn't wait past its drain deadline.
+int64_t csrv_out_deadline(struct Csrv *csrv) {
+  int64_t deadline = csrv_now_ms() + CSRV_OUT_FINISH_MS;
+  if(csrv_is_draining(csrv) && csrv->drain_deadline != 0 && csrv->drain_deadline < deadline) {
+    deadline = csrv->drain_deadline;
+  }
+  return deadline;
+}
+
+// Free whatever is left, once the socket is closed (after csrv_out_finish())
+void csrv_out_cleanup(struct CsrvOutQueue *out) {
+  while(out->head != NULL) {
+    struct CsrvOutBuf *buf = out->head;
+    out->head = buf->next;
+    free(buf->data);
+    free(buf);
+  }
+  out->tail = &out->head;
+}
@@ -0,0 +1,703 @@
+#include "sys/types.h"
+#include "sys/socket.h"
+#include "sys/mman.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "arpa/inet.h"
+#include "string.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "poll.h"
+#include "strings.h"
+#include "csrv.h"
+
+// Headers that describe a single connection and must not be forwarded
+static char *csrv_hop_headers[] = {
+  "Connection",
+  "Keep-Alive",
+  "Proxy-Connection",
+  "Upgrade",
+  "Expect",
+  NULL
+};
+
+// Requests also lose their transfer coding: bodies are only relayed with a
+// Content-Length, or chunked by us (see csrv_proxy_chunked_body())
+static char *csrv_hop_request_headers[] = {
+  "Connection",
+  "Keep-Alive",
+  "Proxy-Connection",
+  "Upgrade",
+  "Expect",
+  "TE",
+  "Trailer",
+  "Transfer-Encoding",
+  NULL
+};
+
+// A thread's pools for one proxy, indexed like proxy->upstreams and ended by
+// an entry without an idle array: the thread-exit destructor gets nothing
+// but this pointer
+static void csrv_proxy_free_pools(void *arg) {
+  struct CsrvUpstreamPool *pools = (struct CsrvUpstreamPool *) arg;
+  for(struct CsrvUpstreamPool *pool = pools; pool->idle != NULL; pool++) {
+    for(size_t i = 0; i < pool->n_idle; i++) {
+      close(pool->idle[i]);
+    }
+    free(pool->idle);
+  }
+  free(pools);
+}
+
+// addrs are "host:port" with host an IPv4 address. The upstreams are a
+// shared mapping so that what a CSRV_FORK child learns about their health
+// reaches the parent, which probes them, and every other child.
+int csrv_proxy_init(struct CsrvProxy *proxy, char **addrs, size_t n_addrs) {
+  proxy->n_upstreams = 0;
+  if(n_addrs == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  void *map = mmap(NULL, n_addrs * sizeof(struct CsrvUpstream), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(map == MAP_FAILED) {
+    return -1;
+  }
+  proxy->upstreams = (struct CsrvUpstream *) map;
+  proxy->map_size = n_addrs * sizeof(struct CsrvUpstream);
+
+  // Each worker thread gets its own pools, closed when it exits
+  if(pthread_key_create(&proxy->pools_key, csrv_proxy_free_pools) != 0) {
+    munmap(proxy->upstreams, proxy->map_size);
+    proxy->upstreams = NULL;
+    return -1;
+  }
+
+  for(size_t i = 0; i < n_addrs; i++) {
+    struct CsrvUpstream *up = &proxy->upstreams[i];
+    up->probe_fd = -1;
+    char *sep = strrchr(addrs[i], ':');
+    if(sep == NULL) {
+      goto init_fail;
+    }
+
+    up->name = strdup(addrs[i]);
+    if(up->name == NULL) {
+      goto init_fail;
+    }
+    proxy->n_upstreams++;
+
+    // Split the copy at the ':' to get the host on its own
+    up->name[sep - addrs[i]] = '\0';
+    up->addr.sin_family = AF_INET;
+    up->addr.sin_port = htons((uint16_t) strtoul(sep + 1, NULL, 10));
+    int pton_res = inet_pton(AF_INET, up->name, &up->addr.sin_addr);
+    up->name[sep - addrs[i]] = ':';
+    if(pton_res != 1 || up->addr.sin_port == 0) {
+      goto init_fail;
+    }
+  }
+
+  return 0;
+
+init_fail:
+  csrv_proxy_cleanup(proxy);
+  errno = EINVAL;
+  return -1;
+}
+
+// Worker threads have exited by now and closed their own pools; what is
+// left is the calling thread's
+void csrv_proxy_cleanup(struct CsrvProxy *proxy) {
+  struct CsrvUpstreamPool *pools = (struct CsrvUpstreamPool *) pthread_getspecific(proxy->pools_key);
+  if(pools != NULL) {
+    pthread_setspecific(proxy->pools_key, NULL);
+    csrv_proxy_free_pools(pools);
+  }
+  pthread_key_delete(proxy->pools_key);
+
+  for(size_t i = 0; i < proxy->n_upstreams; i++) {
+    if(proxy->upstreams[i].probe_fd != -1) {
+      close(proxy->upstreams[i].probe_fd);
+    }
+    free(proxy->upstreams[i].name);
+  }
+
+  munmap(proxy->upstreams, proxy->map_size);
+  proxy->upstreams = NULL;
+  proxy->n_upstreams = 0;
+}
+
+static struct CsrvUpstreamPool *csrv_proxy_pools(struct CsrvProxy *proxy) {
+  struct CsrvUpstreamPool *pools = (struct CsrvUpstreamPool *) pthread_getspecific(proxy->pools_key);
+  if(pools != NULL) {
+    return pools;
+  }
+
+  pools = (struct CsrvUpstreamPool *) calloc(proxy->n_upstreams + 1, sizeof(struct CsrvUpstreamPool));
+  if(pools == NULL) {
+    return NULL;
+  }
+
+  for(size_t i = 0; i < proxy->n_upstreams; i++) {
+    pools[i].idle = (int *) malloc(sizeof(int) * CSRV_PROXY_POOL_MAX);
+    if(pools[i].idle == NULL) {
+      csrv_proxy_free_pools(pools);
+      return NULL;
+    }
+  }
+
+  if(pthread_setspecific(proxy->pools_key, pools) != 0) {
+    csrv_proxy_free_pools(pools);
+    return NULL;
+  }
+  return pools;
+}
+
+// Least connections among upstreams that aren't marked down or already tried.
+// One that is down is left alone for CSRV_PROXY_RETRY_MS, and for good once
+// csrv_proxy_probe() has taken it over.
+static ssize_t csrv_proxy_pick(struct CsrvProxy *proxy, struct CsrvUpstreamPool *pools, bool *tried) {
+  int64_t now = csrv_now_ms();
+  ssize_t best = -1;
+  for(size_t i = 0; i < proxy->n_upstreams; i++) {
+    struct CsrvUpstream *up = &proxy->upstreams[i];
+    int64_t retry_at = __atomic_load_n(&up->retry_at, __ATOMIC_RELAXED);
+    if(tried[i] || (retry_at != 0 && (retry_at > now || __atomic_load_n(&up->probed, __ATOMIC_RELAXED)))) {
+      continue;
+    }
+
+    if(best == -1 || pools[i].active < pools[best].active) {
+      best = i;
+    }
+  }
+
+  return best;
+}
+
+// Take the upstream out of rotation for CSRV_PROXY_RETRY_MS. Where nothing
+// calls csrv_proxy_probe(), the next request after that is the health check.
+static void csrv_proxy_mark_down(struct Csrv *csrv, struct CsrvUpstream *up) {
+  CSRV_LOG_ERROR(csrv, "upstream %s marked down, errno=%s", up->name, strerror(errno));
+  __atomic_store_n(&up->retry_at, csrv_now_ms() + CSRV_PROXY_RETRY_MS, __ATOMIC_RELAXED);
+}
+
+static void csrv_proxy_probe_done(struct Csrv *csrv, struct CsrvUpstream *up, bool healthy) {
+  if(up->probe_fd != -1) {
+    close(up->probe_fd);
+    up->probe_fd = -1;
+  }
+
+  if(healthy) {
+    CSRV_LOG_INFO(csrv, "upstream %s is back", up->name);
+    __atomic_store_n(&up->probed, false, __ATOMIC_RELAXED);
+    __atomic_store_n(&up->retry_at, 0, __ATOMIC_RELAXED);
+  }
+}
+
+// Start connecting; the next attempt is due CSRV_PROXY_RETRY_MS from now
+// unless this one succeeds
+static void csrv_proxy_probe_start(struct Csrv *csrv, struct CsrvUpstream *up, int64_t now) {
+  __atomic_store_n(&up->retry_at, now + CSRV_PROXY_RETRY_MS, __ATOMIC_RELAXED);
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd == -1) {
+    return;
+  }
+
+  up->probe_fd = fd;
+  up->probe_start = now;
+  if(connect(fd, (struct sockaddr *) &up->addr, sizeof(up->addr)) == 0) {
+    csrv_proxy_probe_done(csrv, up, true);
+  } else if(errno != EINPROGRESS) {
+    csrv_proxy_probe_done(csrv, up, false);
+  }
+}
+
+// See whether a connect in progress got through, without waiting for it
+static void csrv_proxy_probe_finish(struct Csrv *csrv, struct CsrvUpstream *up, int64_t now) {
+  struct pollfd pfd;
+  pfd.fd = up->probe_fd;
+  pfd.events = POLLOUT;
+  if(poll(&pfd, 1, 0) != 1) {
+    if(now - up->probe_start >= CSRV_PROXY_CONNECT_TIMEOUT_MS) {
+      csrv_proxy_probe_done(csrv, up, false);
+    }
+    return;
+  }
+
+  int err = 0;
+  socklen_t err_sz = sizeof(err);
+  bool healthy = getsockopt(up->probe_fd, SOL_SOCKET, SO_ERROR, &err, &err_sz) == 0 && err == 0;
+  csrv_proxy_probe_done(csrv, up, healthy);
+}
+
+// Active health checks, called about once a second by the event loops and
+// the CSRV_FORK accept loop. An upstream that is down is taken over here, so
+// requests no longer serve as its probe: it is connected to every
+// CSRV_PROXY_RETRY_MS and only gets requests again once that succeeds.
+// Nothing here blocks; a connect in progress is looked at on a later call.
+void csrv_proxy_probe(struct Csrv *csrv, struct CsrvProxy *proxy) {
+  int64_t now = csrv_now_ms();
+  for(size_t i = 0; i < proxy->n_upstreams; i++) {
+    struct CsrvUpstream *up = &proxy->upstreams[i];
+    int64_t retry_at = __atomic_load_n(&up->retry_at, __ATOMIC_RELAXED);
+    // Workers share the upstreams: one probes, the others move on
+    if(retry_at == 0 || __atomic_exchange_n(&up->probing, 1, __ATOMIC_ACQUIRE) != 0) {
+      continue;
+    }
+
+    __atomic_store_n(&up->probed, true, __ATOMIC_RELAXED);
+    if(up->probe_fd != -1) {
+      csrv_proxy_probe_finish(csrv, up, now);
+    } else if(retry_at <= now) {
+      csrv_proxy_probe_start(csrv, up, now);
+    }
+    __atomic_store_n(&up->probing, 0, __ATOMIC_RELEASE);
+  }
+}
+
+static int csrv_proxy_connect(struct Csrv *csrv, struct CsrvUpstream *up) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd == -1) {
+    return -1;
+  }
+
+  int nodelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  if(connect(fd, (struct sockaddr *) &up->addr, sizeof(up->addr)) == 0) {
+    return fd;
+  }
+
+  if(errno != EINPROGRESS || csrv_coro_wait(fd, POLLOUT, CSRV_PROXY_CONNECT_TIMEOUT_MS) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  int err = 0;
+  socklen_t err_sz = sizeof(err);
+  if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_sz) != 0 || err != 0) {
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  CSRV_LOG_INFO(csrv, "connected to upstream %s on handle %d", up->name, fd);
+  return fd;
+}
+
+// Pop an idle connection that is still open, or connect a fresh one
+static int csrv_proxy_acquire(struct Csrv *csrv, struct CsrvUpstream *up, struct CsrvUpstreamPool *pool, bool *reused) {
+  while(pool->n_idle > 0) {
+    int fd = pool->idle[--pool->n_idle];
+
+    // An idle connection has nothing to read: EOF or stray bytes mean the
+    // upstream closed it or broke protocol while it sat in the pool
+    char peek;
+    if(recv(fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      *reused = true;
+      return fd;
+    }
+
+    close(fd);
+  }
+
+  *reused = false;
+  return csrv_proxy_connect(csrv, up);
+}
+
+static void csrv_proxy_release(struct CsrvUpstreamPool *pool, int fd, bool reusable) {
+  if(reusable && pool->n_idle < CSRV_PROXY_POOL_MAX) {
+    pool->idle[pool->n_idle++] = fd;
+    return;
+  }
+
+  close(fd);
+}
+
+static bool csrv_proxy_hop_header(char **hop, char *line, size_t len) {
+  for(size_t i = 0; hop[i] != NULL; i++) {
+    size_t name_len = strlen(hop[i]);
+    if(name_len < len && line[name_len] == ':' && strncasecmp(line, hop[i], name_len) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Copy the header lines of a parsed message (skipping its request/status
+// line and any named in hop) verbatim, so duplicates, order and case survive
+// the trip
+static int csrv_proxy_copy_head(struct CsrvStrVec *out, struct CsrvRequest *msg, char **hop) {
+  char *head = msg->request.string;
+  size_t end = msg->body_offset + 1;
+  size_t pos = 0;
+  while(pos < end && head[pos] != '\n') {
+    pos++;
+  }
+  pos++;
+
+  while(pos < end) {
+    size_t line_end = pos;
+    while(line_end < end && head[line_end] != '\n') {
+      line_end++;
+    }
+
+    // The blank line that ends the head
+    size_t len = line_end + 1 - pos;
+    if(len <= 2) {
+      break;
+    }
+
+    if(!csrv_proxy_hop_header(hop, &head[pos], len) && csrv_str_vec_pushn(out, &head[pos], len) != 0) {
+      return -1;
+    }
+    pos = line_end + 1;
+  }
+
+  return 0;
+}
+
+static int csrv_proxy_pushs(struct CsrvStrVec *out, char *str) {
+  return csrv_str_vec_pushn(out, str, strlen(str));
+}
+
+// An HTTP/2 request may send a body without a Content-Length, ending it
+// with END_STREAM. Upstream it is framed with chunked encoding, or the body
+// would run into the next request on the pooled connection.
+static bool csrv_proxy_chunked_body(struct CsrvRequest *req) {
+  return req->stream != NULL && !req->headers.has_content_length && req->headers.content_size != 0;
+}
+
+static int csrv_proxy_build_request(struct CsrvStrVec *head, struct CsrvRequest *req) {
+  if(csrv_str_vec_init(head) != 0) {
+    return -1;
+  }
+
+  int result = 0;
+  result |= csrv_proxy_pushs(head, req->headers.method);
+  result |= csrv_proxy_pushs(head, " ");
+  result |= csrv_proxy_pushs(head, req->headers.uri);
+  result |= csrv_proxy_pushs(head, " HTTP/1.1\r\n");
+  result |= csrv_proxy_copy_head(head, req, csrv_hop_request_headers);
+  if(csrv_proxy_chunked_body(req)) {
+    result |= csrv_proxy_pushs(head, "Transfer-Encoding: chunked\r\n");
+  }
+  result |= csrv_proxy_pushs(head, "Connection: keep-alive\r\n\r\n");
+  return result;
+}
+
+// Send the request (head and body) and parse the head of the response.
+// Interim 1xx responses are skipped. On failure *unseen is set if the
+// upstream can't have acted on the request: writing the head failed, or the
+// connection was closed or reset before a single response byte arrived.
+static int csrv_proxy_exchange(struct CsrvRequest *req, int fd, struct CsrvStrVec *head, char *buffer, struct CsrvRequest **out, bool *unseen) {
+  struct Csrv *csrv = req->csrv;
+  *unseen = false;
+  if(csrv_io_write(fd, head->string, head->length) < 0) {
+    *unseen = true;
+    return -1;
+  }
+
+  bool chunked = csrv_proxy_chunked_body(req);
+  ssize_t sz_read;
+  while((sz_read = csrv_read_body(req, buffer, csrv->proxy_buffer_size)) > 0) {
+    char size_line[32];
+    int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", (size_t) sz_read);
+    if((chunked && csrv_io_write(fd, size_line, size_len) < 0)
+       || csrv_io_write(fd, buffer, sz_read) < 0
+       || (chunked && csrv_io_write(fd, "\r\n", 2) < 0)) {
+      return -1;
+    }
+  }
+  if(sz_read < 0 || (chunked && csrv_io_write(fd, "0\r\n\r\n", 5) < 0)) {
+    return -1;
+  }
+
+  struct CsrvRequest *up = csrv_alloc_request(csrv, fd);
+  for(bool first = true; ; first = false) {
+    if(up == NULL) {
+      return -1;
+    }
+    *out = up;
+
+    // A response is parsed like a request: method is the version, uri the
+    // status code and proto the reason phrase. EOF or a reset before
+    // anything was read shows up as a closed connection; so does a timeout,
+    // which is no proof the request wasn't acted on
+    csrv_parse_headers(up);
+    if(up->status != CSRV_OK) {
+      *unseen = first && up->status == CSRV_CONNECTION_CLOSED && errno != ETIMEDOUT;
+      return -1;
+    }
+
+    long code = strtol(up->headers.uri, NULL, 10);
+    if(code < 100 || code >= 200 || code == 101) {
+      return 0;
+    }
+
+    up->headers.content_size = 0;
+    struct CsrvRequest *next = csrv_alloc_request(csrv, fd);
+    if(next != NULL && csrv_request_carry(up, next) != 0) {
+      csrv_cleanup_request(next);
+      next = NULL;
+    }
+    csrv_cleanup_request(up);
+    *out = NULL;
+    up = next;
+  }
+}
+
+// Relay a chunked body verbatim, following the chunk sizes to find its end.
+// HTTP/2 has its own framing, so there only the chunk data is passed on.
+static int csrv_proxy_relay_chunked(struct CsrvRequest *up, struct CsrvResponse *resp, char *buffer) {
+  size_t buffer_size = up->csrv->proxy_buffer_size;
+  bool framed = resp->stream == NULL;
+  size_t pos = 0;
+  size_t len = 0;
+  size_t chunk_left = 0;
+  bool trailers = false;
+
+  for(;;) {
+    if(chunk_left > 0 && pos < len) {
+      size_t n = len - pos < chunk_left ? len - pos : chunk_left;
+      // chunk_left counts the \r\n after the data
+      size_t data_left = chunk_left > 2 ? chunk_left - 2 : 0;
+      size_t out = framed || n < data_left ? n : data_left;
+      if(out > 0 && csrv_response_write_body(resp, &buffer[pos], out) != 0) {
+        return -1;
+      }
+      pos += n;
+      chunk_left -= n;
+      continue;
+    }
+
+    // Size and trailer lines have to be seen whole
+    char *nl = chunk_left == 0 ? memchr(&buffer[pos], '\n', len - pos) : NULL;
+    if(nl == NULL) {
+      memmove(buffer, &buffer[pos], len - pos);
+      len -= pos;
+      pos = 0;
+      if(len == buffer_size) {
+        return -1;
+      }
+
+      ssize_t sz_read = csrv_read_body(up, &buffer[len], buffer_size - len);
+      if(sz_read <= 0) {
+        return -1;
+      }
+      len += sz_read;
+      continue;
+    }
+
+    size_t line_len = nl - &buffer[pos] + 1;
+    if(framed && csrv_response_write_body(resp, &buffer[pos], line_len) != 0) {
+      return -1;
+    }
+
+    if(trailers) {
+      // The blank line after the trailers ends the body
+      if(line_len <= 2) {
+        return 0;
+      }
+    } else {
+      size_t chunk_sz = strtoul(&buffer[pos], NULL, 16);
+      if(chunk_sz == 0) {
+        trailers = true;
+      } else {
+        // The data is followed by its own \r\n
+        chunk_left = chunk_sz + 2;
+      }
+    }
+    pos += line_len;
+  }
+}
+
+// Write the response head and stream the body to the client. *reusable is
+// set when the upstream connection can go back in the pool.
+static int csrv_proxy_relay(struct CsrvRequest *req, struct CsrvResponse *resp, struct CsrvRequest *up, char *buffer, bool *reusable) {
+  long code = strtol(up->headers.uri, NULL, 10);
+  char *connection = up->headers.known[CSRV_HEADER_CONNECTION];
+  bool chunked = up->headers.chunked;
+  bool has_length = up->headers.has_content_length;
+  bool no_body = strcmp(req->headers.method, "HEAD") == 0 || code == 204 || code == 304;
+
+  *reusable = strcmp(up->headers.method, "HTTP/1.1") == 0
+    && (connection == NULL || strcasestr(connection, "close") == NULL);
+
+  // Without framing the body runs until the upstream closes, and the
+  // client can only find its end the same way
+  bool until_close = !no_body && !chunked && !has_length;
+  if(until_close) {
+    *reusable = false;
+    req->keep_alive = false;
+  }
+
+  struct CsrvStrVec head;
+  if(csrv_str_vec_init(&head) != 0) {
+    return -1;
+  }
+
+  int result = 0;
+  result |= csrv_proxy_pushs(&head, "HTTP/1.1 ");
+  result |= csrv_proxy_pushs(&head, up->headers.uri);
+  result |= csrv_proxy_pushs(&head, " ");
+  result |= csrv_proxy_pushs(&head, up->headers.proto);
+  result |= csrv_proxy_pushs(&head, "\r\n");
+  result |= csrv_proxy_copy_head(&head, up, csrv_hop_headers);
+  result |= csrv_proxy_pushs(&head, req->keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+  if(result != 0 || csrv_response_write_head(resp, head.string, head.length) != 0) {
+    free(head.string);
+    return -1;
+  }
+  free(head.string);
+
+  if(no_body) {
+    return 0;
+  }
+
+  if(chunked) {
+    up->headers.content_size = SIZE_MAX;
+    return csrv_proxy_relay_chunked(up, resp, buffer);
+  }
+
+  if(until_close) {
+    up->headers.content_size = SIZE_MAX;
+  }
+
+  ssize_t sz_read;
+  while((sz_read = csrv_read_body(up, buffer, up->csrv->proxy_buffer_size)) > 0) {
+    if(csrv_response_write_body(resp, buffer, sz_read) != 0) {
+      return -1;
+    }
+  }
+
+  // csrv_read_body() reports the upstream hanging up as ECONNRESET
+  if(until_close && sz_read < 0 && errno == ECONNRESET) {
+    return 0;
+  }
+  return sz_read == 0 ? 0 : -1;
+}
+
+// Requests that may be sent again after a failure (RFC 9110 section 9.2.2).
+// Only the safe methods: PUT and DELETE are idempotent too, but a replay
+// can still reorder them against other clients' requests.
+static bool csrv_proxy_idempotent(char *method) {
+  return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0
+    || strcmp(method, "OPTIONS") == 0 || strcmp(method, "TRACE") == 0;
+}
+
+// csrv_handler_t that forwards the request to one of csrv->proxy's upstreams
+// and streams the response back
+void csrv_proxy_handler(struct CsrvRequest *req, struct CsrvResponse *resp) {
+  struct Csrv *csrv = req->csrv;
+  struct CsrvProxy *proxy = csrv->proxy;
+  resp->status = CSRV_HTTP_BAD_GATEWAY;
+  if(proxy == NULL || proxy->n_upstreams == 0) {
+    CSRV_LOG_ERROR(csrv, "csrv_proxy_handler() called without upstreams");
+    return;
+  }
+
+  // A chunked (or otherwise transfer-coded) request body isn't decoded, so
+  // neither its length nor where the next request starts is known
+  if(req->headers.known[CSRV_HEADER_TRANSFER_ENCODING] != NULL) {
+    CSRV_LOG_ERROR(csrv, "rejecting transfer-coded request body for %s", req->headers.uri);
+    resp->status = CSRV_HTTP_LENGTH_REQUIRED;
+    resp->keep_alive = false;
+    return;
+  }
+
+  struct CsrvUpstreamPool *pools = csrv_proxy_pools(proxy);
+  char *buffer = (char *) malloc(csrv->proxy_buffer_size);
+  bool *tried = (bool *) calloc(proxy->n_upstreams, sizeof(bool));
+  struct CsrvStrVec head;
+  head.string = NULL;
+  if(pools == NULL || buffer == NULL || tried == NULL || csrv_proxy_build_request(&head, req) != 0) {
+    CSRV_LOG_ERROR(csrv, "failed to set up proxy request, errno=%s", strerror(errno));
+    goto proxy_done;
+  }
+
+  struct CsrvRequest *up = NULL;
+  struct CsrvUpstreamPool *pool = NULL;
+  int fd = -1;
+  for(;;) {
+    ssize_t idx = csrv_proxy_pick(proxy, pools, tried);
+    if(idx == -1) {
+      CSRV_LOG_ERROR(csrv, "no healthy upstream for %s", req->headers.uri);
+      goto proxy_done;
+    }
+
+    struct CsrvUpstream *upstream = &proxy->upstreams[idx];
+    pool = &pools[idx];
+
+    bool reused;
+    fd = csrv_proxy_acquire(csrv, upstream, pool, &reused);
+    if(fd == -1) {
+      csrv_proxy_mark_down(csrv, upstream);
+      tried[idx] = true;
+      continue;
+    }
+
+    pool->active++;
+    bool unseen;
+    if(csrv_proxy_exchange(req, fd, &head, buffer, &up, &unseen) == 0) {
+      __atomic_store_n(&upstream->retry_at, 0, __ATOMIC_RELAXED);
+      break;
+    }
+
+    pool->active--;
+    close(fd);
+    if(up != NULL) {
+      csrv_cleanup_request(up);
+      up = NULL;
+    }
+
+    // Once part of the body has been sent it can't be replayed
+    if(req->body_read > 0) {
+      CSRV_LOG_ERROR(csrv, "upstream %s failed mid-request, errno=%s", upstream->name, strerror(errno));
+      resp->keep_alive = false;
+      goto proxy_done;
+    }
+
+    // Anything the upstream may have acted on is not sent again, to it or
+    // to another one
+    if(!unseen || !csrv_proxy_idempotent(req->headers.method)) {
+      CSRV_LOG_ERROR(csrv, "upstream %s failed after the request was sent, errno=%s", upstream->name, strerror(errno));
+      if(!reused) {
+        csrv_proxy_mark_down(csrv, upstream);
+      }
+      goto proxy_done;
+    }
+
+    // A pooled connection may have been closed by the upstream just as we
+    // used it; that says nothing about the upstream's health, so try again
+    if(reused) {
+      continue;
+    }
+
+    csrv_proxy_mark_down(csrv, upstream);
+    tried[idx] = true;
+  }
+
+  // From here on the client sees the upstream's response, not ours
+  resp->written = true;
+  bool reusable = false;
+  if(csrv_proxy_relay(req, resp, up, buffer, &reusable) != 0) {
+    CSRV_LOG_ERROR(csrv, "failed to relay upstream response, errno=%s", strerror(errno));
+    reusable = false;
+    req->keep_alive = false;
+  }
+  resp->keep_alive = req->keep_alive;
+
+  pool->active--;
+  csrv_proxy_release(pool, fd, reusable);
+  csrv_cleanup_request(up);
+
+proxy_done:
+  free(head.string);
+  free(tried);
+  free(buffer);
+}
@@ -0,0 +1,242 @@
+#include "sys/types.h"
+#include "sys/socket.h"
+#include "sys/mman.h"
+#include "netinet/in.h"
+#include "string.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "csrv.h"
+
+// Bucket state packed into one word so it can be updated with a single
+// compare-and-swap: milliseconds since the table's epoch in the high half,
+// tokens in thousandths in the low half. A rate of N tokens per second is
+// then simply N thousandths per millisecond.
+// Every stored state has CSRV_RATE_LIVE set, so a state of 0 can only be a
+// slot just handed to a new client, with a full bucket: a real bucket can
+// be empty at millisecond 0.
+#define CSRV_RATE_LIVE ((uint32_t) 1 << 31)
+#define CSRV_RATE_STATE(ms, tokens) ((uint64_t) (ms) << 32 | CSRV_RATE_LIVE | (uint32_t) (tokens))
+#define CSRV_RATE_TOKENS(state) ((uint32_t) (state) & ~CSRV_RATE_LIVE)
+
+_Static_assert((uint64_t) CSRV_RATE_BURST_MAX * 1000 < CSRV_RATE_LIVE, "a full bucket must not reach the live bit");
+
+// Workers read the clock before their compare-and-swap, so a bucket may hold
+// a time slightly ahead of a reader's. Anything further ahead than this is a
+// bucket left alone for so long that the 32-bit clock wrapped.
+#define CSRV_RATE_SKEW_MS (60 * 1000)
+
+static uint64_t csrv_rate_limit_mix(uint64_t key) {
+  // splitmix64 finalizer, so neighbouring addresses spread over the sets
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  return key ^ (key >> 31);
+}
+
+// Set up csrv->limiter from csrv->rate_limit. The table is a shared mapping
+// so that forked children draw from the same buckets as the parent.
+int csrv_rate_limit_init(struct Csrv *csrv) {
+  if(csrv->rate_limit == 0) {
+    return 0;
+  }
+
+  struct CsrvRateLimit *limit = (struct CsrvRateLimit *) calloc(1, sizeof(struct CsrvRateLimit));
+  if(limit == NULL) {
+    return -1;
+  }
+
+  // A power of two number of sets
+  size_t n_slots = csrv->rate_limit_slots != 0 ? csrv->rate_limit_slots : CSRV_RATE_LIMIT_SLOTS;
+  limit->n_sets = 1;
+  while(limit->n_sets * CSRV_RATE_LIMIT_WAYS < n_slots) {
+    limit->n_sets *= 2;
+  }
+
+  limit->map_size = limit->n_sets * (CSRV_RATE_LIMIT_WAYS * sizeof(struct CsrvRateSlot) + 1);
+  void *map = mmap(NULL, limit->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(map == MAP_FAILED) {
+    free(limit);
+    return -1;
+  }
+
+  limit->slots = (struct CsrvRateSlot *) map;
+  limit->hands = (uint8_t *) (limit->slots + limit->n_sets * CSRV_RATE_LIMIT_WAYS);
+  limit->rate = csrv->rate_limit;
+  limit->burst = csrv->rate_burst != 0 ? csrv->rate_burst : csrv->rate_limit;
+  if(limit->burst > CSRV_RATE_BURST_MAX) {
+    limit->burst = CSRV_RATE_BURST_MAX;
+  }
+  limit->epoch = csrv_now_ms();
+
+  csrv->limiter = limit;
+  CSRV_LOG_INFO(csrv, "rate limiting clients to %u/s (burst %u) in %zu slots",
+                limit->rate, limit->burst, limit->n_sets * CSRV_RATE_LIMIT_WAYS);
+  return 0;
+}
+
+void csrv_rate_limit_cleanup(struct Csrv *csrv) {
+  if(csrv->limiter == NULL) {
+    return;
+  }
+
+  munmap(csrv->limiter->slots, csrv->limiter->map_size);
+  free(csrv->limiter);
+  csrv->limiter = NULL;
+}
+
+// The bucket key for a client address, 0 for ones that aren't limited (Unix
+// sockets). IPv6 clients are keyed by their /64, since that is what a
+// single subscriber gets to pick addresses from.
+uint64_t csrv_rate_limit_key(const struct sockaddr *addr) {
+  if(addr->sa_family == AF_INET) {
+    const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+    return (uint64_t) 1 << 32 | in->sin_addr.s_addr;
+  }
+
+  if(addr->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+    const uint8_t *bytes = in6->sin6_addr.s6_addr;
+    if(IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+      uint32_t v4;
+      memcpy(&v4, bytes + 12, sizeof(v4));
+      return (uint64_t) 1 << 32 | v4;
+    }
+
+    uint64_t prefix;
+    memcpy(&prefix, bytes, sizeof(prefix));
+    // Never 0, and never mistaken for an IPv4 key
+    return csrv_rate_limit_mix(prefix) | (uint64_t) 1 << 63;
+  }
+
+  return 0;
+}
+
+// The key for whoever is on the other end of a connected socket
+uint64_t csrv_rate_limit_peer(int sock_handle) {
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  if(getpeername(sock_handle, (struct sockaddr *) &addr, &addr_len) != 0) {
+    return 0;
+  }
+  return csrv_rate_limit_key((struct sockaddr *) &addr);
+}
+
+// Called on every accepted connection: one that is over its client's limit
+// gets the 429 (if the socket takes it at once) and is closed. Returns
+// whether the connection may be served.
+bool csrv_rate_limit_accept(struct Csrv *csrv, int sock_handle, const struct sockaddr *addr) {
+  if(csrv->limiter == NULL || csrv_rate_limit_take(csrv->limiter, csrv_rate_limit_key(addr))) {
+    return true;
+  }
+
+  CSRV_LOG_INFO(csrv, "rate limited connection on socket handle %d", sock_handle);
+  send(sock_handle, CSRV_RATE_LIMIT_RESPONSE, sizeof(CSRV_RATE_LIMIT_RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+  // Closing with unread data makes TCP send a reset, which can overtake the
+  // 429 and have the client discard it. So the FIN goes out behind the 429
+  // first, and whatever the client has already sent is read away. A request
+  // that only arrives after the close still gets the reset, but by then the
+  // answer is ahead of it. Nothing here may wait: this runs on the accept
+  // path.
+  shutdown(sock_handle, SHUT_WR);
+  char discard[4096];
+  for(int i = 0; i < CSRV_RATE_LIMIT_DRAIN; i++) {
+    if(recv(sock_handle, discard, sizeof(discard), MSG_DONTWAIT) <= 0) {
+      break;
+    }
+  }
+  close(sock_handle);
+  return false;
+}
+
+// Give key a slot in its set. The set's clock hand sweeps its ways: a slot
+// used since the hand last passed gets a second chance, the first one that
+// wasn't is taken over with a full bucket.
+static struct CsrvRateSlot *csrv_rate_limit_claim(struct CsrvRateSlot *set, uint8_t *hand, uint64_t key) {
+  for(int step = 0; step < 2 * CSRV_RATE_LIMIT_WAYS; step++) {
+    struct CsrvRateSlot *slot = &set[__atomic_fetch_add(hand, 1, __ATOMIC_RELAXED) % CSRV_RATE_LIMIT_WAYS];
+    uint64_t old_key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+    if(old_key != 0 && __atomic_load_n(&slot->referenced, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&slot->referenced, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    // Whoever loses the race for the slot (or the same client arriving
+    // twice at once) just tries the next one. The bucket is reset only if
+    // it still holds what the evicted client left: once the new client has
+    // taken a token, storing a full bucket would hand that token back.
+    uint64_t old_state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if(__atomic_compare_exchange_n(&slot->key, &old_key, key, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      __atomic_compare_exchange_n(&slot->state, &old_state, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+      return slot;
+    }
+  }
+
+  return NULL;
+}
+
+// Take one token from the client's bucket; false if it has none left. Lock
+// free: a few loads across the set, then a compare-and-swap on the bucket.
+// Clients that lose a slot race are let through rather than delayed.
+bool csrv_rate_limit_take(struct CsrvRateLimit *limit, uint64_t key) {
+  if(key == 0) {
+    return true;
+  }
+
+  size_t set_index = csrv_rate_limit_mix(key) & (limit->n_sets - 1);
+  struct CsrvRateSlot *set = &limit->slots[set_index * CSRV_RATE_LIMIT_WAYS];
+  uint32_t now = (uint32_t) (csrv_now_ms() - limit->epoch);
+
+  struct CsrvRateSlot *slot = NULL;
+  for(int i = 0; i < CSRV_RATE_LIMIT_WAYS; i++) {
+    if(__atomic_load_n(&set[i].key, __ATOMIC_ACQUIRE) == key) {
+      slot = &set[i];
+      break;
+    }
+  }
+
+  if(slot == NULL) {
+    slot = csrv_rate_limit_claim(set, &limit->hands[set_index], key);
+    if(slot == NULL) {
+      return true;
+    }
+  }
+
+  // Only write the flag when it changes, to keep the line shared
+  if(!__atomic_load_n(&slot->referenced, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&slot->referenced, 1, __ATOMIC_RELAXED);
+  }
+
+  uint64_t capacity = (uint64_t) limit->burst * 1000;
+  uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+  for(;;) {
+    uint32_t last = (uint32_t) (state >> 32);
+    int32_t elapsed = (int32_t) (now - last);
+    uint32_t stamp = now;
+    uint64_t tokens = CSRV_RATE_TOKENS(state);
+    if(state == 0 || elapsed < -CSRV_RATE_SKEW_MS) {
+      tokens = capacity;
+    } else if(elapsed < 0) {
+      // Another worker got here with a later clock: nothing to refill, and
+      // its time must not be moved back
+      stamp = last;
+    } else {
+      tokens += (uint64_t) elapsed * limit->rate;
+    }
+    if(tokens > capacity) {
+      tokens = capacity;
+    }
+
+    bool allowed = tokens >= 1000;
+    if(allowed) {
+      tokens -= 1000;
+    }
+
+    if(__atomic_compare_exchange_n(&slot->state, &state, CSRV_RATE_STATE(stamp, tokens), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return allowed;
+    }
+  }
+}
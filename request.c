@@ -24,9 +24,21 @@ struct CsrvRequest *csrv_alloc_request(struct Csrv *csrv, int new_socket_handle)
   req->csrv = csrv;
   req->socket_handle = new_socket_handle;
   req->status = CSRV_OK;
-  req->id = csrv->request_id_max++;
-  
-  csrv->active_requests++;
+
+  // Allocated up front so bytes left over from a pipelined request can be
+  // carried in before the headers are read
+  if(csrv_str_vec_init(&req->request) != 0) {
+    csrv->status = CSRV_ALLOC_FAILURE;
+    CSRV_LOG_ERROR(csrv, "error while allocating str vec, errno=%s", strerror(errno));
+    free(req);
+    return NULL;
+  }
+  // Workers share the Csrv, so the counters are bumped atomically
+  req->id = __atomic_fetch_add(&csrv->request_id_max, 1, __ATOMIC_RELAXED);
+  req->traced = csrv_trace_sampled(csrv, req->id);
+  req->trace_start = CSRV_TRACE_START(req);
+
+  __atomic_add_fetch(&csrv->active_requests, 1, __ATOMIC_RELAXED);
   csrv->status = CSRV_OK;
   return req;
 }
@@ -35,55 +47,85 @@ void csrv_cleanup_request(struct CsrvRequest *req) {
   CSRV_LOG_INFO(req->csrv, "enter csrv_cleanup_request()");
 
   struct Csrv *csrv = req->csrv;
-  csrv->active_requests--;
+  __atomic_sub_fetch(&csrv->active_requests, 1, __ATOMIC_RELAXED);
+  CSRV_TRACE_END(req, "request", req->trace_start);
+
+  // Event workers serve many requests per process, so nothing can be left
+  // for process exit to clean up
+  if(req->headers.header_map.hashmap != NULL) {
+    csrv_str_map_cleanup(&req->headers.header_map);
+  }
+  for(size_t i = 0; i < CSRV_HEADER_COUNT; i++) {
+    free(req->headers.known[i]);
+  }
+  free(req->headers.method);
+  free(req->headers.uri);
+  free(req->headers.proto);
+  free(req->request.string);
   free(req);
   csrv->status = CSRV_OK;
 }
 
+// Read from the client, through the connection's output queue when there is
+// one so that pending zerocopy completions are collected while waiting
+static ssize_t csrv_request_read(struct CsrvRequest *req, void *buffer, size_t sz) {
+  if(req->out != NULL) {
+    return csrv_out_read(req->out, buffer, sz);
+  }
+  return csrv_io_read(req->socket_handle, buffer, sz);
+}
+
 int csrv_read_header_chunk(struct CsrvRequest *req) {
   CSRV_LOG_INFO(req->csrv, "enter csrv_read_header_chunk()");
-  char *buffer = (char *) malloc(CSRV_CHUNK_SIZE);
-  size_t buffer_offs = 0;
-  size_t n_tries = 0;
-  bool done = false;
-  
-  if(csrv_str_vec_init(&req->request) != 0) {
-    CSRV_LOG_ERROR(req->csrv, "error while allocating str vec, errno=%s", strerror(errno));
-    return -1;
-  }
+  // Anything carried over from the previous request may already hold the headers
+  size_t buffer_offs = req->request.length;
+  bool done = buffer_offs > 0 && csrv_probe_header_end(req, 0);
   
   if(csrv_str_map_init(&req->headers.header_map) != 0) {
     CSRV_LOG_ERROR(req->csrv, "error while allocating str map, errno=%s", strerror(errno));
     return -1;
   }
+
+  char *buffer = (char *) malloc(req->csrv->read_buffer_size);
+  if(buffer == NULL) {
+    req->status = CSRV_ALLOC_FAILURE;
+    return -1;
+  }
   
   // Read enough data to read the headers
   while(!done) {
     // 1. Read a chunk out of the buffer
     CSRV_LOG_INFO(req->csrv, "csrv_parse_headers(): read loop");
-    ssize_t sz_read = read(req->socket_handle, buffer, CSRV_CHUNK_SIZE);
+    // Parks this coroutine (or poll()s, outside the event model) on EAGAIN
+    uint64_t read_start = CSRV_TRACE_START(req);
+    ssize_t sz_read = csrv_request_read(req, buffer, req->csrv->read_buffer_size);
+    // An idle keep-alive connection going away (or timing out) before
+    // sending anything is a normal close, not a failed request
+    if(sz_read <= 0 && buffer_offs == 0) {
+      req->status = CSRV_CONNECTION_CLOSED;
+      req->traced = false;
+      free(buffer);
+      return -1;
+    }
+    // The first read also waits for the client (or an idle keep-alive) to send
+    CSRV_TRACE_END(req, buffer_offs == 0 ? "wait" : "read", read_start);
+
     if(sz_read == -1) {
       CSRV_LOG_ERROR(req->csrv, "error during read from socket, errno=%s", strerror(errno));
-      if(errno == EAGAIN) {
-        n_tries++;
-        if(n_tries > CSRV_MAX_EAGAIN_TRIES) {
-          CSRV_LOG_ERROR(req->csrv, "could not read resource after %zu tries, aborting", n_tries);
-          req->status = CSRV_RETRY_EXCEEDED;
-          return -1;
-        }
-        continue;
-      }
-
-      req->status = CSRV_HEADER_PARSE_FAILURE;
+      req->status = errno == ETIMEDOUT ? CSRV_RETRY_EXCEEDED : CSRV_HEADER_PARSE_FAILURE;
       free(buffer);
       return -1;
     }
     
-    // read() returns 0 on EOF
+    // read() returns 0 on EOF, which is an error before the headers are done
     if(sz_read == 0) {
-      break;
+      req->status = CSRV_HEADER_PARSE_FAILURE;
+      free(buffer);
+      return -1;
     }
     
+    csrv_coro_set_idle(false);
+
     // 2. Write the chunk back to the string vector
     if(csrv_str_vec_pushn(&req->request, buffer, sz_read) != 0) {
       CSRV_LOG_ERROR(req->csrv, "error during csrv_str_vec_pushn(), errno=%d", errno);
@@ -101,8 +143,10 @@ int csrv_read_header_chunk(struct CsrvRequest *req) {
   return 0;
 }
 
+// Look for the first \r\n\r\n that ends in the chunk starting at buffer_offs
 bool csrv_probe_header_end(struct CsrvRequest *req, ssize_t buffer_offs) {
-  for(ssize_t i = req->request.length; i - 4 > buffer_offs; i--) {
+  ssize_t start = buffer_offs > 3 ? buffer_offs : 3;
+  for(ssize_t i = start; i < (ssize_t) req->request.length; i++) {
     char* section = &req->request.string[i - 3];
     if(strncmp(section, "\r\n\r\n", 4) == 0) {
       req->body_offset = i;
@@ -119,18 +163,21 @@ void csrv_parse_headers(struct CsrvRequest *req) {
   if(csrv_read_header_chunk(req) != 0) {
     return;
   }
+  uint64_t parse_start = CSRV_TRACE_START(req);
   
+  // A header's name is ours from the ':' until its value is stored
+  char *key = NULL;
+  char *value;
   struct CsrvStrVec vec;
   if(csrv_str_vec_init(&vec) != 0) {
     // Adding a label for goto -- removes a little bit of boilerplate
   parse_alloc_fail:
     CSRV_LOG_ERROR(req->csrv, "error while allocating (header level), errno=%s", strerror(errno));
     req->status = CSRV_ALLOC_FAILURE;
+    free(key);
     return;
   }
-  
-  char *key;
-  char *value;
+
   enum CsrvHeaderParseState state = CSRV_HEADER_PARSE_METHOD;
   // Individually parse out headers
   for(size_t i = 0; i < req->body_offset; i++) {
@@ -151,6 +198,23 @@ void csrv_parse_headers(struct CsrvRequest *req) {
 
     if(current == '\r' || current == '\n') {
       switch(state) {
+        // A status line may omit the reason phrase, e.g. "HTTP/1.1 204"
+        case CSRV_HEADER_PARSE_URI:
+          req->headers.uri = csrv_str_vec_value(&vec);
+          if(req->headers.uri == NULL) {
+            goto parse_alloc_fail;
+          }
+          if(csrv_str_vec_init(&vec) != 0) {
+            goto parse_alloc_fail;
+          }
+          // fallthrough
+        case CSRV_HEADER_PARSE_AFTER_URI:
+          req->headers.proto = strdup("");
+          if(req->headers.proto == NULL) {
+            goto parse_alloc_fail;
+          }
+          state = CSRV_HEADER_PARSE_RETURN;
+          break;
         case CSRV_HEADER_PARSE_PROTO:
           req->headers.proto = csrv_str_vec_value(&vec);
           if(req->headers.proto == NULL) {
@@ -166,8 +230,32 @@ void csrv_parse_headers(struct CsrvRequest *req) {
           if(value == NULL) {
             goto parse_alloc_fail;
           }
-          csrv_str_map_add(&req->headers.header_map, key, value);
-          free(key);
+          // Well-known headers go straight to their slot; a repeat of one
+          // falls through to the map like any other header, except for
+          // Content-Length: lengths that differ leave the body's end
+          // ambiguous (RFC 9112 6.3), and an equal one adds nothing
+          int known = csrv_header_lookup(key, strlen(key));
+          if(known == CSRV_HEADER_CONTENT_LENGTH && req->headers.known[known] != NULL) {
+            size_t first_size;
+            size_t size;
+            bool same = csrv_parse_size(req->headers.known[known], &first_size) == 0
+              && csrv_parse_size(value, &size) == 0 && size == first_size;
+            free(key);
+            key = NULL;
+            free(value);
+            if(!same) {
+              CSRV_LOG_ERROR(req->csrv, "conflicting Content-Length headers");
+              req->status = CSRV_HEADER_PARSE_FAILURE;
+              return;
+            }
+          } else if(known >= 0 && req->headers.known[known] == NULL) {
+            req->headers.known[known] = value;
+            free(key);
+          } else {
+            // The map takes ownership of both key and value
+            csrv_str_map_add(&req->headers.header_map, key, value);
+          }
+          key = NULL;
           if(csrv_str_vec_init(&vec) != 0) {
             goto parse_alloc_fail;
           }
@@ -203,6 +291,8 @@ void csrv_parse_headers(struct CsrvRequest *req) {
           }
           state = CSRV_HEADER_PARSE_AFTER_URI;
           break;
+        // Reason phrases in a status line ("404 Not Found") contain spaces
+        case CSRV_HEADER_PARSE_PROTO:
         case CSRV_HEADER_PARSE_VALUE:
           if(csrv_str_vec_pushc(&vec, current) != 0) {
             goto parse_alloc_fail;
@@ -262,28 +352,116 @@ void csrv_parse_headers(struct CsrvRequest *req) {
   parse_error:
     CSRV_LOG_ERROR(req->csrv, "unhandled char='%c' and state=%d during parse", current, state);
     req->status = CSRV_HEADER_PARSE_FAILURE;
+    free(vec.string);
+    free(key);
     return;
   }
+  free(vec.string);
   
   if(csrv_set_request_meta(req) != 0) {
-    goto parse_alloc_fail;
+    CSRV_LOG_ERROR(req->csrv, "invalid Content-Length: %s", req->headers.known[CSRV_HEADER_CONTENT_LENGTH]);
+    req->status = CSRV_HEADER_PARSE_FAILURE;
+    return;
   }
 
   req->status = CSRV_OK;
+  CSRV_TRACE_END(req, "parse", parse_start);
 }
 
 int csrv_set_request_meta(struct CsrvRequest *req) {
-  char* len = csrv_str_map_get(&req->headers.header_map, "Content-Length");
+  struct CsrvRequestHeader *headers = &req->headers;
+  headers->host = headers->known[CSRV_HEADER_HOST];
+
+  // HTTP/1.1 defaults to keep-alive, HTTP/1.0 has to ask for it
+  char *connection = headers->known[CSRV_HEADER_CONNECTION];
+  req->keep_alive = strcmp(headers->proto, "HTTP/1.0") != 0;
+  if(connection != NULL && strcasestr(connection, "close") != NULL) {
+    req->keep_alive = false;
+  } else if(connection != NULL && strcasestr(connection, "keep-alive") != NULL) {
+    req->keep_alive = true;
+  }
+
+  char *encoding = headers->known[CSRV_HEADER_TRANSFER_ENCODING];
+  headers->chunked = encoding != NULL && strcasestr(encoding, "chunked") != NULL;
+
+  // Chunked request bodies aren't supported, so there is no telling where
+  // the next request on this connection would start
+  if(encoding != NULL) {
+    req->keep_alive = false;
+  }
+
+  char *len = headers->known[CSRV_HEADER_CONTENT_LENGTH];
+  headers->content_size = 0;
+  headers->has_content_length = len != NULL;
   if(len == NULL) {
-    req->headers.content_size = 0;
     return 0;
   }
   
-  if(sscanf(len, "%zu", &req->headers.content_size) != 1) {
-    req->headers.content_size = 0;
+  if(csrv_parse_size(len, &headers->content_size) != 0) {
+    headers->content_size = 0;
     return -1;
   }
 
   return 0;
 }
 
+// Read up to sz bytes of the body: first whatever arrived along with the
+// headers, then straight from the socket. Returns 0 once content_size bytes
+// have been read (on HTTP/2, once the stream ends).
+ssize_t csrv_read_body(struct CsrvRequest *req, char *buffer, size_t sz) {
+  if(req->stream != NULL) {
+    return csrv_h2_read_body(req, buffer, sz);
+  }
+
+  size_t remaining = req->headers.content_size - req->body_read;
+  if(remaining == 0) {
+    return 0;
+  }
+  if(sz > remaining) {
+    sz = remaining;
+  }
+
+  size_t body_start = req->body_offset + 1;
+  size_t buffered = req->request.length - body_start;
+  if(req->body_read < buffered) {
+    size_t n = buffered - req->body_read;
+    if(n > sz) {
+      n = sz;
+    }
+    memcpy(buffer, &req->request.string[body_start + req->body_read], n);
+    req->body_read += n;
+    return n;
+  }
+
+  uint64_t read_start = CSRV_TRACE_START(req);
+  ssize_t sz_read = csrv_request_read(req, buffer, sz);
+  CSRV_TRACE_END(req, "read", read_start);
+  if(sz_read == 0) {
+    // The peer hung up mid-body
+    errno = ECONNRESET;
+    return -1;
+  }
+  if(sz_read > 0) {
+    req->body_read += sz_read;
+  }
+  return sz_read;
+}
+
+// Skip whatever the handler didn't read so the next request can be parsed
+int csrv_drain_body(struct CsrvRequest *req) {
+  char buffer[CSRV_CHUNK_SIZE];
+  ssize_t sz_read;
+  while((sz_read = csrv_read_body(req, buffer, sizeof(buffer))) > 0);
+  return sz_read == 0 ? 0 : -1;
+}
+
+// Move bytes that were read past the end of this request (pipelining) into
+// the next one. Only valid once the body has been drained.
+int csrv_request_carry(struct CsrvRequest *from, struct CsrvRequest *to) {
+  size_t end = from->body_offset + 1 + from->headers.content_size;
+  if(end >= from->request.length) {
+    return 0;
+  }
+
+  return csrv_str_vec_pushn(&to->request, &from->request.string[end], from->request.length - end);
+}
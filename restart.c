@@ -0,0 +1,337 @@
+#include "sys/types.h"
+#include "sys/socket.h"
+#include "sys/prctl.h"
+#include "string.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "poll.h"
+#include "signal.h"
+#include "limits.h"
+#include "csrv.h"
+
+extern char **environ;
+
+// SIGUSR2 in the listening process: hand off and drain
+static volatile sig_atomic_t csrv_restart_signalled = 0;
+// SIGUSR2 in a forked child: the listening process is gone, stop keep-alive
+static volatile sig_atomic_t csrv_drain_signalled = 0;
+
+// What the new process is started from, resolved at startup: argv[0] may be
+// a name that was looked up in PATH, and /proc/self/exe itself would keep
+// pointing at the old binary once a new one is installed over it
+static char csrv_restart_exe[PATH_MAX];
+
+// Set while a handoff waits for its new process, which is this one
+static bool csrv_handoff_running = false;
+static int csrv_handoff_pid = -1;
+
+// How long a forked child may take to drain once signalled, in seconds
+static unsigned int csrv_drain_child_timeout_s = 0;
+
+static void csrv_restart_signal(int sig) {
+  csrv_restart_signalled = 1;
+}
+
+static void csrv_drain_signal(int sig) {
+  csrv_drain_signalled = 1;
+  alarm(csrv_drain_child_timeout_s);
+}
+
+// A forked child that is still draining at its deadline drops its connection
+static void csrv_drain_expired(int sig) {
+  _exit(0);
+}
+
+void csrv_restart_install(struct Csrv *csrv) {
+  if(csrv->argv == NULL) {
+    return;
+  }
+
+  ssize_t exe_len = readlink("/proc/self/exe", csrv_restart_exe, sizeof(csrv_restart_exe) - 1);
+  if(exe_len <= 0) {
+    CSRV_LOG_ERROR(csrv, "readlink(/proc/self/exe) failed with errno=%s, restarting as %s", strerror(errno), csrv->argv[0]);
+    snprintf(csrv_restart_exe, sizeof(csrv_restart_exe), "%s", csrv->argv[0]);
+  } else {
+    csrv_restart_exe[exe_len] = '\0';
+  }
+
+  // No SA_RESTART: poll()/epoll_wait() return EINTR so the restart starts
+  // right away instead of at the next timeout
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = csrv_restart_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR2, &sa, NULL);
+  CSRV_LOG_INFO(csrv, "graceful restart enabled, send SIGUSR2 to pid %d", getpid());
+}
+
+// True once per SIGUSR2; whoever sees it performs the handoff
+bool csrv_restart_pending(void) {
+  return __atomic_exchange_n(&csrv_restart_signalled, 0, __ATOMIC_ACQ_REL) != 0;
+}
+
+// All listeners go in one message, in configuration order
+static int csrv_handoff_send(int channel, struct Csrv *csrv) {
+  char data = 'L';
+  struct iovec iov;
+  iov.iov_base = &data;
+  iov.iov_len = 1;
+
+  union {
+    char buffer[CMSG_SPACE(sizeof(int) * CSRV_LISTENERS_MAX)];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * csrv->n_listeners);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * csrv->n_listeners);
+  for(size_t i = 0; i < csrv->n_listeners; i++) {
+    memcpy(CMSG_DATA(cmsg) + sizeof(int) * i, &csrv->listeners[i].socket_handle, sizeof(int));
+  }
+
+  return sendmsg(channel, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// Copy of environ pointing the new process at its end of the channel. Built
+// before fork(), since a forked child of a threaded process can't malloc().
+static char **csrv_handoff_env(int channel) {
+  size_t n_env = 0;
+  while(environ[n_env] != NULL) {
+    n_env++;
+  }
+
+  char **envp = (char **) malloc(sizeof(char *) * (n_env + 2));
+  char *entry = (char *) malloc(sizeof(CSRV_HANDOFF_ENV) + 16);
+  if(envp == NULL || entry == NULL) {
+    free(envp);
+    free(entry);
+    return NULL;
+  }
+
+  size_t prefix_len = strlen(CSRV_HANDOFF_ENV "=");
+  size_t j = 0;
+  for(size_t i = 0; i < n_env; i++) {
+    if(strncmp(environ[i], CSRV_HANDOFF_ENV "=", prefix_len) != 0) {
+      envp[j++] = environ[i];
+    }
+  }
+
+  snprintf(entry, sizeof(CSRV_HANDOFF_ENV) + 16, "%s=%d", CSRV_HANDOFF_ENV, channel);
+  envp[j++] = entry;
+  envp[j] = NULL;
+  return envp;
+}
+
+// Start csrv->argv as a new process and pass it the listening sockets over a
+// Unix socket with SCM_RIGHTS. The listeners are never closed, so the accept
+// backlogs carry over and no connection is refused. Returns the channel the
+// new process acknowledges on, for the caller to wait on while it keeps
+// accepting, then hand to csrv_handoff_end(); -1 if no handoff was started.
+int csrv_handoff_begin(struct Csrv *csrv) {
+  CSRV_LOG_INFO(csrv, "enter csrv_handoff_begin()");
+
+  // Another SIGUSR2 while one is under way must not start a second process
+  if(__atomic_exchange_n(&csrv_handoff_running, true, __ATOMIC_ACQ_REL)) {
+    CSRV_LOG_ERROR(csrv, "a handoff is already in progress");
+    return -1;
+  }
+
+  int channel[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) != 0) {
+    CSRV_LOG_ERROR(csrv, "socketpair() failed with errno=%s", strerror(errno));
+    __atomic_store_n(&csrv_handoff_running, false, __ATOMIC_RELEASE);
+    return -1;
+  }
+
+  char **envp = csrv_handoff_env(channel[1]);
+  if(envp == NULL) {
+    CSRV_LOG_ERROR(csrv, "failed to build handoff environment");
+    close(channel[0]);
+    close(channel[1]);
+    __atomic_store_n(&csrv_handoff_running, false, __ATOMIC_RELEASE);
+    return -1;
+  }
+
+  // Anything still buffered would otherwise be written twice
+  fflush(csrv->log);
+  int pid = fork();
+  if(pid == 0) {
+    // Only the child's end of the channel survives the exec
+    fcntl(channel[1], F_SETFD, 0);
+    execve(csrv_restart_exe, csrv->argv, envp);
+    _exit(127);
+  }
+
+  // Our own entry is the last one, the rest belong to environ
+  size_t last = 0;
+  while(envp[last + 1] != NULL) {
+    last++;
+  }
+  free(envp[last]);
+  free(envp);
+
+  close(channel[1]);
+  if(pid == -1) {
+    CSRV_LOG_ERROR(csrv, "fork() failed with errno=%s", strerror(errno));
+    close(channel[0]);
+    __atomic_store_n(&csrv_handoff_running, false, __ATOMIC_RELEASE);
+    return -1;
+  }
+
+  CSRV_LOG_INFO(csrv, "started %s as pid %d", csrv_restart_exe, pid);
+  csrv_handoff_pid = pid;
+  if(csrv_handoff_send(channel[0], csrv) != 0) {
+    CSRV_LOG_ERROR(csrv, "failed to send listeners, errno=%s", strerror(errno));
+    close(channel[0]);
+    __atomic_store_n(&csrv_handoff_running, false, __ATOMIC_RELEASE);
+    return -1;
+  }
+  return channel[0];
+}
+
+// Read the acknowledgement once the channel is readable, or give up on the
+// new process if it isn't (ready false: CSRV_HANDOFF_TIMEOUT_MS went by).
+// Returns 0 if the new process has the listeners; the caller should drain.
+int csrv_handoff_end(struct Csrv *csrv, int channel, bool ready) {
+  char ack;
+  int result = 0;
+  if(!ready || read(channel, &ack, 1) != 1) {
+    CSRV_LOG_ERROR(csrv, "pid %d never acknowledged the handoff", csrv_handoff_pid);
+    result = -1;
+  } else {
+    CSRV_LOG_INFO(csrv, "listeners handed off to pid %d", csrv_handoff_pid);
+  }
+
+  close(channel);
+  __atomic_store_n(&csrv_handoff_running, false, __ATOMIC_RELEASE);
+  return result;
+}
+
+// The whole handoff from a coroutine, whose loop keeps accepting while it
+// waits. Outside a loop the wait blocks.
+int csrv_handoff_start(struct Csrv *csrv) {
+  int channel = csrv_handoff_begin(csrv);
+  if(channel == -1) {
+    return -1;
+  }
+  return csrv_handoff_end(csrv, channel, csrv_coro_wait(channel, POLLIN, CSRV_HANDOFF_TIMEOUT_MS) == 0);
+}
+
+// Returns 1 if we were started by csrv_handoff_start() and now own its
+// listeners, 0 for a normal start, -1 if the handoff failed. The listeners
+// are matched up by position, so both processes need the same listen list.
+int csrv_handoff_receive(struct Csrv *csrv) {
+  char *env = getenv(CSRV_HANDOFF_ENV);
+  if(env == NULL) {
+    return 0;
+  }
+
+  int channel = atoi(env);
+  unsetenv(CSRV_HANDOFF_ENV);
+  fcntl(channel, F_SETFD, FD_CLOEXEC);
+
+  char data;
+  struct iovec iov;
+  iov.iov_base = &data;
+  iov.iov_len = 1;
+
+  union {
+    char buffer[CMSG_SPACE(sizeof(int) * CSRV_LISTENERS_MAX)];
+    struct cmsghdr align;
+  } control;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  if(recvmsg(channel, &msg, MSG_CMSG_CLOEXEC) != 1) {
+    CSRV_LOG_ERROR(csrv, "recvmsg() on handoff channel failed with errno=%s", strerror(errno));
+    close(channel);
+    return -1;
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    CSRV_LOG_ERROR(csrv, "handoff message carried no descriptor");
+    close(channel);
+    return -1;
+  }
+
+  size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  int fds[CSRV_LISTENERS_MAX];
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n_fds);
+
+  // No ack: the old process keeps serving rather than handing over to a
+  // process with a different set of listeners
+  if(n_fds != csrv->n_listeners) {
+    CSRV_LOG_ERROR(csrv, "handoff carried %zu listeners, %zu are configured", n_fds, csrv->n_listeners);
+    for(size_t i = 0; i < n_fds; i++) {
+      close(fds[i]);
+    }
+    close(channel);
+    return -1;
+  }
+
+  for(size_t i = 0; i < n_fds; i++) {
+    csrv->listeners[i].socket_handle = fds[i];
+    CSRV_LOG_INFO(csrv, "took over %s as handle %d", csrv->listeners[i].name, fds[i]);
+  }
+
+  if(write(channel, "1", 1) != 1) {
+    CSRV_LOG_ERROR(csrv, "failed to acknowledge handoff, errno=%s", strerror(errno));
+  }
+  close(channel);
+  return 1;
+}
+
+// Stop accepting and finish what's in flight, for at most drain_timeout_ms
+void csrv_drain_begin(struct Csrv *csrv) {
+  int timeout_ms = csrv->drain_timeout_ms > 0 ? csrv->drain_timeout_ms : CSRV_DRAIN_TIMEOUT_MS;
+  csrv->drain_deadline = csrv_now_ms() + timeout_ms;
+  __atomic_store_n(&csrv->draining, true, __ATOMIC_RELEASE);
+  CSRV_LOG_INFO(csrv, "draining, %zu requests in flight", csrv->active_requests);
+}
+
+// Forked children outlive the listening process. When it exits after a
+// handoff they get SIGUSR2, and close each connection after its current
+// request, or exit once drain_timeout_ms is up (SIGALRM) like an event
+// worker would. SA_RESTART so the signal doesn't fail reads already in
+// progress.
+void csrv_drain_child(struct Csrv *csrv, int parent_pid) {
+  int timeout_ms = csrv->drain_timeout_ms > 0 ? csrv->drain_timeout_ms : CSRV_DRAIN_TIMEOUT_MS;
+  csrv_drain_child_timeout_s = (timeout_ms + 999) / 1000;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = csrv_drain_expired;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGALRM, &sa, NULL);
+
+  sa.sa_handler = csrv_drain_signal;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &sa, NULL);
+
+  prctl(PR_SET_PDEATHSIG, SIGUSR2);
+  if(getppid() != parent_pid) {
+    csrv_drain_signal(SIGUSR2);
+  }
+}
+
+bool csrv_is_draining(struct Csrv *csrv) {
+  return __atomic_load_n(&csrv->draining, __ATOMIC_ACQUIRE) || csrv_drain_signalled;
+}
@@ -38,6 +38,9 @@ void csrv_str_map_add(struct CsrvStrMap *map, char *key, char *value) {
   if(map->hashmap[idx] != NULL) {
     map->n_collisions++;
     // TODO add error handler
+    // The map owns what it is given, so a rejected entry is freed here
+    free(key);
+    free(value);
     return;
   }
   map->hashmap[idx] = value;
@@ -39,6 +39,8 @@ int csrv_str_vec_pushn(struct CsrvStrVec *vec, char* buffer, size_t sz) {
     if(vec->string == NULL) {
       return -1;
     }
+
+    vec->buff_sz = new_sz;
   }
 
   memcpy(&vec->string[vec->length], buffer, sz);
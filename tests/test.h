@@ -0,0 +1,141 @@
+#ifndef CSRV_TEST_H
+#define CSRV_TEST_H
+
+#include "sys/types.h"
+#include "sys/socket.h"
+#include "string.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "poll.h"
+#include "pthread.h"
+#include "csrv.h"
+
+// Shared by the programs in tests/, one per area, each run by `make test`.
+// CHECK() reports a failure and carries on, so a run lists everything that
+// is broken; main() returns test_failures != 0.
+
+static int test_failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if(!(cond)) { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      test_failures++; \
+    } \
+  } while(0)
+
+// Decode hex (whitespace ignored) into out; returns the length
+static inline size_t test_hex(const char *hex, uint8_t *out, size_t out_size) {
+  size_t len = 0;
+  int half = -1;
+  for(; *hex != '\0'; hex++) {
+    int digit;
+    if(*hex >= '0' && *hex <= '9') {
+      digit = *hex - '0';
+    } else if(*hex >= 'a' && *hex <= 'f') {
+      digit = *hex - 'a' + 10;
+    } else {
+      continue;
+    }
+
+    if(half == -1) {
+      half = digit;
+    } else if(len < out_size) {
+      out[len++] = (uint8_t) (half << 4 | digit);
+      half = -1;
+    }
+  }
+  return len;
+}
+
+// A server with every default, for csrv_serve_connection()
+static inline void test_server(struct Csrv *csrv, csrv_handler_t handler) {
+  memset(csrv, 0, sizeof(*csrv));
+  csrv->model = CSRV_FORK;
+  csrv->log = fopen(getenv("CSRV_TEST_LOG") != NULL ? getenv("CSRV_TEST_LOG") : "/dev/null", "a");
+  csrv->handler = handler;
+  csrv_config_defaults(csrv);
+}
+
+struct TestConn {
+  struct Csrv *csrv;
+  int server_handle;
+};
+
+static inline void *test_conn_thread(void *arg) {
+  struct TestConn *conn = (struct TestConn *) arg;
+  csrv_serve_connection(conn->csrv, conn->server_handle);
+  return NULL;
+}
+
+// Serve one connection on a thread, the way a forked child does, and feed
+// it input. The client side then half-closes and collects everything the
+// server sent until it hung up. Returns -1 if the server didn't finish
+// within timeout_ms.
+static inline int test_exchange(struct Csrv *csrv, const void *input, size_t len, struct CsrvStrVec *output, int timeout_ms) {
+  int handles[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, handles) != 0) {
+    return -1;
+  }
+
+  struct TestConn conn = { csrv, handles[1] };
+  pthread_t thread;
+  if(pthread_create(&thread, NULL, test_conn_thread, &conn) != 0) {
+    close(handles[0]);
+    close(handles[1]);
+    return -1;
+  }
+
+  if(len == 0) {
+    shutdown(handles[0], SHUT_WR);
+  }
+
+  // Write and read at once, so neither side can block the other
+  const char *pending = (const char *) input;
+  bool done = false;
+  int res = 0;
+  while(!done) {
+    struct pollfd pfd;
+    pfd.fd = handles[0];
+    pfd.events = POLLIN | (len > 0 ? POLLOUT : 0);
+    if(poll(&pfd, 1, timeout_ms) <= 0) {
+      res = -1;
+      break;
+    }
+
+    if(len > 0 && (pfd.revents & POLLOUT)) {
+      ssize_t sz_sent = send(handles[0], pending, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if(sz_sent > 0) {
+        pending += sz_sent;
+        len -= sz_sent;
+      } else if(sz_sent < 0 && errno != EAGAIN) {
+        len = 0;
+      }
+      if(len == 0) {
+        shutdown(handles[0], SHUT_WR);
+      }
+    }
+
+    if(pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+      char buffer[4096];
+      ssize_t sz_read = recv(handles[0], buffer, sizeof(buffer), MSG_DONTWAIT);
+      if(sz_read > 0) {
+        csrv_str_vec_pushn(output, buffer, sz_read);
+      } else if(sz_read == 0 || errno != EAGAIN) {
+        done = true;
+      }
+    }
+  }
+
+  // A server that didn't finish is stopped by closing its socket under it
+  if(res != 0) {
+    shutdown(handles[0], SHUT_RDWR);
+  }
+  close(handles[0]);
+  pthread_join(thread, NULL);
+  return res;
+}
+
+#endif
@@ -0,0 +1,270 @@
+#include "sys/un.h"
+#include "dirent.h"
+#include "netinet/in.h"
+#include "arpa/inet.h"
+#include "test.h"
+
+// The config file parser and the listener address parser on their own: a
+// file with every key, repeated keys, one bad line of each kind, then
+// listener specs good and malformed. Config files are written to /tmp.
+
+static struct Csrv csrv;
+
+static void reset(void) {
+  for(size_t i = 0; i < csrv.n_listeners; i++) {
+    free(csrv.listeners[i].name);
+  }
+  free(csrv.listeners);
+  memset(&csrv, 0, sizeof(csrv));
+  csrv.log = fopen("/dev/null", "a");
+}
+
+// Write text to a fresh file; returns its path, to be freed and unlinked
+static char *write_file(const char *text) {
+  char *path = strdup("/tmp/csrv-test-XXXXXX");
+  int handle = mkstemp(path);
+  CHECK(handle != -1);
+  CHECK(write(handle, text, strlen(text)) == (ssize_t) strlen(text));
+  close(handle);
+  return path;
+}
+
+static int load(const char *text) {
+  char *path = write_file(text);
+  int res = csrv_config_load(&csrv, path);
+  unlink(path);
+  free(path);
+  return res;
+}
+
+static size_t file_size(const char *path) {
+  FILE *file = fopen(path, "r");
+  if(file == NULL) {
+    return 0;
+  }
+  fseek(file, 0, SEEK_END);
+  size_t size = (size_t) ftell(file);
+  fclose(file);
+  return size;
+}
+
+static int open_files(void) {
+  DIR *dir = opendir("/proc/self/fd");
+  int n = 0;
+  while(dir != NULL && readdir(dir) != NULL) {
+    n++;
+  }
+  closedir(dir);
+  return n;
+}
+
+static void check_valid(void) {
+  reset();
+  FILE *user_log = csrv.log;
+  CHECK(load(
+    "# a comment\n"
+    "\n"
+    "  model = event   # trailing comment\n"
+    "workers=3\n"
+    "stack_size = 128k\r\n"
+    "\tread_buffer = 512\n"
+    "proxy_buffer = 16k\n"
+    "multipart_buffer = 1m\n"
+    "drain_timeout_ms = 2500\n"
+    "trace_sample = 10\n"
+    "trace_file = first.json\n"
+    "trace_file = second.json\n"
+    "trace_interval_ms = 0\n"
+    "rate_limit = 50\n"
+    "rate_burst = 100\n"
+    "rate_limit_slots = 16k\n"
+    "zerocopy_min = 32k\n"
+    "port = 9090\n"
+    "listen = 127.0.0.1:8080 backlog=64 nodelay\n"
+    "listen = [::1]:8080 reuseport defer_accept=5 rcvbuf=4096 sndbuf=8192\n") == 0);
+  CHECK(csrv.status == CSRV_OK);
+  CHECK(csrv.log == user_log);
+  CHECK(csrv.model == CSRV_EVENT);
+  CHECK(csrv.n_workers == 3);
+  CHECK(csrv.stack_size == 128 * 1024);
+  CHECK(csrv.read_buffer_size == 512);
+  CHECK(csrv.proxy_buffer_size == 16 * 1024);
+  CHECK(csrv.multipart_buffer_size == 1024 * 1024);
+  CHECK(csrv.drain_timeout_ms == 2500);
+  CHECK(csrv.trace_sample == 10);
+  CHECK(csrv.trace_path != NULL && strcmp(csrv.trace_path, "second.json") == 0);
+  CHECK(csrv.trace_interval_ms == 0);
+  CHECK(csrv.rate_limit == 50 && csrv.rate_burst == 100);
+  CHECK(csrv.rate_limit_slots == 16 * 1024);
+  CHECK(csrv.zerocopy_min == 32 * 1024);
+  CHECK(csrv.port == 9090);
+
+  CHECK(csrv.n_listeners == 2);
+  if(csrv.n_listeners == 2) {
+    struct CsrvListener *v4 = &csrv.listeners[0];
+    struct sockaddr_in *in = (struct sockaddr_in *) &v4->addr;
+    CHECK(strcmp(v4->name, "127.0.0.1:8080") == 0);
+    CHECK(in->sin_family == AF_INET && ntohs(in->sin_port) == 8080);
+    CHECK(in->sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+    CHECK(v4->backlog == 64 && v4->no_delay && !v4->reuse_port);
+    CHECK(v4->socket_handle == -1);
+
+    struct CsrvListener *v6 = &csrv.listeners[1];
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &v6->addr;
+    CHECK(in6->sin6_family == AF_INET6 && ntohs(in6->sin6_port) == 8080);
+    CHECK(memcmp(&in6->sin6_addr, &in6addr_loopback, sizeof(in6addr_loopback)) == 0);
+    CHECK(v6->reuse_port && v6->defer_accept == 5);
+    CHECK(v6->rcvbuf == 4096 && v6->sndbuf == 8192);
+  }
+  free(csrv.trace_path);
+  fclose(csrv.log);
+
+  // The example that ships with the repo loads as is
+  reset();
+  CHECK(csrv_config_load(&csrv, "csrv.conf.example") == 0);
+  CHECK(csrv.n_listeners == 3);
+  fclose(csrv.log);
+}
+
+// A repeated log key closes the file the earlier one opened; the caller's
+// own log is left alone
+static void check_repeated_log(void) {
+  reset();
+  FILE *user_log = csrv.log;
+  int n_open = open_files();
+  char *first = write_file("");
+  char *second = write_file("");
+  char text[256];
+  snprintf(text, sizeof(text), "log = %s\nlog = %s\nlog = %s\nworkers = 0\n", first, first, second);
+  CHECK(load(text) == -1);
+  CHECK(csrv.log != user_log);
+  CHECK(open_files() == n_open + 1);
+  // Only the error about workers is logged, to the second file
+  fflush(csrv.log);
+  CHECK(file_size(first) == 0);
+  CHECK(file_size(second) > 0);
+  CHECK(fclose(user_log) == 0);
+  fclose(csrv.log);
+
+  unlink(first);
+  unlink(second);
+  free(first);
+  free(second);
+}
+
+static void check_invalid_file(const char *text) {
+  reset();
+  if(load(text) != -1 || csrv.status != CSRV_CONFIG_FAILURE) {
+    fprintf(stderr, "accepted: %s", text);
+    test_failures++;
+  }
+  fclose(csrv.log);
+}
+
+static void check_invalid(void) {
+  check_invalid_file("port = 70000\n");
+  check_invalid_file("port = -1\n");
+  check_invalid_file("port = http\n");
+  check_invalid_file("listen = 127.0.0.1:65536\n");
+  check_invalid_file("no_such_key = 1\n");
+  check_invalid_file("workers 4\n");
+  check_invalid_file("workers = 0\n");
+  check_invalid_file("model = threads\n");
+  check_invalid_file("stack_size = 12q\n");
+  check_invalid_file("proxy_buffer = 16\n");
+  check_invalid_file("drain_timeout_ms = 4294967296\n");
+  check_invalid_file("listen = 8080\nlisten = *:8080\n");
+  check_invalid_file("listen = unix:/tmp/csrv.sock\nlisten = unix:/tmp/csrv.sock mode=0600\n");
+
+  // Loading stops at the first bad line
+  reset();
+  CHECK(load("workers = 2\nworkers = zero\nworkers = 5\n") == -1);
+  CHECK(csrv.n_workers == 2);
+  fclose(csrv.log);
+
+  reset();
+  CHECK(csrv_config_load(&csrv, "/nonexistent/csrv.conf") == -1);
+  CHECK(csrv.status == CSRV_CONFIG_FAILURE);
+  fclose(csrv.log);
+}
+
+static void check_listeners(void) {
+  reset();
+  CHECK(csrv_add_listener(&csrv, "8080") == 0);
+  CHECK(csrv_add_listener(&csrv, "[::]:8080") == 0);
+  CHECK(csrv_add_listener(&csrv, "unix:/tmp/csrv-test.sock mode=0660") == 0);
+  CHECK(csrv_add_listener(&csrv, "127.0.0.1:8080\tbacklog=1") == 0);
+  CHECK(csrv.n_listeners == 4);
+  if(csrv.n_listeners == 4) {
+    struct sockaddr_in *any = (struct sockaddr_in *) &csrv.listeners[0].addr;
+    CHECK(any->sin_family == AF_INET && any->sin_addr.s_addr == htonl(INADDR_ANY));
+    struct sockaddr_un *un = (struct sockaddr_un *) &csrv.listeners[2].addr;
+    CHECK(un->sun_family == AF_UNIX && strcmp(un->sun_path, "/tmp/csrv-test.sock") == 0);
+    CHECK(csrv.listeners[2].mode == 0660);
+    CHECK(csrv.listeners[3].backlog == 1);
+  }
+
+  // The same address however it is written, with or without options
+  errno = 0;
+  CHECK(csrv_add_listener(&csrv, "*:8080 reuseport") == -1 && errno == EADDRINUSE);
+  errno = 0;
+  CHECK(csrv_add_listener(&csrv, "[0::0]:8080") == -1 && errno == EADDRINUSE);
+  errno = 0;
+  CHECK(csrv_add_listener(&csrv, "unix:/tmp/csrv-test.sock") == -1 && errno == EADDRINUSE);
+  CHECK(csrv.n_listeners == 4);
+
+  // Port 0 is a fresh port every time
+  CHECK(csrv_add_listener(&csrv, "127.0.0.1:0") == 0);
+  CHECK(csrv_add_listener(&csrv, "127.0.0.1:0") == 0);
+  CHECK(csrv_add_listener(&csrv, "8081") == 0);
+
+  const char *invalid[] = {
+    "",
+    "   ",
+    "http",
+    "70000",
+    "1.2.3:80",
+    "1.2.3.4.5:80",
+    "[::1:80",
+    "::1:80",
+    "[::1]",
+    "[nope]:80",
+    "127.0.0.1:",
+    "unix:",
+    "9000 backlog",
+    "9000 backlog=abc",
+    "9000 reuseport=1",
+    "9000 mode=9",
+    "9000 mode=",
+    "9000 fast",
+  };
+  for(size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    errno = 0;
+    if(csrv_add_listener(&csrv, (char *) invalid[i]) != -1 || errno != EINVAL) {
+      fprintf(stderr, "listener \"%s\" accepted\n", invalid[i]);
+      test_failures++;
+    }
+  }
+  CHECK(csrv.n_listeners == 7);
+
+  // The table is bounded
+  char spec[32];
+  for(unsigned int port = 10000; csrv.n_listeners < CSRV_LISTENERS_MAX; port++) {
+    snprintf(spec, sizeof(spec), "%u", port);
+    CHECK(csrv_add_listener(&csrv, spec) == 0);
+  }
+  errno = 0;
+  CHECK(csrv_add_listener(&csrv, "20000") == -1 && errno == E2BIG);
+  fclose(csrv.log);
+}
+
+int main(int argc, char **argv) {
+  check_valid();
+  check_repeated_log();
+  check_invalid();
+  check_listeners();
+
+  reset();
+  fclose(csrv.log);
+  return test_failures != 0;
+}
@@ -0,0 +1,324 @@
+#include "sys/epoll.h"
+#include "sys/resource.h"
+#include "sys/wait.h"
+#include "signal.h"
+#include "test.h"
+
+// Coroutines on a loop of our own, with no sockets and no loop thread: the
+// test plays the event loop, resuming, expiring and dispatching by hand
+
+static struct Csrv csrv;
+
+static void loop_init(struct CsrvLoop *loop) {
+  memset(loop, 0, sizeof(*loop));
+  loop->csrv = &csrv;
+  CHECK(csrv_stack_pool_init(&loop->stacks, 0) == 0);
+  loop->epoll_handle = epoll_create1(EPOLL_CLOEXEC);
+  CHECK(loop->epoll_handle != -1);
+}
+
+static void loop_cleanup(struct CsrvLoop *loop) {
+  CHECK(loop->n_coros == 0);
+  CHECK(loop->waiting == NULL);
+  CHECK(loop->ready == NULL);
+  close(loop->epoll_handle);
+  csrv_stack_pool_cleanup(&loop->stacks);
+}
+
+// A coroutine that parks once and records how the park ended
+struct Parker {
+  int timeout_ms;
+  bool idle;
+  struct CsrvCoro *coro;
+  int res;
+  int error;
+  bool done;
+  // Unparked as soon as this one's park ends
+  struct Parker *then_unpark;
+};
+
+static void parker_run(void *arg) {
+  struct Parker *parker = (struct Parker *) arg;
+  parker->coro = csrv_coro_self();
+  csrv_coro_set_idle(parker->idle);
+  parker->res = csrv_coro_park(parker->timeout_ms);
+  parker->error = errno;
+  if(parker->then_unpark != NULL && !parker->then_unpark->done) {
+    csrv_coro_unpark(parker->then_unpark->coro);
+  }
+  parker->done = true;
+}
+
+static void parker_spawn(struct CsrvLoop *loop, struct Parker *parker, int timeout_ms) {
+  memset(parker, 0, sizeof(*parker));
+  parker->timeout_ms = timeout_ms;
+  parker->res = 1;
+  CHECK(csrv_coro_spawn_task(loop, parker_run, parker) == 0);
+  CHECK(!parker->done);
+}
+
+static void check_park(void) {
+  struct CsrvLoop loop;
+  loop_init(&loop);
+
+  struct Parker parker;
+  parker_spawn(&loop, &parker, 60000);
+  CHECK(loop.n_coros == 1);
+  CHECK(loop.waiting == parker.coro);
+  CHECK(csrv_coro_self() == NULL);
+
+  // Unparking only queues it; the loop runs it
+  csrv_coro_unpark(parker.coro);
+  CHECK(!parker.done);
+  CHECK(loop.waiting == NULL);
+  CHECK(loop.ready == parker.coro);
+  // Twice is harmless
+  csrv_coro_unpark(parker.coro);
+  csrv_coro_run_ready(&loop);
+  CHECK(parker.done);
+  CHECK(parker.res == 0);
+
+  // Not from the loop's own stack
+  errno = 0;
+  CHECK(csrv_coro_park(1000) == -1 && errno == EINVAL);
+  CHECK(csrv_coro_start(parker_run, &parker) == NULL && errno == EINVAL);
+
+  loop_cleanup(&loop);
+}
+
+struct Starter {
+  struct Parker child;
+  bool child_ran_first;
+};
+
+static void starter_run(void *arg) {
+  struct Starter *starter = (struct Starter *) arg;
+  memset(&starter->child, 0, sizeof(starter->child));
+  starter->child.timeout_ms = 60000;
+  CHECK(csrv_coro_start(parker_run, &starter->child) != NULL);
+  starter->child_ran_first = starter->child.coro != NULL;
+}
+
+// A coroutine started from another one runs only once the loop gets to it
+static void check_start(void) {
+  struct CsrvLoop loop;
+  loop_init(&loop);
+
+  struct Starter starter;
+  CHECK(csrv_coro_spawn_task(&loop, starter_run, &starter) == 0);
+  CHECK(!starter.child_ran_first);
+  CHECK(starter.child.coro == NULL);
+  CHECK(loop.n_coros == 1);
+
+  csrv_coro_run_ready(&loop);
+  CHECK(starter.child.coro != NULL);
+  csrv_coro_unpark(starter.child.coro);
+  csrv_coro_run_ready(&loop);
+  CHECK(starter.child.done && starter.child.res == 0);
+
+  loop_cleanup(&loop);
+}
+
+static void check_deadlines(void) {
+  struct CsrvLoop loop;
+  loop_init(&loop);
+
+  struct Parker soon, later;
+  parker_spawn(&loop, &soon, 100);
+  parker_spawn(&loop, &later, 60000);
+
+  int64_t now = csrv_now_ms();
+  csrv_coro_expire(&loop, now);
+  CHECK(!soon.done && !later.done);
+
+  csrv_coro_expire(&loop, now + 1000);
+  CHECK(soon.done && soon.res == -1 && soon.error == ETIMEDOUT);
+  CHECK(!later.done);
+  CHECK(loop.waiting == later.coro);
+
+  csrv_coro_expire(&loop, now + 60000);
+  CHECK(later.done && later.res == -1 && later.error == ETIMEDOUT);
+
+  loop_cleanup(&loop);
+}
+
+// A coroutine woken by the sweep unparks the one the sweep visits next.
+// The waiting list is newest first, so first wakes second, then third.
+static void check_unpark_during_expire(void) {
+  struct CsrvLoop loop;
+  loop_init(&loop);
+
+  // second isn't due: it must be run once, unparked, and third still found
+  struct Parker first, second, third;
+  parker_spawn(&loop, &third, 0);
+  parker_spawn(&loop, &second, 60000);
+  parker_spawn(&loop, &first, 0);
+  first.then_unpark = &second;
+
+  csrv_coro_expire(&loop, csrv_now_ms());
+  CHECK(first.done && first.res == -1);
+  CHECK(second.done && second.res == 0);
+  CHECK(third.done && third.res == -1);
+  loop_cleanup(&loop);
+
+  // second is due as well: its wait fails, and it runs only once
+  loop_init(&loop);
+  parker_spawn(&loop, &third, 0);
+  parker_spawn(&loop, &second, 0);
+  parker_spawn(&loop, &first, 0);
+  first.then_unpark = &second;
+  second.then_unpark = &third;
+
+  csrv_coro_expire(&loop, csrv_now_ms());
+  CHECK(first.done && first.res == -1);
+  CHECK(second.done && second.res == -1);
+  CHECK(third.done && third.res == -1);
+  loop_cleanup(&loop);
+}
+
+// Waits on a pipe, like a keep-alive connection waiting for its next request
+struct Reader {
+  int fd;
+  bool idle;
+  int res;
+  int error;
+  bool done;
+};
+
+static void reader_run(void *arg) {
+  struct Reader *reader = (struct Reader *) arg;
+  csrv_coro_set_idle(reader->idle);
+  reader->res = csrv_coro_wait(reader->fd, POLLIN, 60000);
+  reader->error = errno;
+  reader->done = true;
+}
+
+// What the event loop does with a batch of events
+static void dispatch(struct CsrvLoop *loop) {
+  struct epoll_event events[8];
+  int n_events = epoll_wait(loop->epoll_handle, events, 8, 0);
+  for(int i = 0; i < n_events; i++) {
+    csrv_coro_wake((struct CsrvCoro *) events[i].data.ptr, false);
+  }
+  csrv_coro_run_ready(loop);
+}
+
+static void check_wake_idle(void) {
+  struct CsrvLoop loop;
+  loop_init(&loop);
+
+  int idle_pipe[2], busy_pipe[2];
+  CHECK(pipe(idle_pipe) == 0 && pipe(busy_pipe) == 0);
+
+  struct Reader idle_reader = { idle_pipe[0], true, 1, 0, false };
+  struct Reader busy_reader = { busy_pipe[0], false, 1, 0, false };
+  CHECK(csrv_coro_spawn_task(&loop, reader_run, &idle_reader) == 0);
+  CHECK(csrv_coro_spawn_task(&loop, reader_run, &busy_reader) == 0);
+  struct Parker idle_parker, busy_parker;
+  parker_spawn(&loop, &busy_parker, 60000);
+  memset(&idle_parker, 0, sizeof(idle_parker));
+  idle_parker.timeout_ms = 60000;
+  idle_parker.idle = true;
+  CHECK(csrv_coro_spawn_task(&loop, parker_run, &idle_parker) == 0);
+
+  csrv_coro_wake_idle(&loop);
+  CHECK(idle_reader.done && idle_reader.res == -1 && idle_reader.error == ETIMEDOUT);
+  CHECK(idle_parker.done && idle_parker.res == -1);
+  CHECK(!busy_reader.done && !busy_parker.done);
+  CHECK(loop.n_coros == 2);
+
+  // The idle reader's descriptor is disarmed: data on it wakes nobody
+  CHECK(write(idle_pipe[1], "x", 1) == 1);
+  dispatch(&loop);
+
+  CHECK(write(busy_pipe[1], "x", 1) == 1);
+  dispatch(&loop);
+  CHECK(busy_reader.done && busy_reader.res == 0);
+
+  csrv_coro_unpark(busy_parker.coro);
+  csrv_coro_run_ready(&loop);
+  CHECK(busy_parker.done && busy_parker.res == 0);
+
+  loop_cleanup(&loop);
+  close(idle_pipe[0]);
+  close(idle_pipe[1]);
+  close(busy_pipe[0]);
+  close(busy_pipe[1]);
+}
+
+// Does touching addr kill a child with SIGSEGV?
+static bool faults(volatile char *addr) {
+  pid_t pid = fork();
+  if(pid == 0) {
+    struct rlimit no_core = { 0, 0 };
+    setrlimit(RLIMIT_CORE, &no_core);
+    *addr = 1;
+    _exit(0);
+  }
+
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid);
+  return WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV;
+}
+
+static void check_stack_pool(void) {
+  struct CsrvStackPool pool;
+  CHECK(csrv_stack_pool_init(&pool, 1) == 0);
+  CHECK(pool.stack_size == pool.page_size);
+  csrv_stack_pool_cleanup(&pool);
+
+  CHECK(csrv_stack_pool_init(&pool, 0) == 0);
+  CHECK(pool.stack_size == CSRV_DEFAULT_STACK_SIZE);
+
+  // The page below the usable stack is the guard; the stack itself is
+  // writable all the way down
+  char *stack = (char *) csrv_stack_alloc(&pool);
+  CHECK(stack != NULL);
+  char *usable = stack + pool.page_size;
+  usable[0] = 1;
+  usable[pool.stack_size - 1] = 1;
+  CHECK(faults(stack + pool.page_size - 1));
+  CHECK(faults(stack));
+  CHECK(!faults(usable));
+
+  // Freed stacks are reused, newest first
+  char *other = (char *) csrv_stack_alloc(&pool);
+  CHECK(other != NULL && other != stack);
+  csrv_stack_free(&pool, stack);
+  csrv_stack_free(&pool, other);
+  CHECK(pool.n_free == 2);
+  CHECK(csrv_stack_alloc(&pool) == other);
+  CHECK(csrv_stack_alloc(&pool) == stack);
+  CHECK(pool.n_free == 0);
+
+  // Past the pool's capacity a freed stack is unmapped instead
+  void **stacks = (void **) malloc(sizeof(void *) * (CSRV_STACK_POOL_MAX + 1));
+  stacks[0] = stack;
+  stacks[1] = other;
+  for(size_t i = 2; i <= CSRV_STACK_POOL_MAX; i++) {
+    stacks[i] = csrv_stack_alloc(&pool);
+    CHECK(stacks[i] != NULL);
+  }
+  for(size_t i = 0; i <= CSRV_STACK_POOL_MAX; i++) {
+    csrv_stack_free(&pool, stacks[i]);
+  }
+  CHECK(pool.n_free == CSRV_STACK_POOL_MAX);
+  CHECK(faults((char *) stacks[CSRV_STACK_POOL_MAX] + pool.page_size));
+
+  free(stacks);
+  csrv_stack_pool_cleanup(&pool);
+}
+
+int main(void) {
+  test_server(&csrv, NULL);
+
+  check_park();
+  check_start();
+  check_deadlines();
+  check_unpark_during_expire();
+  check_wake_idle();
+  check_stack_pool();
+
+  fclose(csrv.log);
+  return test_failures != 0;
+}
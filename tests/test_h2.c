@@ -0,0 +1,376 @@
+#include "test.h"
+
+// HTTP/2 frame handling, fed to a connection served the way a forked child
+// serves it: a prior-knowledge preface, then the frames of each case. The
+// regression cases check the reply for one specific error; the fuzz run
+// mutates valid conversations and checks the server always finishes with
+// output that still parses as frames.
+
+#define TEST_TIMEOUT_MS 5000
+
+// GET answers "hello"; anything else echoes its body back
+static void echo_handler(struct CsrvRequest *req, struct CsrvResponse *resp) {
+  if(strcmp(req->headers.method, "GET") == 0) {
+    csrv_str_vec_pushn(&resp->body, "hello", 5);
+    return;
+  }
+
+  char buffer[1024];
+  ssize_t sz_read;
+  while((sz_read = csrv_read_body(req, buffer, sizeof(buffer))) > 0) {
+    csrv_str_vec_pushn(&resp->body, buffer, sz_read);
+  }
+  if(sz_read < 0) {
+    resp->status = CSRV_HTTP_BAD_REQUEST;
+  }
+}
+
+static void put_frame(struct CsrvStrVec *out, uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t len) {
+  char header[CSRV_H2_FRAME_HEADER] = {
+    (char) (len >> 16), (char) (len >> 8), (char) len, (char) type, (char) flags,
+    (char) (id >> 24), (char) (id >> 16), (char) (id >> 8), (char) id,
+  };
+  csrv_str_vec_pushn(out, header, sizeof(header));
+  if(len > 0) {
+    csrv_str_vec_pushn(out, (char *) payload, len);
+  }
+}
+
+// A request head: :method (2 GET, 3 POST), :scheme http, :path /, and a
+// content-length if one is given
+static void put_request(struct CsrvStrVec *out, uint32_t id, size_t method_index, const char *content_length, bool end_stream) {
+  struct CsrvStrVec block;
+  csrv_str_vec_init(&block);
+  csrv_hpack_encode_indexed(&block, method_index);
+  csrv_hpack_encode_indexed(&block, 6);
+  csrv_hpack_encode_indexed(&block, 4);
+  csrv_hpack_encode(&block, 0, ":authority", "localhost", 9);
+  if(content_length != NULL) {
+    csrv_hpack_encode(&block, csrv_hpack_static_name("content-length"), NULL, (char *) content_length, strlen(content_length));
+  }
+  put_frame(out, CSRV_H2_HEADERS, CSRV_H2_FLAG_END_HEADERS | (end_stream ? CSRV_H2_FLAG_END_STREAM : 0), id, block.string, block.length);
+  free(block.string);
+}
+
+static void put_preface(struct CsrvStrVec *out) {
+  csrv_str_vec_pushn(out, CSRV_H2_PREFACE, strlen(CSRV_H2_PREFACE));
+  put_frame(out, CSRV_H2_SETTINGS, 0, 0, NULL, 0);
+}
+
+// What came back, frame by frame
+struct H2Reply {
+  bool well_formed;
+  int goaway;
+  int rst_stream;
+  int status;
+  bool ping_ack;
+  struct CsrvStrVec body;
+};
+
+static int reply_field(void *ctx, char *name, size_t name_len, char *value, size_t value_len) {
+  struct H2Reply *reply = (struct H2Reply *) ctx;
+  if(name_len == 7 && memcmp(name, ":status", 7) == 0) {
+    reply->status = atoi(value);
+  }
+  return 0;
+}
+
+static void parse_reply(struct CsrvStrVec *output, struct H2Reply *reply) {
+  memset(reply, 0, sizeof(*reply));
+  reply->goaway = -1;
+  reply->rst_stream = -1;
+  reply->well_formed = true;
+  csrv_str_vec_init(&reply->body);
+
+  struct CsrvHpack decoder;
+  csrv_hpack_init(&decoder);
+  const uint8_t *p = (const uint8_t *) output->string;
+  size_t left = output->length;
+  while(left > 0) {
+    if(left < CSRV_H2_FRAME_HEADER) {
+      reply->well_formed = false;
+      break;
+    }
+
+    size_t len = (size_t) p[0] << 16 | (size_t) p[1] << 8 | p[2];
+    uint8_t type = p[3];
+    uint8_t flags = p[4];
+    if(len > CSRV_H2_FRAME_SIZE || left - CSRV_H2_FRAME_HEADER < len || (p[5] & 0x80)) {
+      reply->well_formed = false;
+      break;
+    }
+
+    const uint8_t *payload = p + CSRV_H2_FRAME_HEADER;
+    switch(type) {
+      case CSRV_H2_DATA:
+        csrv_str_vec_pushn(&reply->body, (char *) payload, len);
+        break;
+      case CSRV_H2_HEADERS:
+        // We never pad or prioritize, nor split a block over CONTINUATIONs
+        if(flags != CSRV_H2_FLAG_END_HEADERS && flags != (CSRV_H2_FLAG_END_HEADERS | CSRV_H2_FLAG_END_STREAM)) {
+          reply->well_formed = false;
+        } else if(csrv_hpack_decode(&decoder, payload, len, reply_field, reply) != 0) {
+          reply->well_formed = false;
+        }
+        break;
+      case CSRV_H2_RST_STREAM:
+        reply->rst_stream = len == 4 ? (int) payload[3] : -2;
+        break;
+      case CSRV_H2_PING:
+        reply->ping_ack = flags == CSRV_H2_FLAG_ACK && len == 8 && memcmp(payload, "pingpong", 8) == 0;
+        break;
+      case CSRV_H2_GOAWAY:
+        reply->goaway = len >= 8 ? (int) payload[7] : -2;
+        break;
+      case CSRV_H2_SETTINGS:
+      case CSRV_H2_WINDOW_UPDATE:
+        break;
+      default:
+        reply->well_formed = false;
+        break;
+    }
+
+    p += CSRV_H2_FRAME_HEADER + len;
+    left -= CSRV_H2_FRAME_HEADER + len;
+  }
+  csrv_hpack_cleanup(&decoder);
+}
+
+static void exchange(struct Csrv *csrv, struct CsrvStrVec *input, struct H2Reply *reply) {
+  struct CsrvStrVec output;
+  csrv_str_vec_init(&output);
+  CHECK(test_exchange(csrv, input->string, input->length, &output, TEST_TIMEOUT_MS) == 0);
+  parse_reply(&output, reply);
+  CHECK(reply->well_formed);
+  free(output.string);
+}
+
+static void check_get(struct Csrv *csrv) {
+  struct CsrvStrVec input;
+  csrv_str_vec_init(&input);
+  put_preface(&input);
+  put_request(&input, 1, 2, NULL, true);
+
+  struct H2Reply reply;
+  exchange(csrv, &input, &reply);
+  CHECK(reply.status == 200);
+  CHECK(reply.body.length == 5 && memcmp(reply.body.string, "hello", 5) == 0);
+  CHECK(reply.goaway == CSRV_H2_NO_ERROR);
+  free(reply.body.string);
+  free(input.string);
+}
+
+// With and without a content-length: h2 frames the body either way
+static void check_post(struct Csrv *csrv, const char *content_length) {
+  struct CsrvStrVec input;
+  csrv_str_vec_init(&input);
+  put_preface(&input);
+  put_request(&input, 1, 3, content_length, false);
+  put_frame(&input, CSRV_H2_DATA, 0, 1, "hello ", 6);
+  put_frame(&input, CSRV_H2_DATA, CSRV_H2_FLAG_END_STREAM, 1, "world", 5);
+
+  struct H2Reply reply;
+  exchange(csrv, &input, &reply);
+  CHECK(reply.status == 200);
+  CHECK(reply.body.length == 11 && memcmp(reply.body.string, "hello world", 11) == 0);
+  CHECK(reply.rst_stream == -1);
+  free(reply.body.string);
+  free(input.string);
+}
+
+static void check_ping(struct Csrv *csrv) {
+  struct CsrvStrVec input;
+  csrv_str_vec_init(&input);
+  put_preface(&input);
+  put_frame(&input, CSRV_H2_PING, 0, 0, "pingpong", 8);
+
+  struct H2Reply reply;
+  exchange(csrv, &input, &reply);
+  CHECK(reply.ping_ack);
+  CHECK(reply.goaway == CSRV_H2_NO_ERROR);
+  free(reply.body.string);
+  free(input.string);
+}
+
+// Frames after the preface that have to end the connection with code, or
+// (stream_error) only reset stream 1 with it
+struct H2Case {
+  const char *name;
+  const char *frames;
+  int code;
+  bool stream_error;
+};
+
+// Frame bytes in hex; 82 86 84 is GET http /, 83 is POST, 5c is a literal
+// content-length
+static const struct H2Case cases[] = {
+  { "frame over 16384 bytes", "004001 00 00 00000000", CSRV_H2_FRAME_SIZE_ERROR, false },
+  { "HEADERS on stream 0", "000003 01 05 00000000 828684", CSRV_H2_PROTOCOL_ERROR, false },
+  { "CONTINUATION without HEADERS", "000003 09 04 00000001 828684", CSRV_H2_PROTOCOL_ERROR, false },
+  { "HEADERS interrupted before CONTINUATION", "000002 01 01 00000001 8286 000008 06 00 00000000 0000000000000000",
+    CSRV_H2_PROTOCOL_ERROR, false },
+  { "undecodable header block", "000001 01 05 00000001 80", CSRV_H2_COMPRESSION_ERROR, false },
+  { "padding longer than the frame", "000004 01 0d 00000001 08828684", CSRV_H2_PROTOCOL_ERROR, false },
+  { "connection WINDOW_UPDATE of 0", "000004 08 00 00000000 00000000", CSRV_H2_PROTOCOL_ERROR, false },
+  { "even stream id", "000003 01 05 00000002 828684", CSRV_H2_PROTOCOL_ERROR, false },
+  { "stream id going backwards", "000003 01 05 00000003 828684 000003 01 05 00000001 828684", CSRV_H2_PROTOCOL_ERROR, false },
+  { "DATA on an idle stream", "000001 00 01 00000005 78", CSRV_H2_PROTOCOL_ERROR, false },
+  { "PUSH_PROMISE from a client", "000004 05 04 00000001 00000002", CSRV_H2_PROTOCOL_ERROR, false },
+  { "PING of the wrong size", "000004 06 00 00000000 00000000", CSRV_H2_FRAME_SIZE_ERROR, false },
+  { "SETTINGS on a stream", "000000 04 00 00000001", CSRV_H2_PROTOCOL_ERROR, false },
+  { "initial window over 2^31-1", "000006 04 00 00000000 0004 80000000", CSRV_H2_FLOW_CONTROL_ERROR, false },
+  { "DATA beyond content-length", "000006 01 04 00000001 838684 5c0133 000005 00 01 00000001 68656c6c6f",
+    CSRV_H2_PROTOCOL_ERROR, true },
+  { "conflicting content-length", "000009 01 04 00000001 838684 5c0133 5c0134", CSRV_H2_PROTOCOL_ERROR, true },
+  { "request without :path", "000002 01 05 00000001 8286", CSRV_H2_PROTOCOL_ERROR, true },
+};
+
+static void check_case(struct Csrv *csrv, const struct H2Case *c) {
+  uint8_t frames[256];
+  size_t len = test_hex(c->frames, frames, sizeof(frames));
+  struct CsrvStrVec input;
+  csrv_str_vec_init(&input);
+  put_preface(&input);
+  csrv_str_vec_pushn(&input, (char *) frames, len);
+  // A frame over the limit is rejected from its header alone
+  if(c->code == CSRV_H2_FRAME_SIZE_ERROR && len == CSRV_H2_FRAME_HEADER) {
+    for(size_t i = 0; i < CSRV_H2_FRAME_SIZE + 1; i++) {
+      csrv_str_vec_pushc(&input, 0);
+    }
+  }
+
+  struct H2Reply reply;
+  exchange(csrv, &input, &reply);
+  int got = c->stream_error ? reply.rst_stream : reply.goaway;
+  if(got != c->code || (c->stream_error && reply.goaway != CSRV_H2_NO_ERROR)) {
+    fprintf(stderr, "%s: expected %s %d, got GOAWAY %d and RST_STREAM %d\n", c->name,
+            c->stream_error ? "RST_STREAM" : "GOAWAY", c->code, reply.goaway, reply.rst_stream);
+    test_failures++;
+  }
+  free(reply.body.string);
+  free(input.string);
+}
+
+// xorshift64*, seeded so that a failing run can be repeated
+static uint64_t fuzz_state;
+
+static uint32_t fuzz_next(uint32_t bound) {
+  fuzz_state ^= fuzz_state >> 12;
+  fuzz_state ^= fuzz_state << 25;
+  fuzz_state ^= fuzz_state >> 27;
+  return (uint32_t) ((fuzz_state * 0x2545f4914f6cdd1dULL) >> 32) % bound;
+}
+
+// A few valid conversations to start the mutations from
+static void fuzz_seed(struct CsrvStrVec *out, int which) {
+  switch(which) {
+    case 0:
+      put_request(out, 1, 2, NULL, true);
+      put_request(out, 3, 3, "5", false);
+      put_frame(out, CSRV_H2_DATA, CSRV_H2_FLAG_END_STREAM, 3, "hello", 5);
+      break;
+    case 1:
+      put_frame(out, CSRV_H2_PING, 0, 0, "pingpong", 8);
+      put_request(out, 1, 3, NULL, false);
+      put_frame(out, CSRV_H2_WINDOW_UPDATE, 0, 1, "\x00\x00\x10\x00", 4);
+      put_frame(out, CSRV_H2_DATA, CSRV_H2_FLAG_PADDED | CSRV_H2_FLAG_END_STREAM, 1, "\x02hi\x00\x00", 5);
+      break;
+    default:
+      // A header block split over a CONTINUATION, then trailers
+      put_frame(out, CSRV_H2_HEADERS, 0, 1, "\x83\x86", 2);
+      put_frame(out, CSRV_H2_CONTINUATION, CSRV_H2_FLAG_END_HEADERS, 1, "\x84", 1);
+      put_frame(out, CSRV_H2_DATA, 0, 1, "abc", 3);
+      put_frame(out, CSRV_H2_HEADERS, CSRV_H2_FLAG_END_HEADERS | CSRV_H2_FLAG_END_STREAM, 1, "\x40\x01x\x01y", 5);
+      put_frame(out, CSRV_H2_RST_STREAM, 0, 1, "\x00\x00\x00\x08", 4);
+      break;
+  }
+}
+
+static void fuzz_mutate(struct CsrvStrVec *frames) {
+  int n_mutations = 1 + fuzz_next(4);
+  for(int i = 0; i < n_mutations; i++) {
+    switch(fuzz_next(4)) {
+      case 0:
+        // Flip a byte, likely in a frame header or a header block
+        if(frames->length > 0) {
+          frames->string[fuzz_next(frames->length)] ^= (char) (1 + fuzz_next(255));
+        }
+        break;
+      case 1:
+        // Cut the conversation short
+        if(frames->length > 0) {
+          frames->length = fuzz_next(frames->length);
+        }
+        break;
+      case 2: {
+        // Append a random small frame of a random type
+        uint8_t payload[16];
+        size_t len = fuzz_next(sizeof(payload) + 1);
+        for(size_t j = 0; j < len; j++) {
+          payload[j] = fuzz_next(256);
+        }
+        put_frame(frames, fuzz_next(11), fuzz_next(256), fuzz_next(6), payload, len);
+        break;
+      }
+      default:
+        // Set a byte to one of the values parsers trip on
+        if(frames->length > 0) {
+          static const uint8_t edges[] = { 0x00, 0x01, 0x7f, 0x80, 0xff };
+          frames->string[fuzz_next(frames->length)] = (char) edges[fuzz_next(sizeof(edges))];
+        }
+        break;
+    }
+  }
+}
+
+static void check_fuzz(struct Csrv *csrv, uint64_t seed, int n_runs) {
+  fuzz_state = seed;
+  for(int run = 0; run < n_runs; run++) {
+    struct CsrvStrVec frames;
+    csrv_str_vec_init(&frames);
+    fuzz_seed(&frames, fuzz_next(3));
+    fuzz_mutate(&frames);
+
+    struct CsrvStrVec input;
+    csrv_str_vec_init(&input);
+    put_preface(&input);
+    csrv_str_vec_pushn(&input, frames.string, frames.length);
+
+    struct CsrvStrVec output;
+    csrv_str_vec_init(&output);
+    int res = test_exchange(csrv, input.string, input.length, &output, TEST_TIMEOUT_MS);
+    struct H2Reply reply;
+    parse_reply(&output, &reply);
+    if(res != 0 || !reply.well_formed) {
+      fprintf(stderr, "fuzz seed %llu, run %d: %s\n", (unsigned long long) seed, run,
+              res != 0 ? "server did not finish" : "malformed output");
+      test_failures++;
+    }
+
+    free(reply.body.string);
+    free(output.string);
+    free(input.string);
+    free(frames.string);
+  }
+}
+
+int main(int argc, char **argv) {
+  struct Csrv csrv;
+  test_server(&csrv, echo_handler);
+
+  check_get(&csrv);
+  check_post(&csrv, "11");
+  check_post(&csrv, NULL);
+  check_ping(&csrv);
+  for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    check_case(&csrv, &cases[i]);
+  }
+
+  // `tests/test_h2 SEED RUNS` repeats or extends a fuzz run
+  uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 10) : 1;
+  int n_runs = argc > 2 ? atoi(argv[2]) : 2000;
+  check_fuzz(&csrv, seed, n_runs);
+
+  fclose(csrv.log);
+  return test_failures != 0;
+}
@@ -0,0 +1,188 @@
+#include "ctype.h"
+#include "strings.h"
+#include "test.h"
+
+// Request header parsing: the well-known header table, Content-Length
+// values, and how whole HTTP/1 requests with good and bad headers are
+// answered
+
+#define TEST_TIMEOUT_MS 5000
+
+static const char *known_names[CSRV_HEADER_COUNT] = {
+  "host", "content-length", "connection", "transfer-encoding", "content-type", "accept-encoding",
+  "if-none-match", "cookie", "user-agent", "accept", "authorization", "expect", "upgrade",
+  "keep-alive", "if-modified-since", "range", "referer", "origin", "http2-settings",
+  "sec-websocket-key", "sec-websocket-version", "x-forwarded-for",
+};
+
+static void check_lookup(void) {
+  for(int id = 0; id < CSRV_HEADER_COUNT; id++) {
+    char name[64];
+    size_t len = strlen(known_names[id]);
+    CHECK(strcasecmp(csrv_header_name(id), known_names[id]) == 0);
+
+    // Any case
+    strcpy(name, known_names[id]);
+    CHECK(csrv_header_lookup(name, len) == id);
+    for(size_t i = 0; i < len; i++) {
+      name[i] = toupper((unsigned char) name[i]);
+    }
+    CHECK(csrv_header_lookup(name, len) == id);
+    CHECK(csrv_header_lookup(csrv_header_name(id), len) == id);
+
+    // Only the whole name: the length is part of the match
+    CHECK(csrv_header_lookup(name, len - 1) == -1);
+    strcpy(name, known_names[id]);
+    strcat(name, "x");
+    CHECK(csrv_header_lookup(name, len + 1) == -1);
+
+    // Same first and last character and length, so the same slot
+    strcpy(name, known_names[id]);
+    if(len > 2) {
+      name[1] = name[1] == 'z' ? 'y' : 'z';
+      CHECK(csrv_header_lookup(name, len) == -1);
+    }
+  }
+
+  CHECK(csrv_header_lookup("", 0) == -1);
+  CHECK(csrv_header_lookup("x-custom", 8) == -1);
+  CHECK(csrv_header_lookup("Content_Length", 14) == -1);
+}
+
+// The hash from headers.c, worked out from the names alone: no two of them
+// may share a slot
+static void check_slots(void) {
+  int owner[CSRV_HEADER_SLOTS];
+  for(int slot = 0; slot < CSRV_HEADER_SLOTS; slot++) {
+    owner[slot] = -1;
+  }
+
+  for(int id = 0; id < CSRV_HEADER_COUNT; id++) {
+    const char *name = known_names[id];
+    size_t len = strlen(name);
+    size_t slot = (name[0] + name[len - 1] + 7 * len) & (CSRV_HEADER_SLOTS - 1);
+    if(owner[slot] != -1) {
+      fprintf(stderr, "%s and %s share slot %zu\n", known_names[owner[slot]], name, slot);
+      test_failures++;
+    }
+    owner[slot] = id;
+  }
+}
+
+static void check_parse_size(void) {
+  static const struct {
+    char *text;
+    int res;
+    size_t value;
+  } sizes[] = {
+    { "0", 0, 0 },
+    { "42", 0, 42 },
+    { " \t42\t ", 0, 42 },
+    { "007", 0, 7 },
+    { "18446744073709551615", 0, SIZE_MAX },
+    { "18446744073709551616", -1, 0 },
+    { "99999999999999999999999", -1, 0 },
+    { "", -1, 0 },
+    { " ", -1, 0 },
+    { "abc", -1, 0 },
+    { "-1", -1, 0 },
+    { "+1", -1, 0 },
+    { "1 2", -1, 0 },
+    { "1,1", -1, 0 },
+    { "0x10", -1, 0 },
+    { "1e3", -1, 0 },
+  };
+
+  for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t value = 12345;
+    int res = csrv_parse_size(sizes[i].text, &value);
+    if(res != sizes[i].res || (res == 0 && value != sizes[i].value) || (res != 0 && value != 12345)) {
+      fprintf(stderr, "csrv_parse_size(\"%s\") = %d, %zu\n", sizes[i].text, res, value);
+      test_failures++;
+    }
+  }
+}
+
+// Answers with what it saw: the declared size, the body, and a header
+// that only the map holds. A repeated User-Agent shows as both copies.
+static void echo_handler(struct CsrvRequest *req, struct CsrvResponse *resp) {
+  char line[256];
+  char *custom = csrv_get_header(req, "X-Custom");
+  snprintf(line, sizeof(line), "%zu %s ", req->headers.content_size, custom != NULL ? custom : "-");
+  csrv_str_vec_pushn(&resp->body, line, strlen(line));
+
+  char *repeat = csrv_str_map_get(&req->headers.header_map, "User-Agent");
+  if(repeat != NULL) {
+    snprintf(line, sizeof(line), "%s,%s ", csrv_get_header(req, "User-Agent"), repeat);
+    csrv_str_vec_pushn(&resp->body, line, strlen(line));
+  }
+
+  char buffer[256];
+  ssize_t sz_read;
+  while((sz_read = csrv_read_body(req, buffer, sizeof(buffer))) > 0) {
+    csrv_str_vec_pushn(&resp->body, buffer, sz_read);
+  }
+}
+
+// Send one request and return the response, NUL terminated, for the
+// caller to free
+static char *request(struct Csrv *csrv, const char *text) {
+  struct CsrvStrVec output;
+  csrv_str_vec_init(&output);
+  CHECK(test_exchange(csrv, text, strlen(text), &output, TEST_TIMEOUT_MS) == 0);
+  csrv_str_vec_pushc(&output, '\0');
+  return output.string;
+}
+
+static void check_request(struct Csrv *csrv, const char *text, const char *status, const char *body) {
+  char *response = request(csrv, text);
+  char *response_body = strstr(response, "\r\n\r\n");
+  bool ok = strncmp(response, status, strlen(status)) == 0
+    && (body == NULL || (response_body != NULL && strcmp(response_body + 4, body) == 0));
+  if(!ok) {
+    fprintf(stderr, "request:\n%s\nexpected %s \"%s\", got:\n%s\n", text, status, body != NULL ? body : "", response);
+    test_failures++;
+  }
+  free(response);
+}
+
+static void check_requests(struct Csrv *csrv) {
+  check_request(csrv, "GET / HTTP/1.1\r\nHost: x\r\nX-Custom: yes\r\n\r\n", "HTTP/1.1 200", "0 yes ");
+  check_request(csrv, "POST / HTTP/1.1\r\nHost: x\r\nContent-Length: 3\r\n\r\nabc", "HTTP/1.1 200", "3 - abc");
+  check_request(csrv, "POST / HTTP/1.1\r\ncontent-LENGTH:  3 \r\n\r\nabc", "HTTP/1.1 200", "3 - abc");
+
+  // The same length twice is one header; anything else can't be trusted
+  // to frame the body the way every other hop reads it
+  check_request(csrv, "POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\nabc", "HTTP/1.1 200", "3 - abc");
+  check_request(csrv, "POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 4\r\n\r\nabcd", "HTTP/1.1 400", "");
+  check_request(csrv, "POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: abc\r\n\r\nabc", "HTTP/1.1 400", "");
+
+  check_request(csrv, "POST / HTTP/1.1\r\nContent-Length: abc\r\n\r\nabc", "HTTP/1.1 400", "");
+  check_request(csrv, "POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", "HTTP/1.1 400", "");
+  check_request(csrv, "POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n", "HTTP/1.1 400", "");
+  check_request(csrv, "POST / HTTP/1.1\r\nContent-Length: 1 2\r\n\r\n12", "HTTP/1.1 400", "");
+
+  // Other well-known headers keep their first copy in the slot, where
+  // csrv_get_header() finds it; the repeat is in the map
+  check_request(csrv, "GET / HTTP/1.1\r\nUser-Agent: a\r\nUser-Agent: b\r\n\r\n", "HTTP/1.1 200", "0 - a,b ");
+
+  // A header with no value fails with its name already taken off the wire
+  check_request(csrv, "GET / HTTP/1.1\r\nX-Custom:\r\n\r\n", "HTTP/1.1 400", "");
+  check_request(csrv, "GET / HTTP/1.1\r\nX-Custom: \r\n\r\n", "HTTP/1.1 400", "");
+
+  // So is a head cut short by the client hanging up
+  check_request(csrv, "GET / HTTP/1.1\r\nHost: x", "HTTP/1.1 400", "");
+}
+
+int main(void) {
+  struct Csrv csrv;
+  test_server(&csrv, echo_handler);
+
+  check_lookup();
+  check_slots();
+  check_parse_size();
+  check_requests(&csrv);
+
+  fclose(csrv.log);
+  return test_failures != 0;
+}
@@ -0,0 +1,184 @@
+#include "test.h"
+
+// RFC 7541 Appendix C: every example header block, decoded in sequence on
+// one decoder as the RFC does, with the header list and dynamic table size
+// expected after each
+
+struct HpackVector {
+  const char *block;
+  const char *fields;
+  size_t table_size;
+};
+
+static int collect(void *ctx, char *name, size_t name_len, char *value, size_t value_len) {
+  struct CsrvStrVec *out = (struct CsrvStrVec *) ctx;
+  csrv_str_vec_pushn(out, name, name_len);
+  csrv_str_vec_pushn(out, ": ", 2);
+  csrv_str_vec_pushn(out, value, value_len);
+  return csrv_str_vec_pushc(out, '\n');
+}
+
+static void check_sequence(const char *title, size_t max_size, const struct HpackVector *vectors, size_t n_vectors) {
+  struct CsrvHpack hpack;
+  csrv_hpack_init(&hpack);
+  hpack.max_size = max_size;
+
+  for(size_t i = 0; i < n_vectors; i++) {
+    uint8_t block[512];
+    size_t len = test_hex(vectors[i].block, block, sizeof(block));
+    struct CsrvStrVec fields;
+    csrv_str_vec_init(&fields);
+
+    int res = csrv_hpack_decode(&hpack, block, len, collect, &fields);
+    csrv_str_vec_pushc(&fields, '\0');
+    if(res != 0 || strcmp(fields.string, vectors[i].fields) != 0 || hpack.size != vectors[i].table_size) {
+      fprintf(stderr, "%s, block %zu: res=%d size=%zu\n%s", title, i + 1, res, hpack.size, fields.string);
+    }
+    CHECK(res == 0);
+    CHECK(strcmp(fields.string, vectors[i].fields) == 0);
+    CHECK(hpack.size == vectors[i].table_size);
+    free(fields.string);
+  }
+
+  csrv_hpack_cleanup(&hpack);
+}
+
+// C.2: single representations, each on a fresh decoder
+static const struct HpackVector c2_1[] = {
+  { "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572",
+    "custom-key: custom-header\n", 55 },
+};
+static const struct HpackVector c2_2[] = {
+  { "040c 2f73 616d 706c 652f 7061 7468", ":path: /sample/path\n", 0 },
+};
+static const struct HpackVector c2_3[] = {
+  { "1008 7061 7373 776f 7264 0673 6563 7265 74", "password: secret\n", 0 },
+};
+static const struct HpackVector c2_4[] = {
+  { "82", ":method: GET\n", 0 },
+};
+
+#define C3_FIELDS_1 ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"
+#define C3_FIELDS_2 C3_FIELDS_1 "cache-control: no-cache\n"
+#define C3_FIELDS_3 ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\n" \
+  "custom-key: custom-value\n"
+
+// C.3: requests without Huffman coding
+static const struct HpackVector c3[] = {
+  { "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", C3_FIELDS_1, 57 },
+  { "8286 84be 5808 6e6f 2d63 6163 6865", C3_FIELDS_2, 110 },
+  { "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65", C3_FIELDS_3, 164 },
+};
+
+// C.4: the same requests with Huffman coding
+static const struct HpackVector c4[] = {
+  { "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", C3_FIELDS_1, 57 },
+  { "8286 84be 5886 a8eb 1064 9cbf", C3_FIELDS_2, 110 },
+  { "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf", C3_FIELDS_3, 164 },
+};
+
+#define C5_FIELDS_1 ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n" \
+  "location: https://www.example.com\n"
+#define C5_FIELDS_2 ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n" \
+  "location: https://www.example.com\n"
+#define C5_FIELDS_3 ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\n" \
+  "location: https://www.example.com\ncontent-encoding: gzip\n" \
+  "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n"
+
+// C.5: responses without Huffman coding, with a 256 byte table so entries
+// get evicted
+static const struct HpackVector c5[] = {
+  { "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120"
+    "474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", C5_FIELDS_1, 222 },
+  { "4803 3330 37c1 c0bf", C5_FIELDS_2, 222 },
+  { "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738"
+    "666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33"
+    "3630 303b 2076 6572 7369 6f6e 3d31", C5_FIELDS_3, 215 },
+};
+
+// C.6: the same responses with Huffman coding
+static const struct HpackVector c6[] = {
+  { "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718"
+    "63c7 8f0b 97c8 e9ae 82ae 43d3", C5_FIELDS_1, 222 },
+  { "4883 640e ffc1 c0bf", C5_FIELDS_2, 222 },
+  { "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7"
+    "b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07", C5_FIELDS_3, 215 },
+};
+
+#define N(vectors) (sizeof(vectors) / sizeof(vectors[0]))
+
+// Blocks that must be rejected rather than decoded
+static void check_malformed(void) {
+  static const char *blocks[] = {
+    // Index 0
+    "80",
+    // Past the end of the dynamic table
+    "be",
+    // Integer running off the end of the block
+    "ff",
+    // Integer too large to be real
+    "ff ff ff ff ff ff ff ff ff ff 7f",
+    // String longer than the block
+    "400a 6375 7374",
+    // Huffman string padded with more than 7 bits (RFC 7541 5.2)
+    "4082 ffff 00",
+    // Table size update above the limit, and one after a field
+    "3fe1 ff",
+    "82 20",
+  };
+
+  for(size_t i = 0; i < N(blocks); i++) {
+    uint8_t block[64];
+    size_t len = test_hex(blocks[i], block, sizeof(block));
+    struct CsrvHpack hpack;
+    csrv_hpack_init(&hpack);
+    struct CsrvStrVec fields;
+    csrv_str_vec_init(&fields);
+    if(csrv_hpack_decode(&hpack, block, len, collect, &fields) == 0) {
+      fprintf(stderr, "malformed block %zu (%s) was accepted\n", i, blocks[i]);
+      test_failures++;
+    }
+    free(fields.string);
+    csrv_hpack_cleanup(&hpack);
+  }
+}
+
+// What the encoder writes decodes back to the same fields
+static void check_encode(void) {
+  struct CsrvStrVec block;
+  csrv_str_vec_init(&block);
+  csrv_hpack_encode_indexed(&block, 8);
+  csrv_hpack_encode(&block, csrv_hpack_static_name("content-type"), NULL, "text/plain", 10);
+  csrv_hpack_encode(&block, 0, "x-long", "0123456789012345678901234567890123456789012345678901234567890123456789"
+                    "0123456789012345678901234567890123456789012345678901234567890123456789", 140);
+
+  struct CsrvHpack hpack;
+  csrv_hpack_init(&hpack);
+  struct CsrvStrVec fields;
+  csrv_str_vec_init(&fields);
+  CHECK(csrv_hpack_decode(&hpack, (uint8_t *) block.string, block.length, collect, &fields) == 0);
+  csrv_str_vec_pushc(&fields, '\0');
+  CHECK(strcmp(fields.string, ":status: 200\ncontent-type: text/plain\nx-long: "
+               "0123456789012345678901234567890123456789012345678901234567890123456789"
+               "0123456789012345678901234567890123456789012345678901234567890123456789\n") == 0);
+  // Never indexed by us, so the peer's table stays empty
+  CHECK(hpack.size == 0);
+
+  free(fields.string);
+  free(block.string);
+  csrv_hpack_cleanup(&hpack);
+}
+
+int main(void) {
+  check_sequence("C.2.1", CSRV_HPACK_TABLE_SIZE, c2_1, N(c2_1));
+  check_sequence("C.2.2", CSRV_HPACK_TABLE_SIZE, c2_2, N(c2_2));
+  check_sequence("C.2.3", CSRV_HPACK_TABLE_SIZE, c2_3, N(c2_3));
+  check_sequence("C.2.4", CSRV_HPACK_TABLE_SIZE, c2_4, N(c2_4));
+  check_sequence("C.3", CSRV_HPACK_TABLE_SIZE, c3, N(c3));
+  check_sequence("C.4", CSRV_HPACK_TABLE_SIZE, c4, N(c4));
+  check_sequence("C.5", 256, c5, N(c5));
+  check_sequence("C.6", 256, c6, N(c6));
+  check_malformed();
+  check_encode();
+  return test_failures != 0;
+}
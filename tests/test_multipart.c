@@ -0,0 +1,292 @@
+#include "errno.h"
+#include "test.h"
+
+// multipart/form-data: the boundary search on its own, then whole uploads
+// parsed by a handler that describes every part it got back
+
+#define TEST_TIMEOUT_MS 10000
+#define BOUNDARY "xYzZY-boundary"
+
+static ssize_t naive_find(const char *haystack, size_t n, const char *needle, size_t k) {
+  if(k == 0) {
+    return -1;
+  }
+  for(size_t i = 0; i + k <= n; i++) {
+    if(memcmp(haystack + i, needle, k) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Every needle position and length around the 16 byte blocks, among near
+// misses that share the needle's first and last byte
+static void check_find(void) {
+  const char *needle = "\r\n--" BOUNDARY;
+  size_t k = strlen(needle);
+  char haystack[200];
+
+  for(size_t n = 0; n <= sizeof(haystack); n += 7) {
+    for(size_t at = 0; at + k <= n + k; at++) {
+      memset(haystack, 'a', n);
+      for(size_t i = 0; i + k <= n; i += k + 3) {
+        // A decoy: right first and last byte, wrong middle
+        memcpy(haystack + i, needle, k);
+        haystack[i + k / 2] = '?';
+      }
+      if(at + k <= n) {
+        memcpy(haystack + at, needle, k);
+      }
+
+      ssize_t expected = naive_find(haystack, n, needle, k);
+      ssize_t found = csrv_multipart_find(haystack, n, needle, k);
+      if(found != expected) {
+        fprintf(stderr, "csrv_multipart_find(n=%zu, at=%zu) = %zd, expected %zd\n", n, at, found, expected);
+        test_failures++;
+      }
+    }
+  }
+
+  CHECK(csrv_multipart_find("abc", 3, "", 0) == -1);
+  CHECK(csrv_multipart_find("abc", 3, "abcd", 4) == -1);
+  CHECK(csrv_multipart_find("abc", 3, "abc", 3) == 0);
+  CHECK(csrv_multipart_find("abc", 3, "c", 1) == 2);
+  CHECK(csrv_multipart_find("", 0, "c", 1) == -1);
+}
+
+static void describe(struct CsrvStrVec *out, const char *text) {
+  csrv_str_vec_pushn(out, (char *) text, strlen(text));
+}
+
+// One line per part: name, filename, where it was kept, then its content
+static void parts_handler(struct CsrvRequest *req, struct CsrvResponse *resp) {
+  struct CsrvMultipartPart *parts;
+  if(csrv_multipart_parse(req, &parts) != 0) {
+    char line[64];
+    snprintf(line, sizeof(line), "error %s\n", strerror(errno));
+    describe(&resp->body, line);
+    resp->keep_alive = false;
+    return;
+  }
+
+  for(struct CsrvMultipartPart *part = parts; part != NULL; part = part->next) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s %s %s %zu ", part->name != NULL ? part->name : "-",
+             part->filename != NULL ? part->filename : "-", part->fd == -1 ? "memory" : "file", part->size);
+    describe(&resp->body, line);
+
+    if(part->fd == -1) {
+      csrv_str_vec_pushn(&resp->body, part->value.string, part->value.length);
+    } else {
+      char buffer[4096];
+      ssize_t sz_read;
+      while((sz_read = read(part->fd, buffer, sizeof(buffer))) > 0) {
+        csrv_str_vec_pushn(&resp->body, buffer, sz_read);
+      }
+    }
+    describe(&resp->body, "\n");
+  }
+
+  csrv_multipart_cleanup(parts);
+}
+
+struct Upload {
+  struct CsrvStrVec body;
+  struct CsrvStrVec expected;
+};
+
+static void upload_init(struct Upload *upload) {
+  csrv_str_vec_init(&upload->body);
+  csrv_str_vec_init(&upload->expected);
+}
+
+// spilled: a field expected in a temp file because the others took the memory
+static void upload_part(struct Upload *upload, const char *name, const char *filename, const char *data, size_t len, bool spilled) {
+  char head[256];
+  if(filename != NULL) {
+    snprintf(head, sizeof(head), "--" BOUNDARY "\r\nContent-Disposition: form-data; name=\"%s\"; filename=\"%s\"\r\n"
+             "Content-Type: application/octet-stream\r\n\r\n", name, filename);
+  } else {
+    snprintf(head, sizeof(head), "--" BOUNDARY "\r\nContent-Disposition: form-data; name=\"%s\"\r\n\r\n", name);
+  }
+  describe(&upload->body, head);
+  csrv_str_vec_pushn(&upload->body, (char *) data, len);
+  describe(&upload->body, "\r\n");
+
+  // Files always go to disk; fields do once they are too big
+  bool in_file = filename != NULL || len > CSRV_MULTIPART_FIELD_MAX || spilled;
+  snprintf(head, sizeof(head), "%s %s %s %zu ", name, filename != NULL ? filename : "-", in_file ? "file" : "memory", len);
+  describe(&upload->expected, head);
+  csrv_str_vec_pushn(&upload->expected, (char *) data, len);
+  describe(&upload->expected, "\n");
+}
+
+// Send the upload, with the closing delimiter unless it is left out, and
+// compare what the handler saw with expected (or upload->expected)
+static void upload_check(struct Csrv *csrv, const char *title, struct Upload *upload, bool close, const char *expected) {
+  if(close) {
+    describe(&upload->body, "--" BOUNDARY "--\r\n");
+  }
+
+  char head[256];
+  snprintf(head, sizeof(head), "POST /upload HTTP/1.1\r\nHost: x\r\nContent-Type: multipart/form-data; boundary=\"" BOUNDARY "\"\r\n"
+           "Content-Length: %zu\r\n\r\n", upload->body.length);
+  struct CsrvStrVec input;
+  csrv_str_vec_init(&input);
+  describe(&input, head);
+  csrv_str_vec_pushn(&input, upload->body.string, upload->body.length);
+
+  struct CsrvStrVec output;
+  csrv_str_vec_init(&output);
+  CHECK(test_exchange(csrv, input.string, input.length, &output, TEST_TIMEOUT_MS) == 0);
+  csrv_str_vec_pushc(&output, '\0');
+
+  if(expected == NULL) {
+    csrv_str_vec_pushc(&upload->expected, '\0');
+    expected = upload->expected.string;
+  }
+  char *body = strstr(output.string, "\r\n\r\n");
+  if(body == NULL || strcmp(body + 4, expected) != 0) {
+    fprintf(stderr, "%s: expected\n%.300s\ngot\n%.300s\n", title, expected, output.string);
+    test_failures++;
+  }
+
+  free(output.string);
+  free(input.string);
+  free(upload->body.string);
+  free(upload->expected.string);
+}
+
+static void check_fields(struct Csrv *csrv) {
+  struct Upload upload;
+  upload_init(&upload);
+  upload_part(&upload, "title", NULL, "hello", 5, false);
+  upload_part(&upload, "empty", NULL, "", 0, false);
+  upload_part(&upload, "doc", "a.txt", "line one\r\nline two\r\n", 20, false);
+  upload_check(csrv, "fields and a file", &upload, true, NULL);
+}
+
+// Content that looks like a delimiter without being one: no CRLF in front,
+// one dash short, cut short, or off by its last byte (which the SSE2 search
+// compares first)
+static void check_boundary_like(struct Csrv *csrv) {
+  static const char *values[] = {
+    "--" BOUNDARY,
+    "x\n--" BOUNDARY "x",
+    "\r\n-" BOUNDARY "--",
+    "\r\n--xYzZY-bound",
+    "\r\n--xYzZY-boundarx",
+    "\r\n\r\n\r\n",
+    "--",
+  };
+
+  struct Upload upload;
+  upload_init(&upload);
+  for(size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "v%zu", i);
+    upload_part(&upload, name, i % 2 == 0 ? NULL : "f.bin", values[i], strlen(values[i]), false);
+  }
+  upload_check(csrv, "boundary-like content", &upload, true, NULL);
+}
+
+// A window barely larger than the delimiter: every delimiter and header
+// block straddles fills
+static void check_small_window(struct Csrv *csrv) {
+  size_t saved = csrv->multipart_buffer_size;
+  csrv->multipart_buffer_size = 160;
+
+  // Runs of a delimiter that is never completed
+  const char *pattern = "\r\n--xYzZY-bounda.";
+  char data[1000];
+  for(size_t i = 0; i < sizeof(data); i++) {
+    data[i] = pattern[i % strlen(pattern)];
+  }
+  struct Upload upload;
+  upload_init(&upload);
+  upload_part(&upload, "a", NULL, data, sizeof(data), false);
+  upload_part(&upload, "b", "b.bin", data, sizeof(data) - 1, false);
+  upload_part(&upload, "c", NULL, "short", 5, false);
+  upload_check(csrv, "small window", &upload, true, NULL);
+
+  csrv->multipart_buffer_size = saved;
+}
+
+// A field over the per-field limit, then fields that together go past the
+// memory limit: those that don't fit any more go to temp files
+static void check_memory_cap(struct Csrv *csrv) {
+  size_t field_len = 60 * 1024;
+  char *data = (char *) malloc(CSRV_MULTIPART_FIELD_MAX + 1);
+  for(size_t i = 0; i < CSRV_MULTIPART_FIELD_MAX + 1; i++) {
+    data[i] = 'a' + i % 26;
+  }
+
+  struct Upload upload;
+  upload_init(&upload);
+  upload_part(&upload, "big", NULL, data, CSRV_MULTIPART_FIELD_MAX + 1, false);
+
+  size_t n_fields = CSRV_MULTIPART_MEMORY_MAX / field_len + 3;
+  size_t memory = 0;
+  for(size_t i = 0; i < n_fields; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "f%zu", i);
+    bool fits = memory + field_len <= CSRV_MULTIPART_MEMORY_MAX;
+    if(fits) {
+      memory += field_len;
+    }
+    upload_part(&upload, name, NULL, data, field_len, !fits);
+  }
+  upload_check(csrv, "memory cap", &upload, true, NULL);
+  free(data);
+}
+
+static void check_parts_cap(struct Csrv *csrv) {
+  for(size_t n_parts = CSRV_MULTIPART_PARTS_MAX; n_parts <= CSRV_MULTIPART_PARTS_MAX + 1; n_parts++) {
+    struct Upload upload;
+    upload_init(&upload);
+    for(size_t i = 0; i < n_parts; i++) {
+      upload_part(&upload, "p", NULL, "1", 1, false);
+    }
+
+    char expected[64];
+    snprintf(expected, sizeof(expected), "error %s\n", strerror(E2BIG));
+    upload_check(csrv, "parts cap", &upload, true, n_parts > CSRV_MULTIPART_PARTS_MAX ? expected : NULL);
+  }
+}
+
+static void check_malformed(struct Csrv *csrv) {
+  char expected[64];
+  snprintf(expected, sizeof(expected), "error %s\n", strerror(EBADMSG));
+
+  // No closing delimiter
+  struct Upload upload;
+  upload_init(&upload);
+  upload_part(&upload, "a", NULL, "1", 1, false);
+  upload_check(csrv, "truncated body", &upload, false, expected);
+
+  // Something other than CRLF or "--" after a delimiter
+  upload_init(&upload);
+  describe(&upload.body, "--" BOUNDARY "junk\r\n\r\nx\r\n");
+  upload_check(csrv, "garbage after delimiter", &upload, true, expected);
+
+  // No delimiter at all
+  upload_init(&upload);
+  describe(&upload.body, "just some text");
+  upload_check(csrv, "no delimiter", &upload, false, expected);
+}
+
+int main(void) {
+  struct Csrv csrv;
+  test_server(&csrv, parts_handler);
+
+  check_find();
+  check_fields(&csrv);
+  check_boundary_like(&csrv);
+  check_small_window(&csrv);
+  check_memory_cap(&csrv);
+  check_parts_cap(&csrv);
+  check_malformed(&csrv);
+
+  fclose(csrv.log);
+  return test_failures != 0;
+}
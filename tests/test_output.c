@@ -0,0 +1,271 @@
+#include "sys/socket.h"
+#include "netinet/in.h"
+#include "arpa/inet.h"
+#include "test.h"
+
+// The output queue over real sockets: the copy fallback on a Unix socket,
+// and MSG_ZEROCOPY on loopback, where the kernel reports every send copied.
+// A peer with a tiny receive window that doesn't read holds the zerocopy
+// buffers in the send queue, so the sequence numbers they were sent under
+// can be checked before any completion arrives. Completions are then reaped
+// while reading, or by csrv_out_finish(), which gives up at its deadline.
+
+#define TEST_TIMEOUT_MS 10000
+#define TEST_PEER_RCVBUF 4096
+#define TEST_BIG (20 * 1024)
+
+static struct Csrv csrv;
+
+// A connected loopback pair; the sender is non-blocking like an event
+// worker's connection
+static void tcp_pair(int *sender, int *peer) {
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  CHECK(bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  CHECK(listen(listener, 1) == 0);
+  CHECK(getsockname(listener, (struct sockaddr *) &addr, &addr_len) == 0);
+
+  *peer = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int size = TEST_PEER_RCVBUF;
+  setsockopt(*peer, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  CHECK(connect(*peer, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  *sender = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  CHECK(*sender != -1);
+  size = 1024 * 1024;
+  setsockopt(*sender, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  close(listener);
+}
+
+static void push(struct CsrvOutQueue *out, size_t len, char fill, bool zerocopy) {
+  char *data = (char *) malloc(len);
+  memset(data, fill, len);
+  CHECK(csrv_out_push(out, data, len, zerocopy) == 0);
+}
+
+static size_t queued(struct CsrvOutQueue *out) {
+  size_t n = 0;
+  for(struct CsrvOutBuf *buf = out->head; buf != NULL; buf = buf->next) {
+    n++;
+  }
+  return n;
+}
+
+// Reads everything the server sends until it hangs up, checking that it is
+// expect_len bytes of the fills in order. With reply set, sends it once
+// expect_len bytes are in, after a pause that lets the server find its
+// socket empty first.
+struct Reader {
+  int fd;
+  const char *fills;
+  const size_t *lens;
+  size_t expect_len;
+  const char *reply;
+  size_t n_read;
+  bool intact;
+};
+
+static void *reader_thread(void *arg) {
+  struct Reader *reader = (struct Reader *) arg;
+  size_t fill = 0;
+  size_t in_fill = 0;
+  reader->intact = true;
+  for(;;) {
+    char buffer[4096];
+    ssize_t sz_read = read(reader->fd, buffer, sizeof(buffer));
+    if(sz_read <= 0) {
+      return NULL;
+    }
+    for(ssize_t i = 0; i < sz_read; i++) {
+      while(reader->lens[fill] != 0 && reader->lens[fill] == in_fill) {
+        fill++;
+        in_fill = 0;
+      }
+      reader->intact &= buffer[i] == reader->fills[fill];
+      in_fill++;
+    }
+
+    bool was_short = reader->n_read < reader->expect_len;
+    reader->n_read += sz_read;
+    if(reader->reply != NULL && was_short && reader->n_read >= reader->expect_len) {
+      usleep(100 * 1000);
+      CHECK(send(reader->fd, reader->reply, strlen(reader->reply), MSG_NOSIGNAL) == (ssize_t) strlen(reader->reply));
+    }
+  }
+}
+
+// A Unix socket refuses SO_ZEROCOPY: every buffer is copied and freed as
+// soon as it is sent
+static void check_copy_fallback(void) {
+  int handles[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, handles) == 0);
+  const size_t lens[] = { TEST_BIG, 100, TEST_BIG, 0 };
+  struct Reader reader = { handles[1], "abc", lens, 2 * TEST_BIG + 100, NULL, 0, false };
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, reader_thread, &reader) == 0);
+
+  struct CsrvOutQueue out;
+  csrv_out_init(&out, handles[0]);
+  push(&out, TEST_BIG, 'a', true);
+  push(&out, 100, 'b', false);
+  push(&out, TEST_BIG, 'c', true);
+  CHECK(csrv_out_flush(&out) == 0);
+  CHECK(out.zerocopy == -1);
+  CHECK(out.zc_next == 0);
+  CHECK(out.head == NULL && out.tail == &out.head);
+
+  csrv_out_finish(&out, csrv_out_deadline(&csrv));
+  close(handles[0]);
+  csrv_out_cleanup(&out);
+  pthread_join(thread, NULL);
+  close(handles[1]);
+  CHECK(reader.n_read == 2 * TEST_BIG + 100 && reader.intact);
+}
+
+// Each zerocopy sendmsg() takes the next sequence number, and every buffer
+// it covered records it. Nothing completes while the data sits in our send
+// queue; a copied send frees its buffer at once.
+static void send_stuck(struct CsrvOutQueue *out) {
+  push(out, TEST_BIG, 'a', true);
+  CHECK(csrv_out_flush(out) == 0);
+  CHECK(out->zerocopy == 1);
+  push(out, TEST_BIG, 'b', true);
+  push(out, 100, 'c', false);
+  CHECK(csrv_out_flush(out) == 0);
+  push(out, 100, 'd', false);
+  CHECK(csrv_out_flush(out) == 0);
+  // The copied send takes no sequence number
+  CHECK(out->zc_next == 2);
+
+  CHECK(queued(out) == 3);
+  if(queued(out) == 3) {
+    struct CsrvOutBuf *a = out->head;
+    struct CsrvOutBuf *b = a->next;
+    struct CsrvOutBuf *c = b->next;
+    CHECK(a->sent == a->len && a->zc_sent && a->zc_first == 0 && a->zc_last == 0 && a->zc_done == 0);
+    CHECK(b->zc_sent && b->zc_first == 1 && b->zc_last == 1 && b->zc_done == 0);
+    // Not marked zerocopy, but sent in the same call as b
+    CHECK(c->data[0] == 'c' && c->zc_sent && c->zc_first == 1 && c->zc_last == 1);
+    CHECK(out->tail == &c->next);
+  }
+}
+
+// Completions are reaped while waiting for the next request: the peer reads
+// everything, which makes the kernel copy it and report so, then answers
+static void check_reap_on_read(void) {
+  int sender, peer;
+  tcp_pair(&sender, &peer);
+  struct CsrvOutQueue out;
+  csrv_out_init(&out, sender);
+  send_stuck(&out);
+
+  const size_t lens[] = { TEST_BIG, TEST_BIG, 100, 100, TEST_BIG, 0 };
+  struct Reader reader = { peer, "abcde", lens, 2 * TEST_BIG + 200, "x", 0, false };
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, reader_thread, &reader) == 0);
+
+  char reply[16];
+  CHECK(csrv_out_read(&out, reply, sizeof(reply)) == 1 && reply[0] == 'x');
+  CHECK(out.head == NULL && out.tail == &out.head);
+  // Loopback copies: zerocopy is off for the rest of the connection
+  CHECK(out.zerocopy == -1);
+  push(&out, TEST_BIG, 'e', true);
+  CHECK(csrv_out_flush(&out) == 0);
+  CHECK(out.head == NULL && out.zc_next == 2);
+
+  int64_t start = csrv_now_ms();
+  csrv_out_finish(&out, csrv_out_deadline(&csrv));
+  CHECK(csrv_now_ms() - start < 100);
+  shutdown(sender, SHUT_WR);
+  pthread_join(thread, NULL);
+  close(sender);
+  csrv_out_cleanup(&out);
+  close(peer);
+  CHECK(reader.n_read == 3 * TEST_BIG + 200 && reader.intact);
+}
+
+// Before close, csrv_out_finish() waits for the completions, and a peer
+// that reads late is still waited for
+static void check_finish(void) {
+  int sender, peer;
+  tcp_pair(&sender, &peer);
+  struct CsrvOutQueue out;
+  csrv_out_init(&out, sender);
+  send_stuck(&out);
+
+  const size_t lens[] = { TEST_BIG, TEST_BIG, 100, 100, 0 };
+  struct Reader reader = { peer, "abcd", lens, 2 * TEST_BIG + 200, NULL, 0, false };
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, reader_thread, &reader) == 0);
+
+  csrv_out_finish(&out, csrv_now_ms() + TEST_TIMEOUT_MS);
+  CHECK(out.head == NULL);
+  struct linger linger;
+  socklen_t linger_len = sizeof(linger);
+  CHECK(getsockopt(sender, SOL_SOCKET, SO_LINGER, &linger, &linger_len) == 0 && !linger.l_onoff);
+
+  close(sender);
+  csrv_out_cleanup(&out);
+  pthread_join(thread, NULL);
+  close(peer);
+  CHECK(reader.n_read == 2 * TEST_BIG + 200 && reader.intact);
+}
+
+// A peer that never reads: csrv_out_finish() stops at its deadline and
+// resets the connection, rather than let the kernel send from freed buffers
+static void check_finish_deadline(void) {
+  int sender, peer;
+  tcp_pair(&sender, &peer);
+  struct CsrvOutQueue out;
+  csrv_out_init(&out, sender);
+  send_stuck(&out);
+
+  int64_t start = csrv_now_ms();
+  int64_t deadline = csrv_out_deadline(&csrv);
+  CHECK(deadline - start >= CSRV_OUT_FINISH_MS - 10 && deadline - start <= CSRV_OUT_FINISH_MS);
+  csrv_out_finish(&out, deadline);
+  int64_t waited = csrv_now_ms() - start;
+  CHECK(waited >= CSRV_OUT_FINISH_MS - 10 && waited < CSRV_OUT_FINISH_MS + 500);
+  CHECK(queued(&out) == 3);
+  struct linger linger;
+  socklen_t linger_len = sizeof(linger);
+  CHECK(getsockopt(sender, SOL_SOCKET, SO_LINGER, &linger, &linger_len) == 0);
+  CHECK(linger.l_onoff && linger.l_linger == 0);
+
+  close(sender);
+  csrv_out_cleanup(&out);
+  CHECK(out.head == NULL);
+
+  // The reset reaches the peer instead of the data
+  char buffer[TEST_BIG];
+  ssize_t sz_read;
+  size_t n_read = 0;
+  while((sz_read = read(peer, buffer, sizeof(buffer))) > 0) {
+    n_read += sz_read;
+  }
+  CHECK(sz_read == -1 && errno == ECONNRESET);
+  CHECK(n_read < 2 * TEST_BIG + 200);
+  close(peer);
+
+  // A draining server waits no longer than its drain deadline
+  csrv.drain_deadline = csrv_now_ms() + 50;
+  csrv.draining = true;
+  CHECK(csrv_out_deadline(&csrv) == csrv.drain_deadline);
+  csrv.drain_deadline = csrv_now_ms() + 60 * 1000;
+  CHECK(csrv_out_deadline(&csrv) <= csrv_now_ms() + CSRV_OUT_FINISH_MS);
+  csrv.draining = false;
+}
+
+int main(int argc, char **argv) {
+  test_server(&csrv, NULL);
+  check_copy_fallback();
+  check_reap_on_read();
+  check_finish();
+  check_finish_deadline();
+
+  fclose(csrv.log);
+  return test_failures != 0;
+}
@@ -0,0 +1,350 @@
+#include "sys/socket.h"
+#include "netinet/in.h"
+#include "arpa/inet.h"
+#include "test.h"
+
+// The reverse proxy in front of a second server: a csrv on a loopback port,
+// run by csrv_listen() on its own thread with the event model. Upstream
+// connections are pooled, a dead upstream is failed over from and probed
+// until it is back, and chunked bodies are relayed as they arrive.
+
+#define TEST_TIMEOUT_MS 10000
+#define TEST_STREAM_WAIT_MS 5000
+
+static struct Csrv upstream;
+static struct Csrv csrv;
+
+// Set by the client once the first chunk of /stream reached it, and by the
+// upstream if it gave up waiting for that
+static bool first_seen = false;
+static bool waited_out = false;
+
+static void write_body(struct CsrvResponse *resp, const char *text) {
+  csrv_str_vec_pushn(&resp->body, (char *) text, strlen(text));
+}
+
+static void upstream_handler(struct CsrvRequest *req, struct CsrvResponse *resp) {
+  char line[64];
+  if(strcmp(req->headers.uri, "/port") == 0) {
+    // The proxy's end of the upstream connection, which names the connection
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    getpeername(req->socket_handle, (struct sockaddr *) &addr, &addr_len);
+    snprintf(line, sizeof(line), "%u", ntohs(addr.sin_port));
+    write_body(resp, line);
+  } else if(strcmp(req->headers.uri, "/chunked") == 0) {
+    // Chunks larger than the proxy's buffer, and a trailer
+    resp->written = true;
+    char *head = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+    csrv_response_write_head(resp, head, strlen(head));
+    for(size_t size = 1; size <= 40000; size *= 7) {
+      char *data = (char *) malloc(size);
+      memset(data, 'a' + size % 26, size);
+      snprintf(line, sizeof(line), "%zx\r\n", size);
+      csrv_response_write_body(resp, line, strlen(line));
+      csrv_response_write_body(resp, data, size);
+      csrv_response_write_body(resp, "\r\n", 2);
+      free(data);
+    }
+    char *end = "0\r\nX-Checksum: 1\r\n\r\n";
+    csrv_response_write_body(resp, end, strlen(end));
+  } else if(strcmp(req->headers.uri, "/stream") == 0) {
+    // The second chunk only goes once the client has the first
+    resp->written = true;
+    char *first = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nfirst\r\n";
+    csrv_response_write_head(resp, first, strlen(first));
+    for(int waited = 0; !__atomic_load_n(&first_seen, __ATOMIC_ACQUIRE); waited += 10) {
+      if(waited >= TEST_STREAM_WAIT_MS) {
+        waited_out = true;
+        break;
+      }
+      usleep(10 * 1000);
+    }
+    char *rest = "4\r\nlast\r\n0\r\n\r\n";
+    csrv_response_write_body(resp, rest, strlen(rest));
+  } else {
+    // Echo
+    char buffer[256];
+    ssize_t sz_read;
+    while((sz_read = csrv_read_body(req, buffer, sizeof(buffer))) > 0) {
+      csrv_str_vec_pushn(&resp->body, buffer, sz_read);
+    }
+  }
+}
+
+static void *upstream_thread(void *arg) {
+  csrv_listen(&upstream);
+  return NULL;
+}
+
+// Start the upstream on a port of the kernel's choosing; returns "host:port"
+static char *upstream_start(void) {
+  memset(&upstream, 0, sizeof(upstream));
+  upstream.model = CSRV_EVENT;
+  upstream.n_workers = 1;
+  upstream.log = fopen("/dev/null", "a");
+  upstream.handler = upstream_handler;
+  upstream.status = CSRV_RETRY_EXCEEDED;
+  CHECK(csrv_add_listener(&upstream, "127.0.0.1:0") == 0);
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, upstream_thread, NULL) == 0);
+  pthread_detach(thread);
+  for(int waited = 0; __atomic_load_n(&upstream.status, __ATOMIC_ACQUIRE) != CSRV_OK; waited++) {
+    if(waited == 1000) {
+      fprintf(stderr, "upstream failed to start, status=%d\n", upstream.status);
+      exit(1);
+    }
+    usleep(1000);
+  }
+
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  getsockname(upstream.listeners[0].socket_handle, (struct sockaddr *) &addr, &addr_len);
+  static char name[32];
+  snprintf(name, sizeof(name), "127.0.0.1:%u", ntohs(addr.sin_port));
+  return name;
+}
+
+// A loopback port that is bound but not listening, so connecting to it is
+// refused. The socket is left to the caller.
+static int dead_port(char *name, size_t name_size) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  CHECK(bind(fd, (struct sockaddr *) &addr, addr_len) == 0);
+  getsockname(fd, (struct sockaddr *) &addr, &addr_len);
+  snprintf(name, name_size, "127.0.0.1:%u", ntohs(addr.sin_port));
+  return fd;
+}
+
+// Send requests through the proxy on one client connection; returns what
+// came back, NUL terminated, for the caller to free
+static char *request(const char *text) {
+  struct CsrvStrVec output;
+  csrv_str_vec_init(&output);
+  CHECK(test_exchange(&csrv, text, strlen(text), &output, TEST_TIMEOUT_MS) == 0);
+  csrv_str_vec_pushc(&output, '\0');
+  return output.string;
+}
+
+// The bodies of the Content-Length responses in output, one per line
+static void bodies(char *output, char *out, size_t out_size) {
+  out[0] = '\0';
+  char *pos = output;
+  while((pos = strstr(pos, "Content-Length: ")) != NULL) {
+    size_t len = strtoul(pos + 16, NULL, 10);
+    char *body = strstr(pos, "\r\n\r\n");
+    if(body == NULL) {
+      break;
+    }
+    body += 4;
+    size_t used = strlen(out);
+    snprintf(out + used, out_size - used, "%.*s\n", (int) len, body);
+    pos = body + len;
+  }
+}
+
+static void check_pooling(char *live) {
+  struct CsrvProxy proxy;
+  CHECK(csrv_proxy_init(&proxy, &live, 1) == 0);
+  csrv.proxy = &proxy;
+
+  // Keep-alive requests on one client connection share the upstream one
+  char *output = request("GET /port HTTP/1.1\r\n\r\nGET /port HTTP/1.1\r\n\r\n"
+                         "POST /echo HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello"
+                         "GET /port HTTP/1.1\r\nConnection: close\r\n\r\n");
+  char found[256];
+  bodies(output, found, sizeof(found));
+  char port[16];
+  int n = 0;
+  sscanf(found, "%15[0-9]%n", port, &n);
+  char expected[256];
+  snprintf(expected, sizeof(expected), "%s\n%s\nhello\n%s\n", port, port, port);
+  if(n == 0 || strcmp(found, expected) != 0) {
+    fprintf(stderr, "pooled requests got\n%s\n", output);
+    test_failures++;
+  }
+  free(output);
+
+  // Another client connection is served by another thread here, with
+  // pools of its own
+  output = request("GET /port HTTP/1.1\r\nConnection: close\r\n\r\n");
+  bodies(output, found, sizeof(found));
+  CHECK(found[0] != '\0' && strncmp(found, port, strlen(port)) != 0);
+  free(output);
+
+  csrv_proxy_cleanup(&proxy);
+  csrv.proxy = NULL;
+}
+
+static void check_failover(char *live) {
+  char dead[32];
+  int dead_fd = dead_port(dead, sizeof(dead));
+  char *addrs[] = { dead, live };
+  struct CsrvProxy proxy;
+  CHECK(csrv_proxy_init(&proxy, addrs, 2) == 0);
+  csrv.proxy = &proxy;
+
+  // Both are idle, so the dead one is tried first, marked down and skipped
+  char *output = request("GET /echo HTTP/1.1\r\nContent-Length: 2\r\n\r\nokGET /echo HTTP/1.1\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok");
+  char found[256];
+  bodies(output, found, sizeof(found));
+  CHECK(strcmp(found, "ok\nok\n") == 0);
+  CHECK(proxy.upstreams[0].retry_at > csrv_now_ms());
+  CHECK(proxy.upstreams[1].retry_at == 0);
+  free(output);
+  csrv_proxy_cleanup(&proxy);
+
+  // With nothing left to try the client gets a 502
+  CHECK(csrv_proxy_init(&proxy, addrs, 1) == 0);
+  output = request("GET / HTTP/1.1\r\n\r\n");
+  CHECK(strncmp(output, "HTTP/1.1 502", 12) == 0);
+  free(output);
+
+  csrv_proxy_cleanup(&proxy);
+  csrv.proxy = NULL;
+  close(dead_fd);
+}
+
+// Polls until the probe is through with what it started, or gives up
+static void probe_settle(struct CsrvProxy *proxy) {
+  for(int i = 0; i < 100 && proxy->upstreams[0].probe_fd != -1; i++) {
+    usleep(10000);
+    csrv_proxy_probe(&csrv, proxy);
+  }
+  CHECK(proxy->upstreams[0].probe_fd == -1);
+}
+
+// A downed upstream is handed to the prober and stays out of rotation, past
+// its retry time, until the prober gets a connection through
+static void check_probe(char *live) {
+  char dead[32];
+  int dead_fd = dead_port(dead, sizeof(dead));
+  char *addrs[] = { dead, live };
+  struct CsrvProxy proxy;
+  CHECK(csrv_proxy_init(&proxy, addrs, 2) == 0);
+  csrv.proxy = &proxy;
+  struct CsrvUpstream *up = &proxy.upstreams[0];
+
+  char *output = request("GET /echo HTTP/1.1\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok");
+  free(output);
+  int64_t retry_at = up->retry_at;
+  CHECK(retry_at > csrv_now_ms());
+
+  // Not due yet: taken over, but not connected to
+  csrv_proxy_probe(&csrv, &proxy);
+  CHECK(up->probed && up->probe_fd == -1 && up->retry_at == retry_at);
+
+  // Due, but requests leave it to the prober
+  up->retry_at = csrv_now_ms() - 1;
+  output = request("GET /echo HTTP/1.1\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok");
+  CHECK(strstr(output, "\r\n\r\nok") != NULL);
+  free(output);
+  CHECK(up->retry_at < csrv_now_ms());
+
+  // Still refusing: down for another CSRV_PROXY_RETRY_MS
+  csrv_proxy_probe(&csrv, &proxy);
+  probe_settle(&proxy);
+  CHECK(up->probed && up->retry_at > csrv_now_ms());
+
+  // Back up: the next due probe puts it back in rotation
+  CHECK(listen(dead_fd, 4) == 0);
+  up->retry_at = csrv_now_ms() - 1;
+  csrv_proxy_probe(&csrv, &proxy);
+  probe_settle(&proxy);
+  CHECK(!up->probed && up->retry_at == 0);
+
+  csrv_proxy_cleanup(&proxy);
+  csrv.proxy = NULL;
+  close(dead_fd);
+}
+
+struct StreamClient {
+  int handle;
+  struct CsrvStrVec output;
+};
+
+static void *stream_client(void *arg) {
+  struct StreamClient *client = (struct StreamClient *) arg;
+  char buffer[4096];
+  ssize_t sz_read;
+  while((sz_read = read(client->handle, buffer, sizeof(buffer))) > 0) {
+    csrv_str_vec_pushn(&client->output, buffer, sz_read);
+    csrv_str_vec_pushc(&client->output, '\0');
+    client->output.length--;
+    if(strstr(client->output.string, "5\r\nfirst\r\n") != NULL) {
+      __atomic_store_n(&first_seen, true, __ATOMIC_RELEASE);
+    }
+  }
+  return NULL;
+}
+
+static void check_chunked(char *live) {
+  struct CsrvProxy proxy;
+  CHECK(csrv_proxy_init(&proxy, &live, 1) == 0);
+  csrv.proxy = &proxy;
+
+  // Relayed verbatim: sizes, data, trailer and all
+  struct CsrvStrVec expected;
+  csrv_str_vec_init(&expected);
+  for(size_t size = 1; size <= 40000; size *= 7) {
+    char line[32];
+    snprintf(line, sizeof(line), "%zx\r\n", size);
+    csrv_str_vec_pushn(&expected, line, strlen(line));
+    for(size_t i = 0; i < size; i++) {
+      csrv_str_vec_pushc(&expected, 'a' + size % 26);
+    }
+    csrv_str_vec_pushn(&expected, "\r\n", 2);
+  }
+  csrv_str_vec_pushn(&expected, "0\r\nX-Checksum: 1\r\n\r\n", 21);
+  csrv_str_vec_pushc(&expected, '\0');
+
+  char *output = request("GET /chunked HTTP/1.1\r\nConnection: close\r\n\r\n");
+  char *body = strstr(output, "\r\n\r\n");
+  CHECK(strncmp(output, "HTTP/1.1 200", 12) == 0);
+  CHECK(strcasestr(output, "Transfer-Encoding: chunked\r\n") != NULL);
+  if(body == NULL || strcmp(body + 4, expected.string) != 0) {
+    fprintf(stderr, "chunked body of %zu bytes relayed as %zu\n", expected.length - 1, body != NULL ? strlen(body + 4) : 0);
+    test_failures++;
+  }
+  free(output);
+  free(expected.string);
+
+  // The first chunk reaches the client while the upstream holds the rest
+  int handles[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, handles) == 0);
+  struct TestConn conn = { &csrv, handles[1] };
+  struct StreamClient client = { handles[0] };
+  csrv_str_vec_init(&client.output);
+  pthread_t server_thread, client_thread;
+  CHECK(pthread_create(&server_thread, NULL, test_conn_thread, &conn) == 0);
+  CHECK(pthread_create(&client_thread, NULL, stream_client, &client) == 0);
+  char *text = "GET /stream HTTP/1.1\r\nConnection: close\r\n\r\n";
+  CHECK(write(handles[0], text, strlen(text)) == (ssize_t) strlen(text));
+  pthread_join(server_thread, NULL);
+  pthread_join(client_thread, NULL);
+  CHECK(!waited_out);
+  CHECK(client.output.string != NULL && strstr(client.output.string, "\r\n\r\n5\r\nfirst\r\n4\r\nlast\r\n0\r\n\r\n") != NULL);
+  free(client.output.string);
+  close(handles[0]);
+
+  csrv_proxy_cleanup(&proxy);
+  csrv.proxy = NULL;
+}
+
+int main(void) {
+  char *live = upstream_start();
+  test_server(&csrv, csrv_proxy_handler);
+
+  check_pooling(live);
+  check_failover(live);
+  check_probe(live);
+  check_chunked(live);
+
+  fclose(csrv.log);
+  return test_failures != 0;
+}
@@ -0,0 +1,257 @@
+#include "netinet/in.h"
+#include "arpa/inet.h"
+#include "test.h"
+
+// The rate limit table on its own: refills, the bucket clock running behind
+// or wrapping, CLOCK eviction, workers racing on one table, and how a
+// connection over its limit is turned away. The table's clock is moved by
+// shifting its epoch.
+
+#define TEST_THREADS 8
+
+static struct Csrv csrv;
+
+static struct CsrvRateLimit *limit_init(unsigned int rate, unsigned int burst) {
+  csrv.rate_limit = rate;
+  csrv.rate_burst = burst;
+  csrv.rate_limit_slots = CSRV_RATE_LIMIT_WAYS;
+  CHECK(csrv_rate_limit_init(&csrv) == 0);
+  CHECK(csrv.limiter->n_sets == 1);
+  return csrv.limiter;
+}
+
+static struct CsrvRateSlot *find_slot(struct CsrvRateLimit *limit, uint64_t key) {
+  for(int i = 0; i < CSRV_RATE_LIMIT_WAYS; i++) {
+    if(limit->slots[i].key == key) {
+      return &limit->slots[i];
+    }
+  }
+  return NULL;
+}
+
+// How many of n takes were allowed
+static int take(struct CsrvRateLimit *limit, uint64_t key, int n) {
+  int allowed = 0;
+  for(int i = 0; i < n; i++) {
+    allowed += csrv_rate_limit_take(limit, key);
+  }
+  return allowed;
+}
+
+static void check_refill(void) {
+  // A token every 100 ms, 5 at most
+  struct CsrvRateLimit *limit = limit_init(10, 5);
+  CHECK(take(limit, 1, 6) == 5);
+
+  // 250 ms later: two tokens and a half
+  limit->epoch -= 250;
+  CHECK(take(limit, 1, 3) == 2);
+
+  // An hour later: no more than the burst
+  limit->epoch -= 3600 * 1000;
+  CHECK(take(limit, 1, 6) == 5);
+
+  // A worker whose clock reads behind the bucket's gets nothing back, and
+  // leaves the bucket's time alone
+  struct CsrvRateSlot *slot = find_slot(limit, 1);
+  CHECK(slot != NULL);
+  uint64_t stamp = slot->state >> 32;
+  limit->epoch += 50;
+  CHECK(take(limit, 1, 1) == 0);
+  CHECK(slot->state >> 32 == stamp);
+
+  // So once the clock is 100 ms past the bucket again, one token is due
+  limit->epoch -= 150;
+  CHECK(take(limit, 1, 2) == 1);
+
+  // A bucket that looks far in the future was left alone long enough for
+  // the 32-bit clock to wrap: it starts full
+  limit->epoch += 2 * 60 * 1000 + 1000;
+  CHECK(take(limit, 1, 6) == 5);
+
+  // Key 0 is a client that isn't limited, and takes no slot
+  CHECK(take(limit, 0, 100) == 100);
+  for(int i = 1; i < CSRV_RATE_LIMIT_WAYS; i++) {
+    CHECK(limit->slots[i].key == 0 && limit->slots[i].state == 0);
+  }
+
+  csrv_rate_limit_cleanup(&csrv);
+}
+
+// A bucket emptied in the table's first millisecond packs to the same time
+// and token count as a slot just handed out. It must stay empty.
+static void check_sentinel(void) {
+  struct CsrvRateLimit *limit = limit_init(1, 1);
+  bool tried = false;
+  for(int attempt = 0; attempt < 100 && !tried; attempt++) {
+    memset(limit->slots, 0, CSRV_RATE_LIMIT_WAYS * sizeof(struct CsrvRateSlot));
+    limit->hands[0] = 0;
+    limit->epoch = csrv_now_ms();
+    CHECK(take(limit, 7, 1) == 1);
+    tried = csrv_now_ms() == limit->epoch;
+  }
+  CHECK(tried);
+
+  CHECK(find_slot(limit, 7) != NULL && find_slot(limit, 7)->state != 0);
+  CHECK(take(limit, 7, 3) == 0);
+  csrv_rate_limit_cleanup(&csrv);
+}
+
+static void check_clock(void) {
+  // Next to no refill, so every count below is exact
+  struct CsrvRateLimit *limit = limit_init(1, 2);
+
+  // Eight clients fill the set's eight ways in order
+  for(uint64_t key = 1; key <= 8; key++) {
+    CHECK(take(limit, key, 1) == 1);
+    CHECK(find_slot(limit, key) == &limit->slots[key - 1]);
+  }
+  CHECK(take(limit, 1, 2) == 1);
+
+  // Everyone was used since the hand last passed: a full turn clears them
+  // all, and the slot it started from goes to the new client with a full
+  // bucket, whatever the evicted one had left
+  CHECK(take(limit, 9, 3) == 2);
+  CHECK(find_slot(limit, 1) == NULL);
+  CHECK(find_slot(limit, 9) == &limit->slots[0]);
+  for(int i = 1; i < CSRV_RATE_LIMIT_WAYS; i++) {
+    CHECK(limit->slots[i].referenced == 0);
+  }
+
+  // Unused since: the next way's client goes first
+  CHECK(take(limit, 10, 1) == 1);
+  CHECK(find_slot(limit, 2) == NULL);
+  CHECK(find_slot(limit, 10) == &limit->slots[1]);
+
+  // A client seen again gets a second chance, and the hand moves past it
+  CHECK(take(limit, 3, 1) == 1);
+  CHECK(take(limit, 11, 1) == 1);
+  CHECK(find_slot(limit, 3) == &limit->slots[2]);
+  CHECK(limit->slots[2].referenced == 0);
+  CHECK(find_slot(limit, 4) == NULL);
+  CHECK(find_slot(limit, 11) == &limit->slots[3]);
+
+  // And the evicted come back as new clients
+  CHECK(take(limit, 1, 3) == 2);
+
+  csrv_rate_limit_cleanup(&csrv);
+}
+
+struct Racer {
+  struct CsrvRateLimit *limit;
+  pthread_barrier_t *start;
+  uint64_t key_base;
+  int n_keys;
+  int n_takes;
+  int allowed;
+};
+
+static void *racer_run(void *arg) {
+  struct Racer *racer = (struct Racer *) arg;
+  pthread_barrier_wait(racer->start);
+  for(int i = 0; i < racer->n_takes; i++) {
+    racer->allowed += csrv_rate_limit_take(racer->limit, racer->key_base + i % racer->n_keys);
+  }
+  return NULL;
+}
+
+static int race(struct CsrvRateLimit *limit, struct Racer *racers, int n_keys, int n_takes, bool own_keys) {
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, TEST_THREADS);
+  pthread_t threads[TEST_THREADS];
+  for(int t = 0; t < TEST_THREADS; t++) {
+    racers[t] = (struct Racer) { limit, &start, own_keys ? (uint64_t) (t + 1) << 32 : 42, n_keys, n_takes, 0 };
+    CHECK(pthread_create(&threads[t], NULL, racer_run, &racers[t]) == 0);
+  }
+
+  int allowed = 0;
+  for(int t = 0; t < TEST_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+    allowed += racers[t].allowed;
+  }
+  pthread_barrier_destroy(&start);
+  return allowed;
+}
+
+static void check_race(void) {
+  struct Racer racers[TEST_THREADS];
+
+  // Every worker on one client's bucket: no token is handed out twice and
+  // none is lost, so exactly the burst gets through
+  struct CsrvRateLimit *limit = limit_init(1, 1000);
+  CHECK(take(limit, 42, 1) == 1);
+  int64_t start = csrv_now_ms();
+  int allowed = race(limit, racers, 1, 500, false);
+  int64_t refilled = (csrv_now_ms() - start) / 1000;
+  if(allowed < 999 || allowed > 999 + refilled) {
+    fprintf(stderr, "%d tokens taken from a bucket of 999\n", allowed);
+    test_failures++;
+  }
+  csrv_rate_limit_cleanup(&csrv);
+
+  // Eight times the clients the set has ways for, so slots are claimed
+  // from under each other all the time. The table stays consistent: no
+  // client in two ways, every bucket a real one.
+  limit = limit_init(1000, 10);
+  race(limit, racers, CSRV_RATE_LIMIT_WAYS, 20000, true);
+  for(int i = 0; i < CSRV_RATE_LIMIT_WAYS; i++) {
+    struct CsrvRateSlot *slot = &limit->slots[i];
+    CHECK(slot->key != 0);
+    CHECK(slot->state != 0);
+    CHECK(((uint32_t) slot->state & 0x7fffffff) <= limit->burst * 1000);
+    for(int j = 0; j < i; j++) {
+      CHECK(limit->slots[j].key != slot->key);
+    }
+  }
+  csrv_rate_limit_cleanup(&csrv);
+}
+
+// A connection over its limit, whose client already sent its request: it is
+// answered with the 429 and a clean end of stream
+static void check_accept(void) {
+  limit_init(1, 1);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr("192.0.2.1");
+  const char *request = "GET / HTTP/1.1\r\nHost: x\r\n\r\n";
+
+  for(int i = 0; i < 2; i++) {
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CHECK(write(fds[0], request, strlen(request)) == (ssize_t) strlen(request));
+
+    bool accepted = csrv_rate_limit_accept(&csrv, fds[1], (struct sockaddr *) &addr);
+    CHECK(accepted == (i == 0));
+    if(accepted) {
+      close(fds[1]);
+    } else {
+      char response[256];
+      ssize_t len = read(fds[0], response, sizeof(response));
+      CHECK(len == sizeof(CSRV_RATE_LIMIT_RESPONSE) - 1);
+      CHECK(len > 0 && memcmp(response, CSRV_RATE_LIMIT_RESPONSE, len) == 0);
+      CHECK(read(fds[0], response, sizeof(response)) == 0);
+    }
+    close(fds[0]);
+  }
+
+  // Unix socket clients have no address to be limited by
+  struct sockaddr unix_addr = { AF_UNIX };
+  for(int i = 0; i < 3; i++) {
+    CHECK(csrv_rate_limit_accept(&csrv, -1, &unix_addr));
+  }
+  csrv_rate_limit_cleanup(&csrv);
+}
+
+int main(void) {
+  test_server(&csrv, NULL);
+
+  check_refill();
+  check_sentinel();
+  check_clock();
+  check_race();
+  check_accept();
+
+  fclose(csrv.log);
+  return test_failures != 0;
+}
@@ -0,0 +1,191 @@
+#include "sys/socket.h"
+#include "netinet/in.h"
+#include "arpa/inet.h"
+#include "signal.h"
+#include "test.h"
+
+// Graceful restart under CSRV_FORK, with this program as both servers: the
+// old one runs csrv_listen() on a thread and restarts into a copy of us,
+// started with the mode as argv[1], that takes the listener over SCM_RIGHTS.
+// The old server keeps accepting while the new one starts up, and a child
+// that is still busy when the old server goes is cut off at the drain
+// deadline.
+
+#define TEST_TIMEOUT_MS 10000
+#define TEST_SLOW_MS (30 * 1000)
+// How long the new process takes before it asks for the listener
+#define TEST_STARTUP_MS 1500
+
+static struct Csrv csrv;
+static char *restart_argv[3];
+
+static void write_body(struct CsrvResponse *resp, const char *text) {
+  csrv_str_vec_pushn(&resp->body, (char *) text, strlen(text));
+}
+
+static void old_handler(struct CsrvRequest *req, struct CsrvResponse *resp) {
+  if(strcmp(req->headers.uri, "/slow") == 0) {
+    // Signals cut the sleeps short, not the wait
+    int64_t start = csrv_now_ms();
+    while(csrv_now_ms() - start < TEST_SLOW_MS) {
+      usleep(100 * 1000);
+    }
+    write_body(resp, "slow done");
+  } else {
+    write_body(resp, "old");
+  }
+}
+
+static void new_handler(struct CsrvRequest *req, struct CsrvResponse *resp) {
+  write_body(resp, "new");
+}
+
+// The restarted process: take the listeners over, serve one connection
+static int new_process(char *mode) {
+  test_server(&csrv, new_handler);
+  CHECK(csrv_add_listener(&csrv, "127.0.0.1:0") == 0);
+  if(strcmp(mode, "mismatch") == 0) {
+    // One more listener than the old process has: it must not hand over
+    CHECK(csrv_add_listener(&csrv, "127.0.0.1:0") == 0);
+    return csrv_handoff_receive(&csrv) == -1 ? 0 : 1;
+  }
+
+  usleep(TEST_STARTUP_MS * 1000);
+  if(csrv_handoff_receive(&csrv) != 1) {
+    return 1;
+  }
+  // The listener is non-blocking
+  struct pollfd pfd = { csrv.listeners[0].socket_handle, POLLIN, 0 };
+  int handle = poll(&pfd, 1, TEST_TIMEOUT_MS) == 1 ? accept4(pfd.fd, NULL, NULL, SOCK_CLOEXEC) : -1;
+  if(handle == -1) {
+    return 1;
+  }
+  csrv_serve_connection(&csrv, handle);
+  return 0;
+}
+
+static void *server_thread(void *arg) {
+  // Only this thread takes SIGUSR2, so its poll() is the one interrupted
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR2);
+  pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+  csrv_listen(&csrv);
+  return NULL;
+}
+
+static int connect_to(unsigned int port) {
+  int handle = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  CHECK(connect(handle, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  return handle;
+}
+
+// Everything up to the server hanging up, NUL terminated; -1 if that took
+// longer than timeout_ms
+static int read_all(int handle, char *out, size_t out_size, int timeout_ms) {
+  size_t len = 0;
+  int64_t deadline = csrv_now_ms() + timeout_ms;
+  for(;;) {
+    struct pollfd pfd = { handle, POLLIN, 0 };
+    int64_t left = deadline - csrv_now_ms();
+    if(left <= 0 || poll(&pfd, 1, (int) left) != 1) {
+      out[len] = '\0';
+      return -1;
+    }
+    ssize_t sz_read = read(handle, out + len, out_size - len - 1);
+    if(sz_read <= 0) {
+      out[len] = '\0';
+      return 0;
+    }
+    len += sz_read;
+  }
+}
+
+// Which server answers a new connection, and how soon
+static void check_answer(unsigned int port, const char *body, int within_ms) {
+  int64_t start = csrv_now_ms();
+  int handle = connect_to(port);
+  const char *request = "GET / HTTP/1.1\r\nConnection: close\r\n\r\n";
+  CHECK(write(handle, request, strlen(request)) == (ssize_t) strlen(request));
+  char response[1024];
+  CHECK(read_all(handle, response, sizeof(response), TEST_TIMEOUT_MS) == 0);
+  close(handle);
+
+  char *found = strstr(response, "\r\n\r\n");
+  CHECK(found != NULL && strcmp(found + 4, body) == 0);
+  if(csrv_now_ms() - start > within_ms) {
+    fprintf(stderr, "answered in %lld ms, expected %d\n", (long long) (csrv_now_ms() - start), within_ms);
+    test_failures++;
+  }
+}
+
+int main(int argc, char **argv) {
+  if(argc > 1) {
+    return new_process(argv[1]);
+  }
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  test_server(&csrv, old_handler);
+  CHECK(csrv_add_listener(&csrv, "127.0.0.1:0") == 0);
+  csrv.drain_timeout_ms = 1000;
+  csrv.status = CSRV_RETRY_EXCEEDED;
+  restart_argv[0] = argv[0];
+  csrv.argv = restart_argv;
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, server_thread, NULL) == 0);
+  for(int waited = 0; __atomic_load_n(&csrv.status, __ATOMIC_ACQUIRE) != CSRV_OK; waited++) {
+    if(waited == 1000) {
+      fprintf(stderr, "server failed to start, status=%d\n", csrv.status);
+      return 1;
+    }
+    usleep(1000);
+  }
+
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  getsockname(csrv.listeners[0].socket_handle, (struct sockaddr *) &addr, &addr_len);
+  unsigned int port = ntohs(addr.sin_port);
+  check_answer(port, "old", 1000);
+
+  // A new process with other listeners never acknowledges: we keep them
+  restart_argv[1] = "mismatch";
+  kill(getpid(), SIGUSR2);
+  usleep(500 * 1000);
+  check_answer(port, "old", 1000);
+
+  // A connection busy when the old server goes
+  int slow = connect_to(port);
+  const char *request = "GET /slow HTTP/1.1\r\n\r\n";
+  CHECK(write(slow, request, strlen(request)) == (ssize_t) strlen(request));
+
+  // While the new process starts up the old one still answers, at once
+  restart_argv[1] = "slow";
+  kill(getpid(), SIGUSR2);
+  usleep(200 * 1000);
+  check_answer(port, "old", 1000);
+
+  // Once it acknowledges, the old one leaves and the new one answers
+  pthread_join(thread, NULL);
+  int64_t handed_off = csrv_now_ms();
+  check_answer(port, "new", TEST_TIMEOUT_MS);
+
+  // The busy child is dropped at its drain deadline, not let finish
+  char response[1024];
+  CHECK(read_all(slow, response, sizeof(response), TEST_TIMEOUT_MS) == 0);
+  CHECK(strstr(response, "slow done") == NULL);
+  CHECK(csrv_now_ms() - handed_off < 5000);
+  close(slow);
+
+  fclose(csrv.log);
+  return test_failures != 0;
+}
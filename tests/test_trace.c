@@ -0,0 +1,298 @@
+#include "sys/stat.h"
+#include "sys/syscall.h"
+#include "signal.h"
+#include "fcntl.h"
+#include "test.h"
+
+// Tracing on its own: how many requests are sampled, then spans recorded by
+// hand and the Chrome trace-event lines they come out as. Dumps happen when
+// a buffer fills, on SIGUSR1 and on the interval; with the writer thread
+// running they are handed over, and a thread that dumps doesn't wait for the
+// file (a FIFO nobody has opened yet).
+
+#define TEST_THREADS 4
+#define TEST_THREAD_SPANS 1000
+#define TEST_CHILDREN 400
+
+static struct Csrv csrv;
+static char trace_path[] = "/tmp/csrv-trace-XXXXXX";
+
+struct TraceLine {
+  char name[32];
+  double ts;
+  double dur;
+  int pid;
+  int tid;
+  size_t id;
+};
+
+static bool parse_line(const char *line, struct TraceLine *out) {
+  int consumed = 0;
+  int n = sscanf(line, "{\"name\":\"%31[^\"]\",\"cat\":\"csrv\",\"ph\":\"X\",\"ts\":%lf,\"dur\":%lf,"
+                 "\"pid\":%d,\"tid\":%d,\"args\":{\"id\":%zu}},%n",
+                 out->name, &out->ts, &out->dur, &out->pid, &out->tid, &out->id, &consumed);
+  return n == 6 && consumed > 0 && line[consumed] == '\n';
+}
+
+// Every line of the trace file after the opening "[": parsed into lines
+// (up to max), the count returned, -1 if any line is malformed
+static int read_trace(const char *path, struct TraceLine *lines, int max) {
+  FILE *file = fopen(path, "r");
+  if(file == NULL) {
+    return -1;
+  }
+  char line[512];
+  int n = 0;
+  bool ok = fgets(line, sizeof(line), file) != NULL && strcmp(line, "[\n") == 0;
+  while(ok && fgets(line, sizeof(line), file) != NULL) {
+    struct TraceLine parsed;
+    ok = parse_line(line, &parsed);
+    if(ok && n < max) {
+      lines[n] = parsed;
+    }
+    n++;
+  }
+  fclose(file);
+  return ok ? n : -1;
+}
+
+// Empty the trace file, leaving the array opened
+static void truncate_trace(void) {
+  FILE *file = fopen(trace_path, "w");
+  fputs("[\n", file);
+  fclose(file);
+}
+
+static void fake_request(struct CsrvRequest *req, size_t id) {
+  memset(req, 0, sizeof(*req));
+  req->csrv = &csrv;
+  req->id = id;
+  req->traced = true;
+}
+
+struct Sampler {
+  size_t first_id;
+  size_t n_requests;
+  size_t n_sampled;
+};
+
+static void *sampler_thread(void *arg) {
+  struct Sampler *sampler = (struct Sampler *) arg;
+  for(size_t i = 0; i < sampler->n_requests; i++) {
+    sampler->n_sampled += csrv_trace_sampled(&csrv, sampler->first_id + i);
+  }
+  return NULL;
+}
+
+static size_t sample_on_thread(size_t first_id, size_t n_requests) {
+  struct Sampler sampler = { first_id, n_requests, 0 };
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, sampler_thread, &sampler) == 0);
+  pthread_join(thread, NULL);
+  return sampler.n_sampled;
+}
+
+static void check_sampled(void) {
+  csrv.trace_sample = 0;
+  CHECK(sample_on_thread(0, 1000) == 0);
+  csrv.trace_sample = 1;
+  CHECK(sample_on_thread(0, 1000) == 1000);
+
+  // 1 in N on one thread, however the ids run
+  csrv.trace_sample = 10;
+  size_t n_sampled = sample_on_thread(12345, 100000);
+  CHECK(n_sampled >= 9000 && n_sampled <= 11000);
+
+  // Forked children each see one connection's block of ids, starting fresh
+  csrv.trace_sample = 4;
+  size_t n_first = 0;
+  size_t n_later = 0;
+  for(size_t i = 0; i < TEST_CHILDREN; i++) {
+    n_first += sample_on_thread(i * CSRV_KEEPALIVE_MAX, 1);
+    n_later += sample_on_thread(i * CSRV_KEEPALIVE_MAX, 4);
+  }
+  CHECK(n_first >= TEST_CHILDREN / 4 - 50 && n_first <= TEST_CHILDREN / 4 + 50);
+  CHECK(n_later >= TEST_CHILDREN - 150 && n_later <= TEST_CHILDREN + 150);
+}
+
+static void check_spans(void) {
+  int tid = (int) syscall(SYS_gettid);
+  struct CsrvRequest req;
+  fake_request(&req, 7);
+
+  // The accept span goes to the connection's first request only
+  csrv_trace_accepted(csrv_trace_clock());
+  csrv_trace_accept_span(&req);
+  csrv_trace_accept_span(&req);
+
+  uint64_t start = csrv_trace_clock();
+  usleep(20 * 1000);
+  CSRV_TRACE_END(&req, "handler", start);
+  req.traced = false;
+  CSRV_TRACE_END(&req, "write", start);
+  csrv_trace_dump(&csrv);
+  // Nothing new to dump
+  csrv_trace_dump(&csrv);
+
+  struct TraceLine lines[2];
+  CHECK(read_trace(trace_path, lines, 2) == 2);
+  CHECK(strcmp(lines[0].name, "accept") == 0 && lines[0].id == 7);
+  CHECK(lines[0].dur >= 0 && lines[0].dur < 1000);
+  CHECK(strcmp(lines[1].name, "handler") == 0 && lines[1].id == 7);
+  CHECK(lines[1].pid == getpid() && lines[1].tid == tid);
+  CHECK(lines[1].dur >= 15 * 1000 && lines[1].dur < 1000 * 1000);
+  CHECK(lines[1].ts >= lines[0].ts);
+  truncate_trace();
+
+  // A full buffer is written out before the next span
+  req.traced = true;
+  for(size_t i = 0; i < CSRV_TRACE_SPANS; i++) {
+    CSRV_TRACE_END(&req, "read", csrv_trace_clock());
+  }
+  CHECK(read_trace(trace_path, NULL, 0) == 0);
+  CSRV_TRACE_END(&req, "read", csrv_trace_clock());
+  CHECK(read_trace(trace_path, NULL, 0) == CSRV_TRACE_SPANS);
+  csrv_trace_dump(&csrv);
+  CHECK(read_trace(trace_path, NULL, 0) == CSRV_TRACE_SPANS + 1);
+  truncate_trace();
+}
+
+// Event loops poll between batches: a dump after SIGUSR1 or once the
+// interval is up, otherwise nothing
+static void check_poll(void) {
+  struct CsrvRequest req;
+  fake_request(&req, 8);
+  csrv.trace_interval_ms = 0;
+  CSRV_TRACE_END(&req, "parse", csrv_trace_clock());
+  csrv_trace_poll(&csrv);
+  CHECK(read_trace(trace_path, NULL, 0) == 0);
+  raise(SIGUSR1);
+  csrv_trace_poll(&csrv);
+  CHECK(read_trace(trace_path, NULL, 0) == 1);
+
+  csrv.trace_interval_ms = 50;
+  CSRV_TRACE_END(&req, "parse", csrv_trace_clock());
+  csrv_trace_poll(&csrv);
+  CHECK(read_trace(trace_path, NULL, 0) == 1);
+  usleep(60 * 1000);
+  csrv_trace_poll(&csrv);
+  CHECK(read_trace(trace_path, NULL, 0) == 2);
+  csrv.trace_interval_ms = 0;
+  truncate_trace();
+}
+
+struct Worker {
+  size_t first_id;
+  size_t n_spans;
+  int64_t dump_ms;
+};
+
+static void *worker_thread(void *arg) {
+  struct Worker *worker = (struct Worker *) arg;
+  struct CsrvRequest req;
+  for(size_t i = 0; i < worker->n_spans; i++) {
+    fake_request(&req, worker->first_id + i);
+    CSRV_TRACE_END(&req, "request", csrv_trace_clock());
+  }
+  int64_t start = csrv_now_ms();
+  csrv_trace_dump(&csrv);
+  worker->dump_ms = csrv_now_ms() - start;
+  return NULL;
+}
+
+// Workers hand their buffers over and carry on while the writer is stuck
+// opening a FIFO; once it is read, every span arrives
+static void check_writer(void) {
+  char fifo_path[64];
+  snprintf(fifo_path, sizeof(fifo_path), "%s.fifo", trace_path);
+  CHECK(mkfifo(fifo_path, 0600) == 0);
+  csrv.trace_path = fifo_path;
+  csrv_trace_writer_start(&csrv);
+
+  struct Worker workers[TEST_THREADS];
+  pthread_t threads[TEST_THREADS];
+  size_t n_spans = 0;
+  for(int i = 0; i < TEST_THREADS; i++) {
+    // One of them fills its buffer twice over
+    workers[i].first_id = i * 100000;
+    workers[i].n_spans = i == 0 ? 2 * CSRV_TRACE_SPANS + 5 : TEST_THREAD_SPANS;
+    n_spans += workers[i].n_spans;
+    CHECK(pthread_create(&threads[i], NULL, worker_thread, &workers[i]) == 0);
+  }
+  for(int i = 0; i < TEST_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    CHECK(workers[i].dump_ms < 100);
+  }
+
+  int fd = open(fifo_path, O_RDONLY | O_CLOEXEC);
+  CHECK(fd != -1);
+  FILE *copy = fopen(trace_path, "a");
+  // The writer opens and closes the FIFO for each buffer; it may open it
+  // again before we see the end of the last one
+  size_t n_lines = 0;
+  while(fd != -1 && n_lines < n_spans) {
+    char buffer[65536];
+    ssize_t sz_read = read(fd, buffer, sizeof(buffer));
+    if(sz_read < 0) {
+      break;
+    }
+    if(sz_read == 0) {
+      close(fd);
+      fd = open(fifo_path, O_RDONLY | O_CLOEXEC);
+      continue;
+    }
+    fwrite(buffer, 1, sz_read, copy);
+    for(ssize_t i = 0; i < sz_read; i++) {
+      n_lines += buffer[i] == '\n';
+    }
+  }
+  fclose(copy);
+  csrv_trace_writer_stop(&csrv);
+  close(fd);
+  CHECK(n_lines == n_spans);
+
+  // Each thread's spans are in order under its own tid
+  static struct TraceLine lines[2 * CSRV_TRACE_SPANS + 5 + (TEST_THREADS - 1) * TEST_THREAD_SPANS];
+  CHECK(read_trace(trace_path, lines, sizeof(lines) / sizeof(lines[0])) == (int) n_spans);
+  size_t next_id[TEST_THREADS] = { 0 };
+  int tids[TEST_THREADS] = { 0 };
+  for(size_t i = 0; i < n_spans && i < sizeof(lines) / sizeof(lines[0]); i++) {
+    int thread = (int) (lines[i].id / 100000);
+    CHECK(thread < TEST_THREADS && lines[i].id % 100000 == next_id[thread]);
+    if(thread >= TEST_THREADS) {
+      continue;
+    }
+    next_id[thread]++;
+    CHECK(tids[thread] == 0 || tids[thread] == lines[i].tid);
+    tids[thread] = lines[i].tid;
+  }
+  for(int i = 0; i < TEST_THREADS; i++) {
+    CHECK(next_id[i] == workers[i].n_spans);
+    CHECK(i == 0 || tids[i] != tids[0]);
+  }
+
+  unlink(fifo_path);
+  csrv.trace_path = trace_path;
+}
+
+int main(int argc, char **argv) {
+  // A dump that blocks on the FIFO would wait forever
+  alarm(60);
+  test_server(&csrv, NULL);
+  int fd = mkstemp(trace_path);
+  CHECK(fd != -1);
+  close(fd);
+  csrv.trace_path = trace_path;
+
+  check_sampled();
+
+  csrv.trace_sample = 1;
+  csrv_trace_install(&csrv);
+  check_spans();
+  check_poll();
+  check_writer();
+
+  unlink(trace_path);
+  fclose(csrv.log);
+  return test_failures != 0;
+}
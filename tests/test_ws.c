@@ -0,0 +1,527 @@
+#include "test.h"
+
+// WebSocket: unmasking on its own, then the handshake and framing of whole
+// connections, served after the upgrade the way a forked child serves them.
+// The client frames go out with the handshake, and every reply frame is
+// written down as "opcode length payload;" to compare. Last, broadcasts
+// from several threads at once.
+
+#define TEST_TIMEOUT_MS 5000
+
+static void check_unmask(void) {
+  const uint8_t key[4] = { 0x37, 0xfa, 0x21, 0x3d };
+  uint8_t data[128 + 16];
+  uint8_t expected[128];
+
+  // Every length around the 8 and 16 byte steps, at every alignment
+  for(size_t offset = 0; offset < 16; offset++) {
+    for(size_t len = 0; len <= 128; len++) {
+      for(size_t i = 0; i < len; i++) {
+        data[offset + i] = (uint8_t) (i * 7 + offset);
+        expected[i] = data[offset + i] ^ key[i & 3];
+      }
+      csrv_ws_unmask(data + offset, len, key);
+      if(memcmp(data + offset, expected, len) != 0) {
+        fprintf(stderr, "csrv_ws_unmask(offset=%zu, len=%zu) is wrong\n", offset, len);
+        test_failures++;
+      }
+    }
+  }
+}
+
+static void ws_message(struct CsrvWs *ws, enum CsrvWsOpcode opcode, char *data, size_t len) {
+  csrv_ws_send(ws, opcode, data, len);
+}
+
+static const struct CsrvWsHandler echo = { ws_message, NULL };
+
+static void ws_handler(struct CsrvRequest *req, struct CsrvResponse *resp) {
+  csrv_ws_upgrade(req, resp, &echo, NULL);
+}
+
+// The handshake from RFC 6455 section 1.3, whose accept value is known
+#define HANDSHAKE "GET /chat HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n" \
+  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n"
+#define ACCEPT "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo="
+
+#define FIN 0x80
+
+// A masked client frame
+static void put_frame(struct CsrvStrVec *out, uint8_t first, const void *payload, size_t len) {
+  const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+  uint8_t header[14];
+  size_t header_len = 2;
+  header[0] = first;
+  if(len < 126) {
+    header[1] = 0x80 | len;
+  } else if(len < 65536) {
+    header[1] = 0x80 | 126;
+    header[2] = len >> 8;
+    header[3] = len;
+    header_len = 4;
+  } else {
+    header[1] = 0x80 | 127;
+    for(int i = 0; i < 8; i++) {
+      header[2 + i] = (uint64_t) len >> (56 - 8 * i);
+    }
+    header_len = 10;
+  }
+  memcpy(header + header_len, key, 4);
+  header_len += 4;
+  csrv_str_vec_pushn(out, (char *) header, header_len);
+
+  for(size_t i = 0; i < len; i++) {
+    csrv_str_vec_pushc(out, ((const uint8_t *) payload)[i] ^ key[i & 3]);
+  }
+}
+
+static void put_close(struct CsrvStrVec *out, uint16_t code) {
+  uint8_t payload[2] = { code >> 8, code & 0xff };
+  put_frame(out, FIN | CSRV_WS_CLOSE, payload, 2);
+}
+
+static void describe_frame(struct CsrvStrVec *out, uint8_t opcode, const uint8_t *payload, size_t len) {
+  char head[64];
+  if(opcode == CSRV_WS_CLOSE && len >= 2) {
+    snprintf(head, sizeof(head), "%x %zu %u;", opcode, len, (unsigned) payload[0] << 8 | payload[1]);
+    csrv_str_vec_pushn(out, head, strlen(head));
+    return;
+  }
+  snprintf(head, sizeof(head), "%x %zu ", opcode, len);
+  csrv_str_vec_pushn(out, head, strlen(head));
+  csrv_str_vec_pushn(out, (char *) payload, len);
+  csrv_str_vec_pushc(out, ';');
+}
+
+// The server's frames, after checking the handshake; server frames are
+// never masked nor fragmented. Returns false on anything malformed.
+static bool describe_reply(struct CsrvStrVec *output, struct CsrvStrVec *frames) {
+  csrv_str_vec_pushc(output, '\0');
+  output->length--;
+  char *end = strstr(output->string, "\r\n\r\n");
+  if(strncmp(output->string, "HTTP/1.1 101 ", 13) != 0 || end == NULL || strstr(output->string, ACCEPT) == NULL) {
+    return false;
+  }
+
+  const uint8_t *p = (const uint8_t *) end + 4;
+  size_t left = output->length - (end + 4 - output->string);
+  while(left > 0) {
+    if(left < 2 || (p[0] & 0xf0) != FIN || (p[1] & 0x80) != 0) {
+      return false;
+    }
+    uint64_t len = p[1] & 0x7f;
+    size_t header = 2;
+    if(len == 126) {
+      if(left < 4) {
+        return false;
+      }
+      len = (uint64_t) p[2] << 8 | p[3];
+      header = 4;
+    } else if(len == 127) {
+      if(left < 10) {
+        return false;
+      }
+      len = 0;
+      for(int i = 0; i < 8; i++) {
+        len = len << 8 | p[2 + i];
+      }
+      header = 10;
+    }
+    if(left - header < len) {
+      return false;
+    }
+
+    describe_frame(frames, p[0] & 0x0f, p + header, len);
+    p += header + len;
+    left -= header + len;
+  }
+  return true;
+}
+
+static void check_conversation(struct Csrv *csrv, const char *title, struct CsrvStrVec *input, struct CsrvStrVec *expected) {
+  struct CsrvStrVec output;
+  csrv_str_vec_init(&output);
+  CHECK(test_exchange(csrv, input->string, input->length, &output, TEST_TIMEOUT_MS) == 0);
+
+  struct CsrvStrVec frames;
+  csrv_str_vec_init(&frames);
+  bool well_formed = describe_reply(&output, &frames);
+  if(!well_formed || frames.length != expected->length || memcmp(frames.string, expected->string, frames.length) != 0) {
+    fprintf(stderr, "%s: expected\n%.*s\ngot%s\n%.*s\n", title, (int) (expected->length > 300 ? 300 : expected->length),
+            expected->string, well_formed ? "" : " (malformed)", (int) (frames.length > 300 ? 300 : frames.length), frames.string);
+    test_failures++;
+  }
+
+  free(frames.string);
+  free(output.string);
+  free(input->string);
+  free(expected->string);
+}
+
+// One text message in a frame of its own, then a close: the echo, or the
+// close code it has to be refused with
+static void check_text(struct Csrv *csrv, const char *title, const char *text, size_t len, uint16_t refused) {
+  struct CsrvStrVec input;
+  struct CsrvStrVec expected;
+  csrv_str_vec_init(&input);
+  csrv_str_vec_init(&expected);
+  csrv_str_vec_pushn(&input, HANDSHAKE, strlen(HANDSHAKE));
+  put_frame(&input, FIN | CSRV_WS_TEXT, text, len);
+  put_close(&input, CSRV_WS_NORMAL);
+
+  uint8_t code[2] = { refused >> 8, refused & 0xff };
+  if(refused == 0) {
+    describe_frame(&expected, CSRV_WS_TEXT, (const uint8_t *) text, len);
+    code[0] = CSRV_WS_NORMAL >> 8;
+    code[1] = CSRV_WS_NORMAL & 0xff;
+  }
+  describe_frame(&expected, CSRV_WS_CLOSE, code, 2);
+  check_conversation(csrv, title, &input, &expected);
+}
+
+static void check_utf8(struct Csrv *csrv) {
+  static const struct {
+    const char *title;
+    const char *text;
+    bool valid;
+  } texts[] = {
+    { "ascii", "hello", true },
+    { "two to four byte sequences", "\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80", true },
+    { "U+10FFFF", "\xf4\x8f\xbf\xbf", true },
+    { "stray continuation byte", "a\x80", false },
+    { "0xff", "\xff", false },
+    { "overlong slash", "\xc0\xaf", false },
+    { "overlong three bytes", "\xe0\x80\xaf", false },
+    { "surrogate", "\xed\xa0\x80", false },
+    { "past U+10FFFF", "\xf4\x90\x80\x80", false },
+    { "truncated at the end", "ok\xe2\x82", false },
+    { "continuation missing", "\xe2\x28\xa1", false },
+  };
+
+  for(size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); i++) {
+    check_text(csrv, texts[i].title, texts[i].text, strlen(texts[i].text), texts[i].valid ? 0 : CSRV_WS_INVALID_DATA);
+  }
+
+  // Binary data isn't checked
+  struct CsrvStrVec input;
+  struct CsrvStrVec expected;
+  csrv_str_vec_init(&input);
+  csrv_str_vec_init(&expected);
+  csrv_str_vec_pushn(&input, HANDSHAKE, strlen(HANDSHAKE));
+  put_frame(&input, FIN | CSRV_WS_BINARY, "\xff\xc0", 2);
+  put_close(&input, CSRV_WS_NORMAL);
+  describe_frame(&expected, CSRV_WS_BINARY, (const uint8_t *) "\xff\xc0", 2);
+  describe_frame(&expected, CSRV_WS_CLOSE, (const uint8_t *) "\x03\xe8", 2);
+  check_conversation(csrv, "binary", &input, &expected);
+}
+
+// Fragments with a ping in between, a character split across fragments,
+// and the 16 and 64 bit length forms
+static void check_framing(struct Csrv *csrv) {
+  struct CsrvStrVec input;
+  struct CsrvStrVec expected;
+  csrv_str_vec_init(&input);
+  csrv_str_vec_init(&expected);
+  csrv_str_vec_pushn(&input, HANDSHAKE, strlen(HANDSHAKE));
+  put_frame(&input, CSRV_WS_TEXT, "hel", 3);
+  put_frame(&input, FIN | CSRV_WS_PING, "p", 1);
+  put_frame(&input, CSRV_WS_CONTINUATION, "lo \xe2\x82", 5);
+  put_frame(&input, FIN | CSRV_WS_CONTINUATION, "\xac", 1);
+  put_frame(&input, FIN | CSRV_WS_PONG, "unsolicited", 11);
+  describe_frame(&expected, CSRV_WS_PONG, (const uint8_t *) "p", 1);
+  describe_frame(&expected, CSRV_WS_TEXT, (const uint8_t *) "hello \xe2\x82\xac", 9);
+
+  size_t sizes[] = { 125, 126, 65535, 65536, 70000 };
+  for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    uint8_t *data = (uint8_t *) malloc(sizes[i]);
+    for(size_t j = 0; j < sizes[i]; j++) {
+      data[j] = (uint8_t) (j * 31 + i);
+    }
+    put_frame(&input, FIN | CSRV_WS_BINARY, data, sizes[i]);
+    describe_frame(&expected, CSRV_WS_BINARY, data, sizes[i]);
+    free(data);
+  }
+
+  // An empty close is answered with an empty one
+  put_frame(&input, FIN | CSRV_WS_CLOSE, NULL, 0);
+  describe_frame(&expected, CSRV_WS_CLOSE, NULL, 0);
+  // Nothing after the close is read
+  put_frame(&input, FIN | CSRV_WS_TEXT, "late", 4);
+  check_conversation(csrv, "framing", &input, &expected);
+}
+
+// Client frames that have to end the connection with a close code
+static void check_protocol_errors(struct Csrv *csrv) {
+  static const struct {
+    const char *title;
+    const char *frames;
+    uint16_t code;
+  } cases[] = {
+    // Hex; every frame but the first case's is masked with a zero key
+    { "unmasked frame", "8105 68656c6c6f", CSRV_WS_PROTOCOL_ERROR },
+    { "RSV1 set", "c180 00000000", CSRV_WS_PROTOCOL_ERROR },
+    { "reserved data opcode", "8380 00000000", CSRV_WS_PROTOCOL_ERROR },
+    { "reserved control opcode", "8b80 00000000", CSRV_WS_PROTOCOL_ERROR },
+    { "fragmented ping", "0980 00000000", CSRV_WS_PROTOCOL_ERROR },
+    { "ping over 125 bytes", "89fe 007e 00000000", CSRV_WS_PROTOCOL_ERROR },
+    { "continuation with nothing to continue", "8081 00000000 61", CSRV_WS_PROTOCOL_ERROR },
+    { "new message inside a fragmented one", "0181 00000000 61 8181 00000000 62", CSRV_WS_PROTOCOL_ERROR },
+    { "message over the limit", "82ff 0000000000100001 00000000", CSRV_WS_TOO_BIG },
+    { "close with a one byte payload", "8881 00000000 03", CSRV_WS_PROTOCOL_ERROR },
+    { "close code 1005", "8882 00000000 03ed", CSRV_WS_PROTOCOL_ERROR },
+    { "close code 999", "8882 00000000 03e7", CSRV_WS_PROTOCOL_ERROR },
+    { "close reason not UTF-8", "8883 00000000 03e8ff", CSRV_WS_INVALID_DATA },
+  };
+
+  for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    uint8_t frames[64];
+    size_t len = test_hex(cases[i].frames, frames, sizeof(frames));
+    struct CsrvStrVec input;
+    struct CsrvStrVec expected;
+    csrv_str_vec_init(&input);
+    csrv_str_vec_init(&expected);
+    csrv_str_vec_pushn(&input, HANDSHAKE, strlen(HANDSHAKE));
+    csrv_str_vec_pushn(&input, (char *) frames, len);
+    // Never answered: the connection is over
+    put_frame(&input, FIN | CSRV_WS_TEXT, "late", 4);
+
+    uint8_t code[2] = { cases[i].code >> 8, cases[i].code & 0xff };
+    describe_frame(&expected, CSRV_WS_CLOSE, code, 2);
+    check_conversation(csrv, cases[i].title, &input, &expected);
+  }
+
+  // A close code the client may use is echoed
+  struct CsrvStrVec input;
+  struct CsrvStrVec expected;
+  csrv_str_vec_init(&input);
+  csrv_str_vec_init(&expected);
+  csrv_str_vec_pushn(&input, HANDSHAKE, strlen(HANDSHAKE));
+  put_close(&input, 4000);
+  describe_frame(&expected, CSRV_WS_CLOSE, (const uint8_t *) "\x0f\xa0", 2);
+  check_conversation(csrv, "application close code", &input, &expected);
+}
+
+// Handshakes that are refused with a plain 400
+static void check_handshake(struct Csrv *csrv) {
+  static const char *requests[] = {
+    "GET / HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: short\r\n"
+    "Sec-WebSocket-Version: 13\r\n\r\n",
+    "GET / HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 8\r\n\r\n",
+    "POST / HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n",
+    "GET / HTTP/1.1\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n\r\n",
+  };
+
+  for(size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+    struct CsrvStrVec output;
+    csrv_str_vec_init(&output);
+    CHECK(test_exchange(csrv, requests[i], strlen(requests[i]), &output, TEST_TIMEOUT_MS) == 0);
+    csrv_str_vec_pushc(&output, '\0');
+    if(strncmp(output.string, "HTTP/1.1 400 ", 13) != 0) {
+      fprintf(stderr, "handshake %zu: expected a 400, got\n%s\n", i, output.string);
+      test_failures++;
+    }
+    // The version we speak is named for clients that asked for another
+    CHECK((i == 1) == (strstr(output.string, "Sec-WebSocket-Version: 13") != NULL));
+    free(output.string);
+  }
+}
+
+// Broadcasts from several threads to members served the blocking way, one
+// of which hangs up halfway through
+#define TEST_MEMBERS 4
+#define TEST_BROADCASTERS 4
+#define TEST_MESSAGES 500
+
+static struct CsrvWsGroup group;
+static int n_closed = 0;
+
+static void member_close(struct CsrvWs *ws, uint16_t code) {
+  __atomic_add_fetch(&n_closed, 1, __ATOMIC_RELAXED);
+}
+
+static const struct CsrvWsHandler member = { NULL, member_close };
+
+static void group_handler(struct CsrvRequest *req, struct CsrvResponse *resp) {
+  struct CsrvWs *ws = csrv_ws_upgrade(req, resp, &member, NULL);
+  if(ws != NULL) {
+    csrv_ws_join(&group, ws);
+  }
+}
+
+struct Member {
+  int handle;
+  // Hang up after this many messages, 0 to stay for the close handshake
+  int quit_after;
+  int received;
+  int next[TEST_BROADCASTERS];
+  bool in_order;
+  bool closed;
+};
+
+// Read broadcasts, "<broadcaster> <n>" padded out, each broadcaster's in order
+static void *member_read(void *arg) {
+  struct Member *m = (struct Member *) arg;
+  struct CsrvStrVec buffer;
+  csrv_str_vec_init(&buffer);
+  m->in_order = true;
+
+  // The handshake reply first
+  while(strstr(buffer.length > 0 ? buffer.string : "", "\r\n\r\n") == NULL) {
+    char c;
+    if(read(m->handle, &c, 1) != 1) {
+      free(buffer.string);
+      return NULL;
+    }
+    csrv_str_vec_pushc(&buffer, c);
+    csrv_str_vec_pushc(&buffer, '\0');
+    buffer.length--;
+  }
+  buffer.length = 0;
+
+  uint8_t chunk[16384];
+  ssize_t n;
+  while(!m->closed && (n = read(m->handle, chunk, sizeof(chunk))) > 0) {
+    csrv_str_vec_pushn(&buffer, (char *) chunk, n);
+    uint8_t *p = (uint8_t *) buffer.string;
+    size_t left = buffer.length;
+    while(left >= 2) {
+      size_t len = p[1] & 0x7f;
+      size_t header = len == 126 ? 4 : 2;
+      if(left < header) {
+        break;
+      }
+      if(len == 126) {
+        len = (size_t) p[2] << 8 | p[3];
+      }
+      if(left < header + len) {
+        break;
+      }
+
+      if((p[0] & 0x0f) == CSRV_WS_CLOSE) {
+        m->closed = true;
+      } else {
+        int from = -1;
+        int seq = -1;
+        sscanf((char *) p + header, "%d %d", &from, &seq);
+        if(from < 0 || from >= TEST_BROADCASTERS || seq != m->next[from]) {
+          m->in_order = false;
+        } else {
+          m->next[from]++;
+        }
+        m->received++;
+      }
+      p += header + len;
+      left -= header + len;
+    }
+    memmove(buffer.string, p, left);
+    buffer.length = left;
+
+    if(m->quit_after != 0 && m->received >= m->quit_after) {
+      shutdown(m->handle, SHUT_RDWR);
+      break;
+    }
+  }
+  free(buffer.string);
+  return NULL;
+}
+
+static void *broadcaster_run(void *arg) {
+  int from = (int) (intptr_t) arg;
+  char message[4096];
+  for(int seq = 0; seq < TEST_MESSAGES; seq++) {
+    // Now and then one too big to go out with the rest
+    size_t len = seq % 50 == 0 ? sizeof(message) : 16;
+    memset(message, '.', len);
+    int head = snprintf(message, sizeof(message), "%d %d ", from, seq);
+    message[head] = '.';
+    CHECK(csrv_ws_broadcast(&group, CSRV_WS_TEXT, message, len) >= 0);
+  }
+  return NULL;
+}
+
+static void check_broadcast(void) {
+  struct Csrv csrv;
+  test_server(&csrv, group_handler);
+  CHECK(csrv_ws_group_init(&group) == 0);
+
+  struct Member members[TEST_MEMBERS + 1];
+  struct TestConn conns[TEST_MEMBERS + 1];
+  pthread_t servers[TEST_MEMBERS + 1];
+  pthread_t readers[TEST_MEMBERS + 1];
+  for(int i = 0; i <= TEST_MEMBERS; i++) {
+    int handles[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, handles) == 0);
+    // A small socket buffer, so frames keep being queued and finished later
+    int sndbuf = 4096;
+    setsockopt(handles[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    memset(&members[i], 0, sizeof(members[i]));
+    members[i].handle = handles[0];
+    members[i].quit_after = i == TEST_MEMBERS ? TEST_BROADCASTERS * TEST_MESSAGES / 2 : 0;
+    conns[i] = (struct TestConn) { &csrv, handles[1] };
+    CHECK(pthread_create(&servers[i], NULL, test_conn_thread, &conns[i]) == 0);
+    CHECK(write(handles[0], HANDSHAKE, strlen(HANDSHAKE)) == (ssize_t) strlen(HANDSHAKE));
+    CHECK(pthread_create(&readers[i], NULL, member_read, &members[i]) == 0);
+  }
+
+  for(int waited = 0; ; waited++) {
+    pthread_mutex_lock(&group.lock);
+    bool joined = group.n_members == TEST_MEMBERS + 1;
+    pthread_mutex_unlock(&group.lock);
+    if(joined || waited == TEST_TIMEOUT_MS) {
+      CHECK(joined);
+      break;
+    }
+    usleep(1000);
+  }
+
+  pthread_t broadcasters[TEST_BROADCASTERS];
+  for(intptr_t b = 0; b < TEST_BROADCASTERS; b++) {
+    CHECK(pthread_create(&broadcasters[b], NULL, broadcaster_run, (void *) b) == 0);
+  }
+  for(int b = 0; b < TEST_BROADCASTERS; b++) {
+    pthread_join(broadcasters[b], NULL);
+  }
+
+  // Everyone who stayed got everything, in order, then closes
+  struct CsrvStrVec close_frame;
+  csrv_str_vec_init(&close_frame);
+  put_close(&close_frame, CSRV_WS_NORMAL);
+  for(int i = 0; i < TEST_MEMBERS; i++) {
+    CHECK(send(members[i].handle, close_frame.string, close_frame.length, MSG_NOSIGNAL) == (ssize_t) close_frame.length);
+  }
+  free(close_frame.string);
+
+  for(int i = 0; i <= TEST_MEMBERS; i++) {
+    pthread_join(readers[i], NULL);
+    pthread_join(servers[i], NULL);
+    close(members[i].handle);
+    CHECK(members[i].in_order);
+    if(i < TEST_MEMBERS) {
+      CHECK(members[i].received == TEST_BROADCASTERS * TEST_MESSAGES);
+      CHECK(members[i].closed);
+    }
+  }
+  CHECK(n_closed == TEST_MEMBERS + 1);
+  CHECK(group.n_members == 0 && group.members == NULL);
+
+  csrv_ws_group_cleanup(&group);
+  fclose(csrv.log);
+}
+
+int main(void) {
+  struct Csrv csrv;
+  test_server(&csrv, ws_handler);
+
+  check_unmask();
+  check_handshake(&csrv);
+  check_utf8(&csrv);
+  check_framing(&csrv);
+  check_protocol_errors(&csrv);
+  check_broadcast();
+
+  fclose(csrv.log);
+  return test_failures != 0;
+}
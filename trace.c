@@ -0,0 +1,339 @@
+#include "sys/types.h"
+#include "sys/syscall.h"
+#include "sys/stat.h"
+#include "string.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "signal.h"
+#include "time.h"
+#include "pthread.h"
+#include "csrv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "x86intrin.h"
+#endif
+
+// Bumped by SIGUSR1; every thread dumps once it sees a new value
+static volatile sig_atomic_t csrv_trace_generation = 0;
+
+// Clock calibration, shared by forked children so their timestamps line up
+static uint64_t csrv_trace_base_ticks;
+static double csrv_trace_base_us;
+static double csrv_trace_ticks_per_us = 1000;
+
+static __thread struct CsrvTraceBuffer *csrv_trace_buffer = NULL;
+
+// The accept() that started this thread's newest connection, for its first request
+static __thread uint64_t csrv_trace_accept_start;
+static __thread uint64_t csrv_trace_accept_end;
+
+// Requests this thread lets pass until the next sampled one, counting it; 0
+// until its first request
+static __thread uint64_t csrv_trace_countdown = 0;
+
+// Under CSRV_EVENT, workers hand their buffers to a writer thread, which
+// formats and appends them, so the file I/O never stalls a loop
+static pthread_mutex_t csrv_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t csrv_trace_cond = PTHREAD_COND_INITIALIZER;
+static struct CsrvTraceBuffer *csrv_trace_queue = NULL;
+static struct CsrvTraceBuffer **csrv_trace_queue_tail = &csrv_trace_queue;
+static size_t csrv_trace_n_queued = 0;
+static bool csrv_trace_stopping = false;
+static bool csrv_trace_writer_running = false;
+static pthread_t csrv_trace_writer;
+
+// The TSC where there is one, otherwise CLOCK_MONOTONIC in nanoseconds
+uint64_t csrv_trace_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double csrv_trace_monotonic_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void csrv_trace_signal(int sig) {
+  csrv_trace_generation++;
+}
+
+// Calibrate the clock against CLOCK_MONOTONIC and install the SIGUSR1
+// handler. Does nothing unless csrv->trace_sample is set.
+void csrv_trace_install(struct Csrv *csrv) {
+  if(csrv->trace_sample == 0) {
+    return;
+  }
+
+  csrv_trace_base_us = csrv_trace_monotonic_us();
+  csrv_trace_base_ticks = csrv_trace_clock();
+#if defined(__x86_64__) || defined(__i386__)
+  struct timespec pause = { 0, CSRV_TRACE_CALIBRATE_MS * 1000000 };
+  nanosleep(&pause, NULL);
+  double elapsed_us = csrv_trace_monotonic_us() - csrv_trace_base_us;
+  csrv_trace_ticks_per_us = (csrv_trace_clock() - csrv_trace_base_ticks) / elapsed_us;
+#endif
+
+  // Open the JSON array before there are workers or children to append
+  // to it, so that no span can land ahead of it. A file left by an
+  // earlier run (or the server this one replaces) is appended to as is.
+  int fd = open(csrv->trace_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  struct stat st;
+  if(fd == -1 || fstat(fd, &st) != 0 || (st.st_size == 0 && write(fd, "[\n", 2) != 2)) {
+    CSRV_LOG_ERROR(csrv, "failed to open trace file %s, errno=%s", csrv->trace_path, strerror(errno));
+  }
+  if(fd != -1) {
+    close(fd);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = csrv_trace_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+  CSRV_LOG_INFO(csrv, "tracing 1 in %u requests to %s, send SIGUSR1 to pid %d to dump",
+                csrv->trace_sample, csrv->trace_path, getpid());
+}
+
+// splitmix64 finalizer
+static uint64_t csrv_trace_mix(uint64_t key) {
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return key;
+}
+
+// Whether request id is sampled. Most requests only count down to the next
+// sample; the gap after each one is drawn from a hash of its id, uniform in
+// 1..2N-1 so that 1 in N requests is sampled on average. A thread's first
+// request starts the count at a phase hashed from its id: each forked child
+// sees only its own connection, numbered from a block of CSRV_KEEPALIVE_MAX
+// ids, so a fixed start (or id % N) would pick the same request of every
+// connection instead of 1 in N of them.
+bool csrv_trace_sampled(struct Csrv *csrv, size_t id) {
+  uint64_t sample = csrv->trace_sample;
+  if(sample == 0) {
+    return false;
+  }
+  if(csrv_trace_countdown > 1) {
+    csrv_trace_countdown--;
+    return false;
+  }
+
+  uint64_t key = csrv_trace_mix(id);
+  if(csrv_trace_countdown == 0) {
+    csrv_trace_countdown = 1 + key % sample;
+    if(csrv_trace_countdown > 1) {
+      csrv_trace_countdown--;
+      return false;
+    }
+    key = csrv_trace_mix(key);
+  }
+  csrv_trace_countdown = 1 + key % (2 * sample - 1);
+  return true;
+}
+
+void csrv_trace_accepted(uint64_t start) {
+  csrv_trace_accept_start = start;
+  csrv_trace_accept_end = csrv_trace_clock();
+}
+
+// The first request on a connection also gets the accept() that opened it
+void csrv_trace_accept_span(struct CsrvRequest *req) {
+  if(csrv_trace_accept_end != 0) {
+    csrv_trace_span(req, "accept", csrv_trace_accept_start, csrv_trace_accept_end);
+    csrv_trace_accept_end = 0;
+  }
+}
+
+void csrv_trace_span(struct CsrvRequest *req, const char *name, uint64_t start, uint64_t end) {
+  struct CsrvTraceBuffer *buffer = csrv_trace_buffer;
+  if(buffer != NULL && buffer->n_spans == CSRV_TRACE_SPANS) {
+    // Handed to the writer, if there is one, and replaced below
+    csrv_trace_dump(req->csrv);
+    buffer = csrv_trace_buffer;
+  }
+  if(buffer == NULL) {
+    buffer = (struct CsrvTraceBuffer *) calloc(1, sizeof(struct CsrvTraceBuffer));
+    if(buffer == NULL) {
+      return;
+    }
+    buffer->tid = (int) syscall(SYS_gettid);
+    buffer->generation = csrv_trace_generation;
+    buffer->last_dump = csrv_now_ms();
+    csrv_trace_buffer = buffer;
+  }
+
+  struct CsrvSpan *span = &buffer->spans[buffer->n_spans++];
+  span->name = name;
+  span->id = req->id;
+  span->start = start;
+  span->end = end;
+}
+
+static double csrv_trace_us(uint64_t ticks) {
+  return csrv_trace_base_us + (double) (int64_t) (ticks - csrv_trace_base_ticks) / csrv_trace_ticks_per_us;
+}
+
+// Append a buffer's spans to csrv->trace_path as complete ("X") events.
+// The file is a JSON array that is never closed, which the trace viewers
+// accept, so every thread and forked child can append to it with one
+// O_APPEND write() and no coordination.
+static void csrv_trace_write(struct Csrv *csrv, struct CsrvTraceBuffer *buffer) {
+  struct CsrvStrVec out;
+  if(csrv_str_vec_init(&out) != 0) {
+    buffer->n_spans = 0;
+    return;
+  }
+
+  int pid = getpid();
+  int res = 0;
+  for(size_t i = 0; i < buffer->n_spans && res == 0; i++) {
+    struct CsrvSpan *span = &buffer->spans[i];
+    char line[256];
+    double ts = csrv_trace_us(span->start);
+    int len = snprintf(line, sizeof(line),
+                       "{\"name\":\"%s\",\"cat\":\"csrv\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                       "\"pid\":%d,\"tid\":%d,\"args\":{\"id\":%zu}},\n",
+                       span->name, ts, csrv_trace_us(span->end) - ts, pid, buffer->tid, span->id);
+    res = len > 0 && (size_t) len < sizeof(line) ? csrv_str_vec_pushn(&out, line, len) : -1;
+  }
+  buffer->n_spans = 0;
+
+  // csrv_trace_install() created the file and opened the array
+  int fd = open(csrv->trace_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+  if(fd == -1 || res != 0 || write(fd, out.string, out.length) != (ssize_t) out.length) {
+    CSRV_LOG_ERROR(csrv, "failed to write trace to %s, errno=%s", csrv->trace_path, strerror(errno));
+  }
+  if(fd != -1) {
+    close(fd);
+  }
+  free(out.string);
+}
+
+// Write out this thread's spans. With the writer running the buffer is
+// queued for it instead, and the thread starts a new one with its next span.
+// Otherwise (forked children, or no writer thread) the write blocks the
+// caller, which under CSRV_FORK holds up only its own connection.
+void csrv_trace_dump(struct Csrv *csrv) {
+  struct CsrvTraceBuffer *buffer = csrv_trace_buffer;
+  if(buffer == NULL) {
+    return;
+  }
+
+  buffer->generation = csrv_trace_generation;
+  buffer->last_dump = csrv_now_ms();
+  if(buffer->n_spans == 0) {
+    return;
+  }
+
+  if(!csrv_trace_writer_running) {
+    csrv_trace_write(csrv, buffer);
+    return;
+  }
+
+  bool queued = false;
+  pthread_mutex_lock(&csrv_trace_lock);
+  if(csrv_trace_n_queued < CSRV_TRACE_QUEUE_MAX) {
+    buffer->next = NULL;
+    *csrv_trace_queue_tail = buffer;
+    csrv_trace_queue_tail = &buffer->next;
+    csrv_trace_n_queued++;
+    pthread_cond_signal(&csrv_trace_cond);
+    queued = true;
+  }
+  pthread_mutex_unlock(&csrv_trace_lock);
+
+  if(queued) {
+    csrv_trace_buffer = NULL;
+  } else {
+    CSRV_LOG_ERROR(csrv, "trace writer is behind, dropped %zu spans", buffer->n_spans);
+    buffer->n_spans = 0;
+  }
+}
+
+static void *csrv_trace_writer_loop(void *arg) {
+  struct Csrv *csrv = (struct Csrv *) arg;
+  pthread_mutex_lock(&csrv_trace_lock);
+  for(;;) {
+    while(csrv_trace_queue == NULL && !csrv_trace_stopping) {
+      pthread_cond_wait(&csrv_trace_cond, &csrv_trace_lock);
+    }
+    struct CsrvTraceBuffer *buffer = csrv_trace_queue;
+    if(buffer == NULL) {
+      break;
+    }
+    csrv_trace_queue = buffer->next;
+    if(csrv_trace_queue == NULL) {
+      csrv_trace_queue_tail = &csrv_trace_queue;
+    }
+    csrv_trace_n_queued--;
+    pthread_mutex_unlock(&csrv_trace_lock);
+
+    csrv_trace_write(csrv, buffer);
+    free(buffer);
+    pthread_mutex_lock(&csrv_trace_lock);
+  }
+  pthread_mutex_unlock(&csrv_trace_lock);
+  return NULL;
+}
+
+// Start the writer thread before the workers (does nothing unless
+// csrv->trace_sample is set). If it can't be started, workers write their
+// own spans.
+void csrv_trace_writer_start(struct Csrv *csrv) {
+  if(csrv->trace_sample == 0) {
+    return;
+  }
+
+  csrv_trace_stopping = false;
+  if(pthread_create(&csrv_trace_writer, NULL, csrv_trace_writer_loop, csrv) != 0) {
+    CSRV_LOG_ERROR(csrv, "failed to start trace writer, workers will write their own spans");
+    return;
+  }
+  csrv_trace_writer_running = true;
+}
+
+// Once the workers are joined: write out everything queued and stop
+void csrv_trace_writer_stop(struct Csrv *csrv) {
+  if(!csrv_trace_writer_running) {
+    return;
+  }
+
+  pthread_mutex_lock(&csrv_trace_lock);
+  csrv_trace_stopping = true;
+  pthread_cond_signal(&csrv_trace_cond);
+  pthread_mutex_unlock(&csrv_trace_lock);
+  pthread_join(csrv_trace_writer, NULL);
+  csrv_trace_writer_running = false;
+}
+
+// Called by event loops between batches: dump after SIGUSR1, or every
+// trace_interval_ms. Threads that never traced a request return at once.
+void csrv_trace_poll(struct Csrv *csrv) {
+  struct CsrvTraceBuffer *buffer = csrv_trace_buffer;
+  if(buffer == NULL) {
+    return;
+  }
+  if(buffer->n_spans == 0) {
+    // A signal while there was nothing to dump is already answered
+    buffer->generation = csrv_trace_generation;
+    return;
+  }
+
+  if(buffer->generation != csrv_trace_generation
+     || (csrv->trace_interval_ms > 0 && csrv_now_ms() - buffer->last_dump >= csrv->trace_interval_ms)) {
+    csrv_trace_dump(csrv);
+  }
+}
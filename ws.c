@@ -0,0 +1,1080 @@
+#include "sys/types.h"
+#include "sys/socket.h"
+#include "sys/epoll.h"
+#include "sys/eventfd.h"
+#include "string.h"
+#include "strings.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "poll.h"
+#include "pthread.h"
+#include "sched.h"
+#include "csrv.h"
+
+#ifdef __SSE2__
+#include "emmintrin.h"
+#endif
+
+#define CSRV_WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// Reads land here first; only a frame split across reads is copied out to
+// the connection, so an idle one holds no buffer of its own
+static __thread uint8_t csrv_ws_buffer[CSRV_WS_READ_BUFFER];
+
+static uint32_t csrv_ws_rol(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+// SHA-1, for Sec-WebSocket-Accept only
+static void csrv_ws_sha1(const uint8_t *data, size_t len, uint8_t digest[20]) {
+  uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  uint8_t block[64];
+  uint64_t bits = (uint64_t) len * 8;
+
+  // The message, a 0x80 byte, zero padding and the 64-bit length, one block
+  // at a time
+  size_t total = (len + 8) / 64 * 64 + 64;
+  for(size_t offset = 0; offset < total; offset += 64) {
+    for(size_t i = 0; i < 64; i++) {
+      size_t pos = offset + i;
+      if(pos < len) {
+        block[i] = data[pos];
+      } else if(pos == len) {
+        block[i] = 0x80;
+      } else if(pos >= total - 8) {
+        block[i] = (uint8_t) (bits >> (8 * (total - 1 - pos)));
+      } else {
+        block[i] = 0;
+      }
+    }
+
+    uint32_t w[80];
+    for(int i = 0; i < 16; i++) {
+      w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16
+        | (uint32_t) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for(int i = 16; i < 80; i++) {
+      w[i] = csrv_ws_rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for(int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if(i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if(i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if(i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t temp = csrv_ws_rol(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = csrv_ws_rol(b, 30);
+      b = a;
+      a = temp;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  for(int i = 0; i < 5; i++) {
+    digest[i * 4] = h[i] >> 24;
+    digest[i * 4 + 1] = h[i] >> 16;
+    digest[i * 4 + 2] = h[i] >> 8;
+    digest[i * 4 + 3] = h[i];
+  }
+}
+
+static void csrv_ws_base64(const uint8_t *src, size_t len, char *out) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t o = 0;
+  for(size_t i = 0; i < len; i += 3) {
+    uint32_t triple = (uint32_t) src[i] << 16;
+    triple |= i + 1 < len ? (uint32_t) src[i + 1] << 8 : 0;
+    triple |= i + 2 < len ? src[i + 2] : 0;
+    out[o++] = alphabet[(triple >> 18) & 0x3f];
+    out[o++] = alphabet[(triple >> 12) & 0x3f];
+    out[o++] = i + 1 < len ? alphabet[(triple >> 6) & 0x3f] : '=';
+    out[o++] = i + 2 < len ? alphabet[triple & 0x3f] : '=';
+  }
+  out[o] = '\0';
+}
+
+// XOR a client payload with its masking key in place. The key repeats every
+// 4 bytes, so any run that starts at a multiple of 4 can use it as a 16-byte
+// (SSE2) or 8-byte vector.
+void csrv_ws_unmask(uint8_t *data, size_t len, const uint8_t key[4]) {
+  size_t i = 0;
+  uint32_t key32;
+  memcpy(&key32, key, sizeof(key32));
+
+#ifdef __SSE2__
+  __m128i mask = _mm_set1_epi32((int) key32);
+  for(; i + 16 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+    _mm_storeu_si128((__m128i *) (data + i), _mm_xor_si128(block, mask));
+  }
+#endif
+
+  uint64_t key64 = (uint64_t) key32 << 32 | key32;
+  for(; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    word ^= key64;
+    memcpy(data + i, &word, sizeof(word));
+  }
+
+  for(; i < len; i++) {
+    data[i] ^= key[i & 3];
+  }
+}
+
+// Text messages and close reasons must be UTF-8 (RFC 6455 section 8.1)
+static bool csrv_ws_utf8_valid(const uint8_t *s, size_t len) {
+  size_t i = 0;
+  while(i < len) {
+    if(s[i] < 0x80) {
+      i++;
+      continue;
+    }
+
+    size_t n;
+    uint32_t cp;
+    if((s[i] & 0xe0) == 0xc0) {
+      n = 1;
+      cp = s[i] & 0x1f;
+    } else if((s[i] & 0xf0) == 0xe0) {
+      n = 2;
+      cp = s[i] & 0x0f;
+    } else if((s[i] & 0xf8) == 0xf0) {
+      n = 3;
+      cp = s[i] & 0x07;
+    } else {
+      return false;
+    }
+
+    if(i + n >= len) {
+      return false;
+    }
+    for(size_t j = 1; j <= n; j++) {
+      if((s[i + j] & 0xc0) != 0x80) {
+        return false;
+      }
+      cp = cp << 6 | (s[i + j] & 0x3f);
+    }
+
+    // Overlong encodings, surrogates and anything past U+10FFFF
+    if((n == 1 && cp < 0x80) || (n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000)
+       || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) {
+      return false;
+    }
+    i += n + 1;
+  }
+
+  return true;
+}
+
+// A serialized frame, shared by every connection it is queued on
+struct CsrvWsFrame {
+  size_t refs;
+  size_t len;
+  uint8_t data[];
+};
+
+// Server frames are never masked, so the same bytes go to every client
+static struct CsrvWsFrame *csrv_ws_frame_new(enum CsrvWsOpcode opcode, const char *data, size_t len) {
+  size_t header = len < 126 ? 2 : len <= 0xffff ? 4 : 10;
+  struct CsrvWsFrame *frame = (struct CsrvWsFrame *) malloc(sizeof(struct CsrvWsFrame) + header + len);
+  if(frame == NULL) {
+    return NULL;
+  }
+
+  frame->refs = 1;
+  frame->len = header + len;
+  frame->data[0] = 0x80 | opcode;
+  if(header == 2) {
+    frame->data[1] = len;
+  } else if(header == 4) {
+    frame->data[1] = 126;
+    frame->data[2] = len >> 8;
+    frame->data[3] = len;
+  } else {
+    frame->data[1] = 127;
+    for(int i = 0; i < 8; i++) {
+      frame->data[2 + i] = (uint64_t) len >> (56 - 8 * i);
+    }
+  }
+  memcpy(frame->data + header, data, len);
+  return frame;
+}
+
+static void csrv_ws_frame_release(struct CsrvWsFrame *frame) {
+  if(__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(frame);
+  }
+}
+
+// Held for a few loads and stores at a time, never across a system call
+static void csrv_ws_lock(struct CsrvWs *ws) {
+  unsigned int spins = 0;
+  while(__atomic_test_and_set(&ws->lock, __ATOMIC_ACQUIRE)) {
+    while(__atomic_load_n(&ws->lock, __ATOMIC_RELAXED)) {
+      // The holder may have been preempted; stop burning its CPU
+      if(++spins >= CSRV_WS_SPIN_MAX) {
+        sched_yield();
+        spins = 0;
+      }
+#ifdef __SSE2__
+      _mm_pause();
+#endif
+    }
+  }
+}
+
+static void csrv_ws_unlock(struct CsrvWs *ws) {
+  __atomic_clear(&ws->lock, __ATOMIC_RELEASE);
+}
+
+// Mark the connection dead from any thread. Shutting the socket down is what
+// wakes the owning loop, which then frees it.
+static void csrv_ws_break(struct CsrvWs *ws) {
+  csrv_ws_lock(ws);
+  bool first = !ws->failed;
+  ws->failed = true;
+  csrv_ws_unlock(ws);
+
+  if(first) {
+    shutdown(ws->socket_handle, SHUT_RDWR);
+  }
+}
+
+// Drop a reference: the owner's, or a broadcast's. The last one closes the
+// socket, so no other thread ever writes to a descriptor number reused since.
+static void csrv_ws_release(struct CsrvWs *ws) {
+  if(__atomic_sub_fetch(&ws->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+
+  close(ws->socket_handle);
+  if(ws->wake_handle != -1) {
+    close(ws->wake_handle);
+  }
+  while(ws->out != NULL) {
+    struct CsrvWsOut *entry = ws->out;
+    ws->out = entry->next;
+    csrv_ws_frame_release(entry->frame);
+    free(entry);
+  }
+  free(ws->in);
+  free(ws->msg);
+  free(ws);
+}
+
+// Become the one thread writing to the socket, with the lock held. If
+// another thread already is, it is told to look at the queue again before
+// it lets go, and we leave our output to it.
+static bool csrv_ws_claim(struct CsrvWs *ws) {
+  if(ws->sending) {
+    ws->dirty = true;
+    return false;
+  }
+  ws->sending = true;
+  ws->dirty = false;
+  return true;
+}
+
+// Write as much of data as the socket takes right now; -1 if it is broken
+static ssize_t csrv_ws_write(struct CsrvWs *ws, uint8_t *data, size_t len) {
+  size_t pos = 0;
+  while(pos < len) {
+    ssize_t sent = send(ws->socket_handle, data + pos, len - pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(sent >= 0) {
+      pos += sent;
+    } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if(errno != EINTR) {
+      return -1;
+    }
+  }
+  return pos;
+}
+
+// Send the queue, then ask the owning loop for EPOLLOUT while output is left
+// (or wake csrv_ws_serve_blocking()'s poll() to add POLLOUT), and let go.
+// Only a thread that claimed the connection gets here, and the lock is only
+// taken between system calls.
+static void csrv_ws_pump(struct CsrvWs *ws) {
+  bool blocked = false;
+  bool arm_tried = false;
+  for(;;) {
+    csrv_ws_lock(ws);
+    struct CsrvWsOut *entry = blocked || ws->failed ? NULL : ws->out;
+    if(entry != NULL) {
+      // Only we take entries off the queue, so this one stays put
+      csrv_ws_unlock(ws);
+      struct CsrvWsFrame *frame = entry->frame;
+      ssize_t sent = csrv_ws_write(ws, frame->data + entry->pos, frame->len - entry->pos);
+      if(sent < 0) {
+        csrv_ws_break(ws);
+        continue;
+      }
+
+      csrv_ws_lock(ws);
+      entry->pos += sent;
+      ws->out_bytes -= sent;
+      bool whole = entry->pos == frame->len;
+      if(whole) {
+        ws->out = entry->next;
+        if(ws->out == NULL) {
+          ws->out_tail = NULL;
+        }
+      }
+      csrv_ws_unlock(ws);
+
+      if(whole) {
+        csrv_ws_frame_release(frame);
+        free(entry);
+      } else {
+        blocked = true;
+      }
+      continue;
+    }
+
+    // A close must reach the owning loop even when it went out in full
+    bool want = ws->out != NULL || ws->close_sent;
+    int wake_handle = -1;
+    int epoll_handle = -1;
+    if(!arm_tried && want != ws->armed) {
+      arm_tried = true;
+      if(ws->loop == NULL) {
+        if(!want) {
+          ws->armed = false;
+        } else if(ws->wake_handle != -1) {
+          ws->armed = true;
+          wake_handle = ws->wake_handle;
+        }
+      } else if(ws->registered) {
+        ws->armed = want;
+        epoll_handle = ws->loop->epoll_handle;
+      }
+    }
+
+    if(wake_handle == -1 && epoll_handle == -1) {
+      if(!ws->dirty || ws->failed) {
+        ws->sending = false;
+        csrv_ws_unlock(ws);
+        return;
+      }
+      // Output was queued behind us
+      ws->dirty = false;
+      blocked = false;
+      arm_tried = false;
+      csrv_ws_unlock(ws);
+      continue;
+    }
+    csrv_ws_unlock(ws);
+
+    int res;
+    if(wake_handle != -1) {
+      res = eventfd_write(wake_handle, 1);
+    } else {
+      struct epoll_event ev;
+      ev.events = EPOLLIN | EPOLLRDHUP | (want ? EPOLLOUT : 0);
+      ev.data.ptr = ws;
+      res = epoll_ctl(epoll_handle, EPOLL_CTL_MOD, ws->socket_handle, &ev);
+    }
+    if(res != 0) {
+      csrv_ws_lock(ws);
+      ws->armed = !want;
+      csrv_ws_unlock(ws);
+    }
+  }
+}
+
+// Send frame, or queue whatever the socket doesn't take right away. A close
+// frame, pushed with its code as close, is the last one the connection
+// accepts; other frames pass 0. Safe from any thread holding a reference.
+static int csrv_ws_push(struct CsrvWs *ws, struct CsrvWsFrame *frame, uint16_t close) {
+  csrv_ws_lock(ws);
+  if(ws->close_sent || ws->failed) {
+    csrv_ws_unlock(ws);
+    return -1;
+  }
+  ws->close_sent = close != 0;
+  if(close != 0 && ws->close_code == 0) {
+    ws->close_code = close;
+  }
+  bool claimed = ws->out == NULL && csrv_ws_claim(ws);
+  csrv_ws_unlock(ws);
+
+  // Straight into the socket when nothing is queued ahead of it
+  ssize_t pos = 0;
+  if(claimed && (pos = csrv_ws_write(ws, frame->data, frame->len)) < 0) {
+    csrv_ws_break(ws);
+    csrv_ws_pump(ws);
+    return -1;
+  }
+
+  int result = 0;
+  if(pos < frame->len) {
+    struct CsrvWsOut *entry = (struct CsrvWsOut *) malloc(sizeof(struct CsrvWsOut));
+    csrv_ws_lock(ws);
+    // A client that can't keep up is dropped rather than buffered without bound
+    if(entry == NULL || ws->failed || ws->out_bytes + (frame->len - pos) > CSRV_WS_OUT_MAX) {
+      result = -1;
+    } else {
+      __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+      entry->frame = frame;
+      entry->pos = pos;
+      // The rest of a frame we started goes ahead of any queued meanwhile
+      if(claimed) {
+        entry->next = ws->out;
+        ws->out = entry;
+        if(ws->out_tail == NULL) {
+          ws->out_tail = entry;
+        }
+      } else {
+        entry->next = NULL;
+        if(ws->out_tail != NULL) {
+          ws->out_tail->next = entry;
+        } else {
+          ws->out = entry;
+        }
+        ws->out_tail = entry;
+      }
+      ws->out_bytes += frame->len - pos;
+      claimed = claimed || csrv_ws_claim(ws);
+    }
+    csrv_ws_unlock(ws);
+
+    if(result != 0) {
+      free(entry);
+      csrv_ws_break(ws);
+    }
+  }
+
+  if(claimed) {
+    csrv_ws_pump(ws);
+  }
+  return result;
+}
+
+int csrv_ws_send(struct CsrvWs *ws, enum CsrvWsOpcode opcode, char *data, size_t len) {
+  struct CsrvWsFrame *frame = csrv_ws_frame_new(opcode, data, len);
+  if(frame == NULL) {
+    return -1;
+  }
+
+  int result = csrv_ws_push(ws, frame, 0);
+  csrv_ws_frame_release(frame);
+  return result;
+}
+
+// Start the closing handshake. The socket is closed once the close frame has
+// been sent, without waiting for the client's reply.
+void csrv_ws_close(struct CsrvWs *ws, uint16_t code) {
+  uint8_t payload[2] = { code >> 8, code & 0xff };
+  struct CsrvWsFrame *frame = csrv_ws_frame_new(CSRV_WS_CLOSE, (char *) payload, code == CSRV_WS_NO_STATUS ? 0 : 2);
+  if(frame == NULL) {
+    csrv_ws_break(ws);
+    return;
+  }
+
+  csrv_ws_push(ws, frame, code);
+  csrv_ws_frame_release(frame);
+}
+
+static bool csrv_ws_close_code_valid(uint16_t code) {
+  return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) || (code >= 3000 && code <= 4999);
+}
+
+static void csrv_ws_deliver(struct CsrvWs *ws, enum CsrvWsOpcode opcode, uint8_t *data, size_t len) {
+  if(opcode == CSRV_WS_TEXT && !csrv_ws_utf8_valid(data, len)) {
+    csrv_ws_close(ws, CSRV_WS_INVALID_DATA);
+    return;
+  }
+
+  if(ws->handler->message != NULL) {
+    ws->handler->message(ws, opcode, (char *) data, len);
+  }
+}
+
+static void csrv_ws_control(struct CsrvWs *ws, enum CsrvWsOpcode opcode, uint8_t *data, size_t len) {
+  switch(opcode) {
+  case CSRV_WS_PING:
+    csrv_ws_send(ws, CSRV_WS_PONG, (char *) data, len);
+    return;
+  case CSRV_WS_PONG:
+    return;
+  case CSRV_WS_CLOSE:
+  default:
+    break;
+  }
+
+  uint16_t code = CSRV_WS_NO_STATUS;
+  if(len == 1) {
+    csrv_ws_close(ws, CSRV_WS_PROTOCOL_ERROR);
+    return;
+  }
+  if(len >= 2) {
+    code = (uint16_t) data[0] << 8 | data[1];
+    if(!csrv_ws_close_code_valid(code)) {
+      csrv_ws_close(ws, CSRV_WS_PROTOCOL_ERROR);
+      return;
+    }
+    if(!csrv_ws_utf8_valid(data + 2, len - 2)) {
+      csrv_ws_close(ws, CSRV_WS_INVALID_DATA);
+      return;
+    }
+  }
+
+  // Echo the client's code to complete the handshake. It is the one
+  // reported even if a close of ours went out first.
+  csrv_ws_lock(ws);
+  ws->close_code = code;
+  csrv_ws_unlock(ws);
+  csrv_ws_close(ws, code);
+}
+
+// Handle one frame from the start of data. Returns its length, 0 if it
+// isn't complete yet, or -1 after a protocol error; the close frame queued
+// for it ends the connection once sent.
+static ssize_t csrv_ws_frame(struct CsrvWs *ws, uint8_t *data, size_t len) {
+  if(len < 2) {
+    return 0;
+  }
+
+  bool fin = (data[0] & 0x80) != 0;
+  enum CsrvWsOpcode opcode = data[0] & 0x0f;
+  uint64_t payload_len = data[1] & 0x7f;
+  size_t header = 2;
+
+  // No extensions are negotiated, so the RSV bits must be clear, and every
+  // client frame must be masked
+  if((data[0] & 0x70) != 0 || (data[1] & 0x80) == 0) {
+    csrv_ws_close(ws, CSRV_WS_PROTOCOL_ERROR);
+    return -1;
+  }
+
+  if(payload_len == 126) {
+    if(len < 4) {
+      return 0;
+    }
+    payload_len = (uint64_t) data[2] << 8 | data[3];
+    header = 4;
+  } else if(payload_len == 127) {
+    if(len < 10) {
+      return 0;
+    }
+    payload_len = 0;
+    for(int i = 0; i < 8; i++) {
+      payload_len = payload_len << 8 | data[2 + i];
+    }
+    header = 10;
+  }
+
+  bool control = (opcode & 0x8) != 0;
+  if(control && (!fin || payload_len > 125)) {
+    csrv_ws_close(ws, CSRV_WS_PROTOCOL_ERROR);
+    return -1;
+  }
+
+  // Checked before anything is buffered, so a huge length costs nothing
+  if(payload_len > CSRV_WS_MESSAGE_MAX || (!control && ws->msg_len + payload_len > CSRV_WS_MESSAGE_MAX)) {
+    csrv_ws_close(ws, CSRV_WS_TOO_BIG);
+    return -1;
+  }
+
+  header += 4;
+  if(len < header + payload_len) {
+    return 0;
+  }
+
+  uint8_t *payload = data + header;
+  csrv_ws_unmask(payload, payload_len, data + header - 4);
+
+  if(control) {
+    if(opcode != CSRV_WS_CLOSE && opcode != CSRV_WS_PING && opcode != CSRV_WS_PONG) {
+      csrv_ws_close(ws, CSRV_WS_PROTOCOL_ERROR);
+      return -1;
+    }
+    csrv_ws_control(ws, opcode, payload, payload_len);
+    return header + payload_len;
+  }
+
+  if(opcode == CSRV_WS_CONTINUATION) {
+    if(ws->msg_opcode == CSRV_WS_CONTINUATION) {
+      csrv_ws_close(ws, CSRV_WS_PROTOCOL_ERROR);
+      return -1;
+    }
+  } else if(opcode != CSRV_WS_TEXT && opcode != CSRV_WS_BINARY) {
+    csrv_ws_close(ws, CSRV_WS_PROTOCOL_ERROR);
+    return -1;
+  } else if(ws->msg_opcode != CSRV_WS_CONTINUATION) {
+    // A new message while a fragmented one is still open
+    csrv_ws_close(ws, CSRV_WS_PROTOCOL_ERROR);
+    return -1;
+  } else if(fin) {
+    // Unfragmented: handed over straight from the read buffer
+    csrv_ws_deliver(ws, opcode, payload, payload_len);
+    return header + payload_len;
+  }
+
+  if(payload_len > 0) {
+    uint8_t *msg = (uint8_t *) realloc(ws->msg, ws->msg_len + payload_len);
+    if(msg == NULL) {
+      csrv_ws_close(ws, CSRV_WS_INTERNAL_ERROR);
+      return -1;
+    }
+    memcpy(msg + ws->msg_len, payload, payload_len);
+    ws->msg = msg;
+    ws->msg_len += payload_len;
+  }
+  if(opcode != CSRV_WS_CONTINUATION) {
+    ws->msg_opcode = opcode;
+  }
+
+  if(fin) {
+    enum CsrvWsOpcode msg_opcode = ws->msg_opcode;
+    uint8_t *msg = ws->msg;
+    size_t msg_len = ws->msg_len;
+    ws->msg = NULL;
+    ws->msg_len = 0;
+    ws->msg_opcode = CSRV_WS_CONTINUATION;
+    csrv_ws_deliver(ws, msg_opcode, msg, msg_len);
+    free(msg);
+  }
+
+  return header + payload_len;
+}
+
+// Handle every complete frame in data; keep the rest for the next read
+static int csrv_ws_input(struct CsrvWs *ws, uint8_t *data, size_t len) {
+  size_t used = 0;
+  while(used < len && !ws->close_sent) {
+    ssize_t frame_len = csrv_ws_frame(ws, data + used, len - used);
+    if(frame_len <= 0) {
+      break;
+    }
+    used += frame_len;
+  }
+
+  size_t left = ws->close_sent ? 0 : len - used;
+  if(left == 0) {
+    free(ws->in);
+    ws->in = NULL;
+    ws->in_len = 0;
+    ws->in_size = 0;
+    return 0;
+  }
+
+  if(data == ws->in) {
+    memmove(ws->in, data + used, left);
+  } else {
+    if(left > ws->in_size) {
+      uint8_t *in = (uint8_t *) realloc(ws->in, left);
+      if(in == NULL) {
+        return -1;
+      }
+      ws->in = in;
+      ws->in_size = left;
+    }
+    memcpy(ws->in, data + used, left);
+  }
+  ws->in_len = left;
+  return 0;
+}
+
+// Read once and handle what arrived. -1 once the connection is gone.
+static int csrv_ws_read(struct CsrvWs *ws) {
+  ssize_t n = read(ws->socket_handle, csrv_ws_buffer, sizeof(csrv_ws_buffer));
+  if(n < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+  }
+  if(n == 0) {
+    return -1;
+  }
+
+  // After our close frame anything else the client sends is dropped
+  if(ws->close_sent) {
+    return 0;
+  }
+
+  if(ws->in_len == 0) {
+    return csrv_ws_input(ws, csrv_ws_buffer, n);
+  }
+
+  // Continue a partial frame; its buffer grows geometrically
+  if(ws->in_len + n > ws->in_size) {
+    size_t size = ws->in_size * 2 > ws->in_len + n ? ws->in_size * 2 : ws->in_len + n;
+    uint8_t *in = (uint8_t *) realloc(ws->in, size);
+    if(in == NULL) {
+      return -1;
+    }
+    ws->in = in;
+    ws->in_size = size;
+  }
+  memcpy(ws->in + ws->in_len, csrv_ws_buffer, n);
+  ws->in_len += n;
+  return csrv_ws_input(ws, ws->in, ws->in_len);
+}
+
+// Validate the handshake, send 101 Switching Protocols and attach a
+// connection to the response; csrv_serve_connection() hands the socket over
+// once the handler returns. On failure the response is left as a 400.
+struct CsrvWs *csrv_ws_upgrade(struct CsrvRequest *req, struct CsrvResponse *resp, const struct CsrvWsHandler *handler, void *user) {
+  struct CsrvRequestHeader *headers = &req->headers;
+  char *upgrade = headers->known[CSRV_HEADER_UPGRADE];
+  char *connection = headers->known[CSRV_HEADER_CONNECTION];
+  char *key = headers->known[CSRV_HEADER_SEC_WEBSOCKET_KEY];
+  char *version = headers->known[CSRV_HEADER_SEC_WEBSOCKET_VERSION];
+
+  resp->status = CSRV_HTTP_BAD_REQUEST;
+  resp->keep_alive = false;
+
+  // Over HTTP/2 this would need RFC 8441 extended CONNECT
+  if(req->stream != NULL || resp->written || strcmp(headers->method, "GET") != 0
+     || headers->content_size != 0 || headers->chunked
+     || upgrade == NULL || strcasestr(upgrade, "websocket") == NULL
+     || connection == NULL || strcasestr(connection, "upgrade") == NULL
+     || key == NULL || strlen(key) != 24) {
+    return NULL;
+  }
+
+  if(version == NULL || strcmp(version, "13") != 0) {
+    csrv_str_map_add(&resp->headers, strdup("Sec-WebSocket-Version"), strdup("13"));
+    return NULL;
+  }
+
+  struct CsrvWs *ws = (struct CsrvWs *) calloc(1, sizeof(struct CsrvWs));
+  if(ws == NULL) {
+    resp->status = CSRV_HTTP_SERVER_ERROR;
+    return NULL;
+  }
+  ws->kind = CSRV_EVENT_WS;
+  ws->socket_handle = req->socket_handle;
+  ws->csrv = req->csrv;
+  ws->handler = handler;
+  ws->user = user;
+  ws->wake_handle = -1;
+  ws->refs = 1;
+
+  uint8_t concat[24 + sizeof(CSRV_WS_GUID)];
+  uint8_t digest[20];
+  char accept[32];
+  memcpy(concat, key, 24);
+  memcpy(concat + 24, CSRV_WS_GUID, sizeof(CSRV_WS_GUID) - 1);
+  csrv_ws_sha1(concat, sizeof(concat) - 1, digest);
+  csrv_ws_base64(digest, sizeof(digest), accept);
+
+  char reply[160];
+  int reply_len = snprintf(reply, sizeof(reply),
+                           "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                           "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+  resp->written = true;
+  if(csrv_io_write(req->socket_handle, reply, reply_len) < 0) {
+    free(ws);
+    return NULL;
+  }
+
+  resp->status = CSRV_HTTP_OK;
+  resp->websocket = ws;
+
+  // Frames the client sent right behind its handshake
+  size_t body_start = req->body_offset + 1;
+  if(body_start < req->request.length
+     && csrv_ws_input(ws, (uint8_t *) &req->request.string[body_start], req->request.length - body_start) != 0) {
+    csrv_ws_break(ws);
+  }
+  return ws;
+}
+
+// Done with the connection: only the owning loop (or process) calls this,
+// after the client is gone or our close frame is out. The socket is closed
+// once no broadcast holds a reference any more.
+static void csrv_ws_free(struct CsrvWs *ws) {
+  if(ws->close_code == 0) {
+    ws->close_code = CSRV_WS_ABNORMAL;
+  }
+  if(ws->handler->close != NULL) {
+    ws->handler->close(ws, ws->close_code);
+  }
+
+  // Once out of its group no new broadcast can reach the connection, and
+  // any still under way finds it failed
+  csrv_ws_leave(ws);
+
+  struct CsrvLoop *loop = ws->loop;
+  if(loop != NULL) {
+    if(ws->prev != NULL) {
+      ws->prev->next = ws->next;
+    } else {
+      loop->websockets = ws->next;
+    }
+    if(ws->next != NULL) {
+      ws->next->prev = ws->prev;
+    }
+  }
+
+  csrv_ws_lock(ws);
+  ws->failed = true;
+  bool registered = ws->registered;
+  ws->registered = false;
+  csrv_ws_unlock(ws);
+  if(registered) {
+    epoll_ctl(loop->epoll_handle, EPOLL_CTL_DEL, ws->socket_handle, NULL);
+  }
+  csrv_ws_release(ws);
+}
+
+// Returns true once the connection has been freed
+static bool csrv_ws_handle(struct CsrvWs *ws, bool readable, bool writable) {
+  bool gone = false;
+  if(readable && csrv_ws_read(ws) != 0) {
+    gone = true;
+  }
+
+  csrv_ws_lock(ws);
+  bool claimed = (writable || ws->out != NULL) && csrv_ws_claim(ws);
+  csrv_ws_unlock(ws);
+  if(claimed) {
+    csrv_ws_pump(ws);
+  }
+
+  // A close frame another thread is still writing isn't out yet
+  csrv_ws_lock(ws);
+  bool done = gone || ws->failed || (ws->close_sent && ws->out == NULL && !ws->sending);
+  csrv_ws_unlock(ws);
+
+  if(done) {
+    csrv_ws_free(ws);
+  }
+  return done;
+}
+
+void csrv_ws_event(struct CsrvWs *ws, uint32_t events) {
+  csrv_ws_handle(ws, (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0, (events & EPOLLOUT) != 0);
+}
+
+// Serve the connection until it closes, outside of an event loop. Frames
+// queued by other threads (broadcasts) signal the eventfd, so they don't
+// wait for the poll() to time out.
+static void csrv_ws_serve_blocking(struct CsrvWs *ws) {
+  int wake_handle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(wake_handle == -1) {
+    CSRV_LOG_ERROR(ws->csrv, "eventfd() failed for websocket %d with errno=%s", ws->socket_handle, strerror(errno));
+  }
+  csrv_ws_lock(ws);
+  ws->wake_handle = wake_handle;
+  csrv_ws_unlock(ws);
+
+  bool drained = false;
+  for(;;) {
+    if(!drained && csrv_is_draining(ws->csrv)) {
+      csrv_ws_close(ws, CSRV_WS_GOING_AWAY);
+      drained = true;
+    }
+
+    // Whoever queues output from now on wakes the poll() if this didn't
+    // already ask for POLLOUT
+    csrv_ws_lock(ws);
+    bool pending = ws->out != NULL || ws->close_sent || ws->failed;
+    ws->armed = pending;
+    csrv_ws_unlock(ws);
+
+    struct pollfd pfd[2];
+    pfd[0].fd = ws->socket_handle;
+    pfd[0].events = POLLIN | (pending ? POLLOUT : 0);
+    pfd[0].revents = 0;
+    pfd[1].fd = wake_handle;
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+    // Wakes up now and then to notice draining
+    int poll_res = poll(pfd, wake_handle != -1 ? 2 : 1, 1000);
+    if(poll_res < 0 && errno != EINTR) {
+      csrv_ws_lock(ws);
+      ws->close_code = CSRV_WS_ABNORMAL;
+      csrv_ws_unlock(ws);
+      csrv_ws_free(ws);
+      return;
+    }
+
+    // Only there to wake the poll(); how often doesn't matter
+    eventfd_t n_wakes;
+    if(pfd[1].revents & POLLIN) {
+      eventfd_read(wake_handle, &n_wakes);
+    }
+
+    if(csrv_ws_handle(ws, (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0, (pfd[0].revents & POLLOUT) != 0)) {
+      return;
+    }
+  }
+}
+
+// Take over the socket of an upgraded connection. In CSRV_EVENT the running
+// coroutine's loop serves it from now on and this returns straight away;
+// elsewhere it is served here until it closes.
+void csrv_ws_run(struct CsrvWs *ws) {
+  struct CsrvCoro *self = csrv_coro_self();
+  if(self == NULL) {
+    csrv_ws_serve_blocking(ws);
+    return;
+  }
+
+  // Broadcasts may be writing already; until registered they leave
+  // EPOLLOUT to us
+  struct CsrvLoop *loop = self->loop;
+  csrv_ws_lock(ws);
+  ws->loop = loop;
+  bool done = ws->failed || (ws->close_sent && ws->out == NULL && !ws->sending);
+  csrv_ws_unlock(ws);
+
+  if(!done) {
+    // The finished coroutine may still be registered for this descriptor
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = ws;
+    int ctl_res = epoll_ctl(loop->epoll_handle, EPOLL_CTL_MOD, ws->socket_handle, &ev);
+    if(ctl_res == -1 && errno == ENOENT) {
+      ctl_res = epoll_ctl(loop->epoll_handle, EPOLL_CTL_ADD, ws->socket_handle, &ev);
+    }
+    if(ctl_res == -1) {
+      CSRV_LOG_ERROR(loop->csrv, "epoll_ctl() failed for websocket %d with errno=%s", ws->socket_handle, strerror(errno));
+      done = true;
+    }
+  }
+
+  if(done) {
+    csrv_ws_lock(ws);
+    ws->loop = NULL;
+    csrv_ws_unlock(ws);
+    csrv_ws_free(ws);
+    return;
+  }
+
+  // Output queued so far still needs EPOLLOUT
+  csrv_ws_lock(ws);
+  ws->registered = true;
+  ws->armed = false;
+  bool claimed = csrv_ws_claim(ws);
+  csrv_ws_unlock(ws);
+  if(claimed) {
+    csrv_ws_pump(ws);
+  }
+
+  ws->next = loop->websockets;
+  if(loop->websockets != NULL) {
+    loop->websockets->prev = ws;
+  }
+  loop->websockets = ws;
+}
+
+// Send every connection on the loop a 1001 Going Away
+void csrv_ws_drain(struct CsrvLoop *loop) {
+  for(struct CsrvWs *ws = loop->websockets; ws != NULL; ws = ws->next) {
+    csrv_ws_close(ws, CSRV_WS_GOING_AWAY);
+  }
+}
+
+int csrv_ws_group_init(struct CsrvWsGroup *group) {
+  group->members = NULL;
+  group->n_members = 0;
+  return pthread_mutex_init(&group->lock, NULL) == 0 ? 0 : -1;
+}
+
+// Members are left alone; they leave on their own as they close
+void csrv_ws_group_cleanup(struct CsrvWsGroup *group) {
+  pthread_mutex_destroy(&group->lock);
+}
+
+// Only from the connection's own loop, e.g. in its message callback or right
+// after csrv_ws_upgrade(). A connection is in at most one group.
+void csrv_ws_join(struct CsrvWsGroup *group, struct CsrvWs *ws) {
+  csrv_ws_leave(ws);
+
+  pthread_mutex_lock(&group->lock);
+  ws->group = group;
+  ws->group_prev = NULL;
+  ws->group_next = group->members;
+  if(group->members != NULL) {
+    group->members->group_prev = ws;
+  }
+  group->members = ws;
+  group->n_members++;
+  pthread_mutex_unlock(&group->lock);
+}
+
+void csrv_ws_leave(struct CsrvWs *ws) {
+  struct CsrvWsGroup *group = ws->group;
+  if(group == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&group->lock);
+  if(ws->group_prev != NULL) {
+    ws->group_prev->group_next = ws->group_next;
+  } else {
+    group->members = ws->group_next;
+  }
+  if(ws->group_next != NULL) {
+    ws->group_next->group_prev = ws->group_prev;
+  }
+  group->n_members--;
+  ws->group = NULL;
+  ws->group_prev = NULL;
+  ws->group_next = NULL;
+  pthread_mutex_unlock(&group->lock);
+}
+
+// Send one message to every member of the group, from any thread. The frame
+// is built once and shared; each member either takes it straight into its
+// socket buffer or queues a reference to it. The group's lock is only held
+// to take a reference on each member, so the sends don't serialise other
+// broadcasts, joins and leaves. Returns the number of members it was sent
+// or queued to, or -1.
+ssize_t csrv_ws_broadcast(struct CsrvWsGroup *group, enum CsrvWsOpcode opcode, char *data, size_t len) {
+  struct CsrvWsFrame *frame = csrv_ws_frame_new(opcode, data, len);
+  if(frame == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&group->lock);
+  size_t n_members = group->n_members;
+  struct CsrvWs **members = (struct CsrvWs **) malloc(sizeof(struct CsrvWs *) * (n_members > 0 ? n_members : 1));
+  if(members == NULL) {
+    pthread_mutex_unlock(&group->lock);
+    csrv_ws_frame_release(frame);
+    return -1;
+  }
+  size_t i = 0;
+  for(struct CsrvWs *ws = group->members; ws != NULL; ws = ws->group_next) {
+    __atomic_add_fetch(&ws->refs, 1, __ATOMIC_RELAXED);
+    members[i++] = ws;
+  }
+  pthread_mutex_unlock(&group->lock);
+
+  ssize_t n_sent = 0;
+  for(i = 0; i < n_members; i++) {
+    if(csrv_ws_push(members[i], frame, 0) == 0) {
+      n_sent++;
+    }
+    csrv_ws_release(members[i]);
+  }
+
+  free(members);
+  csrv_ws_frame_release(frame);
+  return n_sent;
+}